@@ -0,0 +1,51 @@
+/**
+ * Counts heap allocations for host_allocations by interposing the allocation
+ * functions and forwarding to glibc's implementations. Memory from mmap
+ * (large images, JIT code) is not counted
+ *
+ * Linked into main and benchmark only: the tests run under valgrind, which
+ * needs to see glibc's allocation functions to check for leaks
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "hostperf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+#ifdef __cplusplus
+}
+#endif
+
+#define COUNT_ALLOCATION() \
+    __atomic_fetch_add(&host_num_allocations, 1, __ATOMIC_RELAXED)
+
+__attribute__((constructor)) static void start_counting(void) {
+    host_allocations_counted = true;
+}
+
+void* malloc(size_t size) __THROW {
+    COUNT_ALLOCATION();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+    COUNT_ALLOCATION();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+    COUNT_ALLOCATION();
+    return __libc_realloc(ptr, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) __THROW {
+    COUNT_ALLOCATION();
+    return __libc_memalign(alignment, size);
+}
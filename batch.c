@@ -0,0 +1,320 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "memory.h"
+#include "output.h"
+#include "parallel.h"
+#include "program.h"
+#include "utils.h"
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Appends a copy of path to *paths, growing it geometrically
+static bool append_path(char*** paths, size_t* num_paths, size_t* capacity,
+                        const char* path) {
+    if (*num_paths == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+        char** grown =
+            (char**)realloc(*paths, new_capacity * sizeof(char*));
+        if (grown == NULL) return false;
+        *paths = grown;
+        *capacity = new_capacity;
+    }
+    char* copy = strdup(path);
+    if (copy == NULL) return false;
+    (*paths)[(*num_paths)++] = copy;
+    return true;
+}
+
+char** batch_paths(const char* path, image_format format, size_t* num_paths) {
+    char** paths = NULL;
+    size_t capacity = 0;
+    *num_paths = 0;
+
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (dir == NULL) return NULL;
+        bool hex_only = format == IMAGE_FORMAT_AUTO || format == IMAGE_FORMAT_HEX;
+        const struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char* extension = strrchr(entry->d_name, '.');
+            if (hex_only &&
+                (extension == NULL || strcmp(extension, ".hex") != 0))
+                continue;
+            size_t length = strlen(path) + strlen(entry->d_name) + 2;
+            char* file = (char*)malloc(length);
+            snprintf(file, length, "%s/%s", path, entry->d_name);
+            struct stat file_st;
+            bool ok = stat(file, &file_st) != 0 || !S_ISREG(file_st.st_mode) ||
+                      append_path(&paths, num_paths, &capacity, file);
+            free(file);
+            if (!ok) break;
+        }
+        closedir(dir);
+        if (*num_paths > 0)
+            qsort(paths, *num_paths, sizeof(char*), compare_paths);
+    } else {
+        FILE* list = fopen(path, "r");
+        if (list == NULL) return NULL;
+        char* line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ((length = getline(&line, &size, list)) != -1) {
+            while (length > 0 &&
+                   (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                line[--length] = '\0';
+            if (length == 0) continue;
+            if (!append_path(&paths, num_paths, &capacity, line)) break;
+        }
+        free(line);
+        fclose(list);
+    }
+
+    // An empty batch is still a valid (non-NULL) result
+    if (paths == NULL) paths = (char**)malloc(sizeof(char*));
+    return paths;
+}
+
+void free_batch_paths(char** paths, size_t num_paths) {
+    for (size_t i = 0; i < num_paths; i++) free(paths[i]);
+    free(paths);
+}
+
+typedef struct {
+    // Formatted result, see run_batch
+    char* output;
+    bool failed;
+    bool done;
+} batch_job;
+
+// The range of job indices a worker has yet to run, packed as
+// (end << 32) | begin so that owner and thieves can update it with one CAS.
+// Padded to a cache line so workers don't contend on each other's ranges
+typedef struct {
+    uint64_t range;
+    char padding[64 - sizeof(uint64_t)];
+} worker_queue;
+
+typedef struct {
+    char* const* paths;
+    batch_job* jobs;
+    worker_queue* queues;
+    size_t num_workers;
+    const batch_options* options;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} batch;
+
+typedef struct {
+    batch* b;
+    size_t worker;
+} worker_args;
+
+#define PACK_RANGE(begin, end) (((uint64_t)(end) << 32) | (uint32_t)(begin))
+#define RANGE_BEGIN(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+// Takes the first job from the worker's own range, or returns false if empty
+static bool pop_job(worker_queue* queue, size_t* job) {
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+    while (RANGE_BEGIN(range) < RANGE_END(range)) {
+        uint64_t taken = PACK_RANGE(RANGE_BEGIN(range) + 1, RANGE_END(range));
+        if (__atomic_compare_exchange_n(&queue->range, &range, taken, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *job = RANGE_BEGIN(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the back half of some other worker's range into thief's (empty)
+// range, or returns false if there is nothing left to steal
+static bool steal_jobs(batch* b, size_t thief) {
+    for (size_t k = 1; k < b->num_workers; k++) {
+        worker_queue* victim = &b->queues[(thief + k) % b->num_workers];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (RANGE_BEGIN(range) < RANGE_END(range)) {
+            uint32_t begin = RANGE_BEGIN(range), end = RANGE_END(range);
+            uint32_t split = end - (end - begin + 1) / 2;
+            if (__atomic_compare_exchange_n(
+                    &victim->range, &range, PACK_RANGE(begin, split), false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&b->queues[thief].range,
+                                 PACK_RANGE(split, end), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Runs one program, without exiting on errors, and formats its result
+static void run_job(batch* b, size_t index) {
+    const batch_options* options = b->options;
+    batch_job* job = &b->jobs[index];
+    const char* error = NULL;
+    char state[OUTPUT_STATE_SIZE];
+    size_t state_length = 0;
+
+    program_image image;
+    image_status status = load_image(b->paths[index], options->format, &image);
+    if (status != IMAGE_OK) {
+        error = image_status_message(status);
+    } else {
+        program* prog = create_program(image.words, image.num_instructions);
+        guest_memory* mem = create_memory(options->flat_memory);
+        if (prog == NULL) {
+            error = "Failed to allocate decoded program";
+        } else if (mem == NULL) {
+            error = "Failed to allocate guest memory";
+        } else {
+            prog->peephole = options->peephole;
+            int32_t registers[NUM_REGISTERS] = {0};
+            uint32_t pc = INITIAL_PC;
+            guest_memory* previous = memory_bind(mem);
+            uint64_t steps = run_engine(options->engine, prog, registers,
+                                        &pc, options->max_steps);
+            memory_bind(previous);
+            if (mem->out_of_memory)
+                error = "Out of memory for guest pages";
+            else if (steps == options->max_steps &&
+                     !engine_done(prog, registers, pc))
+                error = "Didn't halt within the step limit";
+            else if (!validate_pc(pc))
+                error = "Invalid PC (not a multiple of word size)";
+            else
+                state_length = format_registers(
+                    state, options->output == OUTPUT_BINARY ? OUTPUT_ARRAY
+                                                            : options->output,
+                    options->disp_hex, registers, pc);
+        }
+        free_memory(mem);
+        free_program(prog);
+        free_image(&image);
+    }
+
+    const char* path = b->paths[index];
+    // Room for path and error escaped as JSON strings
+    size_t size = 6 * (strlen(path) + (error != NULL ? strlen(error) : 0)) +
+                  OUTPUT_STATE_SIZE + 32;
+    char* output = (char*)malloc(size);
+    if (output != NULL) {
+        char* end = output;
+        if (options->output == OUTPUT_JSON) {
+            end = stpcpy(end, "{\"path\": ");
+            end += format_json_string(end, path);
+            if (error != NULL) {
+                end = stpcpy(end, ", \"error\": ");
+                end += format_json_string(end, error);
+                end = stpcpy(end, "}\n");
+            } else {
+                // Splice the state's fields into the same object
+                end = stpcpy(end, ", ");
+                memcpy(end, state + 1, state_length - 1);
+                end += state_length - 1;
+            }
+        } else {
+            end = stpcpy(stpcpy(end, path), "\n");
+            if (error != NULL) {
+                end = stpcpy(stpcpy(stpcpy(end, "error: "), error), "\n");
+            } else {
+                memcpy(end, state, state_length);
+                end += state_length;
+            }
+        }
+        *end = '\0';
+    }
+
+    pthread_mutex_lock(&b->lock);
+    job->output = output;
+    job->failed = error != NULL || output == NULL;
+    job->done = true;
+    pthread_cond_broadcast(&b->job_done);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void* worker_main(void* arg) {
+    worker_args* args = (worker_args*)arg;
+    batch* b = args->b;
+    worker_queue* queue = &b->queues[args->worker];
+    size_t job;
+    while (pop_job(queue, &job) || (steal_jobs(b, args->worker) &&
+                                    pop_job(queue, &job)))
+        run_job(b, job);
+    return NULL;
+}
+
+size_t run_batch(char* const* paths, size_t num_paths,
+                 const batch_options* options, FILE* out) {
+    size_t num_workers =
+        options->num_threads == 0 ? default_num_threads() : options->num_threads;
+    if (num_workers > num_paths) num_workers = num_paths;
+    if (num_workers == 0) return 0;
+
+    batch b;
+    b.paths = paths;
+    b.options = options;
+    b.num_workers = num_workers;
+    b.jobs = (batch_job*)calloc(num_paths, sizeof(batch_job));
+    b.queues = (worker_queue*)calloc(num_workers, sizeof(worker_queue));
+    pthread_t* threads = (pthread_t*)malloc(num_workers * sizeof(pthread_t));
+    worker_args* args = (worker_args*)malloc(num_workers * sizeof(worker_args));
+    if (b.jobs == NULL || b.queues == NULL || threads == NULL || args == NULL) {
+        free(b.jobs);
+        free(b.queues);
+        free(threads);
+        free(args);
+        fprintf(out, "error: out of memory\n");
+        return num_paths;
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.job_done, NULL);
+
+    // Each worker starts with an equal contiguous share of the jobs
+    for (size_t k = 0; k < num_workers; k++)
+        b.queues[k].range = PACK_RANGE(num_paths * k / num_workers,
+                                       num_paths * (k + 1) / num_workers);
+    size_t num_started = 0;
+    for (size_t k = 0; k < num_workers; k++) {
+        args[k].b = &b;
+        args[k].worker = k;
+        if (pthread_create(&threads[num_started], NULL, worker_main,
+                           &args[k]) == 0)
+            num_started++;
+    }
+    // If no thread could be started, run everything on this thread (worker 0
+    // steals the other workers' shares)
+    if (num_started == 0) worker_main(&args[0]);
+
+    // Write results in input order as soon as each one is done
+    size_t num_failed = 0;
+    for (size_t i = 0; i < num_paths; i++) {
+        pthread_mutex_lock(&b.lock);
+        while (!b.jobs[i].done) pthread_cond_wait(&b.job_done, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+        if (b.jobs[i].output != NULL) fputs(b.jobs[i].output, out);
+        num_failed += b.jobs[i].failed;
+        free(b.jobs[i].output);
+    }
+
+    for (size_t k = 0; k < num_started; k++) pthread_join(threads[k], NULL);
+    pthread_cond_destroy(&b.job_done);
+    pthread_mutex_destroy(&b.lock);
+    free(b.jobs);
+    free(b.queues);
+    free(threads);
+    free(args);
+    return num_failed;
+}
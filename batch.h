@@ -0,0 +1,81 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+#include "image.h"
+#include "output.h"
+
+// Upper bound for -j
+#define MAX_BATCH_THREADS 1024
+
+typedef struct {
+    engine_kind engine;
+    image_format format;
+    // Same meaning as --output (except that OUTPUT_BINARY isn't supported)
+    // and -x
+    output_mode output;
+    bool disp_hex;
+    // Number of worker threads, or 0 for default_num_threads()
+    size_t num_threads;
+    // Same meaning as --flat-memory
+    bool flat_memory;
+    // Same meaning as --peephole
+    bool peephole;
+    // Stop each program after this many instructions (UINT64_MAX for no
+    // limit). A program stopped short is reported as an error
+    uint64_t max_steps;
+} batch_options;
+
+/**
+ * Returns the programs a batch runs, in order
+ *
+ * If path is a directory, these are its regular files with extension .hex
+ * (or, if format is binary or elf, all of its regular files), sorted by name.
+ * Otherwise, path is a list with one program path per line (empty lines are
+ * skipped)
+ *
+ * @param path directory or list file
+ * @param format
+ * @param num_paths set to the number of programs
+ * @return char** (free with free_batch_paths), or NULL if path can't be read
+ */
+char** batch_paths(const char* path, image_format format, size_t* num_paths);
+
+/**
+ * Frees the result of batch_paths
+ *
+ * @param paths
+ * @param num_paths
+ */
+void free_batch_paths(char** paths, size_t num_paths);
+
+/**
+ * Loads and runs every program in paths to completion, concurrently on a pool
+ * of worker threads, and writes each one's final state to out in the order
+ * of paths
+ *
+ * Each program gets its own registers and PC, starting from 0 and
+ * INITIAL_PC. Workers take programs from their own share of paths first and
+ * steal from other workers once theirs runs out, so a few slow programs don't
+ * leave the other workers idle. For each program, out gets a line with its
+ * path followed by its final state (formatted as print_state would) or by an
+ * "error: " line if it could not be loaded, didn't halt within
+ * options->max_steps instructions or ended with an invalid PC. With
+ * OUTPUT_JSON, each program is instead one line with its "path" and either
+ * its "registers" and "pc" or an "error"
+ *
+ * @param paths
+ * @param num_paths
+ * @param options
+ * @param out
+ * @return number of programs that failed
+ */
+size_t run_batch(char* const* paths, size_t num_paths,
+                 const batch_options* options, FILE* out);
+
+#endif  // BATCH_H
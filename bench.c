@@ -0,0 +1,390 @@
+/**
+ * Benchmarks the execution engines on large synthetic programs
+ *
+ * Build and run with make bench, or see ./benchmark -h for options. Results are
+ * printed as a table, or with --json as one JSON object per engine per line so
+ * they can be collected and compared across commits
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "hostperf.h"
+#include "image.h"
+#include "lockstep.h"
+#include "pipeline.h"
+#include "program.h"
+#include "synth.h"
+
+// Heap allocations are counted by alloccount.o (see host_allocations)
+static uint64_t allocations(void) { return host_allocations(); }
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+typedef struct {
+    synth_options synth;
+    const char* mix;
+    // Best of this many runs is reported
+    unsigned int repeats;
+    // Engines to run, indexed by engine_kind
+    bool engines[NUM_ENGINES];
+    // Contexts for the lockstep row, or 0 to skip it
+    uint32_t contexts;
+    bool json;
+} bench_options;
+
+// One row of results
+typedef struct {
+    const char* engine;
+    // Instructions executed per run (summed over contexts for lockstep)
+    uint64_t instructions;
+    double load_ms;
+    double decode_ms;
+    // Includes translation (for jit)
+    double first_run_ms;
+    double best_run_ms;
+    long peak_rss_kb;
+    // During load, decode, and every run
+    uint64_t allocations;
+} bench_result;
+
+static void print_result(const bench_options* options,
+                         const bench_result* result) {
+    double ns_per_instruction =
+        result->best_run_ms * 1e6 / (double)result->instructions;
+    double mips = (double)result->instructions / (result->best_run_ms * 1e3);
+    if (options->json) {
+        printf(
+            "{\"engine\": \"%s\", \"program_instructions\": %u, \"mix\": "
+            "\"%s\", \"dependency_distance\": %u, \"seed\": %u, "
+            "\"instructions\": %llu, \"load_ms\": %.3f, \"decode_ms\": %.3f, "
+            "\"first_run_ms\": %.3f, \"best_run_ms\": %.3f, "
+            "\"ns_per_instruction\": %.4f, \"mips\": %.2f, "
+            "\"peak_rss_kb\": %ld, \"allocations\": %llu}\n",
+            result->engine, options->synth.num_instructions, options->mix,
+            options->synth.dependency_distance, options->synth.seed,
+            (unsigned long long)result->instructions, result->load_ms,
+            result->decode_ms, result->first_run_ms, result->best_run_ms,
+            ns_per_instruction, mips, result->peak_rss_kb,
+            (unsigned long long)result->allocations);
+    } else {
+        printf("%-12s %14llu %9.2f %9.2f %9.2f %9.2f %8.3f %9.1f %10ld "
+               "%8llu\n",
+               result->engine, (unsigned long long)result->instructions,
+               result->load_ms, result->decode_ms, result->first_run_ms,
+               result->best_run_ms, ns_per_instruction, mips,
+               result->peak_rss_kb, (unsigned long long)result->allocations);
+    }
+    fflush(stdout);
+}
+
+// Loads and decodes the program at path, filling in the load and decode
+// fields of result. Returns NULL on failure
+static program* load_program(const char* path, program_image* image,
+                             bench_result* result) {
+    double start = now_ms();
+    image_status status = load_image(path, IMAGE_FORMAT_HEX, image);
+    result->load_ms = now_ms() - start;
+    if (status != IMAGE_OK) {
+        fprintf(stderr, "Failed to load %s: %s\n", path,
+                image_status_message(status));
+        return NULL;
+    }
+    start = now_ms();
+    program* prog = create_program(image->words, image->num_instructions);
+    result->decode_ms = now_ms() - start;
+    if (prog == NULL) {
+        fprintf(stderr, "Failed to allocate decoded program\n");
+        free_image(image);
+    }
+    return prog;
+}
+
+// Each engine starts from a fresh load so that cached translations and
+// allocation counts aren't shared between rows. peephole is only meaningful
+// for the interpreter (see program.peephole)
+static bool bench_engine(const char* path, engine_kind engine, bool peephole,
+                         const bench_options* options) {
+    bench_result result = {peephole ? "peephole" : engine_name(engine), 0, 0,
+                           0, 0, 0, 0, 0};
+    uint64_t allocations_before = allocations();
+    program_image image;
+    program* prog = load_program(path, &image, &result);
+    if (prog == NULL) return false;
+    prog->peephole = peephole;
+
+    for (unsigned int r = 0; r < options->repeats; r++) {
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+        double start = now_ms();
+        result.instructions =
+            run_engine(engine, prog, registers, &pc, UINT64_MAX);
+        double elapsed = now_ms() - start;
+        if (r == 0) result.first_run_ms = result.best_run_ms = elapsed;
+        if (elapsed < result.best_run_ms) result.best_run_ms = elapsed;
+    }
+
+    result.allocations = allocations() - allocations_before;
+    result.peak_rss_kb = peak_rss_kb();
+    print_result(options, &result);
+    free_program(prog);
+    free_image(&image);
+    return true;
+}
+
+static bool bench_lockstep(const char* path, const bench_options* options) {
+    bench_result result = {"lockstep", 0, 0, 0, 0, 0, 0, 0};
+    uint64_t allocations_before = allocations();
+    program_image image;
+    program* prog = load_program(path, &image, &result);
+    if (prog == NULL) return false;
+    lockstep_state* state = create_lockstep_state(options->contexts);
+    if (state == NULL) {
+        fprintf(stderr, "Failed to allocate lockstep state\n");
+        free_program(prog);
+        free_image(&image);
+        return false;
+    }
+
+    for (unsigned int r = 0; r < options->repeats; r++) {
+        for (uint32_t c = 0; c < state->num_contexts; c++)
+            state->pcs[c] = INITIAL_PC;
+        double start = now_ms();
+        result.instructions =
+            run_lockstep(prog, state, UINT64_MAX, lockstep_best_isa());
+        double elapsed = now_ms() - start;
+        if (r == 0) result.first_run_ms = result.best_run_ms = elapsed;
+        if (elapsed < result.best_run_ms) result.best_run_ms = elapsed;
+    }
+
+    result.allocations = allocations() - allocations_before;
+    result.peak_rss_kb = peak_rss_kb();
+    print_result(options, &result);
+    free_lockstep_state(state);
+    free_program(prog);
+    free_image(&image);
+    return true;
+}
+
+// Times the program on the pipeline model (see run_pipelined), from a fresh
+// pipeline each run
+static bool bench_pipeline(const char* path, const bench_options* options) {
+    bench_result result = {"pipeline", 0, 0, 0, 0, 0, 0, 0};
+    uint64_t allocations_before = allocations();
+    program_image image;
+    program* prog = load_program(path, &image, &result);
+    if (prog == NULL) return false;
+
+    for (unsigned int r = 0; r < options->repeats; r++) {
+        pipeline* pipe = create_pipeline(prog);
+        if (pipe == NULL) {
+            fprintf(stderr, "Failed to allocate pipeline\n");
+            free_program(prog);
+            free_image(&image);
+            return false;
+        }
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+        double start = now_ms();
+        result.instructions =
+            run_pipelined(prog, registers, &pc, UINT64_MAX, pipe);
+        double elapsed = now_ms() - start;
+        if (r == 0) result.first_run_ms = result.best_run_ms = elapsed;
+        if (elapsed < result.best_run_ms) result.best_run_ms = elapsed;
+        free_pipeline(pipe);
+    }
+
+    result.allocations = allocations() - allocations_before;
+    result.peak_rss_kb = peak_rss_kb();
+    print_result(options, &result);
+    free_program(prog);
+    free_image(&image);
+    return true;
+}
+
+// Writes instructions to a new temporary hex file, returning its path (free
+// with free) or NULL on failure
+static char* write_hex_file(const uint32_t* instructions,
+                            uint32_t num_instructions) {
+    char* path = strdup("/tmp/mips_bench_XXXXXX");
+    int fd = mkstemp(path);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        free(path);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < num_instructions; i++)
+        fprintf(file, "%08x\n", instructions[i]);
+    if (fclose(file) != 0) {
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+static void print_usage(void) {
+    printf(
+        "Usage: ./benchmark [-n num_instructions] [-r repeats] [-s seed] "
+        "[--mix=mix] [--deps=distance] [--engine=name] [--contexts=N] "
+        "[--json]\n\n"
+        "Generates a synthetic program, then loads, decodes and runs it with "
+        "each engine and reports speed, memory and allocations.\n\n"
+        "Options:\n"
+        "\t-n num_instructions: program length (default: 1048576)\n"
+        "\t-r repeats: runs per engine, the fastest is reported (default: 3)\n"
+        "\t-s seed: random seed for the generator (default: 1)\n"
+        "\t--mix=mix: instruction mix, either uniform (default), alu, shift, "
+        "immediate, or weights such as add=3,sll=1\n"
+        "\t--deps=distance: 0 (default) for random registers, else each "
+        "instruction reads the register written distance instructions earlier "
+        "(1 to %d; 1 is one long dependency chain)\n"
+        "\t--engine=name: only run this engine (interpreter, threaded or jit); "
+        "may be repeated. The interpreter is also run with peephole fusion, as "
+        "the peephole row. Without --engine, the pipeline row also times the "
+        "program on the five-stage pipeline model (see --pipeline in ./main)\n"
+        "\t--contexts=N: also run N contexts in lockstep, 0 to skip (default: "
+        "1024; skipped if --engine is given)\n"
+        "\t--json: print one JSON object per engine per line\n",
+        SYNTH_MAX_DEPENDENCY_DISTANCE);
+}
+
+// Parses a non-negative integer no larger than max, or exits
+static unsigned long parse_number(const char* arg, unsigned long max) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 0);
+    if (*arg == '\0' || *arg == '-' || *end != '\0' || value > max) {
+        fprintf(stderr, "Invalid number %s. For correct usage, type "
+                        "./benchmark -h\n", arg);
+        exit(1);
+    }
+    return value;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    options.synth = synth_default_options();
+    options.mix = "uniform";
+    options.repeats = 3;
+    memset(options.engines, 0, sizeof(options.engines));
+    bool any_engine = false;
+    options.contexts = 1024;
+    options.json = false;
+
+    static const struct option long_options[] = {
+        {"mix", required_argument, NULL, 'M'},
+        {"deps", required_argument, NULL, 'd'},
+        {"engine", required_argument, NULL, 'e'},
+        {"contexts", required_argument, NULL, 'c'},
+        {"json", no_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hn:r:s:", long_options, NULL)) !=
+           -1) {
+        engine_kind engine;
+        switch (opt) {
+            case 'n':
+                options.synth.num_instructions =
+                    parse_number(optarg, MAX_IMAGE_INSTRUCTIONS);
+                break;
+            case 'r':
+                options.repeats = parse_number(optarg, 1000000);
+                if (options.repeats == 0) options.repeats = 1;
+                break;
+            case 's':
+                options.synth.seed = parse_number(optarg, UINT32_MAX);
+                break;
+            case 'M':
+                if (!synth_parse_mix(optarg, options.synth.weights)) {
+                    fprintf(stderr, "Invalid mix %s. For correct usage, type "
+                                    "./benchmark -h\n", optarg);
+                    return 1;
+                }
+                options.mix = optarg;
+                break;
+            case 'd':
+                options.synth.dependency_distance =
+                    parse_number(optarg, SYNTH_MAX_DEPENDENCY_DISTANCE);
+                break;
+            case 'e':
+                if (!parse_engine(optarg, &engine)) {
+                    fprintf(stderr, "Unknown engine %s. For correct usage, "
+                                    "type ./benchmark -h\n", optarg);
+                    return 1;
+                }
+                options.engines[engine] = true;
+                any_engine = true;
+                break;
+            case 'c':
+                options.contexts = parse_number(optarg, 1 << 24);
+                break;
+            case 'J':
+                options.json = true;
+                break;
+            case 'h':
+                print_usage();
+                return 0;
+            default:
+                fprintf(stderr, "For correct usage, type ./benchmark -h\n");
+                return 1;
+        }
+    }
+    if (!any_engine)
+        for (int engine = 0; engine < NUM_ENGINES; engine++)
+            options.engines[engine] = true;
+
+    double start = now_ms();
+    uint32_t* instructions = synth_program(&options.synth);
+    if (instructions == NULL) {
+        fprintf(stderr, "Failed to generate program\n");
+        return 1;
+    }
+    char* path = write_hex_file(instructions, options.synth.num_instructions);
+    free(instructions);
+    if (path == NULL) {
+        fprintf(stderr, "Failed to write program to a temporary file\n");
+        return 1;
+    }
+    if (!options.json) {
+        printf("%u instructions, mix %s, dependency distance %u, seed %u "
+               "(generated in %.0f ms)\n\n",
+               options.synth.num_instructions, options.mix,
+               options.synth.dependency_distance, options.synth.seed,
+               now_ms() - start);
+        printf("%-12s %14s %9s %9s %9s %9s %8s %9s %10s %8s\n", "engine",
+               "instructions", "load ms", "decode ms", "first ms", "best ms",
+               "ns/instr", "MIPS", "peak RSS", "allocs");
+    }
+
+    bool ok = true;
+    for (int engine = 0; engine < NUM_ENGINES; engine++)
+        if (options.engines[engine])
+            ok = bench_engine(path, (engine_kind)engine, false, &options) && ok;
+    if (options.engines[ENGINE_INTERPRETER])
+        ok = bench_engine(path, ENGINE_INTERPRETER, true, &options) && ok;
+    if (options.contexts > 0 && !any_engine)
+        ok = bench_lockstep(path, &options) && ok;
+    if (!any_engine) ok = bench_pipeline(path, &options) && ok;
+
+    unlink(path);
+    free(path);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+#include "block.h"
+
+#include <stdlib.h>
+
+#include "instructions.h"
+#include "peephole.h"
+
+block_cache* create_block_cache(const program* prog) {
+    block_cache* cache = (block_cache*)malloc(sizeof(block_cache));
+    if (cache == NULL) return NULL;
+    cache->num_instructions = prog->num_instructions;
+    cache->peephole = prog->peephole;
+    cache->reached = 0;
+    // + 1 so that an empty program is still a non-NULL allocation
+    cache->by_start = (basic_block**)calloc(
+        (size_t)prog->num_instructions + 1, sizeof(basic_block*));
+    if (cache->by_start == NULL) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void free_block_cache(block_cache* cache) {
+    if (cache == NULL) return;
+    for (uint32_t i = 0; i < cache->num_instructions; i++) {
+        basic_block* block = cache->by_start[i];
+        if (block != NULL && block->op_start != NULL) {
+            free((instruction*)block->ops);
+            free(block->op_start);
+        }
+        free(block);
+    }
+    free(cache->by_start);
+    free(cache);
+}
+
+// Replaces block's ops with fused ones. Leaves them as they are if
+// allocation fails, since fusing is only an optimization
+static void fuse_block(basic_block* block, const program* prog) {
+    instruction* ops =
+        (instruction*)malloc(block->num_ops * sizeof(instruction));
+    uint32_t* op_start =
+        (uint32_t*)malloc((block->num_ops + 1) * sizeof(uint32_t));
+    if (ops == NULL || op_start == NULL) {
+        free(ops);
+        free(op_start);
+        return;
+    }
+    block->num_ops = peephole_fuse(block->ops, block->num_ops, ops, op_start);
+    block->ops = ops;
+    block->op_start = op_start;
+}
+
+basic_block* lookup_block(block_cache* cache, const program* prog,
+                          uint32_t start) {
+    basic_block* block = cache->by_start[start];
+    if (block != NULL) return block;
+
+    block = (basic_block*)calloc(1, sizeof(basic_block));
+    if (block == NULL) return NULL;
+    uint32_t i = start;
+    bool control_flow = false;
+    while (i < prog->num_instructions && i - start < MAX_BLOCK_LENGTH &&
+           !control_flow)
+        control_flow = is_control_flow(prog->decoded[i++].name);
+    block->start = start;
+    block->length = i - start;
+    block->ends_in_control_flow = control_flow;
+    block->ops = &prog->decoded[start];
+    block->num_ops = block->length - 1;
+    // Fusing a single instruction can't save anything
+    if (cache->peephole && block->length > 2) fuse_block(block, prog);
+    cache->by_start[start] = block;
+    if (i > cache->reached) cache->reached = i;
+    return block;
+}
+
+void link_block(basic_block* block, uint32_t next_pc, basic_block* next) {
+    for (int k = 0; k < BLOCK_SUCCESSORS; k++) {
+        if (block->successor[k] != NULL) continue;
+        block->successor_pc[k] = next_pc;
+        block->successor[k] = next;
+        return;
+    }
+}
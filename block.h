@@ -0,0 +1,102 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "program.h"
+
+// Longest run of instructions in a single basic block. Longer straight-line
+// runs are split into several blocks that chain to each other
+#define MAX_BLOCK_LENGTH 1024
+// Number of successors a block remembers: taken and not taken for a branch
+#define BLOCK_SUCCESSORS 2
+
+/**
+ * A run of instructions that is always executed from start to finish
+ *
+ * A block starts wherever execution enters it and ends after the first
+ * control flow instruction (see is_control_flow), after MAX_BLOCK_LENGTH
+ * instructions, or at the end of the program, whichever comes first. Blocks
+ * may overlap, e.g., when a branch targets the middle of another block
+ *
+ * Once the block that follows this one has been looked up, it is linked in
+ * successor (with the PC it starts at in successor_pc), so a loop goes
+ * straight from one block to the next without a lookup
+ *
+ * Every instruction but the last is run from ops. Normally ops points into
+ * the program's decoded instructions, but if the program was created with
+ * peephole set, the block gets its own ops from peephole_fuse (with op_start
+ * mapping them back to instructions, relative to start), which the last
+ * instruction never takes part in
+ */
+typedef struct basic_block {
+    // Index of the first instruction
+    uint32_t start;
+    uint32_t length;
+    // Whether the last instruction is a control flow instruction
+    bool ends_in_control_flow;
+    const instruction* ops;
+    uint32_t num_ops;
+    // NULL unless ops were fused (in which case ops is owned by the block)
+    uint32_t* op_start;
+    uint32_t successor_pc[BLOCK_SUCCESSORS];
+    // NULL until linked
+    struct basic_block* successor[BLOCK_SUCCESSORS];
+} basic_block;
+
+/**
+ * Blocks of a program, built on first execution
+ *
+ * by_start[i] is the block that starts at instruction i (NULL if it hasn't
+ * been executed yet)
+ */
+struct block_cache {
+    basic_block** by_start;
+    uint32_t num_instructions;
+    // Whether blocks are built with peephole_fuse (from program.peephole)
+    bool peephole;
+    // One past the last instruction of every block built so far, so no
+    // instruction at or after it has been executed
+    uint32_t reached;
+};
+
+/**
+ * Creates an empty block cache for prog
+ *
+ * @param prog
+ * @return block_cache* (free with free_block_cache), or NULL if allocation
+ * fails
+ */
+block_cache* create_block_cache(const program* prog);
+
+/**
+ * Frees a block cache and all of its blocks
+ *
+ * @param cache may be NULL
+ */
+void free_block_cache(block_cache* cache);
+
+/**
+ * Returns the block of prog that starts at instruction index start, building
+ * and caching it if it doesn't exist yet
+ *
+ * @param cache created for prog
+ * @param prog
+ * @param start less than prog->num_instructions
+ * @return basic_block*, or NULL if allocation fails
+ */
+basic_block* lookup_block(block_cache* cache, const program* prog,
+                          uint32_t start);
+
+/**
+ * Links next as a successor of block (which jumped or fell through to
+ * next_pc) if block has a free successor slot
+ *
+ * @param block
+ * @param next_pc
+ * @param next
+ */
+void link_block(basic_block* block, uint32_t next_pc, basic_block* next);
+
+#endif  // BLOCK_H
@@ -0,0 +1,198 @@
+#include "checkpoint.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "engine.h"
+
+// Checkpoint files are named CHECKPOINT_PREFIX<steps>CHECKPOINT_SUFFIX, with
+// steps zero-padded so that they sort in order
+#define CHECKPOINT_PREFIX "checkpoint-"
+#define CHECKPOINT_SUFFIX ".snap"
+
+checkpoint_log* open_checkpoints(const char* directory, uint64_t interval) {
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) return NULL;
+    checkpoint_log* log = (checkpoint_log*)calloc(1, sizeof(checkpoint_log));
+    if (log == NULL) return NULL;
+    log->directory = strdup(directory);
+    if (log->directory == NULL) {
+        free(log);
+        return NULL;
+    }
+    log->interval = interval;
+    return log;
+}
+
+void close_checkpoints(checkpoint_log* log) {
+    if (log == NULL) return;
+    free(log->directory);
+    free(log->latest);
+    free(log);
+}
+
+// A checkpoint file found in a log's directory
+typedef struct {
+    char* path;
+    snapshot_header header;
+    // Whether its prefix of the program is unchanged
+    bool valid;
+} checkpoint_file;
+
+static int compare_by_prefix(const void* a, const void* b) {
+    uint32_t x = ((const checkpoint_file*)a)->header.num_instructions;
+    uint32_t y = ((const checkpoint_file*)b)->header.num_instructions;
+    return (x > y) - (x < y);
+}
+
+// Returns the checkpoint files in directory (setting *count), or NULL if
+// there are none or allocation fails. Files that aren't readable snapshots
+// are deleted
+static checkpoint_file* list_checkpoints(const char* directory,
+                                         size_t* count) {
+    *count = 0;
+    DIR* dir = opendir(directory);
+    if (dir == NULL) return NULL;
+    checkpoint_file* files = NULL;
+    size_t capacity = 0;
+    const struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (strncmp(entry->d_name, CHECKPOINT_PREFIX,
+                    strlen(CHECKPOINT_PREFIX)) != 0 ||
+            length < strlen(CHECKPOINT_SUFFIX) ||
+            strcmp(entry->d_name + length - strlen(CHECKPOINT_SUFFIX),
+                   CHECKPOINT_SUFFIX) != 0)
+            continue;
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            checkpoint_file* grown = (checkpoint_file*)realloc(
+                files, capacity * sizeof(checkpoint_file));
+            if (grown == NULL) break;
+            files = grown;
+        }
+        checkpoint_file* file = &files[*count];
+        size_t size = strlen(directory) + 1 + length + 1;
+        file->path = (char*)malloc(size);
+        if (file->path == NULL) break;
+        snprintf(file->path, size, "%s/%s", directory, entry->d_name);
+        snapshot_status status =
+            read_snapshot_header(file->path, &file->header);
+        if (status == SNAPSHOT_OK) {
+            (*count)++;
+            continue;
+        }
+        if (status != SNAPSHOT_OPEN_FAILED) unlink(file->path);
+        free(file->path);
+    }
+    closedir(dir);
+    return files;
+}
+
+bool resume_from_checkpoint(checkpoint_log* log, const uint32_t* words,
+                            uint32_t num_instructions, uint64_t max_steps,
+                            snapshot_state* state, guest_memory** mem) {
+    size_t count;
+    checkpoint_file* files = list_checkpoints(log->directory, &count);
+
+    // Hash every prefix in one pass over the program, shortest first
+    if (count > 0)
+        qsort(files, count, sizeof(checkpoint_file), compare_by_prefix);
+    uint64_t hash = PROGRAM_HASH_EMPTY;
+    uint32_t hashed = 0;
+    for (size_t i = 0; i < count; i++) {
+        const snapshot_header* header = &files[i].header;
+        files[i].valid = header->num_instructions <= num_instructions;
+        if (!files[i].valid) continue;
+        hash = program_hash_extend(hash, words + hashed,
+                                   header->num_instructions - hashed);
+        hashed = header->num_instructions;
+        files[i].valid = header->program_hash == hash;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!files[i].valid) unlink(files[i].path);
+    }
+
+    // Latest within max_steps first. One that can't be restored (e.g., its
+    // parent is gone) is deleted in favor of the one before
+    bool resumed = false;
+    while (!resumed) {
+        checkpoint_file* latest = NULL;
+        for (size_t i = 0; i < count; i++) {
+            if (files[i].valid && files[i].header.steps <= max_steps &&
+                (latest == NULL ||
+                 files[i].header.steps > latest->header.steps))
+                latest = &files[i];
+        }
+        if (latest == NULL) break;
+        latest->valid = false;
+        if (restore_snapshot(latest->path, words, num_instructions, state,
+                             *mem) == SNAPSHOT_OK) {
+            resumed = true;
+            log->latest = strdup(latest->path);
+            log->resumed_prefix = latest->header.num_instructions;
+            // Its chain may already be long, so the next one starts anew
+            log->since_full = CHECKPOINTS_PER_FULL;
+        } else {
+            unlink(latest->path);
+            bool flat = (*mem)->flat != NULL;
+            free_memory(*mem);
+            *mem = create_memory(flat);
+            if (*mem == NULL) break;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) free(files[i].path);
+    free(files);
+    return resumed;
+}
+
+// Saves state as the next checkpoint of log
+static snapshot_status save_checkpoint(checkpoint_log* log,
+                                       const program* prog,
+                                       const uint32_t* words,
+                                       const snapshot_state* state,
+                                       guest_memory* mem) {
+    uint32_t prefix = prog->blocks != NULL ? prog->blocks->reached
+                                           : prog->num_instructions;
+    if (log->resumed_prefix > prefix) prefix = log->resumed_prefix;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/" CHECKPOINT_PREFIX "%020" PRIu64
+                 CHECKPOINT_SUFFIX, log->directory, state->steps) >=
+        (int)sizeof(path))
+        return SNAPSHOT_OPEN_FAILED;
+    bool full =
+        log->latest == NULL || log->since_full + 1 >= CHECKPOINTS_PER_FULL;
+    snapshot_status status = save_snapshot(path, full ? NULL : log->latest,
+                                           words, prefix, state, mem);
+    if (status != SNAPSHOT_OK) return status;
+    free(log->latest);
+    log->latest = strdup(path);
+    log->since_full = full ? 0 : log->since_full + 1;
+    return log->latest != NULL ? SNAPSHOT_OK : SNAPSHOT_NO_MEMORY;
+}
+
+snapshot_status run_checkpointed(checkpoint_log* log, program* prog,
+                                 const uint32_t* words, snapshot_state* state,
+                                 uint64_t max_steps, guest_memory* mem) {
+    snapshot_status status = SNAPSHOT_OK;
+    while (state->steps < max_steps &&
+           !engine_done(prog, state->registers, state->pc)) {
+        // Up to the next multiple of the interval, so checkpoints land on the
+        // same steps whether or not the run resumed
+        uint64_t steps = log->interval - state->steps % log->interval;
+        if (steps > max_steps - state->steps) steps = max_steps - state->steps;
+        state->steps +=
+            run_interpreter(prog, state->registers, &state->pc, steps);
+        if (status == SNAPSHOT_OK)
+            status = save_checkpoint(log, prog, words, state, mem);
+    }
+    return status;
+}
@@ -0,0 +1,101 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memory.h"
+#include "program.h"
+#include "snapshot.h"
+
+// Steps between checkpoints unless --checkpoint-interval says otherwise
+#define DEFAULT_CHECKPOINT_INTERVAL 1000000
+// One checkpoint in this many is a full snapshot instead of an incremental
+// one, which keeps chains of parents well under SNAPSHOT_MAX_CHAIN
+#define CHECKPOINTS_PER_FULL 16
+
+/**
+ * Checkpoints of a program's runs, kept in a directory across runs so that
+ * re-running the program after an edit doesn't start over
+ *
+ * A run saves a snapshot every interval steps, named after its step count.
+ * Each one records the prefix of the program the run had depended on by
+ * then, i.e., every instruction up to the furthest block executed (see
+ * block_cache.reached), and its hash. When the program is loaded again, the
+ * prefix hashes of all checkpoints are checked against it in one pass: any
+ * checkpoint whose prefix changed was taken after execution reached an
+ * edited instruction and is deleted, and the run resumes from the remaining
+ * one with the most steps
+ *
+ * Runs always start from all-zero registers at INITIAL_PC with an empty
+ * memory, as ./main does, so that's the state checkpoints are relative to
+ */
+typedef struct {
+    char* directory;
+    uint64_t interval;
+    // Path of the checkpoint the run resumed from or saved last, NULL if none
+    char* latest;
+    // Incremental checkpoints saved since the last full one
+    uint32_t since_full;
+    // Instructions the run had depended on when it resumed
+    uint32_t resumed_prefix;
+} checkpoint_log;
+
+/**
+ * Opens (creating it if needed) a directory of checkpoints
+ *
+ * @param directory
+ * @param interval steps between checkpoints, at least 1
+ * @return checkpoint_log* (free with close_checkpoints), or NULL if the
+ * directory can't be created or allocation fails
+ */
+checkpoint_log* open_checkpoints(const char* directory, uint64_t interval);
+
+/**
+ * Frees a checkpoint_log. The checkpoints stay in its directory
+ *
+ * @param log may be NULL
+ */
+void close_checkpoints(checkpoint_log* log);
+
+/**
+ * Restores the latest checkpoint in log that is still valid for a program
+ * and taken within max_steps, deleting those that aren't valid (or can't be
+ * restored). Later checkpoints are kept, for runs with a higher limit
+ *
+ * @param log
+ * @param words the program's instructions, possibly edited since the
+ * checkpoints were saved
+ * @param num_instructions
+ * @param max_steps the run's step limit
+ * @param state set to the checkpoint's state if one is restored
+ * @param mem an empty memory, filled in if a checkpoint is restored. If a
+ * checkpoint fails to restore partway, *mem is replaced by a new empty one
+ * (flat if it was)
+ * @return true if a checkpoint was restored, else false (run from the start)
+ */
+bool resume_from_checkpoint(checkpoint_log* log, const uint32_t* words,
+                            uint32_t num_instructions, uint64_t max_steps,
+                            snapshot_state* state, guest_memory** mem);
+
+/**
+ * Runs prog with the interpreter (see run_interpreter) from state until it
+ * is done or state->steps reaches max_steps, saving a checkpoint in log
+ * every log->interval steps and once it stops
+ *
+ * Memory instructions access mem, which must be bound (see memory_bind)
+ *
+ * @param log
+ * @param prog
+ * @param words the instructions prog was created from
+ * @param state registers, pc and steps, updated as the program runs
+ * @param max_steps
+ * @param mem
+ * @return SNAPSHOT_OK if every checkpoint was saved, else why the first one
+ * that wasn't failed (no more are attempted, but the run carries on)
+ */
+snapshot_status run_checkpointed(checkpoint_log* log, program* prog,
+                                 const uint32_t* words, snapshot_state* state,
+                                 uint64_t max_steps, guest_memory* mem);
+
+#endif  // CHECKPOINT_H
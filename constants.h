@@ -34,19 +34,40 @@
 #define IMMEDIATE_START_BIT 15
 #define IMMEDIATE_END_BIT 0
 
+// J-type instruction has target
+#define TARGET_START_BIT 25
+#define TARGET_END_BIT 0
+
 #define R_TYPE_OPCODE 0b000000
+#define J_OPCODE 0b000010
+#define JAL_OPCODE 0b000011
+#define BEQ_OPCODE 0b000100
+#define BNE_OPCODE 0b000101
 #define ADDI_OPCODE 0b001000
 #define ANDI_OPCODE 0b001100
 #define ORI_OPCODE 0b001101
+#define LB_OPCODE 0b100000
+#define LW_OPCODE 0b100011
+#define SB_OPCODE 0b101000
+#define SW_OPCODE 0b101011
+#define LL_OPCODE 0b110000
+#define SC_OPCODE 0b111000
 
 #define SLL_FUNCT 0b000000
 #define SRA_FUNCT 0b000011
+#define JR_FUNCT 0b001000
+#define SYSCALL_FUNCT 0b001100
 #define ADD_FUNCT 0b100000
 #define SUB_FUNCT 0b100010
 #define AND_FUNCT 0b100100
 #define OR_FUNCT 0b100101
 #define NOR_FUNCT 0b100111
 
+// Opcode and funct are 6 bits each, so there are 64 of each (see the decode
+// tables in instructions.c)
+#define NUM_OPCODES 64
+#define NUM_FUNCTS 64
+
 // For bit_select
 #define UNSIGNED_INT_NUM_BITS sizeof(unsigned int) * 8
 
@@ -54,7 +75,15 @@
 #define NUM_REGISTERS 32
 // Each instruction is 4 bytes
 #define WORD_SIZE 4
-// Definitely lower than the actual max number, but this is a suitable limit
-#define MAX_INSTRUCTIONS 1000
+
+// syscall reads its service number from $v0, and service 10 halts the program
+#define V0_REGISTER 2
+#define EXIT_SYSCALL 10
+// jal writes the return address to $ra
+#define RA_REGISTER 31
+// instruction_destination of an instruction that writes no register
+#define NO_DESTINATION 0xff
+// j and jal keep the upper 4 bits of the PC
+#define JUMP_REGION_MASK 0xf0000000u
 
 #endif  // CONSTANTS_H
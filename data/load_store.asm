@@ -0,0 +1,11 @@
+addi	$8, $0, 4096
+addi	$9, $0, -2
+sw	$9, 0($8)
+lb	$10, 1($8)
+sb	$0, 0($8)
+lw	$11, 0($8)
+addi	$9, $9, 300
+sw	$9, 4094($8)
+lw	$12, 4094($8)
+lb	$13, 2($8)
+lw	$14, 0x1fff($0)
@@ -0,0 +1,13 @@
+addi	$8, $0, 10
+addi	$9, $0, 0
+loop:
+add	$9, $9, $8
+addi	$8, $8, -1
+bne	$8, $0, loop
+jal	double
+addi	$2, $0, 10
+syscall
+addi	$10, $0, 1
+double:
+add	$9, $9, $9
+jr	$31
@@ -0,0 +1,135 @@
+#include "debug.h"
+
+#include <stdlib.h>
+
+#include "block.h"
+#include "constants.h"
+#include "instructions.h"
+#include "jit.h"
+
+debugger* create_debugger(program* prog, const uint32_t* words,
+                          engine_kind engine) {
+    debugger* dbg = (debugger*)calloc(1, sizeof(debugger));
+    if (dbg == NULL) return NULL;
+    const uint32_t n = prog->num_instructions;
+    // + 1 so an empty program doesn't look like a failed allocation
+    dbg->names = (instruction_name*)malloc((n + 1) * sizeof(instruction_name));
+    dbg->dests = (uint8_t*)malloc(n + 1);
+    dbg->breakpoints = (bool*)calloc(n + 1, sizeof(bool));
+    if (dbg->names == NULL || dbg->dests == NULL || dbg->breakpoints == NULL) {
+        free_debugger(dbg);
+        return NULL;
+    }
+    dbg->prog = prog;
+    dbg->words = words;
+    dbg->engine = engine;
+    for (uint32_t i = 0; i < n; i++) {
+        dbg->names[i] = prog->decoded[i].name;
+        dbg->dests[i] = instruction_destination(&prog->decoded[i]);
+    }
+    return dbg;
+}
+
+// Drops everything the engines translated from the decoded instructions, so
+// the next run sees the current patches
+static void drop_translations(program* prog) {
+    free_block_cache(prog->blocks);
+    prog->blocks = NULL;
+    jit_free(prog->jit);
+    prog->jit = NULL;
+}
+
+// Whether the debugger has to stop at instruction i
+static bool is_patched(const debugger* dbg, uint32_t i) {
+    return dbg->breakpoints[i] ||
+           (dbg->dests[i] != NO_DESTINATION &&
+            (dbg->watched >> dbg->dests[i]) & 1);
+}
+
+// Renames instruction i to BREAKPOINT if the debugger has to stop at it, else
+// back to its own name
+static void patch(debugger* dbg, uint32_t i) {
+    dbg->prog->decoded[i].name =
+        is_patched(dbg, i) ? BREAKPOINT : dbg->names[i];
+}
+
+void free_debugger(debugger* dbg) {
+    if (dbg == NULL) return;
+    if (dbg->names != NULL && dbg->prog != NULL) {
+        for (uint32_t i = 0; i < dbg->prog->num_instructions; i++)
+            dbg->prog->decoded[i].name = dbg->names[i];
+        drop_translations(dbg->prog);
+    }
+    free(dbg->names);
+    free(dbg->dests);
+    free(dbg->breakpoints);
+    free(dbg);
+}
+
+bool debug_set_breakpoint(debugger* dbg, uint32_t pc, bool set) {
+    if (pc % WORD_SIZE != 0 || pc / WORD_SIZE >= dbg->prog->num_instructions)
+        return false;
+    uint32_t i = pc / WORD_SIZE;
+    if (dbg->breakpoints[i] == set) return true;
+    dbg->breakpoints[i] = set;
+    patch(dbg, i);
+    drop_translations(dbg->prog);
+    return true;
+}
+
+bool debug_set_watchpoint(debugger* dbg, int reg, bool set) {
+    if (reg < 0 || reg >= NUM_REGISTERS) return false;
+    uint32_t watched = set ? dbg->watched | (1u << reg)
+                           : dbg->watched & ~(1u << reg);
+    if (watched == dbg->watched) return true;
+    dbg->watched = watched;
+    for (uint32_t i = 0; i < dbg->prog->num_instructions; i++)
+        if (dbg->dests[i] == reg) patch(dbg, i);
+    drop_translations(dbg->prog);
+    return true;
+}
+
+// Same as engine_done, but for the unpatched program
+static bool is_done(const debugger* dbg, const int32_t* registers,
+                    uint32_t pc) {
+    return pc >= dbg->prog->num_instructions * WORD_SIZE ||
+           pc % WORD_SIZE != 0 ||
+           (dbg->names[pc >> 2] == SYSCALL &&
+            registers[V0_REGISTER] == EXIT_SYSCALL);
+}
+
+debug_stop debug_run(debugger* dbg, int32_t* registers, uint32_t* pc,
+                     uint64_t max_steps) {
+    uint64_t steps = 0;
+    while (steps < max_steps) {
+        if (is_done(dbg, registers, *pc)) return DEBUG_DONE;
+        const uint32_t i = (*pc) >> 2;
+        if (is_patched(dbg, i)) {
+            // Patching keeps the handler, so the instruction can be run
+            // without unpatching it
+            const instruction* instruct = &dbg->prog->decoded[i];
+            const uint8_t dest = dbg->dests[i];
+            const int32_t old_value = dest != NO_DESTINATION ? registers[dest]
+                                                             : 0;
+            instruct->execute(instruct->_fields, registers, pc);
+            steps++;
+            dbg->steps++;
+            if (dest != NO_DESTINATION && (dbg->watched >> dest) & 1 &&
+                registers[dest] != old_value) {
+                dbg->watch_register = dest;
+                dbg->watch_old_value = old_value;
+                return DEBUG_WATCHPOINT;
+            }
+        } else {
+            uint64_t executed = run_engine(dbg->engine, dbg->prog, registers,
+                                           pc, max_steps - steps);
+            steps += executed;
+            dbg->steps += executed;
+        }
+        if ((*pc) % WORD_SIZE == 0 &&
+            (*pc) / WORD_SIZE < dbg->prog->num_instructions &&
+            dbg->breakpoints[(*pc) / WORD_SIZE])
+            return DEBUG_BREAKPOINT;
+    }
+    return DEBUG_STEPPED;
+}
@@ -0,0 +1,116 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "engine.h"
+#include "program.h"
+
+// Why debug_run returned
+typedef enum {
+    // pc is on a breakpoint, whose instruction hasn't been executed
+    DEBUG_BREAKPOINT,
+    // A watched register changed (see debugger.watch_register); pc is after
+    // the instruction that changed it
+    DEBUG_WATCHPOINT,
+    // The requested number of instructions were executed
+    DEBUG_STEPPED,
+    // Execution is over (see engine_done), e.g., the program halted or pc is
+    // invalid
+    DEBUG_DONE
+} debug_stop;
+
+/**
+ * Breakpoints and register watchpoints on a program
+ *
+ * Both are set by patching the instructions to stop at in prog->decoded:
+ * their name becomes BREAKPOINT, which every engine stops before (see
+ * instruction_halts), and which is only ever the last instruction of a block.
+ * Between stops, the program runs at the full speed of the engine, and
+ * instructions without a breakpoint cost nothing extra. A register watchpoint
+ * patches every instruction that writes the register, and the debugger
+ * executes those itself to see whether the value changed
+ */
+typedef struct {
+    program* prog;
+    // The instructions prog was created from
+    const uint32_t* words;
+    engine_kind engine;
+    // Name of every instruction of prog before patching
+    instruction_name* names;
+    // Register each instruction writes, or NO_DESTINATION
+    uint8_t* dests;
+    // Whether each instruction has a breakpoint
+    bool* breakpoints;
+    // Bit r is set if register r is watched
+    uint32_t watched;
+    // Instructions executed by debug_run so far
+    uint64_t steps;
+    // After a DEBUG_WATCHPOINT stop, the register that changed and its value
+    // before
+    uint8_t watch_register;
+    int32_t watch_old_value;
+} debugger;
+
+/**
+ * Creates a debugger for prog, without breakpoints or watchpoints
+ *
+ * @param prog must not be run with another engine while the debugger exists
+ * @param words the instructions prog was created from
+ * @param engine runs the program between stops
+ * @return debugger* (free with free_debugger), or NULL if allocation fails
+ */
+debugger* create_debugger(program* prog, const uint32_t* words,
+                          engine_kind engine);
+
+/**
+ * Removes every breakpoint and watchpoint from the program and frees dbg
+ *
+ * @param dbg may be NULL
+ */
+void free_debugger(debugger* dbg);
+
+/**
+ * Sets or clears the breakpoint on the instruction at pc
+ *
+ * Translations cached in the program are dropped, and rebuilt on the next
+ * run
+ *
+ * @param dbg
+ * @param pc
+ * @param set true to set, false to clear
+ * @return true on success, else false (pc isn't the address of an
+ * instruction)
+ */
+bool debug_set_breakpoint(debugger* dbg, uint32_t pc, bool set);
+
+/**
+ * Sets or clears the watchpoint on a register, which stops execution after
+ * any instruction that changes its value
+ *
+ * @param dbg
+ * @param reg
+ * @param set true to set, false to clear
+ * @return true on success, else false (reg isn't a register number)
+ */
+bool debug_set_watchpoint(debugger* dbg, int reg, bool set);
+
+/**
+ * Runs the program until a breakpoint or watchpoint is hit, max_steps
+ * instructions have been executed, or execution is over
+ *
+ * The instruction at pc is executed even if it has a breakpoint, so running
+ * again after stopping at one continues past it
+ *
+ * @param dbg
+ * @param registers
+ * @param pc
+ * @param max_steps e.g., 1 to step, UINT64_MAX to continue
+ * @return why execution stopped. If a breakpoint is reached just as max_steps
+ * runs out, DEBUG_BREAKPOINT
+ */
+debug_stop debug_run(debugger* dbg, int32_t* registers, uint32_t* pc,
+                     uint64_t max_steps);
+
+#endif  // DEBUG_H
@@ -0,0 +1,310 @@
+#include "engine.h"
+
+#include <string.h>
+
+#include "block.h"
+#include "constants.h"
+#include "instructions.h"
+#include "jit.h"
+#include "memory.h"
+
+// Indexed by engine_kind
+static const char* const ENGINE_NAMES[] = {"interpreter", "threaded", "jit"};
+
+bool parse_engine(const char* name, engine_kind* engine) {
+    for (unsigned int i = 0; i < NUM_ENGINES; i++) {
+        if (strcmp(name, ENGINE_NAMES[i]) == 0) {
+            *engine = (engine_kind)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* engine_name(engine_kind engine) { return ENGINE_NAMES[engine]; }
+
+uint64_t run_engine(engine_kind engine, program* prog, int32_t* registers,
+                    uint32_t* pc, uint64_t max_steps) {
+    switch (engine) {
+        case ENGINE_JIT:
+            return run_jit(prog, registers, pc, max_steps);
+        case ENGINE_THREADED:
+            return run_threaded(prog, registers, pc, max_steps);
+        case ENGINE_INTERPRETER:
+        default:
+            return run_interpreter(prog, registers, pc, max_steps);
+    }
+}
+
+bool engine_done(const program* prog, const int32_t* registers, uint32_t pc) {
+    return pc >= prog->num_instructions * WORD_SIZE || pc % WORD_SIZE != 0 ||
+           instruction_halts(&prog->decoded[pc >> 2], registers);
+}
+
+// Runs one instruction at a time, checking pc before each one. Used when the
+// step budget ends inside a block, or if the block cache can't be allocated
+static uint64_t run_single(const program* prog, int32_t* registers,
+                           uint32_t* pc, uint64_t max_steps) {
+    uint64_t steps = 0;
+    while (steps < max_steps && !engine_done(prog, registers, *pc)) {
+        const instruction* instruct = &prog->decoded[(*pc) >> 2];
+        instruct->execute(instruct->_fields, registers, pc);
+        steps++;
+    }
+    return steps;
+}
+
+uint64_t run_interpreter(program* prog, int32_t* registers, uint32_t* pc,
+                         uint64_t max_steps) {
+    if (prog->blocks == NULL) prog->blocks = create_block_cache(prog);
+    block_cache* cache = prog->blocks;
+    if (cache == NULL) return run_single(prog, registers, pc, max_steps);
+
+    const uint32_t end_pc = prog->num_instructions * WORD_SIZE;
+    uint64_t steps = 0;
+    basic_block* block = NULL;
+    while (true) {
+        if (block == NULL) {
+            if ((*pc) >= end_pc || (*pc) % WORD_SIZE != 0) break;
+            block = lookup_block(cache, prog, (*pc) >> 2);
+            if (block == NULL) {
+                // Instructions run without blocks could be anywhere
+                cache->reached = prog->num_instructions;
+                steps += run_single(prog, registers, pc, max_steps - steps);
+                break;
+            }
+        }
+        if (block->length > max_steps - steps) {
+            steps += run_single(prog, registers, pc, max_steps - steps);
+            break;
+        }
+
+        // Only the last instruction of a block can change the PC other than
+        // by advancing it, so nothing needs to be checked before then. Fused
+        // ops don't advance pc, so it is set before the last instruction
+        const instruction* op = block->ops;
+        const instruction* ops_end = op + block->num_ops;
+        for (; op < ops_end; op++) op->execute(op->_fields, registers, pc);
+        const uint32_t last_index = block->start + block->length - 1;
+        *pc = last_index * WORD_SIZE;
+        const instruction* last = &prog->decoded[last_index];
+        if (instruction_halts(last, registers)) {
+            steps += block->length - 1;
+            break;
+        }
+        last->execute(last->_fields, registers, pc);
+        steps += block->length;
+
+        basic_block* next = NULL;
+        for (int k = 0; k < BLOCK_SUCCESSORS; k++)
+            if (block->successor[k] != NULL && block->successor_pc[k] == *pc)
+                next = block->successor[k];
+        if (next == NULL && (*pc) < end_pc && (*pc) % WORD_SIZE == 0) {
+            next = lookup_block(cache, prog, (*pc) >> 2);
+            if (next != NULL) link_block(block, *pc, next);
+        }
+        block = next;
+    }
+    return steps;
+}
+
+// GCC and Clang support labels as values, which lets each handler jump
+// straight to the next one instead of going back through a switch
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+uint64_t run_threaded(const program* prog, int32_t* registers, uint32_t* pc,
+                      uint64_t max_steps) {
+    if ((*pc) % WORD_SIZE != 0) return 0;
+
+    const instruction* const decoded = prog->decoded;
+    const uint32_t n = prog->num_instructions;
+    // i is the index of the next instruction, so i * WORD_SIZE is the PC the
+    // handlers see as pc + WORD_SIZE. Arithmetic on it wraps around the same
+    // way as pc does
+    uint32_t i = (*pc) >> 2;
+    uint32_t jump_target;
+    uint64_t steps = 0;
+
+    int32_t regs[NUM_REGISTERS];
+    memcpy(regs, registers, sizeof(regs));
+    guest_memory* const mem = bound_memory;
+    const instruction* instruct;
+
+    // Shifts and add/sub are done on uint32_t to avoid signed overflow, which
+    // gives the same two's complement result as the handlers in
+    // instructions.c
+#if USE_COMPUTED_GOTO
+    // Indexed by instruction_name
+    static const void* const LABELS[] = {
+        &&op_sll, &&op_sra, &&op_add,  &&op_sub,  &&op_and, &&op_or,
+        &&op_nor, &&op_addi, &&op_andi, &&op_ori, &&op_lw, &&op_sw,
+        &&op_lb,  &&op_sb,  &&op_ll,   &&op_sc,   &&op_beq, &&op_bne,
+        &&op_j,   &&op_jal, &&op_jr,   &&op_syscall, &&op_breakpoint};
+#define DISPATCH()                                   \
+    do {                                             \
+        if (steps == max_steps || i >= n) goto done; \
+        instruct = &decoded[i++];                    \
+        steps++;                                     \
+        goto* LABELS[instruct->name];                \
+    } while (0)
+#define OP(label, name) label:
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define OP(label, name) case name:
+    while (steps < max_steps && i < n) {
+        instruct = &decoded[i++];
+        steps++;
+        switch (instruct->name) {
+#endif
+
+    OP(op_sll, SLL) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = (int32_t)((uint32_t)regs[f.rt] << f.shamt);
+        DISPATCH();
+    }
+    OP(op_sra, SRA) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = regs[f.rt] >> f.shamt;
+        DISPATCH();
+    }
+    OP(op_add, ADD) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = (int32_t)((uint32_t)regs[f.rt] + (uint32_t)regs[f.rs]);
+        DISPATCH();
+    }
+    OP(op_sub, SUB) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = (int32_t)((uint32_t)regs[f.rs] - (uint32_t)regs[f.rt]);
+        DISPATCH();
+    }
+    OP(op_and, AND) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = regs[f.rt] & regs[f.rs];
+        DISPATCH();
+    }
+    OP(op_or, OR) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = regs[f.rt] | regs[f.rs];
+        DISPATCH();
+    }
+    OP(op_nor, NOR) {
+        r_fields f = instruct->_fields.r;
+        regs[f.rd] = ~(regs[f.rt] | regs[f.rs]);
+        DISPATCH();
+    }
+    OP(op_addi, ADDI) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] = (int32_t)((uint32_t)regs[f.rs] + (uint32_t)f.immediate);
+        DISPATCH();
+    }
+    OP(op_andi, ANDI) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] = regs[f.rs] & f.immediate;
+        DISPATCH();
+    }
+    OP(op_ori, ORI) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] = regs[f.rs] | f.immediate;
+        DISPATCH();
+    }
+    OP(op_lw, LW) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] = memory_load_word(mem, (uint32_t)regs[f.rs] + f.immediate);
+        DISPATCH();
+    }
+    OP(op_sw, SW) {
+        i_fields f = instruct->_fields.i;
+        memory_store_word(mem, (uint32_t)regs[f.rs] + f.immediate, regs[f.rt]);
+        DISPATCH();
+    }
+    OP(op_lb, LB) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] =
+            (int8_t)memory_load_byte(mem, (uint32_t)regs[f.rs] + f.immediate);
+        DISPATCH();
+    }
+    OP(op_sb, SB) {
+        i_fields f = instruct->_fields.i;
+        memory_store_byte(mem, (uint32_t)regs[f.rs] + f.immediate,
+                          (uint8_t)regs[f.rt]);
+        DISPATCH();
+    }
+    OP(op_ll, LL) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] =
+            memory_load_linked(mem, (uint32_t)regs[f.rs] + f.immediate);
+        DISPATCH();
+    }
+    OP(op_sc, SC) {
+        i_fields f = instruct->_fields.i;
+        regs[f.rt] = memory_store_conditional(
+            mem, (uint32_t)regs[f.rs] + f.immediate, regs[f.rt]);
+        DISPATCH();
+    }
+    OP(op_beq, BEQ) {
+        i_fields f = instruct->_fields.i;
+        if (regs[f.rs] == regs[f.rt]) i += (uint32_t)(int32_t)f.immediate;
+        DISPATCH();
+    }
+    OP(op_bne, BNE) {
+        i_fields f = instruct->_fields.i;
+        if (regs[f.rs] != regs[f.rt]) i += (uint32_t)(int32_t)f.immediate;
+        DISPATCH();
+    }
+    OP(op_j, J) {
+        i = (((i * WORD_SIZE) & JUMP_REGION_MASK) |
+             ((uint32_t)instruct->_fields.j.target << 2)) >>
+            2;
+        DISPATCH();
+    }
+    OP(op_jal, JAL) {
+        regs[RA_REGISTER] = (int32_t)(i * WORD_SIZE);
+        i = (((i * WORD_SIZE) & JUMP_REGION_MASK) |
+             ((uint32_t)instruct->_fields.j.target << 2)) >>
+            2;
+        DISPATCH();
+    }
+    OP(op_jr, JR) {
+        jump_target = (uint32_t)regs[instruct->_fields.r.rs];
+        // An invalid target can't be represented by i
+        if (jump_target % WORD_SIZE != 0) goto invalid_pc;
+        i = jump_target >> 2;
+        DISPATCH();
+    }
+    OP(op_syscall, SYSCALL) {
+        if (regs[V0_REGISTER] == EXIT_SYSCALL) {
+            // Halt on the syscall without executing it
+            i--;
+            steps--;
+            goto done;
+        }
+        DISPATCH();
+    }
+    OP(op_breakpoint, BREAKPOINT) {
+        i--;
+        steps--;
+        goto done;
+    }
+
+#if !USE_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef DISPATCH
+#undef OP
+
+done:
+    memcpy(registers, regs, sizeof(regs));
+    *pc = i * WORD_SIZE;
+    return steps;
+
+invalid_pc:
+    memcpy(registers, regs, sizeof(regs));
+    *pc = jump_target;
+    return steps;
+}
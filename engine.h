@@ -0,0 +1,102 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "program.h"
+
+/**
+ * Execution engines that can run a decoded program
+ *
+ * All engines produce identical register and PC state; they differ only in how
+ * instructions are dispatched. Select one with ./main --engine=<name>
+ */
+typedef enum {
+    // Calls each decoded instruction's execute function pointer
+    ENGINE_INTERPRETER,
+    // Switch/computed-goto dispatch with PC and registers held in locals
+    ENGINE_THREADED,
+    // Compiles runs of instructions to x86-64 machine code (see jit.h)
+    ENGINE_JIT
+} engine_kind;
+
+// Number of engine_kind values
+#define NUM_ENGINES (ENGINE_JIT + 1)
+
+/**
+ * Parses an engine name as given to --engine
+ *
+ * @param name "interpreter" | "threaded" | "jit"
+ * @param engine set to the parsed engine on success
+ * @return true on success, else false
+ */
+bool parse_engine(const char* name, engine_kind* engine);
+
+/**
+ * Returns the name of engine as accepted by parse_engine
+ *
+ * @param engine
+ * @return const char*
+ */
+const char* engine_name(engine_kind engine);
+
+/**
+ * Executes prog with the given engine, mutating registers and pc
+ *
+ * prog is not const because some engines cache translated code in it
+ *
+ * Execution stops once pc is past the final instruction, pc is invalid (i.e.,
+ * not a multiple of WORD_SIZE), the program halts (see instruction_halts), or
+ * max_steps instructions have been executed, whichever comes first. Callers
+ * detect an invalid pc with validate_pc
+ *
+ * Loads and stores access the calling thread's bound memory (see memory_bind),
+ * which must be set if prog has any
+ *
+ * @param engine
+ * @param prog
+ * @param registers
+ * @param pc
+ * @param max_steps maximum number of instructions to execute (e.g., 1 for step
+ * mode, UINT64_MAX to run to completion)
+ * @return number of instructions executed
+ */
+uint64_t run_engine(engine_kind engine, program* prog, int32_t* registers,
+                    uint32_t* pc, uint64_t max_steps);
+
+/**
+ * Returns whether running prog from pc would execute nothing, i.e., pc is past
+ * the final instruction, pc is invalid, or the program has halted
+ *
+ * @param prog
+ * @param registers
+ * @param pc
+ * @return true if execution is over, else false
+ */
+bool engine_done(const program* prog, const int32_t* registers, uint32_t pc);
+
+/**
+ * Same as run_engine with ENGINE_INTERPRETER
+ *
+ * @note Instructions are run a basic block at a time (see block.h). Blocks are
+ * built on first execution and cached in prog, and a block that jumps or falls
+ * through to another is linked to it, so a hot loop goes from block to block
+ * without looking up or bounds checking the PC of every instruction. If
+ * prog->peephole is set, blocks are also fused (see peephole_fuse), which
+ * runs fewer handlers for the same instructions and step counts
+ */
+uint64_t run_interpreter(program* prog, int32_t* registers, uint32_t* pc,
+                         uint64_t max_steps);
+
+/**
+ * Same as run_engine with ENGINE_THREADED
+ *
+ * @note Registers and pc are copied into locals for the duration of the call
+ * so the compiler can keep them in host registers, and written back on return.
+ * prog is not modified, so several threads may run it at once
+ */
+uint64_t run_threaded(const program* prog, int32_t* registers, uint32_t* pc,
+                      uint64_t max_steps);
+
+#endif  // ENGINE_H
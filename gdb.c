@@ -0,0 +1,586 @@
+#include "gdb.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "memory.h"
+
+// gdb's MIPS register numbers: $0 to $31 are the general purpose registers,
+// then come sr, lo, hi, bad, cause and pc, then the floating point registers
+#define GDB_PC_REGISTER 37
+// Registers in a g packet (the floating point ones are left out)
+#define GDB_NUM_G_REGISTERS 38
+// Registers in the target description
+#define GDB_NUM_REGISTERS 72
+// Sent by gdb outside of a packet to interrupt the program
+#define GDB_INTERRUPT 0x03
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Removes the Unix socket at path, if there is one. Returns false (with errno
+// set to EEXIST) if path is something else, which is left alone
+static bool remove_socket(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return false;
+    }
+    return unlink(path) == 0 || errno == ENOENT;
+}
+
+int gdb_accept(const char* address) {
+    const char* port = address[0] == ':' ? address + 1 : address;
+    const bool tcp =
+        *port != '\0' && strspn(port, "0123456789") == strlen(port);
+    int listener;
+    if (tcp) {
+        unsigned long number = strtoul(port, NULL, 10);
+        if (number == 0 || number > 65535) {
+            errno = EINVAL;
+            return -1;
+        }
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0) return -1;
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)number);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listener, 1) != 0) {
+            int saved = errno;
+            close(listener);
+            errno = saved;
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        // A socket left behind by an earlier run can't be bound again
+        if (!remove_socket(address)) return -1;
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) return -1;
+        if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listener, 1) != 0) {
+            int saved = errno;
+            close(listener);
+            errno = saved;
+            return -1;
+        }
+    }
+    int fd = accept(listener, NULL, NULL);
+    int saved = errno;
+    close(listener);
+    if (!tcp) remove_socket(address);
+    if (fd >= 0 && tcp) {
+        // Packets are small and each waits for a reply
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    errno = saved;
+    return fd;
+}
+
+// A connection to gdb, with the bytes received but not parsed yet
+typedef struct {
+    int fd;
+    char in[GDB_PACKET_SIZE];
+    size_t in_start;
+    size_t in_end;
+    // Whether gdb disconnected (or reading failed)
+    bool closed;
+    // The last packet sent, framed, which is resent if gdb asks for it
+    char out[GDB_PACKET_SIZE + 4];
+    size_t out_length;
+} gdb_connection;
+
+// Reads whatever gdb sent into conn->in, which must be empty, waiting for it
+// unless wait is false. Returns false if nothing was read
+static bool fill(gdb_connection* conn, bool wait) {
+    if (conn->closed) return false;
+    if (!wait) {
+        struct pollfd fds = {conn->fd, POLLIN, 0};
+        if (poll(&fds, 1, 0) <= 0) return false;
+    }
+    ssize_t n;
+    do {
+        n = read(conn->fd, conn->in, sizeof(conn->in));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        conn->closed = true;
+        return false;
+    }
+    conn->in_start = 0;
+    conn->in_end = (size_t)n;
+    return true;
+}
+
+// Returns the next byte from gdb, or -1 if it disconnected
+static int read_byte(gdb_connection* conn) {
+    if (conn->in_start == conn->in_end && !fill(conn, true)) return -1;
+    return (unsigned char)conn->in[conn->in_start++];
+}
+
+static bool write_bytes(gdb_connection* conn, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(conn->fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            conn->closed = true;
+            return false;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// Sends data (which can't contain $, # or }) framed as a packet
+static bool send_packet(gdb_connection* conn, const char* data,
+                        size_t length) {
+    if (length > GDB_PACKET_SIZE) length = GDB_PACKET_SIZE;
+    uint8_t checksum = 0;
+    for (size_t k = 0; k < length; k++) checksum += (uint8_t)data[k];
+    conn->out[0] = '$';
+    memcpy(conn->out + 1, data, length);
+    conn->out[length + 1] = '#';
+    conn->out[length + 2] = HEX_DIGITS[checksum >> 4];
+    conn->out[length + 3] = HEX_DIGITS[checksum & 0xf];
+    conn->out_length = length + 4;
+    return write_bytes(conn, conn->out, conn->out_length);
+}
+
+static bool send_string(gdb_connection* conn, const char* data) {
+    return send_packet(conn, data, strlen(data));
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Waits for the next packet from gdb, acknowledging it, and sets data (NUL
+// terminated) and length to its contents. Returns false if gdb disconnected
+static bool receive_packet(gdb_connection* conn, char* data, size_t* length) {
+    while (true) {
+        int c = read_byte(conn);
+        if (c < 0) return false;
+        if (c == '-') {
+            if (!write_bytes(conn, conn->out, conn->out_length)) return false;
+            continue;
+        }
+        // Acks, and interrupts that arrive once the program stopped
+        if (c != '$') continue;
+        size_t n = 0;
+        uint8_t checksum = 0;
+        bool too_long = false;
+        while ((c = read_byte(conn)) >= 0 && c != '#') {
+            checksum += (uint8_t)c;
+            if (n < GDB_PACKET_SIZE - 1)
+                data[n++] = (char)c;
+            else
+                too_long = true;
+        }
+        int high = read_byte(conn);
+        int low = read_byte(conn);
+        if (c < 0 || low < 0) return false;
+        if (too_long || hex_value(high) < 0 || hex_value(low) < 0 ||
+            (hex_value(high) << 4 | hex_value(low)) != checksum) {
+            if (!write_bytes(conn, "-", 1)) return false;
+            continue;
+        }
+        if (!write_bytes(conn, "+", 1)) return false;
+        data[n] = '\0';
+        *length = n;
+        return true;
+    }
+}
+
+// Returns whether gdb asked to interrupt the program (or disconnected) since
+// the last packet, without waiting
+static bool interrupt_requested(gdb_connection* conn) {
+    if (conn->in_start == conn->in_end && !fill(conn, false))
+        return conn->closed;
+    while (conn->in_start < conn->in_end) {
+        char c = conn->in[conn->in_start];
+        if (c == GDB_INTERRUPT) {
+            conn->in_start++;
+            return true;
+        }
+        // Anything but an ack is the start of a packet, left for later
+        if (c != '+') return false;
+        conn->in_start++;
+    }
+    return false;
+}
+
+// Parses hex digits at *text, advancing it past them. Returns false if there
+// are none
+static bool parse_hex(const char** text, uint32_t* value) {
+    const char* p = *text;
+    uint32_t v = 0;
+    while (hex_value(*p) >= 0) v = v << 4 | (uint32_t)hex_value(*p++);
+    if (p == *text) return false;
+    *text = p;
+    *value = v;
+    return true;
+}
+
+// Appends value as gdb sends register values: its bytes in target (little
+// endian) order, in hex. Returns where the text ends
+static char* append_register(char* out, uint32_t value) {
+    for (int k = 0; k < 4; k++, value >>= 8) {
+        *out++ = HEX_DIGITS[(value >> 4) & 0xf];
+        *out++ = HEX_DIGITS[value & 0xf];
+    }
+    return out;
+}
+
+// The inverse of append_register. Returns false if text is too short
+static bool parse_register(const char* text, uint32_t* value) {
+    uint32_t v = 0;
+    for (int k = 0; k < 4; k++) {
+        int high = hex_value(text[2 * k]);
+        int low = high < 0 ? -1 : hex_value(text[2 * k + 1]);
+        if (low < 0) return false;
+        v |= (uint32_t)(high << 4 | low) << (8 * k);
+    }
+    *value = v;
+    return true;
+}
+
+// Appends the value of gdb's register number reg, or x's if it doesn't
+// exist here
+static char* append_gdb_register(char* out, int reg, const int32_t* registers,
+                                 uint32_t pc) {
+    if (reg < NUM_REGISTERS)
+        return append_register(out, (uint32_t)registers[reg]);
+    if (reg == GDB_PC_REGISTER) return append_register(out, pc);
+    if (reg < GDB_PC_REGISTER) return append_register(out, 0);
+    memset(out, 'x', 8);
+    return out + 8;
+}
+
+// Sets gdb's register number reg, ignoring registers that don't exist here
+static void set_gdb_register(int reg, uint32_t value, int32_t* registers,
+                             uint32_t* pc) {
+    if (reg < NUM_REGISTERS)
+        registers[reg] = (int32_t)value;
+    else if (reg == GDB_PC_REGISTER)
+        *pc = value;
+}
+
+// Byte at address, where the program's instructions are at their addresses
+static uint8_t read_guest_byte(const debugger* dbg, uint32_t address) {
+    if (address / WORD_SIZE < dbg->prog->num_instructions)
+        return (uint8_t)(dbg->words[address / WORD_SIZE] >>
+                         (8 * (address % WORD_SIZE)));
+    if (bound_memory == NULL) return 0;
+    return memory_load_byte(bound_memory, address);
+}
+
+// Writes the target description gdb reads with qXfer:features:read. gdb's
+// MIPS support requires the floating point registers to be described, even
+// though they don't exist here. Returns its length
+static size_t target_description(char* out) {
+    char* p = out;
+    p += sprintf(p,
+                 "<?xml version=\"1.0\"?>"
+                 "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                 "<target><architecture>mips</architecture>"
+                 "<feature name=\"org.gnu.gdb.mips.cpu\">");
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        p += sprintf(p, "<reg name=\"r%d\" bitsize=\"32\" regnum=\"%d\"/>", r,
+                     r);
+    p += sprintf(p,
+                 "<reg name=\"lo\" bitsize=\"32\" regnum=\"33\"/>"
+                 "<reg name=\"hi\" bitsize=\"32\" regnum=\"34\"/>"
+                 "<reg name=\"pc\" bitsize=\"32\" regnum=\"37\"/>"
+                 "</feature><feature name=\"org.gnu.gdb.mips.cp0\">"
+                 "<reg name=\"status\" bitsize=\"32\" regnum=\"32\"/>"
+                 "<reg name=\"badvaddr\" bitsize=\"32\" regnum=\"35\"/>"
+                 "<reg name=\"cause\" bitsize=\"32\" regnum=\"36\"/>"
+                 "</feature><feature name=\"org.gnu.gdb.mips.fpu\">");
+    for (int r = 0; r < 32; r++)
+        p += sprintf(p,
+                     "<reg name=\"f%d\" bitsize=\"32\" type=\"ieee_single\" "
+                     "regnum=\"%d\"/>",
+                     r, GDB_PC_REGISTER + 1 + r);
+    p += sprintf(p,
+                 "<reg name=\"fcsr\" bitsize=\"32\" group=\"float\" "
+                 "regnum=\"70\"/>"
+                 "<reg name=\"fir\" bitsize=\"32\" group=\"float\" "
+                 "regnum=\"71\"/></feature></target>");
+    return (size_t)(p - out);
+}
+
+// Sends text to gdb's console
+static bool send_output(gdb_connection* conn, const char* text) {
+    char reply[GDB_PACKET_SIZE];
+    size_t n = 0;
+    reply[n++] = 'O';
+    for (; *text != '\0' && n + 2 <= sizeof(reply); text++) {
+        reply[n++] = HEX_DIGITS[(uint8_t)*text >> 4];
+        reply[n++] = HEX_DIGITS[*text & 0xf];
+    }
+    return send_packet(conn, reply, n);
+}
+
+// Runs a "monitor" command, given in hex
+static bool run_monitor_command(gdb_connection* conn, debugger* dbg,
+                                const char* hex) {
+    char command[GDB_PACKET_SIZE / 2 + 1];
+    size_t n = 0;
+    for (; hex_value(hex[0]) >= 0 && hex_value(hex[1]) >= 0; hex += 2)
+        command[n++] = (char)(hex_value(hex[0]) << 4 | hex_value(hex[1]));
+    command[n] = '\0';
+
+    char text[GDB_PACKET_SIZE];
+    char name[16];
+    int reg;
+    char end;
+    if (sscanf(command, "%15s $%d %c", name, &reg, &end) == 2 ||
+        sscanf(command, "%15s %d %c", name, &reg, &end) == 2) {
+        bool watch = strcmp(name, "watch") == 0;
+        if ((watch || strcmp(name, "unwatch") == 0) &&
+            debug_set_watchpoint(dbg, reg, watch))
+            snprintf(text, sizeof(text), "%s $%d\n",
+                     watch ? "Watching" : "No longer watching", reg);
+        else
+            snprintf(text, sizeof(text), "Invalid command: %s\n", command);
+    } else if (strcmp(command, "steps") == 0) {
+        snprintf(text, sizeof(text), "%llu instructions executed\n",
+                 (unsigned long long)dbg->steps);
+    } else if (strcmp(command, "help") == 0) {
+        snprintf(text, sizeof(text),
+                 "monitor watch $N: stop after any instruction that changes "
+                 "register $N\n"
+                 "monitor unwatch $N: stop watching register $N\n"
+                 "monitor steps: print the number of instructions executed\n");
+    } else {
+        snprintf(text, sizeof(text),
+                 "Unknown command: %s (see monitor help)\n", command);
+    }
+    return send_output(conn, text) && send_string(conn, "OK");
+}
+
+// Continues (or with step, steps) the program, and tells gdb why it stopped.
+// Sets stop_reply to the reply, for later ? packets
+static bool resume(gdb_connection* conn, debugger* dbg, int32_t* registers,
+                   uint32_t* pc, bool step, char* stop_reply) {
+    debug_stop stop;
+    bool interrupted = false;
+    if (step) {
+        stop = debug_run(dbg, registers, pc, 1);
+    } else {
+        while ((stop = debug_run(dbg, registers, pc, GDB_POLL_STEPS)) ==
+                   DEBUG_STEPPED &&
+               !(interrupted = interrupt_requested(conn))) {
+        }
+    }
+    if (stop == DEBUG_WATCHPOINT) {
+        char text[128];
+        snprintf(text, sizeof(text), "$%d changed from %d to %d\n",
+                 dbg->watch_register, dbg->watch_old_value,
+                 registers[dbg->watch_register]);
+        if (!send_output(conn, text)) return false;
+    }
+    if (stop == DEBUG_DONE)
+        // A misaligned pc stops the program as a bad access would
+        strcpy(stop_reply, (*pc) % WORD_SIZE == 0 ? "W00" : "S0b");
+    else
+        strcpy(stop_reply, interrupted ? "S02" : "S05");
+    return send_string(conn, stop_reply);
+}
+
+gdb_result serve_gdb(debugger* dbg, int fd, int32_t* registers, uint32_t* pc) {
+    gdb_connection* conn = (gdb_connection*)calloc(1, sizeof(gdb_connection));
+    char* packet = (char*)malloc(GDB_PACKET_SIZE);
+    char* reply = (char*)malloc(GDB_PACKET_SIZE + 1);
+    // Large enough for the target description
+    char* description = (char*)malloc(4 * GDB_PACKET_SIZE);
+    if (conn == NULL || packet == NULL || reply == NULL ||
+        description == NULL) {
+        free(conn);
+        free(packet);
+        free(reply);
+        free(description);
+        return GDB_DETACHED;
+    }
+    conn->fd = fd;
+    size_t description_length = target_description(description);
+    char stop_reply[8] = "S05";
+    gdb_result result = GDB_DETACHED;
+    size_t length;
+    uint32_t address, count, value;
+    while (receive_packet(conn, packet, &length)) {
+        const char* args = packet + 1;
+        char* out = reply;
+        bool ok = true;
+        switch (packet[0]) {
+            case '?':
+                out = stpcpy(out, stop_reply);
+                break;
+            case 'g':
+                for (int r = 0; r < GDB_NUM_G_REGISTERS; r++)
+                    out = append_gdb_register(out, r, registers, *pc);
+                break;
+            case 'G':
+                for (int r = 0; r < GDB_NUM_G_REGISTERS &&
+                                parse_register(args + 8 * r, &value);
+                     r++)
+                    set_gdb_register(r, value, registers, pc);
+                out = stpcpy(out, "OK");
+                break;
+            case 'p':
+                if (parse_hex(&args, &value) && value < GDB_NUM_REGISTERS)
+                    out = append_gdb_register(out, (int)value, registers, *pc);
+                else
+                    out = stpcpy(out, "E01");
+                break;
+            case 'P':
+                if (parse_hex(&args, &address) && *args++ == '=' &&
+                    parse_register(args, &value)) {
+                    set_gdb_register((int)address, value, registers, pc);
+                    out = stpcpy(out, "OK");
+                } else {
+                    out = stpcpy(out, "E01");
+                }
+                break;
+            case 'm':
+                if (!parse_hex(&args, &address) || *args++ != ',' ||
+                    !parse_hex(&args, &count)) {
+                    out = stpcpy(out, "E01");
+                    break;
+                }
+                if (count > GDB_PACKET_SIZE / 2) count = GDB_PACKET_SIZE / 2;
+                for (uint32_t k = 0; k < count; k++) {
+                    uint8_t byte = read_guest_byte(dbg, address + k);
+                    *out++ = HEX_DIGITS[byte >> 4];
+                    *out++ = HEX_DIGITS[byte & 0xf];
+                }
+                break;
+            case 'M':
+                if (!parse_hex(&args, &address) || *args++ != ',' ||
+                    !parse_hex(&args, &count) || *args++ != ':' ||
+                    strlen(args) < 2 * (size_t)count ||
+                    bound_memory == NULL) {
+                    out = stpcpy(out, "E01");
+                    break;
+                }
+                // Instructions are decoded ahead of time, so they can't be
+                // written
+                for (uint32_t k = 0; k < count && ok; k++)
+                    ok = (address + k) / WORD_SIZE >=
+                         dbg->prog->num_instructions;
+                for (uint32_t k = 0; k < count && ok; k++) {
+                    int high = hex_value(args[2 * k]);
+                    int low = hex_value(args[2 * k + 1]);
+                    ok = high >= 0 && low >= 0;
+                    if (ok)
+                        memory_store_byte(bound_memory, address + k,
+                                          (uint8_t)(high << 4 | low));
+                }
+                out = stpcpy(out, ok ? "OK" : "E01");
+                break;
+            case 'c':
+            case 's':
+                if (parse_hex(&args, &address)) *pc = address;
+                if (!resume(conn, dbg, registers, pc, packet[0] == 's',
+                            stop_reply))
+                    goto done;
+                continue;
+            case 'Z':
+            case 'z':
+                // Only breakpoints; gdb watches memory itself if these
+                // aren't supported
+                if (args[0] != '0' && args[0] != '1') break;
+                args++;
+                if (*args++ == ',' && parse_hex(&args, &address) &&
+                    debug_set_breakpoint(dbg, address, packet[0] == 'Z'))
+                    out = stpcpy(out, "OK");
+                else
+                    out = stpcpy(out, "E01");
+                break;
+            case 'H':
+            case 'T':
+                out = stpcpy(out, "OK");
+                break;
+            case 'D':
+                send_string(conn, "OK");
+                goto done;
+            case 'k':
+                result = GDB_KILLED;
+                goto done;
+            case 'v':
+                if (strcmp(packet, "vKill") == 0 ||
+                    strncmp(packet, "vKill;", 6) == 0) {
+                    send_string(conn, "OK");
+                    result = GDB_KILLED;
+                    goto done;
+                }
+                break;
+            case 'q':
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    out += sprintf(out, "PacketSize=%x;qXfer:features:read+",
+                                   GDB_PACKET_SIZE);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    out = stpcpy(out, "1");
+                } else if (strncmp(packet, "qRcmd,", 6) == 0) {
+                    if (!run_monitor_command(conn, dbg, packet + 6)) goto done;
+                    continue;
+                } else if (strncmp(packet, "qXfer:features:read:target.xml:",
+                                   31) == 0) {
+                    args = packet + 31;
+                    if (!parse_hex(&args, &address) || *args++ != ',' ||
+                        !parse_hex(&args, &count)) {
+                        out = stpcpy(out, "E01");
+                        break;
+                    }
+                    if (count > GDB_PACKET_SIZE - 1)
+                        count = GDB_PACKET_SIZE - 1;
+                    if (address > description_length)
+                        address = description_length;
+                    if (count > description_length - address)
+                        count = description_length - address;
+                    // m if there is more after this part, l if it's the last
+                    *out++ = address + count < description_length ? 'm' : 'l';
+                    memcpy(out, description + address, count);
+                    out += count;
+                }
+                break;
+            default:
+                // An empty reply tells gdb the packet isn't supported
+                break;
+        }
+        if (!send_packet(conn, reply, (size_t)(out - reply))) break;
+    }
+done:
+    free(conn);
+    free(packet);
+    free(reply);
+    free(description);
+    return result;
+}
@@ -0,0 +1,51 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include <stdint.h>
+
+#include "debug.h"
+
+// Largest packet the stub accepts, in bytes of packet data
+#define GDB_PACKET_SIZE 4096
+// Instructions run between checks for an interrupt (Ctrl-C) from gdb while
+// continuing
+#define GDB_POLL_STEPS (1 << 20)
+
+// How a gdb session ended
+typedef enum {
+    // gdb detached or disconnected; the program should run on without it
+    GDB_DETACHED,
+    // gdb killed the program
+    GDB_KILLED
+} gdb_result;
+
+/**
+ * Listens on address and waits for gdb to connect
+ *
+ * @param address a TCP port on 127.0.0.1 (e.g., "1234" or ":1234"), or else
+ * the path of a Unix socket to create (replacing a socket already there, but
+ * failing with EEXIST if anything else is)
+ * @return the connection's file descriptor, or -1 (with errno set) on failure
+ */
+int gdb_accept(const char* address);
+
+/**
+ * Serves the GDB remote serial protocol on fd until gdb detaches, kills the
+ * program, or disconnects
+ *
+ * gdb sees a little-endian 32-bit MIPS target with the registers numbered as
+ * gdb numbers them ($0 to $31, then sr, lo, hi, bad, cause and pc), of which
+ * only the general purpose registers and pc exist here. Memory reads of the
+ * program's addresses return its instructions, and other addresses access the
+ * bound memory (see memory_bind). Breakpoints are set with Z0 and Z1 packets,
+ * and register watchpoints with "monitor watch $N" (see "monitor help")
+ *
+ * @param dbg debugs the program gdb controls
+ * @param fd a connection to gdb, e.g., from gdb_accept (not closed)
+ * @param registers
+ * @param pc
+ * @return how the session ended
+ */
+gdb_result serve_gdb(debugger* dbg, int fd, int32_t* registers, uint32_t* pc);
+
+#endif  // GDB_H
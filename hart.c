@@ -0,0 +1,173 @@
+#include "hart.h"
+
+#include <pthread.h>
+#include <string.h>
+
+struct hart_run;
+
+// One hart's thread
+typedef struct {
+    struct hart_run* run;
+    uint32_t index;
+    // Instructions executed in this run_harts
+    uint64_t steps;
+    // Set once the hart is done or out of steps
+    bool stopped;
+} hart_thread;
+
+// Shared by the threads of one run_harts. Everything below lock is guarded
+// by it
+typedef struct hart_run {
+    hart* harts;
+    hart_thread* threads;
+    uint32_t num_harts;
+    guest_memory* memory;
+    const hart_options* options;
+    pthread_mutex_t lock;
+    // Broadcast whenever any of the fields below changes
+    pthread_cond_t changed;
+    // Set once every thread has been started
+    bool started;
+    // Set once every hart has stopped, or a thread couldn't be started
+    bool stop;
+    // Number of quanta that every hart has finished
+    uint64_t quanta;
+    // Harts that have finished the current quantum
+    uint32_t arrived;
+    // With options->serial, the hart whose turn it is
+    uint32_t turn;
+} hart_run;
+
+void init_hart(hart* hart, program* prog, uint32_t index, uint32_t num_harts) {
+    memset(hart, 0, sizeof(*hart));
+    hart->prog = prog;
+    hart->pc = INITIAL_PC;
+    hart->registers[HART_ID_REGISTER] = (int32_t)index;
+    hart->registers[NUM_HARTS_REGISTER] = (int32_t)num_harts;
+}
+
+// Whether the hart of thread has nothing left to run
+static bool hart_stopped(const hart_run* run, const hart_thread* thread) {
+    const hart* h = &run->harts[thread->index];
+    return thread->steps >= run->options->max_steps ||
+           engine_done(h->prog, h->registers, h->pc);
+}
+
+// Runs thread's hart for one quantum, unless it has stopped
+static void run_quantum(hart_run* run, hart_thread* thread) {
+    if (thread->stopped) return;
+    hart* h = &run->harts[thread->index];
+    uint64_t max_steps = run->options->max_steps - thread->steps;
+    if (max_steps > run->options->quantum) max_steps = run->options->quantum;
+    uint64_t steps =
+        run_engine(run->options->engine, h->prog, h->registers, &h->pc,
+                   max_steps);
+    thread->steps += steps;
+    h->steps += steps;
+    thread->stopped = hart_stopped(run, thread);
+}
+
+static void* hart_main(void* arg) {
+    hart_thread* thread = (hart_thread*)arg;
+    hart_run* run = thread->run;
+    hart* h = &run->harts[thread->index];
+    memory_bind(run->memory);
+    bound_reservation = h->reservation;
+
+    pthread_mutex_lock(&run->lock);
+    while (!run->started && !run->stop)
+        pthread_cond_wait(&run->changed, &run->lock);
+    while (!run->stop) {
+        if (run->options->serial)
+            while (run->turn != thread->index)
+                pthread_cond_wait(&run->changed, &run->lock);
+        pthread_mutex_unlock(&run->lock);
+        run_quantum(run, thread);
+        pthread_mutex_lock(&run->lock);
+
+        // Barrier: the last hart to finish the quantum starts the next one,
+        // or stops every hart if none has anything left to run
+        run->turn++;
+        if (++run->arrived == run->num_harts) {
+            run->arrived = 0;
+            run->turn = 0;
+            run->quanta++;
+            run->stop = true;
+            for (uint32_t k = 0; k < run->num_harts; k++)
+                run->stop &= run->threads[k].stopped;
+            pthread_cond_broadcast(&run->changed);
+        } else {
+            if (run->options->serial)
+                pthread_cond_broadcast(&run->changed);
+            const uint64_t quanta = run->quanta;
+            while (run->quanta == quanta)
+                pthread_cond_wait(&run->changed, &run->lock);
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    h->reservation = bound_reservation;
+    memory_bind(NULL);
+    return NULL;
+}
+
+hart_status run_harts(hart* harts, uint32_t num_harts, guest_memory* memory,
+                      const hart_options* options) {
+    if (num_harts > 1 && memory->flat == NULL) return HARTS_NOT_FLAT;
+    hart_run run;
+    hart_thread threads[MAX_HARTS];
+    pthread_t ids[MAX_HARTS];
+    run.harts = harts;
+    run.threads = threads;
+    run.num_harts = num_harts;
+    run.memory = memory;
+    run.options = options;
+    run.started = false;
+    run.stop = true;
+    run.quanta = 0;
+    run.arrived = 0;
+    run.turn = 0;
+    for (uint32_t k = 0; k < num_harts; k++) {
+        threads[k].run = &run;
+        threads[k].index = k;
+        threads[k].steps = 0;
+        threads[k].stopped = hart_stopped(&run, &threads[k]);
+        run.stop &= threads[k].stopped;
+    }
+    // Also covers num_harts == 0
+    if (run.stop) return HARTS_OK;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.changed, NULL);
+
+    uint32_t num_started = 0;
+    while (num_started < num_harts &&
+           pthread_create(&ids[num_started], NULL, hart_main,
+                          &threads[num_started]) == 0)
+        num_started++;
+    // Threads wait for started, so none has run anything yet. If not every
+    // one could be started, the barriers would never open, so stop them all
+    pthread_mutex_lock(&run.lock);
+    if (num_started == num_harts)
+        run.started = true;
+    else
+        run.stop = true;
+    pthread_cond_broadcast(&run.changed);
+    pthread_mutex_unlock(&run.lock);
+    for (uint32_t k = 0; k < num_started; k++) pthread_join(ids[k], NULL);
+
+    pthread_cond_destroy(&run.changed);
+    pthread_mutex_destroy(&run.lock);
+    return num_started == num_harts ? HARTS_OK : HARTS_THREAD_FAILED;
+}
+
+const char* hart_status_message(hart_status status) {
+    switch (status) {
+        case HARTS_OK:
+            return "Success";
+        case HARTS_NOT_FLAT:
+            return "Harts need a flat guest memory to share";
+        case HARTS_THREAD_FAILED:
+        default:
+            return "Failed to start a thread for every hart";
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef HART_H
+#define HART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "memory.h"
+#include "program.h"
+
+// Most harts run_harts runs at once (one host thread each)
+#define MAX_HARTS 256
+// Instructions each hart executes between barriers by default
+#define DEFAULT_HART_QUANTUM 10000
+// Registers a hart starts with its index and the number of harts in ($a0
+// and $a1), so harts running the same program can each take their own part
+// of the work
+#define HART_ID_REGISTER 4
+#define NUM_HARTS_REGISTER 5
+
+/**
+ * One simulated core: a program with its own registers and PC
+ *
+ * Harts share guest memory, in which ll and sc are atomic with respect to
+ * each other (see memory_store_conditional). Engines cache translations in
+ * their program, so every hart needs a program of its own, even harts that
+ * run the same image
+ */
+typedef struct {
+    program* prog;
+    int32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    // Instructions executed, summed over every run_harts
+    uint64_t steps;
+    // Of ll and sc, kept between quanta (see bound_reservation)
+    memory_reservation reservation;
+} hart;
+
+typedef struct {
+    engine_kind engine;
+    // Instructions each hart executes between barriers
+    uint64_t quantum;
+    // Each hart stops once it has executed this many instructions in this
+    // run_harts
+    uint64_t max_steps;
+    // If true, harts take turns executing their quantum, in order of index,
+    // instead of all executing at once
+    bool serial;
+} hart_options;
+
+typedef enum {
+    HARTS_OK,
+    // Several harts need a flat memory to share (see create_memory)
+    HARTS_NOT_FLAT,
+    HARTS_THREAD_FAILED
+} hart_status;
+
+/**
+ * Sets up hart to run prog from the start: registers 0 apart from
+ * HART_ID_REGISTER and NUM_HARTS_REGISTER, and the PC at INITIAL_PC
+ *
+ * @param hart
+ * @param prog not owned by hart
+ * @param index
+ * @param num_harts
+ */
+void init_hart(hart* hart, program* prog, uint32_t index, uint32_t num_harts);
+
+/**
+ * Runs harts on one host thread each until every one of them is done (see
+ * engine_done), reaches an invalid PC, or has executed options->max_steps
+ * instructions
+ *
+ * Execution proceeds in quanta: every hart executes options->quantum
+ * instructions (fewer if it stops), then waits at a barrier until all the
+ * others have too. No hart is ever more than one quantum ahead of another,
+ * whatever the host's scheduling, so a program whose harts never access the
+ * same memory within one quantum gives the same result on every run. With
+ * options->serial, harts take turns within each quantum instead, in order
+ * of index, which makes every program behave the same on every run, even
+ * one whose harts race on memory (e.g., contend for a lock with ll and sc),
+ * at the cost of running one hart at a time
+ *
+ * @param harts
+ * @param num_harts at most MAX_HARTS
+ * @param memory shared by every hart, which must be flat if there are
+ * several
+ * @param options
+ * @return HARTS_OK, or why nothing was run
+ */
+hart_status run_harts(hart* harts, uint32_t num_harts, guest_memory* memory,
+                      const hart_options* options);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* hart_status_message(hart_status status);
+
+#endif  // HART_H
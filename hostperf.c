@@ -0,0 +1,176 @@
+#include "hostperf.h"
+
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+bool host_allocations_counted = false;
+uint64_t host_num_allocations = 0;
+
+uint64_t host_allocations(void) {
+    return __atomic_load_n(&host_num_allocations, __ATOMIC_RELAXED);
+}
+
+static const char* const REGION_NAMES[NUM_HOST_REGIONS] = {"load", "decode",
+                                                           "run"};
+
+// Opens a perf counter for the calling thread's user space, returning its file
+// descriptor or -1 if it isn't available
+static int open_perf_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                        PERF_FLAG_FD_CLOEXEC);
+}
+
+host_profile* create_host_profile(void) {
+    host_profile* host = (host_profile*)calloc(1, sizeof(host_profile));
+    if (host == NULL) return NULL;
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++) host->fds[c] = -1;
+    host->fds[HOST_CYCLES] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    host->fds[HOST_INSTRUCTIONS] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    host->fds[HOST_BRANCH_MISSES] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    host->fds[HOST_L1D_MISSES] = open_perf_counter(
+        PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    host->fds[HOST_PAGE_FAULTS] =
+        open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++)
+        host->available[c] = host->fds[c] >= 0;
+    host->available[HOST_TSC_TICKS] = HAVE_TSC;
+    host->available[HOST_ALLOCATIONS] = host_allocations_counted;
+    return host;
+}
+
+void free_host_profile(host_profile* host) {
+    if (host == NULL) return;
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++)
+        if (host->fds[c] >= 0) close(host->fds[c]);
+    free(host);
+}
+
+static uint64_t read_tsc(void) {
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Reads every available counter other than the TSC into values
+static void read_counters(host_profile* host, uint64_t* values) {
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+        if (host->fds[c] < 0) continue;
+        uint64_t value;
+        if (read(host->fds[c], &value, sizeof(value)) == sizeof(value))
+            values[c] = value;
+        else
+            host->available[c] = false;
+    }
+    values[HOST_ALLOCATIONS] = host_allocations();
+}
+
+void host_region_begin(host_profile* host, host_region region) {
+    if (host == NULL) return;
+    read_counters(host, host->start);
+    // Last, so that reading the other counters isn't timed
+    host->start[HOST_TSC_TICKS] = read_tsc();
+}
+
+void host_region_end(host_profile* host, host_region region, uint64_t units) {
+    if (host == NULL) return;
+    uint64_t end[NUM_HOST_COUNTERS] = {0};
+    end[HOST_TSC_TICKS] = read_tsc();
+    read_counters(host, end);
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++)
+        host->totals[region][c] += end[c] - host->start[c];
+    host->units[region] += units;
+}
+
+const char* host_counter_name(host_counter counter) {
+    switch (counter) {
+        case HOST_TSC_TICKS:
+            return "tsc_ticks";
+        case HOST_CYCLES:
+            return "cycles";
+        case HOST_INSTRUCTIONS:
+            return "instructions";
+        case HOST_BRANCH_MISSES:
+            return "branch_misses";
+        case HOST_L1D_MISSES:
+            return "l1d_misses";
+        case HOST_PAGE_FAULTS:
+            return "page_faults";
+        case HOST_ALLOCATIONS:
+        default:
+            return "allocations";
+    }
+}
+
+static double per_unit(const host_profile* host, host_region region,
+                       host_counter counter) {
+    uint64_t units = host->units[region];
+    return units == 0 ? 0
+                      : (double)host->totals[region][counter] / (double)units;
+}
+
+void print_host_report(FILE* out, const host_profile* host) {
+    for (int r = 0; r < NUM_HOST_REGIONS; r++) {
+        fprintf(out, "%sHost counters for %s: %llu guest instructions\n\n",
+                r == 0 ? "" : "\n", REGION_NAMES[r],
+                (unsigned long long)host->units[r]);
+        fprintf(out, "| Counter        |          Total | Per instruction |\n");
+        fprintf(out, "-----------------------------------------------------\n");
+        for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+            if (!host->available[c]) {
+                fprintf(out, "| %-14s | %14s | %15s |\n",
+                        host_counter_name((host_counter)c), "n/a", "n/a");
+                continue;
+            }
+            fprintf(out, "| %-14s | %14llu | %15.3f |\n",
+                    host_counter_name((host_counter)c),
+                    (unsigned long long)host->totals[r][c],
+                    per_unit(host, (host_region)r, (host_counter)c));
+        }
+    }
+}
+
+void write_host_report_json(FILE* out, const host_profile* host) {
+    fprintf(out, "{");
+    for (int r = 0; r < NUM_HOST_REGIONS; r++) {
+        fprintf(out, "%s\"%s\": {\"guest_instructions\": %llu",
+                r == 0 ? "" : ", ", REGION_NAMES[r],
+                (unsigned long long)host->units[r]);
+        for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+            const char* name = host_counter_name((host_counter)c);
+            if (!host->available[c]) {
+                fprintf(out, ", \"%s\": null, \"%s_per_instruction\": null",
+                        name, name);
+                continue;
+            }
+            fprintf(out, ", \"%s\": %llu, \"%s_per_instruction\": %.4f", name,
+                    (unsigned long long)host->totals[r][c], name,
+                    per_unit(host, (host_region)r, (host_counter)c));
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "}\n");
+}
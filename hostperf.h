@@ -0,0 +1,133 @@
+#ifndef HOSTPERF_H
+#define HOSTPERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * What the simulator itself costs on the host, measured over regions of its
+ * work (loading the program, decoding it, running it) and normalised per
+ * guest instruction, to make and defend engine choices on real hardware
+ *
+ * Hardware and software counters come from Linux perf_event_open, counting
+ * user space of the calling thread only. Any of them may be unavailable
+ * (e.g., no PMU in a virtual machine, or perf_event_paranoid too high), in
+ * which case it is reported as such rather than as 0
+ */
+
+typedef enum {
+    // Time stamp counter (rdtsc), x86 only
+    HOST_TSC_TICKS,
+    HOST_CYCLES,
+    HOST_INSTRUCTIONS,
+    HOST_BRANCH_MISSES,
+    // Level 1 data cache read misses
+    HOST_L1D_MISSES,
+    HOST_PAGE_FAULTS,
+    // Heap allocations by any thread, only counted in programs linked with
+    // alloccount.o (see host_allocations_counted)
+    HOST_ALLOCATIONS,
+    NUM_HOST_COUNTERS
+} host_counter;
+
+typedef enum {
+    // Reading the program file (see instruction_file_to_image)
+    HOST_REGION_LOAD,
+    // Decoding it (see create_program)
+    HOST_REGION_DECODE,
+    // Executing it
+    HOST_REGION_RUN,
+    NUM_HOST_REGIONS
+} host_region;
+
+typedef struct {
+    // perf_event_open file descriptors, -1 for counters read another way or
+    // not available
+    int fds[NUM_HOST_COUNTERS];
+    bool available[NUM_HOST_COUNTERS];
+    // Counts summed over every begin and end of each region
+    uint64_t totals[NUM_HOST_REGIONS][NUM_HOST_COUNTERS];
+    // Guest instructions each region handled (loaded, decoded or executed),
+    // which totals are normalised by
+    uint64_t units[NUM_HOST_REGIONS];
+    // Counts at the last host_region_begin
+    uint64_t start[NUM_HOST_COUNTERS];
+} host_profile;
+
+// Set by alloccount.o, if linked in, once its allocation functions are in
+// place
+extern bool host_allocations_counted;
+// Incremented by alloccount.o's allocation functions (see host_allocations)
+extern uint64_t host_num_allocations;
+
+/**
+ * Returns the number of heap allocations (malloc, calloc, realloc and
+ * aligned_alloc) made so far by any thread, or 0 if they aren't counted
+ *
+ * @return uint64_t
+ */
+uint64_t host_allocations(void);
+
+/**
+ * Opens every available counter. Counting starts immediately, but only
+ * counts between host_region_begin and host_region_end are kept
+ *
+ * @return host_profile* (free with free_host_profile), or NULL if allocation
+ * fails
+ */
+host_profile* create_host_profile(void);
+
+/**
+ * Closes a host profile's counters and frees it
+ *
+ * @param host may be NULL
+ */
+void free_host_profile(host_profile* host);
+
+/**
+ * Starts measuring region. Regions don't nest: at most one is measured at a
+ * time
+ *
+ * @param host may be NULL, to do nothing
+ * @param region
+ */
+void host_region_begin(host_profile* host, host_region region);
+
+/**
+ * Stops measuring region, adding what was counted since host_region_begin to
+ * its totals
+ *
+ * @param host may be NULL, to do nothing
+ * @param region
+ * @param units guest instructions the region handled this time
+ */
+void host_region_end(host_profile* host, host_region region, uint64_t units);
+
+/**
+ * Returns a short name for counter, as used in reports
+ *
+ * @param counter
+ * @return const char*
+ */
+const char* host_counter_name(host_counter counter);
+
+/**
+ * Prints a human-readable report of every measured region: each counter's
+ * total and its value per guest instruction, or n/a if unavailable
+ *
+ * @param out
+ * @param host
+ */
+void print_host_report(FILE* out, const host_profile* host);
+
+/**
+ * Writes the same report as one JSON object, with null for unavailable
+ * counters
+ *
+ * @param out
+ * @param host
+ */
+void write_host_report_json(FILE* out, const host_profile* host);
+
+#endif  // HOSTPERF_H
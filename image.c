@@ -0,0 +1,440 @@
+#include "image.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+// Allocates space for num_instructions words, in an anonymous mapping if the
+// image is large
+static image_status allocate_words(program_image* image,
+                                   uint32_t num_instructions) {
+    size_t size = (size_t)num_instructions * sizeof(uint32_t);
+    image->num_instructions = num_instructions;
+    image->mapping = NULL;
+    image->mapped_size = 0;
+    if (size >= LARGE_IMAGE_BYTES) {
+        void* words = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (words == MAP_FAILED) return IMAGE_NO_MEMORY;
+        image->words = (uint32_t*)words;
+        image->mapping = words;
+        image->mapped_size = size;
+    } else {
+        image->words = (uint32_t*)malloc(size == 0 ? 1 : size);
+        if (image->words == NULL) return IMAGE_NO_MEMORY;
+    }
+    return IMAGE_OK;
+}
+
+void free_image(program_image* image) {
+    if (image->mapping != NULL)
+        munmap(image->mapping, image->mapped_size);
+    else
+        free(image->words);
+    image->words = NULL;
+    image->num_instructions = 0;
+    image->mapping = NULL;
+    image->mapped_size = 0;
+}
+
+const char* image_status_message(image_status status) {
+    switch (status) {
+        case IMAGE_OK:
+            return "Success";
+        case IMAGE_OPEN_FAILED:
+            return "Failed to open file";
+        case IMAGE_TOO_LARGE:
+            return "Program has too many instructions";
+        case IMAGE_BAD_FORMAT:
+            return "File is not in the expected format";
+        case IMAGE_NO_MEMORY:
+        default:
+            return "Out of memory";
+    }
+}
+
+// Parses one line (up to end or '\n') like strtoul(line, NULL, 16), keeping
+// the low 32 bits
+static uint32_t parse_hex_line(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+    uint32_t value = 0;
+    for (; p < end; p++) {
+        char c = *p;
+        uint32_t digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            break;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+// A line starts at offset 0 and after every '\n' that isn't the last byte.
+// Chunk [begin, end) of the text owns the lines that start inside it
+typedef struct {
+    const char* text;
+    size_t size;
+    // Number of lines owned by each chunk, then (after a prefix sum) the
+    // index of each chunk's first line
+    uint32_t* line_counts;
+    uint32_t* words;
+} hex_parse;
+
+static size_t count_lines(const hex_parse* parse, size_t begin, size_t end) {
+    if (begin == end) return 0;
+    size_t count = begin == 0 ? 1 : 0;
+    // A '\n' at q starts a line at q + 1, which is in [begin, end) iff q is
+    // in [begin - 1, end - 1)
+    const char* p = parse->text + (begin == 0 ? 0 : begin - 1);
+    const char* last = parse->text + end - 1;
+    while (p < last && (p = (const char*)memchr(p, '\n', last - p)) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+static void count_chunk(size_t chunk, size_t begin, size_t end, void* ctx) {
+    hex_parse* parse = (hex_parse*)ctx;
+    parse->line_counts[chunk] = count_lines(parse, begin, end);
+}
+
+static void parse_chunk(size_t chunk, size_t begin, size_t end, void* ctx) {
+    hex_parse* parse = (hex_parse*)ctx;
+    const char* text = parse->text;
+    const char* text_end = text + parse->size;
+    uint32_t* out = parse->words + parse->line_counts[chunk];
+
+    // Find the first line starting at or after begin
+    const char* p = text + begin;
+    if (begin != 0 && text[begin - 1] != '\n') {
+        p = (const char*)memchr(p, '\n', end - begin);
+        if (p == NULL) return;
+        p++;
+    }
+    while (p < text + end) {
+        const char* line_end = (const char*)memchr(p, '\n', text_end - p);
+        if (line_end == NULL) line_end = text_end;
+        *out++ = parse_hex_line(p, line_end);
+        p = line_end + 1;
+    }
+}
+
+static image_status load_mapped_hex(const char* text, size_t size,
+                                    program_image* image) {
+    hex_parse parse = {text, size, NULL, NULL};
+    size_t num_chunks = parallel_num_chunks(size, MIN_PARSE_CHUNK_BYTES);
+    parse.line_counts = (uint32_t*)malloc(num_chunks * sizeof(uint32_t));
+    if (parse.line_counts == NULL) return IMAGE_NO_MEMORY;
+
+    // Pass 1 counts lines per chunk, so each chunk knows where its words go
+    parallel_for(size, MIN_PARSE_CHUNK_BYTES, count_chunk, &parse);
+    uint64_t total = 0;
+    for (size_t k = 0; k < num_chunks; k++) {
+        uint32_t count = parse.line_counts[k];
+        parse.line_counts[k] = (uint32_t)total;
+        total += count;
+    }
+    if (total > MAX_IMAGE_INSTRUCTIONS) {
+        free(parse.line_counts);
+        return IMAGE_TOO_LARGE;
+    }
+
+    image_status status = allocate_words(image, (uint32_t)total);
+    if (status == IMAGE_OK) {
+        // Pass 2 parses each chunk's lines into place
+        parse.words = image->words;
+        parallel_for(size, MIN_PARSE_CHUNK_BYTES, parse_chunk, &parse);
+    }
+    free(parse.line_counts);
+    return status;
+}
+
+static image_status load_streamed_hex(FILE* file, program_image* image) {
+    uint32_t capacity = 1024;
+    image_status status = allocate_words(image, capacity);
+    if (status != IMAGE_OK) return status;
+    image->num_instructions = 0;
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, file)) != -1) {
+        if (image->num_instructions == capacity) {
+            if (capacity == MAX_IMAGE_INSTRUCTIONS) {
+                status = IMAGE_TOO_LARGE;
+                break;
+            }
+            // Grow geometrically (by copying into a new allocation, since the
+            // words may be mmap'd)
+            uint32_t new_capacity = capacity > MAX_IMAGE_INSTRUCTIONS / 2
+                                        ? MAX_IMAGE_INSTRUCTIONS
+                                        : capacity * 2;
+            program_image grown;
+            status = allocate_words(&grown, new_capacity);
+            if (status != IMAGE_OK) break;
+            memcpy(grown.words, image->words, capacity * sizeof(uint32_t));
+            free_image(image);
+            *image = grown;
+            image->num_instructions = capacity;
+            capacity = new_capacity;
+        }
+        image->words[image->num_instructions++] =
+            parse_hex_line(line, line + length);
+    }
+    free(line);
+    if (status != IMAGE_OK) free_image(image);
+    return status;
+}
+
+// Loads hex text from fd, which is closed on return
+static image_status load_hex_fd(int fd, program_image* image) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        image_status status;
+        if (st.st_size == 0) {
+            status = allocate_words(image, 0);
+        } else {
+            void* text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (text == MAP_FAILED) {
+                close(fd);
+                return IMAGE_NO_MEMORY;
+            }
+            // The text is read front to back by each thread
+            madvise(text, st.st_size, MADV_SEQUENTIAL);
+            status = load_mapped_hex((const char*)text, st.st_size, image);
+            munmap(text, st.st_size);
+        }
+        close(fd);
+        return status;
+    }
+
+    FILE* file = fdopen(fd, "r");
+    if (file == NULL) {
+        close(fd);
+        return IMAGE_OPEN_FAILED;
+    }
+    image_status status = load_streamed_hex(file, image);
+    fclose(file);
+    return status;
+}
+
+image_status load_hex_image(const char* filepath, program_image* image) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return IMAGE_OPEN_FAILED;
+    return load_hex_fd(fd, image);
+}
+
+static bool host_is_big_endian(void) {
+    const uint32_t one = 1;
+    uint8_t first;
+    memcpy(&first, &one, 1);
+    return first == 0;
+}
+
+static uint32_t read_u32(const uint8_t* p, bool swap) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t read_u16(const uint8_t* p, bool swap) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap ? __builtin_bswap16(value) : value;
+}
+
+// Reads field of the ELF structure type at p
+#define ELF_U32(p, type, field, swap) \
+    read_u32((p) + offsetof(type, field), swap)
+#define ELF_U16(p, type, field, swap) \
+    read_u16((p) + offsetof(type, field), swap)
+
+// Finds the instruction words of a 32-bit MIPS ELF file. On success, sets
+// *offset and *size (in bytes) and *big_endian to the file's byte order
+static image_status find_elf_text(const uint8_t* file, size_t file_size,
+                                  size_t* offset, size_t* size,
+                                  bool* big_endian) {
+    if (file_size < sizeof(Elf32_Ehdr) || memcmp(file, ELFMAG, SELFMAG) != 0 ||
+        file[EI_CLASS] != ELFCLASS32)
+        return IMAGE_BAD_FORMAT;
+    if (file[EI_DATA] != ELFDATA2LSB && file[EI_DATA] != ELFDATA2MSB)
+        return IMAGE_BAD_FORMAT;
+    *big_endian = file[EI_DATA] == ELFDATA2MSB;
+    const bool swap = *big_endian != host_is_big_endian();
+    if (ELF_U16(file, Elf32_Ehdr, e_machine, swap) != EM_MIPS)
+        return IMAGE_BAD_FORMAT;
+
+    // Prefer the .text section
+    size_t shoff = ELF_U32(file, Elf32_Ehdr, e_shoff, swap);
+    size_t shentsize = ELF_U16(file, Elf32_Ehdr, e_shentsize, swap);
+    size_t shnum = ELF_U16(file, Elf32_Ehdr, e_shnum, swap);
+    size_t shstrndx = ELF_U16(file, Elf32_Ehdr, e_shstrndx, swap);
+    if (shoff != 0 && shentsize >= sizeof(Elf32_Shdr) && shstrndx < shnum &&
+        shoff + shnum * shentsize <= file_size) {
+        const uint8_t* strtab_header = file + shoff + shstrndx * shentsize;
+        size_t strtab = ELF_U32(strtab_header, Elf32_Shdr, sh_offset, swap);
+        size_t strtab_size = ELF_U32(strtab_header, Elf32_Shdr, sh_size, swap);
+        if (strtab + strtab_size > file_size) return IMAGE_BAD_FORMAT;
+        for (size_t k = 0; k < shnum; k++) {
+            const uint8_t* header = file + shoff + k * shentsize;
+            size_t name = ELF_U32(header, Elf32_Shdr, sh_name, swap);
+            if (name + sizeof(".text") > strtab_size ||
+                memcmp(file + strtab + name, ".text", sizeof(".text")) != 0)
+                continue;
+            *offset = ELF_U32(header, Elf32_Shdr, sh_offset, swap);
+            *size = ELF_U32(header, Elf32_Shdr, sh_size, swap);
+            return *offset + *size <= file_size ? IMAGE_OK : IMAGE_BAD_FORMAT;
+        }
+    }
+
+    // Stripped files may have no section headers, so fall back to the first
+    // executable segment
+    size_t phoff = ELF_U32(file, Elf32_Ehdr, e_phoff, swap);
+    size_t phentsize = ELF_U16(file, Elf32_Ehdr, e_phentsize, swap);
+    size_t phnum = ELF_U16(file, Elf32_Ehdr, e_phnum, swap);
+    if (phoff == 0 || phentsize < sizeof(Elf32_Phdr) ||
+        phoff + phnum * phentsize > file_size)
+        return IMAGE_BAD_FORMAT;
+    for (size_t k = 0; k < phnum; k++) {
+        const uint8_t* header = file + phoff + k * phentsize;
+        if (ELF_U32(header, Elf32_Phdr, p_type, swap) != PT_LOAD ||
+            !(ELF_U32(header, Elf32_Phdr, p_flags, swap) & PF_X))
+            continue;
+        *offset = ELF_U32(header, Elf32_Phdr, p_offset, swap);
+        *size = ELF_U32(header, Elf32_Phdr, p_filesz, swap);
+        return *offset + *size <= file_size ? IMAGE_OK : IMAGE_BAD_FORMAT;
+    }
+    return IMAGE_BAD_FORMAT;
+}
+
+// Loads a binary dump or ELF file from fd, which is closed on return
+static image_status load_mapped_binary(int fd, image_format format,
+                                       program_image* image) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return IMAGE_BAD_FORMAT;
+    }
+    size_t file_size = st.st_size;
+    if (file_size == 0) {
+        close(fd);
+        return format == IMAGE_FORMAT_ELF ? IMAGE_BAD_FORMAT
+                                          : allocate_words(image, 0);
+    }
+
+    // A private writable mapping is only copied for pages that get written,
+    // i.e., only if the words have to be byte-swapped
+    uint8_t* file = (uint8_t*)mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return IMAGE_NO_MEMORY;
+
+    size_t offset = 0, size = file_size;
+    bool big_endian = format == IMAGE_FORMAT_BINARY_BE;
+    image_status status = IMAGE_OK;
+    if (format == IMAGE_FORMAT_ELF)
+        status = find_elf_text(file, file_size, &offset, &size, &big_endian);
+    if (status == IMAGE_OK && size / WORD_SIZE > MAX_IMAGE_INSTRUCTIONS)
+        status = IMAGE_TOO_LARGE;
+    if (status != IMAGE_OK) {
+        munmap(file, file_size);
+        return status;
+    }
+
+    uint32_t num_instructions = size / WORD_SIZE;
+    const bool swap = big_endian != host_is_big_endian();
+    if (offset % sizeof(uint32_t) == 0) {
+        image->words = (uint32_t*)(file + offset);
+        image->num_instructions = num_instructions;
+        image->mapping = file;
+        image->mapped_size = file_size;
+        if (swap) {
+            for (uint32_t i = 0; i < num_instructions; i++)
+                image->words[i] = __builtin_bswap32(image->words[i]);
+        }
+        return IMAGE_OK;
+    }
+
+    // Misaligned words can't be used in place
+    status = allocate_words(image, num_instructions);
+    if (status == IMAGE_OK) {
+        for (uint32_t i = 0; i < num_instructions; i++)
+            image->words[i] = read_u32(file + offset + i * WORD_SIZE, swap);
+    }
+    munmap(file, file_size);
+    return status;
+}
+
+image_status load_image(const char* filepath, image_format format,
+                        program_image* image) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return IMAGE_OPEN_FAILED;
+
+    if (format == IMAGE_FORMAT_AUTO) {
+        char magic[SELFMAG];
+        bool is_elf = pread(fd, magic, SELFMAG, 0) == SELFMAG &&
+                      memcmp(magic, ELFMAG, SELFMAG) == 0;
+        format = is_elf ? IMAGE_FORMAT_ELF : IMAGE_FORMAT_HEX;
+    }
+    if (format == IMAGE_FORMAT_HEX) return load_hex_fd(fd, image);
+    return load_mapped_binary(fd, format, image);
+}
+
+image_status load_image_buffer(const void* data, size_t size,
+                               image_format format, program_image* image) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    if (format == IMAGE_FORMAT_AUTO)
+        format = size >= SELFMAG && memcmp(bytes, ELFMAG, SELFMAG) == 0
+                     ? IMAGE_FORMAT_ELF
+                     : IMAGE_FORMAT_HEX;
+    if (format == IMAGE_FORMAT_HEX) {
+        if (size == 0) return allocate_words(image, 0);
+        return load_mapped_hex((const char*)bytes, size, image);
+    }
+
+    size_t offset = 0, text_size = size;
+    bool big_endian = format == IMAGE_FORMAT_BINARY_BE;
+    if (format == IMAGE_FORMAT_ELF) {
+        image_status status =
+            find_elf_text(bytes, size, &offset, &text_size, &big_endian);
+        if (status != IMAGE_OK) return status;
+    }
+    if (text_size / WORD_SIZE > MAX_IMAGE_INSTRUCTIONS) return IMAGE_TOO_LARGE;
+    uint32_t num_instructions = text_size / WORD_SIZE;
+    image_status status = allocate_words(image, num_instructions);
+    if (status != IMAGE_OK) return status;
+    const bool swap = big_endian != host_is_big_endian();
+    for (uint32_t i = 0; i < num_instructions; i++)
+        image->words[i] = read_u32(bytes + offset + i * WORD_SIZE, swap);
+    return IMAGE_OK;
+}
+
+// Indexed by image_format
+static const char* const FORMAT_NAMES[] = {"auto", "hex", "binary",
+                                           "binary-be", "elf"};
+
+bool parse_image_format(const char* name, image_format* format) {
+    for (unsigned int i = 0; i < sizeof(FORMAT_NAMES) / sizeof(FORMAT_NAMES[0]);
+         i++) {
+        if (strcmp(name, FORMAT_NAMES[i]) == 0) {
+            *format = (image_format)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,127 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Images with at least this many bytes of instructions are stored in an
+// anonymous mapping instead of on the heap
+#define LARGE_IMAGE_BYTES (1 << 20)
+// Each thread parsing a hex file handles at least this many bytes of it
+#define MIN_PARSE_CHUNK_BYTES (1 << 20)
+// pc is a uint32_t, so this is the most instructions a program can have
+#define MAX_IMAGE_INSTRUCTIONS (UINT32_MAX / WORD_SIZE)
+
+/**
+ * A loaded program in 32-bit form, i.e., the raw instruction words
+ *
+ * words is sized to the program (there is no fixed maximum other than
+ * MAX_IMAGE_INSTRUCTIONS). If mapping is not NULL, words points into an
+ * mmap'd region (anonymous, or of the program file itself) that starts at
+ * mapping and is mapped_size bytes long, else words is heap allocated
+ */
+typedef struct {
+    uint32_t* words;
+    uint32_t num_instructions;
+    void* mapping;
+    size_t mapped_size;
+} program_image;
+
+typedef enum {
+    IMAGE_OK,
+    IMAGE_OPEN_FAILED,
+    IMAGE_TOO_LARGE,
+    IMAGE_NO_MEMORY,
+    IMAGE_BAD_FORMAT
+} image_status;
+
+// Formats accepted by load_image (and ./main --format=<name>)
+typedef enum {
+    // ELF if the file starts with the ELF magic number, else hex
+    IMAGE_FORMAT_AUTO,
+    // One instruction per line in hex (MARS "Hexadecimal Text" dump)
+    IMAGE_FORMAT_HEX,
+    // Raw 32-bit words (MARS "Binary" dump), little- or big-endian
+    IMAGE_FORMAT_BINARY_LE,
+    IMAGE_FORMAT_BINARY_BE,
+    // The .text section of a 32-bit MIPS ELF executable (either endianness)
+    IMAGE_FORMAT_ELF
+} image_format;
+
+/**
+ * Parses a file with MIPS instructions in hex format (one instruction per line,
+ * as produced by MARS) into image
+ *
+ * Regular files are mmap'd, split into chunks at line boundaries, and parsed on
+ * several threads (see parallel_for). Anything else (e.g., a pipe) is read line
+ * by line into a buffer that grows geometrically. Either way, each line is
+ * parsed the same way strtoul(line, NULL, 16) would, so an empty line is a 0
+ * instruction
+ *
+ * @param filepath
+ * @param image set on success (free with free_image)
+ * @return IMAGE_OK on success, else the reason loading failed
+ */
+image_status load_hex_image(const char* filepath, program_image* image);
+
+/**
+ * Loads a file in the given format into image
+ *
+ * Binary dumps and ELF files are mmap'd and their words are used in place,
+ * without copying or parsing. If the file's byte order differs from the
+ * host's, the words are byte-swapped in a private (copy-on-write) mapping of
+ * the file. An ELF program runs as if its .text section were at address 0,
+ * like MARS with "Compact, Text at Address 0". Trailing bytes that don't make
+ * up a whole word are ignored
+ *
+ * @param filepath
+ * @param format
+ * @param image set on success (free with free_image)
+ * @return IMAGE_OK on success, else the reason loading failed
+ */
+image_status load_image(const char* filepath, image_format format,
+                        program_image* image);
+
+/**
+ * Same as load_image, but for a file's contents already in memory
+ *
+ * The words are always copied out of data, which the caller may free as soon
+ * as this returns
+ *
+ * @param data
+ * @param size in bytes
+ * @param format
+ * @param image set on success (free with free_image)
+ * @return IMAGE_OK on success, else the reason loading failed
+ */
+image_status load_image_buffer(const void* data, size_t size,
+                               image_format format, program_image* image);
+
+/**
+ * Parses a format name as given to --format
+ *
+ * @param name "auto" | "hex" | "binary" (little-endian) | "binary-be" | "elf"
+ * @param format set to the parsed format on success
+ * @return true on success, else false
+ */
+bool parse_image_format(const char* name, image_format* format);
+
+/**
+ * Frees the instruction words of image and resets it to an empty image
+ *
+ * @param image
+ */
+void free_image(program_image* image);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* image_status_message(image_status status);
+
+#endif  // IMAGE_H
@@ -3,7 +3,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <utility>
+
 #include "constants.h"
+#include "memory.h"
 #include "types.h"
 
 // This is given to you, don't edit
@@ -15,97 +18,193 @@ unsigned int bit_select(unsigned int num, unsigned int start_bit,
     return num;
 }
 
+// Same as bit_select(num, FIELD_START_BIT, FIELD_END_BIT) for a field named
+// in constants.h (e.g., SELECT(instruct, RS)), but folds to a shift and a mask
+#define SELECT(num, FIELD)             \
+    (((num) >> FIELD##_END_BIT) &      \
+     ((1u << (FIELD##_START_BIT - FIELD##_END_BIT + 1)) - 1))
+
+// Pairs an opcode (I-type) or funct (R-type) value with its decode entry and
+// assembly mnemonic
+typedef struct {
+    unsigned int code;
+    decode_entry entry;
+    const char* mnemonic;
+} instruction_def;
+
+// To support a new instruction, add its opcode or funct to constants.h, its
+// name to types.h, and a row below
+static constexpr instruction_def R_TYPE_DEFS[] = {
+    {SLL_FUNCT, {SLL, R_TYPE, LAYOUT_RD_RT_SHAMT, sll, true}, "sll"},
+    {SRA_FUNCT, {SRA, R_TYPE, LAYOUT_RD_RT_SHAMT, sra, true}, "sra"},
+    {ADD_FUNCT, {ADD, R_TYPE, LAYOUT_RD_RS_RT, add, true}, "add"},
+    {SUB_FUNCT, {SUB, R_TYPE, LAYOUT_RD_RS_RT, sub, true}, "sub"},
+    {AND_FUNCT, {AND, R_TYPE, LAYOUT_RD_RS_RT, and_op, true}, "and"},
+    {OR_FUNCT, {OR, R_TYPE, LAYOUT_RD_RS_RT, or_op, true}, "or"},
+    {NOR_FUNCT, {NOR, R_TYPE, LAYOUT_RD_RS_RT, nor, true}, "nor"},
+    {JR_FUNCT, {JR, R_TYPE, LAYOUT_RS, jr, true}, "jr"},
+    {SYSCALL_FUNCT, {SYSCALL, R_TYPE, LAYOUT_NONE, syscall_op, true}, "syscall"},
+};
+
+static constexpr instruction_def I_TYPE_DEFS[] = {
+    {ADDI_OPCODE, {ADDI, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, addi, true}, "addi"},
+    {ANDI_OPCODE, {ANDI, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, andi, true}, "andi"},
+    {ORI_OPCODE, {ORI, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, ori, true}, "ori"},
+    {LW_OPCODE, {LW, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, lw, true}, "lw"},
+    {SW_OPCODE, {SW, I_TYPE, LAYOUT_RS_RT_OFFSET, sw, true}, "sw"},
+    {LB_OPCODE, {LB, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, lb, true}, "lb"},
+    {SB_OPCODE, {SB, I_TYPE, LAYOUT_RS_RT_OFFSET, sb, true}, "sb"},
+    {LL_OPCODE, {LL, I_TYPE, LAYOUT_RT_RS_IMMEDIATE, ll, true}, "ll"},
+    {SC_OPCODE, {SC, I_TYPE, LAYOUT_RS_RT_OFFSET_RT, sc, true}, "sc"},
+    {BEQ_OPCODE, {BEQ, I_TYPE, LAYOUT_RS_RT_OFFSET, beq, true}, "beq"},
+    {BNE_OPCODE, {BNE, I_TYPE, LAYOUT_RS_RT_OFFSET, bne, true}, "bne"},
+};
+
+static constexpr instruction_def J_TYPE_DEFS[] = {
+    {J_OPCODE, {J, J_TYPE, LAYOUT_TARGET, j, true}, "j"},
+    {JAL_OPCODE, {JAL, J_TYPE, LAYOUT_TARGET, jal, true}, "jal"},
+};
+
+typedef struct {
+    decode_entry opcode[NUM_OPCODES];
+    decode_entry funct[NUM_FUNCTS];
+} decode_tables;
+
+// Unknown encodings decode as sll (with valid set to false), which is what
+// the original if-chain in determine_instruction_name fell back to
+static constexpr decode_tables build_decode_tables() {
+    decode_tables tables{};
+    for (unsigned int i = 0; i < NUM_OPCODES; i++)
+        tables.opcode[i] = {SLL, i == R_TYPE_OPCODE ? R_TYPE : I_TYPE,
+                            LAYOUT_RT_RS_IMMEDIATE, sll, false};
+    for (unsigned int i = 0; i < NUM_FUNCTS; i++)
+        tables.funct[i] = {SLL, R_TYPE, LAYOUT_RD_RT_SHAMT, sll, false};
+    for (const instruction_def& def : R_TYPE_DEFS)
+        tables.funct[def.code] = def.entry;
+    for (const instruction_def& def : I_TYPE_DEFS)
+        tables.opcode[def.code] = def.entry;
+    for (const instruction_def& def : J_TYPE_DEFS)
+        tables.opcode[def.code] = def.entry;
+    return tables;
+}
+
+static constexpr decode_tables DECODE_TABLES = build_decode_tables();
+
+// Returns the definition of name, or NULL if there is none
+static const instruction_def* find_def(instruction_name name) {
+    for (const instruction_def& def : R_TYPE_DEFS)
+        if (def.entry.name == name) return &def;
+    for (const instruction_def& def : I_TYPE_DEFS)
+        if (def.entry.name == name) return &def;
+    for (const instruction_def& def : J_TYPE_DEFS)
+        if (def.entry.name == name) return &def;
+    return NULL;
+}
+
+const char* instruction_mnemonic(instruction_name name) {
+    const instruction_def* def = find_def(name);
+    return def == NULL ? "?" : def->mnemonic;
+}
+
+operand_layout instruction_layout(instruction_name name) {
+    const instruction_def* def = find_def(name);
+    return def == NULL ? LAYOUT_RD_RT_SHAMT : def->entry.layout;
+}
+
+uint8_t instruction_destination(const instruction* instruct) {
+    switch (instruction_layout(instruct->name)) {
+        case LAYOUT_RD_RS_RT:
+        case LAYOUT_RD_RT_SHAMT:
+            return instruct->_fields.r.rd;
+        case LAYOUT_RT_RS_IMMEDIATE:
+        case LAYOUT_RS_RT_OFFSET_RT:
+            return instruct->_fields.i.rt;
+        case LAYOUT_TARGET:
+            return instruct->name == JAL ? RA_REGISTER : NO_DESTINATION;
+        default:
+            return NO_DESTINATION;
+    }
+}
+
+bool is_control_flow(instruction_name name) { return name >= BEQ; }
+
+bool is_nop(const instruction* instruct) {
+    r_fields r = instruct->_fields.r;
+    i_fields f = instruct->_fields.i;
+    switch (instruct->name) {
+        case SLL:
+        case SRA:
+            return r.rd == r.rt && r.shamt == 0;
+        case AND:
+        case OR:
+            return r.rd == r.rs && r.rd == r.rt;
+        case ADDI:
+        case ORI:
+            return f.rt == f.rs && f.immediate == 0;
+        default:
+            return false;
+    }
+}
+
+bool is_memory_access(instruction_name name) {
+    return name >= LW && name <= SC;
+}
+
+const decode_entry* lookup_instruction(uint32_t instruct) {
+    unsigned int opcode = SELECT(instruct, OPCODE);
+    if (opcode == R_TYPE_OPCODE)
+        return &DECODE_TABLES.funct[SELECT(instruct, FUNCT)];
+    return &DECODE_TABLES.opcode[opcode];
+}
+
 instruction_type determine_instruction_type(uint32_t instruct) {
-    unsigned int temp = bit_select(instruct, OPCODE_START_BIT, OPCODE_END_BIT);
-    if (temp == R_TYPE_OPCODE) {
-        return R_TYPE;
+    return lookup_instruction(instruct)->type;
+}
+
+// Extracts the fields of instruct given its (already determined) type
+static fields extract_fields(uint32_t instruct, instruction_type type) {
+    fields rv;
+    if (type == R_TYPE) {
+        r_fields rf;
+        rf.rs = SELECT(instruct, RS);
+        rf.rt = SELECT(instruct, RT);
+        rf.rd = SELECT(instruct, RD);
+        rf.shamt = SELECT(instruct, SHAMT);
+        rv.r = rf;
+    } else if (type == I_TYPE) {
+        i_fields if1;
+        if1.rs = SELECT(instruct, RS);
+        if1.rt = SELECT(instruct, RT);
+        if1.immediate = (int16_t)SELECT(instruct, IMMEDIATE);
+        rv.i = if1;
     } else {
-        return I_TYPE;
+        j_fields jf;
+        jf.target = SELECT(instruct, TARGET);
+        rv.j = jf;
     }
+    return rv;
 }
 
 fields* create_fields(uint32_t instruct) {
     fields* rv = (fields*)malloc(sizeof(fields));
-    r_fields rf1;
-    i_fields if1;
-
-    if (determine_instruction_type(instruct) == R_TYPE) {
-        uint8_t rs = bit_select(instruct, RS_START_BIT, RS_END_BIT);
-        uint8_t rt = bit_select(instruct, RT_START_BIT, RT_END_BIT);
-        uint8_t rd = bit_select(instruct, RD_START_BIT, RD_END_BIT);
-        uint8_t shamt = bit_select(instruct, SHAMT_START_BIT, SHAMT_END_BIT);
-        rf1.rs = rs;
-        rf1.rt = rt;
-        rf1.rd = rd;
-        rf1.shamt = shamt;
-        rv->r = rf1;
-    } else {
-        uint8_t rs = bit_select(instruct, RS_START_BIT, RS_END_BIT);
-        uint8_t rt = bit_select(instruct, RT_START_BIT, RT_END_BIT);
-        uint16_t immediate =
-            bit_select(instruct, IMMEDIATE_START_BIT, IMMEDIATE_END_BIT);
-        if1.rs = rs;
-        if1.rt = rt;
-        if1.immediate = immediate;
-        rv->i = if1;
-    }
-    free(rv);
+    *rv = extract_fields(instruct, determine_instruction_type(instruct));
     return rv;
 }
 
 instruction_name determine_instruction_name(uint32_t instruct) {
-    int function = bit_select(instruct, FUNCT_START_BIT, FUNCT_END_BIT);
-    int opcode = bit_select(instruct, OPCODE_START_BIT, OPCODE_END_BIT);
-    if (determine_instruction_type(instruct) == R_TYPE) {
-        if (function == SLL_FUNCT)
-            return SLL;
-        else if (function == SRA_FUNCT)
-            return SRA;
-        else if (function == ADD_FUNCT)
-            return ADD;
-        else if (function == SUB_FUNCT)
-            return SUB;
-        else if (function == AND_FUNCT)
-            return AND;
-        else if (function == OR_FUNCT)
-            return OR;
-        else if (function == NOR_FUNCT)
-            return NOR;
-    } else {
-        if (opcode == ADDI_OPCODE)
-            return ADDI;
-        else if (opcode == ANDI_OPCODE)
-            return ANDI;
-        else if (opcode == ORI_OPCODE)
-            return ORI;
-    }
-    return SLL;
+    return lookup_instruction(instruct)->name;
+}
+
+void decode_instruction(uint32_t instruct, instruction* out) {
+    const decode_entry* entry = lookup_instruction(instruct);
+    out->_fields = extract_fields(instruct, entry->type);
+    out->name = entry->name;
+    out->execute = entry->execute;
 }
 
 instruction* create_instruction(uint32_t instruct) {
     instruction* rv = (instruction*)malloc(sizeof(instruction));
-    instruction_name inst = determine_instruction_name(instruct);
-    rv->_fields = *create_fields(instruct);
-    if (inst == SLL)
-        rv->execute = sll;
-    else if (inst == SRA)
-        rv->execute = sra;
-    else if (inst == ADD)
-        rv->execute = add;
-    else if (inst == SUB)
-        rv->execute = sub;
-    else if (inst == AND)
-        rv->execute = and_op;
-    else if (inst == OR)
-        rv->execute = or_op;
-    else if (inst == NOR)
-        rv->execute = nor;
-    else if (inst == ADDI)
-        rv->execute = addi;
-    else if (inst == ANDI)
-        rv->execute = andi;
-    else if (inst == ORI)
-        rv->execute = ori;
+    decode_instruction(instruct, rv);
     return rv;
 }
 
@@ -179,3 +278,205 @@ void ori(fields fields, int32_t* registers, uint32_t* pc) {
     registers[i_fields.rt] = registers[i_fields.rs] | i_fields.immediate;
     *pc += WORD_SIZE;
 }
+
+// Memory instructions access bound_memory at rs + immediate
+
+void lw(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    registers[i_fields.rt] = memory_load_word(
+        bound_memory, (uint32_t)registers[i_fields.rs] + i_fields.immediate);
+    *pc += WORD_SIZE;
+}
+
+void sw(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    memory_store_word(bound_memory,
+                      (uint32_t)registers[i_fields.rs] + i_fields.immediate,
+                      registers[i_fields.rt]);
+    *pc += WORD_SIZE;
+}
+
+void lb(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    registers[i_fields.rt] = (int8_t)memory_load_byte(
+        bound_memory, (uint32_t)registers[i_fields.rs] + i_fields.immediate);
+    *pc += WORD_SIZE;
+}
+
+void sb(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    memory_store_byte(bound_memory,
+                      (uint32_t)registers[i_fields.rs] + i_fields.immediate,
+                      (uint8_t)registers[i_fields.rt]);
+    *pc += WORD_SIZE;
+}
+
+void ll(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    registers[i_fields.rt] = memory_load_linked(
+        bound_memory, (uint32_t)registers[i_fields.rs] + i_fields.immediate);
+    *pc += WORD_SIZE;
+}
+
+void sc(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    registers[i_fields.rt] = memory_store_conditional(
+        bound_memory, (uint32_t)registers[i_fields.rs] + i_fields.immediate,
+        registers[i_fields.rt]);
+    *pc += WORD_SIZE;
+}
+
+// Branch and jump targets are computed from the address of the next
+// instruction (there are no delay slots)
+void beq(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    *pc += WORD_SIZE;
+    if (registers[i_fields.rs] == registers[i_fields.rt])
+        *pc += (uint32_t)(int32_t)i_fields.immediate << 2;
+}
+
+void bne(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    *pc += WORD_SIZE;
+    if (registers[i_fields.rs] != registers[i_fields.rt])
+        *pc += (uint32_t)(int32_t)i_fields.immediate << 2;
+}
+
+void j(fields fields, int32_t* registers, uint32_t* pc) {
+    *pc = ((*pc + WORD_SIZE) & JUMP_REGION_MASK) |
+          ((uint32_t)fields.j.target << 2);
+}
+
+void jal(fields fields, int32_t* registers, uint32_t* pc) {
+    registers[RA_REGISTER] = (int32_t)(*pc + WORD_SIZE);
+    j(fields, registers, pc);
+}
+
+void jr(fields fields, int32_t* registers, uint32_t* pc) {
+    *pc = (uint32_t)registers[fields.r.rs];
+}
+
+// Exit (service 10) halts by leaving pc on the syscall, so executing it again
+// does nothing. Other services are not supported and do nothing
+void syscall_op(fields fields, int32_t* registers, uint32_t* pc) {
+    if (registers[V0_REGISTER] != EXIT_SYSCALL) *pc += WORD_SIZE;
+}
+
+// Handlers specialised on operand shape, which specialize_instruction picks
+// instead of the ones above. Each computes exactly what the general handler
+// does for that shape, $0 included, but without extracting the fields it
+// already knows at compile time
+
+typedef void (*instruction_handler)(fields fields, int32_t* registers,
+                                    uint32_t* pc);
+
+// addi $t, $t, k is specialised for MIN_SMALL_IMMEDIATE <= k <
+// MIN_SMALL_IMMEDIATE + NUM_SMALL_IMMEDIATES, which covers the usual loop
+// counter and pointer steps
+#define MIN_SMALL_IMMEDIATE -16
+#define NUM_SMALL_IMMEDIATES 32
+
+// An instruction that only advances the PC (see is_nop)
+static void skip(fields fields, int32_t* registers, uint32_t* pc) {
+    *pc += WORD_SIZE;
+}
+
+// addi or ori with immediate 0
+static void move(fields fields, int32_t* registers, uint32_t* pc) {
+    i_fields i_fields = fields.i;
+    registers[i_fields.rt] = registers[i_fields.rs];
+    *pc += WORD_SIZE;
+}
+
+// andi with immediate 0, which doesn't need rs
+static void clear(fields fields, int32_t* registers, uint32_t* pc) {
+    registers[fields.i.rt] = 0;
+    *pc += WORD_SIZE;
+}
+
+// R-type ALU instructions whose rd is also rs, so only rd and rt are
+// extracted. Operands are in the same order as in the general handlers
+template <instruction_name NAME>
+static void alu_in_place(fields fields, int32_t* registers, uint32_t* pc) {
+    r_fields r_fields = fields.r;
+    int32_t* rd = &registers[r_fields.rd];
+    const int32_t rt = registers[r_fields.rt];
+    if constexpr (NAME == ADD)
+        *rd = rt + *rd;
+    else if constexpr (NAME == SUB)
+        *rd = *rd - rt;
+    else if constexpr (NAME == AND)
+        *rd = rt & *rd;
+    else if constexpr (NAME == OR)
+        *rd = rt | *rd;
+    else
+        *rd = ~(rt | *rd);
+    *pc += WORD_SIZE;
+}
+
+template <int IMMEDIATE>
+static void addi_in_place(fields fields, int32_t* registers, uint32_t* pc) {
+    int32_t* rt = &registers[fields.i.rt];
+    *rt = *rt + IMMEDIATE;
+    *pc += WORD_SIZE;
+}
+
+typedef struct {
+    // Indexed by immediate - MIN_SMALL_IMMEDIATE
+    instruction_handler addi_in_place[NUM_SMALL_IMMEDIATES];
+} specialised_tables;
+
+template <size_t... IMMEDIATES>
+static constexpr specialised_tables build_specialised_tables(
+    std::index_sequence<IMMEDIATES...>) {
+    return {{addi_in_place<(int)IMMEDIATES + MIN_SMALL_IMMEDIATE>...}};
+}
+
+static constexpr specialised_tables SPECIALISED_TABLES =
+    build_specialised_tables(std::make_index_sequence<NUM_SMALL_IMMEDIATES>());
+
+void specialize_instruction(instruction* instruct) {
+    const instruction_def* def = find_def(instruct->name);
+    if (def == NULL) return;
+    r_fields r = instruct->_fields.r;
+    i_fields f = instruct->_fields.i;
+    instruct->execute = def->entry.execute;
+    if (is_nop(instruct)) {
+        instruct->execute = skip;
+        return;
+    }
+    switch (instruct->name) {
+        case ADD:
+            if (r.rd == r.rs) instruct->execute = alu_in_place<ADD>;
+            break;
+        case SUB:
+            if (r.rd == r.rs) instruct->execute = alu_in_place<SUB>;
+            break;
+        case AND:
+            if (r.rd == r.rs) instruct->execute = alu_in_place<AND>;
+            break;
+        case OR:
+            if (r.rd == r.rs) instruct->execute = alu_in_place<OR>;
+            break;
+        case NOR:
+            if (r.rd == r.rs) instruct->execute = alu_in_place<NOR>;
+            break;
+        case ADDI:
+            if (f.immediate == 0)
+                instruct->execute = move;
+            else if (f.rt == f.rs && f.immediate >= MIN_SMALL_IMMEDIATE &&
+                     f.immediate < MIN_SMALL_IMMEDIATE + NUM_SMALL_IMMEDIATES)
+                instruct->execute =
+                    SPECIALISED_TABLES
+                        .addi_in_place[f.immediate - MIN_SMALL_IMMEDIATE];
+            break;
+        case ORI:
+            if (f.immediate == 0) instruct->execute = move;
+            break;
+        case ANDI:
+            if (f.immediate == 0) instruct->execute = clear;
+            break;
+        default:
+            break;
+    }
+}
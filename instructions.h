@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "constants.h"
+#include "memory.h"
 #include "types.h"
 
 /**
@@ -20,15 +22,99 @@ unsigned int bit_select(unsigned int num, unsigned int start_bit,
                         unsigned int end_bit);
 
 /**
- * Given MIPS instruction in 32-bit form, determines whether it is R-type or
- * I-type and returns that type
+ * Looks up the decode entry (name, type, operand layout and handler) for a
+ * MIPS instruction in 32-bit form
+ *
+ * The entries come from tables indexed by opcode and funct that are built at
+ * compile time from the constants in constants.h, so this is at most two
+ * indexed loads
+ *
+ * @param instruct
+ * @return const decode_entry* (never NULL; entry->valid is false for
+ * unsupported encodings)
+ */
+const decode_entry* lookup_instruction(uint32_t instruct);
+
+/**
+ * Returns the assembly mnemonic of name, e.g., "addi"
+ *
+ * @param name
+ * @return const char*
+ */
+const char* instruction_mnemonic(instruction_name name);
+
+/**
+ * Returns which fields name reads and writes
+ *
+ * @param name
+ * @return operand_layout
+ */
+operand_layout instruction_layout(instruction_name name);
+
+/**
+ * Returns whether name can change the PC other than by advancing it to the
+ * next instruction (branches, jumps and syscall), i.e., whether it ends a
+ * basic block
+ *
+ * @param name
+ * @return true if name is a control flow instruction, else false
+ */
+bool is_control_flow(instruction_name name);
+
+/**
+ * Returns whether instruct only advances the PC, e.g., sll $0, $0, 0 or
+ * addi $t, $t, 0
+ *
+ * @param instruct
+ * @return true if executing instruct changes nothing but the PC, else false
+ */
+bool is_nop(const instruction* instruct);
+
+/**
+ * Returns whether name loads from or stores to memory (see memory.h)
+ *
+ * @param name
+ * @return true if name is lw, sw, lb, sb, ll or sc, else false
+ */
+bool is_memory_access(instruction_name name);
+
+/**
+ * Returns the register instruct writes, if any
+ *
+ * @param instruct
+ * @return the register number, or NO_DESTINATION
+ */
+uint8_t instruction_destination(const instruction* instruct);
+
+/**
+ * Returns whether executing instruct with registers would halt the program,
+ * i.e., it is a syscall requesting exit ($v0 == EXIT_SYSCALL), or a
+ * breakpoint
+ *
+ * Engines check this before executing a syscall and stop without executing
+ * it, so a halted program's pc stays on the syscall and running it again
+ * executes nothing. Likewise, they stop on a breakpoint until the debugger
+ * that set it executes the instruction (see debug.h)
+ *
+ * @param instruct
+ * @param registers
+ * @return true if the program halts at instruct, else false
+ */
+static inline bool instruction_halts(const instruction* instruct,
+                                     const int32_t* registers) {
+    return (instruct->name == SYSCALL &&
+            registers[V0_REGISTER] == EXIT_SYSCALL) ||
+           instruct->name == BREAKPOINT;
+}
+
+/**
+ * Given MIPS instruction in 32-bit form, determines whether it is R-type,
+ * I-type or J-type and returns that type
  *
- * @note Although J-type MIPS instructions also exist, you need only distinguish
- * between R-type and I-type for this lab
  * @note See [MIPS Cheat
  * Sheet](https://uncch.instructure.com/users/9947/files/4534610?verifier=0lJburrtzSqIT791v3YyAlhY3ZBq0MykyBPR1nY6&wrap=1)
  * @param instruction
- * @return R_TYPE | I_TYPE
+ * @return R_TYPE | I_TYPE | J_TYPE
  */
 instruction_type determine_instruction_type(uint32_t instruct);
 
@@ -47,7 +133,7 @@ instruction_type determine_instruction_type(uint32_t instruct);
  * field, so the constants IMMEDIATE_START_BIT and IMMEDIATE_END_BIT are defined
  * as 15 and 0, respectively
  * @param instruction
- * @return fields*
+ * @return fields* (caller must free)
  */
 fields* create_fields(uint32_t instruct);
 
@@ -60,7 +146,8 @@ fields* create_fields(uint32_t instruct);
  * assigned to instruction.execute, see README.md section Function
  * pointer
  * @param instruction
- * @return SLL | SRA | ADD | SUB | AND | OR | NOR | ADDI | ANDI | ORI
+ * @return SLL | SRA | ADD | SUB | AND | OR | NOR | ADDI | ANDI | ORI | LW | SW
+ * | LB | SB | LL | SC | BEQ | BNE | J | JAL | JR | SYSCALL
  */
 instruction_name determine_instruction_name(uint32_t instruct);
 
@@ -70,7 +157,8 @@ instruction_name determine_instruction_name(uint32_t instruct);
  *
  * Specifically, initializes the struct members _fields and execute
  *
- * @note _fields is initialized using create_fields
+ * @note _fields is initialized the same way as create_fields, but without the
+ * intermediate allocation (see decode_instruction)
  * @note execute is a function pointer that you can set like so: rv->execute =
  * sll (sll is the name of the sll function near the bottom of this file, and rv
  * is the result of malloc(sizeof(instruction)))
@@ -79,6 +167,36 @@ instruction_name determine_instruction_name(uint32_t instruct);
  */
 instruction* create_instruction(uint32_t instruct);
 
+/**
+ * Decodes a 32-bit MIPS instruction into the caller-provided instruction
+ * struct (_fields, name and execute), without allocating
+ *
+ * This is what create_instruction and create_program use, so a whole program
+ * can be decoded once into a contiguous array instead of allocating an
+ * instruction on every step
+ *
+ * @param instruct
+ * @param out instruction to initialize
+ */
+void decode_instruction(uint32_t instruct, instruction* out);
+
+/**
+ * Replaces instruct's handler with one specialised for its operands, if
+ * there is one: R-type ALU instructions whose rd is also rs, addi $t, $t, k
+ * for small k, moves and clears (addi, ori or andi with immediate 0), and
+ * nops (see is_nop)
+ *
+ * A specialised handler executes the same way as the general one, but
+ * extracts fewer fields and does no work whose result it already knows.
+ * create_program specialises every instruction it decodes; decode_instruction
+ * and create_instruction always give the general handler (e.g., add). Call
+ * this again after changing instruct's fields, since its handler may depend
+ * on them
+ *
+ * @param instruct decoded (see decode_instruction)
+ */
+void specialize_instruction(instruction* instruct);
+
 /**
  * Executes the given instruction, mutating pc and probably registers
  *
@@ -107,9 +225,8 @@ void execute_instruction(instruction* instruct, int32_t* registers,
  * Before the function is called, pc is the address of the instruction to be
  * executed
  * When the function returns, pc should be the address of the next
- * instruction to be executed, which is *pc + WORD_SIZE for all instructions in
- * this lab because there aren't control flow instructions
- * But if there were control flow instructions, this would not be the case
+ * instruction to be executed, which is *pc + WORD_SIZE for all instructions
+ * except the control flow ones (branches, jumps and syscall) at the end
  */
 
 void sll(fields fields, int32_t* registers, uint32_t* pc);
@@ -126,4 +243,22 @@ void addi(fields fields, int32_t* registers, uint32_t* pc);
 void andi(fields fields, int32_t* registers, uint32_t* pc);
 void ori(fields fields, int32_t* registers, uint32_t* pc);
 
+// Memory instructions access bound_memory, which must be set (see
+// memory_bind)
+void lw(fields fields, int32_t* registers, uint32_t* pc);
+void sw(fields fields, int32_t* registers, uint32_t* pc);
+void lb(fields fields, int32_t* registers, uint32_t* pc);
+void sb(fields fields, int32_t* registers, uint32_t* pc);
+// sc sets rt to 1 if it stored, else 0 (see memory_store_conditional)
+void ll(fields fields, int32_t* registers, uint32_t* pc);
+void sc(fields fields, int32_t* registers, uint32_t* pc);
+
+void beq(fields fields, int32_t* registers, uint32_t* pc);
+void bne(fields fields, int32_t* registers, uint32_t* pc);
+void j(fields fields, int32_t* registers, uint32_t* pc);
+void jal(fields fields, int32_t* registers, uint32_t* pc);
+void jr(fields fields, int32_t* registers, uint32_t* pc);
+// Can't name this "syscall" because unistd.h declares a function by that name
+void syscall_op(fields fields, int32_t* registers, uint32_t* pc);
+
 #endif  // INSTRUCTIONS_H
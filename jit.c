@@ -0,0 +1,477 @@
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "instructions.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+bool jit_supports(instruction_name name) {
+    switch (name) {
+        case SLL:
+        case SRA:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case NOR:
+        case ADDI:
+        case ANDI:
+        case ORI:
+            return true;
+        default:
+            return false;
+    }
+}
+
+#if defined(__x86_64__)
+
+// Host register numbers as encoded in ModRM and REX
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// Block functions are called as void block(int32_t* registers), so (System V
+// ABI) rdi holds the guest register array. rax is the scratch register. The
+// rest can hold guest registers, caller-saved ones first
+static const uint8_t ALLOCATABLE[] = {RCX, RDX, RSI, R8,  R9,  R10, R11,
+                                      RBX, RBP, R12, R13, R14, R15};
+
+#define NUM_ALLOCATABLE (sizeof(ALLOCATABLE) / sizeof(ALLOCATABLE[0]))
+#define NOT_ALLOCATED 0xff
+
+// Opcodes for "op r32, r/m32" and "mov r/m32, r32"
+#define OP_MOV_LOAD 0x8b
+#define OP_MOV_STORE 0x89
+#define OP_ADD 0x03
+#define OP_SUB 0x2b
+#define OP_AND 0x23
+#define OP_OR 0x0b
+// Group opcodes, with the operation selected by the ModRM reg field
+#define OP_GROUP1_IMM32 0x81
+#define OP_GROUP1_IMM8 0x83
+#define GROUP1_ADD 0
+#define GROUP1_OR 1
+#define GROUP1_AND 4
+#define OP_GROUP2_IMM8 0xc1
+#define GROUP2_SHL 4
+#define GROUP2_SAR 7
+#define OP_GROUP3 0xf7
+#define GROUP3_NOT 2
+
+// Upper bounds used to size the code buffer: the longest sequence emitted for
+// one guest instruction, and for one block's prologue and epilogue
+#define MAX_BYTES_PER_INSTRUCTION 32
+#define MAX_BYTES_PER_BLOCK \
+    (2 * NUM_REGISTERS * 4 + 2 * NUM_ALLOCATABLE * 2 + 1)
+
+typedef struct {
+    uint8_t* code;
+    size_t size;
+} code_buffer;
+
+// Where a guest register lives inside a block: in host register host, or (if
+// host is NOT_ALLOCATED) in memory at [rdi + guest * 4]
+typedef struct {
+    uint8_t host;
+    uint8_t guest;
+} location;
+
+static void emit_byte(code_buffer* buf, uint8_t byte) {
+    buf->code[buf->size++] = byte;
+}
+
+static void emit_u32(code_buffer* buf, uint32_t value) {
+    memcpy(&buf->code[buf->size], &value, sizeof(value));
+    buf->size += sizeof(value);
+}
+
+static bool is_callee_saved(uint8_t host) {
+    return host == RBX || host == RBP || host >= R12;
+}
+
+static void emit_push(code_buffer* buf, uint8_t host) {
+    if (host >= R8) emit_byte(buf, 0x41);
+    emit_byte(buf, 0x50 | (host & 7));
+}
+
+static void emit_pop(code_buffer* buf, uint8_t host) {
+    if (host >= R8) emit_byte(buf, 0x41);
+    emit_byte(buf, 0x58 | (host & 7));
+}
+
+// Emits opcode with ModRM reg field reg and r/m operand loc
+static void emit_rm(code_buffer* buf, uint8_t opcode, uint8_t reg,
+                    location loc) {
+    bool in_host = loc.host != NOT_ALLOCATED;
+    uint8_t rex = 0x40 | (reg >= R8 ? 0x04 : 0) |
+                  (in_host && loc.host >= R8 ? 0x01 : 0);
+    if (rex != 0x40) emit_byte(buf, rex);
+    emit_byte(buf, opcode);
+    if (in_host) {
+        emit_byte(buf, 0xc0 | (reg & 7) << 3 | (loc.host & 7));
+    } else {
+        // [rdi + disp8]; guest * 4 is at most 124, so disp8 always fits
+        emit_byte(buf, 0x40 | (reg & 7) << 3 | RDI);
+        emit_byte(buf, loc.guest * WORD_SIZE);
+    }
+}
+
+static location host_location(uint8_t host) {
+    location loc = {host, 0};
+    return loc;
+}
+
+static location memory_location(uint8_t guest) {
+    location loc = {NOT_ALLOCATED, guest};
+    return loc;
+}
+
+static bool same_location(location a, location b) {
+    if (a.host != NOT_ALLOCATED || b.host != NOT_ALLOCATED)
+        return a.host == b.host;
+    return a.guest == b.guest;
+}
+
+// Emits mov host, loc unless loc already is host
+static void emit_load(code_buffer* buf, uint8_t host, location loc) {
+    if (!same_location(host_location(host), loc))
+        emit_rm(buf, OP_MOV_LOAD, host, loc);
+}
+
+// Emits op host, imm (group 1), using the imm8 form when imm fits
+static void emit_group1_imm(code_buffer* buf, uint8_t ext, uint8_t host,
+                            int32_t imm) {
+    if (imm >= -128 && imm <= 127) {
+        emit_rm(buf, OP_GROUP1_IMM8, ext, host_location(host));
+        emit_byte(buf, (uint8_t)imm);
+    } else {
+        emit_rm(buf, OP_GROUP1_IMM32, ext, host_location(host));
+        emit_u32(buf, (uint32_t)imm);
+    }
+}
+
+// Returns which guest registers instruct reads and which one it writes
+static void operands(const instruction* instruct, uint8_t* reads,
+                     int* num_reads, uint8_t* write) {
+    r_fields r = instruct->_fields.r;
+    i_fields i = instruct->_fields.i;
+    switch (instruct->name) {
+        case SLL:
+        case SRA:
+            reads[0] = r.rt;
+            *num_reads = 1;
+            *write = r.rd;
+            break;
+        case ADDI:
+        case ANDI:
+        case ORI:
+            reads[0] = i.rs;
+            *num_reads = 1;
+            *write = i.rt;
+            break;
+        default:
+            reads[0] = r.rs;
+            reads[1] = r.rt;
+            *num_reads = 2;
+            *write = r.rd;
+            break;
+    }
+}
+
+// Emits dst = a op b for a three-register ALU instruction
+static void emit_alu(code_buffer* buf, uint8_t opcode, bool commutative,
+                     bool invert, location dst, location a, location b) {
+    uint8_t target = dst.host;
+    if (target != NOT_ALLOCATED && commutative && same_location(dst, b)) {
+        location tmp = a;
+        a = b;
+        b = tmp;
+    }
+    // If dst is b (and the operation isn't commutative), or dst is in memory,
+    // compute into the scratch register first
+    if (target == NOT_ALLOCATED ||
+        (same_location(dst, b) && !same_location(dst, a)))
+        target = RAX;
+    emit_load(buf, target, a);
+    emit_rm(buf, opcode, target, b);
+    if (invert) emit_rm(buf, OP_GROUP3, GROUP3_NOT, host_location(target));
+    if (target != dst.host) emit_rm(buf, OP_MOV_STORE, target, dst);
+}
+
+static void emit_instruction(code_buffer* buf, const instruction* instruct,
+                             const uint8_t* allocation) {
+#define LOCATION(guest)                                          \
+    (allocation[guest] == NOT_ALLOCATED ? memory_location(guest) \
+                                        : host_location(allocation[guest]))
+    r_fields r = instruct->_fields.r;
+    i_fields i = instruct->_fields.i;
+    switch (instruct->name) {
+        case ADD:
+            emit_alu(buf, OP_ADD, true, false, LOCATION(r.rd), LOCATION(r.rt),
+                     LOCATION(r.rs));
+            return;
+        case SUB:
+            emit_alu(buf, OP_SUB, false, false, LOCATION(r.rd), LOCATION(r.rs),
+                     LOCATION(r.rt));
+            return;
+        case AND:
+            emit_alu(buf, OP_AND, true, false, LOCATION(r.rd), LOCATION(r.rt),
+                     LOCATION(r.rs));
+            return;
+        case OR:
+            emit_alu(buf, OP_OR, true, false, LOCATION(r.rd), LOCATION(r.rt),
+                     LOCATION(r.rs));
+            return;
+        case NOR:
+            emit_alu(buf, OP_OR, true, true, LOCATION(r.rd), LOCATION(r.rt),
+                     LOCATION(r.rs));
+            return;
+        default:
+            break;
+    }
+
+    // The remaining instructions are dst = src op constant
+    location dst, src;
+    if (instruct->name == SLL || instruct->name == SRA) {
+        dst = LOCATION(r.rd);
+        src = LOCATION(r.rt);
+    } else {
+        dst = LOCATION(i.rt);
+        src = LOCATION(i.rs);
+    }
+#undef LOCATION
+    uint8_t target = dst.host == NOT_ALLOCATED ? RAX : dst.host;
+    emit_load(buf, target, src);
+    switch (instruct->name) {
+        case SLL:
+        case SRA:
+            emit_rm(buf, OP_GROUP2_IMM8,
+                    instruct->name == SLL ? GROUP2_SHL : GROUP2_SAR,
+                    host_location(target));
+            emit_byte(buf, r.shamt);
+            break;
+        case ADDI:
+            emit_group1_imm(buf, GROUP1_ADD, target, i.immediate);
+            break;
+        case ANDI:
+            emit_group1_imm(buf, GROUP1_AND, target, i.immediate);
+            break;
+        case ORI:
+            emit_group1_imm(buf, GROUP1_OR, target, i.immediate);
+            break;
+        default:
+            break;
+    }
+    if (target != dst.host) emit_rm(buf, OP_MOV_STORE, target, dst);
+}
+
+// Compiles instructions [start, start + length) into a native function
+static void compile_block(code_buffer* buf, const instruction* decoded,
+                          uint32_t start, uint32_t length) {
+    // Count uses of each guest register, and whether its first use in the
+    // block is a read (in which case it must be loaded on entry)
+    uint32_t uses[NUM_REGISTERS] = {0};
+    bool read_first[NUM_REGISTERS] = {false};
+    bool written[NUM_REGISTERS] = {false};
+    for (uint32_t i = start; i < start + length; i++) {
+        uint8_t reads[2], write;
+        int num_reads;
+        operands(&decoded[i], reads, &num_reads, &write);
+        for (int j = 0; j < num_reads; j++) {
+            if (uses[reads[j]]++ == 0) read_first[reads[j]] = true;
+        }
+        uses[write]++;
+        written[write] = true;
+    }
+
+    // Give the most used guest registers a host register. A register used
+    // only once gains nothing from being cached
+    uint8_t allocation[NUM_REGISTERS];
+    memset(allocation, NOT_ALLOCATED, sizeof(allocation));
+    for (unsigned int k = 0; k < NUM_ALLOCATABLE; k++) {
+        int best = -1;
+        for (int g = 0; g < NUM_REGISTERS; g++) {
+            if (allocation[g] == NOT_ALLOCATED && uses[g] >= 2 &&
+                (best < 0 || uses[g] > uses[best]))
+                best = g;
+        }
+        if (best < 0) break;
+        allocation[best] = ALLOCATABLE[k];
+    }
+
+    for (unsigned int k = 0; k < NUM_ALLOCATABLE; k++) {
+        bool used = false;
+        for (int g = 0; g < NUM_REGISTERS; g++)
+            used |= allocation[g] == ALLOCATABLE[k];
+        if (used && is_callee_saved(ALLOCATABLE[k]))
+            emit_push(buf, ALLOCATABLE[k]);
+    }
+    for (int g = 0; g < NUM_REGISTERS; g++) {
+        if (allocation[g] != NOT_ALLOCATED && read_first[g])
+            emit_rm(buf, OP_MOV_LOAD, allocation[g], memory_location(g));
+    }
+
+    for (uint32_t i = start; i < start + length; i++)
+        emit_instruction(buf, &decoded[i], allocation);
+
+    // Block exit: write back cached registers, restore callee-saved ones
+    for (int g = 0; g < NUM_REGISTERS; g++) {
+        if (allocation[g] != NOT_ALLOCATED && written[g])
+            emit_rm(buf, OP_MOV_STORE, allocation[g], memory_location(g));
+    }
+    for (int k = NUM_ALLOCATABLE - 1; k >= 0; k--) {
+        bool used = false;
+        for (int g = 0; g < NUM_REGISTERS; g++)
+            used |= allocation[g] == ALLOCATABLE[k];
+        if (used && is_callee_saved(ALLOCATABLE[k]))
+            emit_pop(buf, ALLOCATABLE[k]);
+    }
+    emit_byte(buf, 0xc3);  // ret
+}
+
+// Sets is_target[i] for every instruction i that a beq, bne, j or jal in prog
+// can jump to. jr targets aren't known until run time
+static void mark_branch_targets(const program* prog, bool* is_target) {
+    for (uint32_t k = 0; k < prog->num_instructions; k++) {
+        const instruction* instruct = &prog->decoded[k];
+        uint32_t next_pc = (k + 1) * WORD_SIZE, target;
+        switch (instruct->name) {
+            case BEQ:
+            case BNE:
+                target = next_pc +
+                         ((uint32_t)(int32_t)instruct->_fields.i.immediate << 2);
+                break;
+            case J:
+            case JAL:
+                target = (next_pc & JUMP_REGION_MASK) |
+                         ((uint32_t)instruct->_fields.j.target << 2);
+                break;
+            default:
+                continue;
+        }
+        if (target / WORD_SIZE < prog->num_instructions)
+            is_target[target / WORD_SIZE] = true;
+    }
+}
+
+jit_program* jit_compile(const program* prog) {
+    const uint32_t n = prog->num_instructions;
+    jit_program* jit = (jit_program*)calloc(1, sizeof(jit_program));
+    if (jit == NULL) return NULL;
+    jit->entry = (void (**)(int32_t*))calloc(n + 1, sizeof(*jit->entry));
+    jit->length = (uint32_t*)calloc(n + 1, sizeof(uint32_t));
+    if (jit->entry == NULL || jit->length == NULL) {
+        jit_free(jit);
+        return NULL;
+    }
+
+    // Split the program into blocks. Blocks also end before every static
+    // branch and jump target, so a loop enters its body at a block start
+    bool* is_target = (bool*)calloc(n + 1, sizeof(bool));
+    if (is_target == NULL) {
+        jit_free(jit);
+        return NULL;
+    }
+    mark_branch_targets(prog, is_target);
+    uint32_t num_blocks = 0;
+    for (uint32_t i = 0; i < n;) {
+        if (!jit_supports(prog->decoded[i].name)) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        do {
+            i++;
+        } while (i < n && i - start < JIT_MAX_BLOCK_LENGTH &&
+                 jit_supports(prog->decoded[i].name) && !is_target[i]);
+        jit->length[start] = i - start;
+        num_blocks++;
+    }
+    free(is_target);
+
+    jit->code_size = (size_t)n * MAX_BYTES_PER_INSTRUCTION +
+                     (size_t)num_blocks * MAX_BYTES_PER_BLOCK + 1;
+    void* code = mmap(NULL, jit->code_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        jit->code_size = 0;
+        jit_free(jit);
+        return NULL;
+    }
+    jit->code = (uint8_t*)code;
+
+    code_buffer buf = {jit->code, 0};
+    for (uint32_t i = 0; i < n; i++) {
+        if (jit->length[i] == 0) continue;
+        jit->entry[i] = (void (*)(int32_t*))(jit->code + buf.size);
+        compile_block(&buf, prog->decoded, i, jit->length[i]);
+    }
+
+    // Map the code executable, and no longer writable, before running it
+    if (mprotect(jit->code, jit->code_size, PROT_READ | PROT_EXEC) != 0) {
+        jit_free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_free(jit_program* jit) {
+    if (jit == NULL) return;
+    if (jit->code != NULL) munmap(jit->code, jit->code_size);
+    free(jit->entry);
+    free(jit->length);
+    free(jit);
+}
+
+#else  // !defined(__x86_64__)
+
+jit_program* jit_compile(const program* prog) { return NULL; }
+
+void jit_free(jit_program* jit) {}
+
+#endif  // defined(__x86_64__)
+
+uint64_t run_jit(program* prog, int32_t* registers, uint32_t* pc,
+                 uint64_t max_steps) {
+    if (prog->jit == NULL) prog->jit = jit_compile(prog);
+    const jit_program* jit = prog->jit;
+    if (jit == NULL) return run_interpreter(prog, registers, pc, max_steps);
+
+    const uint32_t end_pc = prog->num_instructions * WORD_SIZE;
+    uint64_t steps = 0;
+    while (steps < max_steps && (*pc) < end_pc && (*pc) % WORD_SIZE == 0) {
+        uint32_t i = (*pc) >> 2;
+        uint32_t length = jit->length[i];
+        if (length != 0 && length <= max_steps - steps) {
+            jit->entry[i](registers);
+            *pc += length * WORD_SIZE;
+            steps += length;
+        } else {
+            const instruction* instruct = &prog->decoded[i];
+            if (instruction_halts(instruct, registers)) break;
+            instruct->execute(instruct->_fields, registers, pc);
+            steps++;
+        }
+    }
+    return steps;
+}
@@ -0,0 +1,75 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "program.h"
+
+// Longest run of guest instructions compiled into a single native block
+#define JIT_MAX_BLOCK_LENGTH 1024
+
+/**
+ * Native code for a program, produced by jit_compile
+ *
+ * The program is split into blocks: maximal runs (up to JIT_MAX_BLOCK_LENGTH)
+ * of instructions the JIT supports that no branch or jump targets except at
+ * the start. entry[i] is the native function for the
+ * block starting at instruction i (NULL if no block starts there) and
+ * length[i] is the number of instructions in it
+ */
+struct jit_program {
+    uint8_t* code;
+    size_t code_size;
+    void (**entry)(int32_t* registers);
+    uint32_t* length;
+};
+
+/**
+ * Returns whether the JIT can generate native code for name
+ *
+ * Instructions that are not supported are run by the interpreter
+ *
+ * @param name
+ * @return true if supported, else false
+ */
+bool jit_supports(instruction_name name);
+
+/**
+ * Compiles every block of prog into x86-64 machine code in an mmap'd buffer
+ *
+ * Within a block, the most used guest registers are kept in host registers and
+ * are only written back to the registers array when the block exits
+ *
+ * @param prog
+ * @return jit_program* (free with jit_free), or NULL if the host is not x86-64
+ * or executable memory could not be mapped
+ */
+jit_program* jit_compile(const program* prog);
+
+/**
+ * Frees a jit_program created by jit_compile
+ *
+ * @param jit may be NULL
+ */
+void jit_free(jit_program* jit);
+
+/**
+ * Executes prog using native code for each block, compiling prog on first use
+ * (the result is cached in prog->jit)
+ *
+ * Same semantics as run_engine. Instructions outside of a block, and blocks
+ * longer than the remaining step budget, are run by the interpreter. If
+ * compilation is not possible, the whole program is run by the interpreter
+ *
+ * @param prog
+ * @param registers
+ * @param pc
+ * @param max_steps
+ * @return number of instructions executed
+ */
+uint64_t run_jit(program* prog, int32_t* registers, uint32_t* pc,
+                 uint64_t max_steps);
+
+#endif  // JIT_H
@@ -0,0 +1,467 @@
+#include "lockstep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "instructions.h"
+#include "memory.h"
+#include "parallel.h"
+
+lockstep_state* create_lockstep_state(uint32_t num_contexts) {
+    if (num_contexts > UINT32_MAX - LOCKSTEP_LANE_MULTIPLE) return NULL;
+    lockstep_state* state = (lockstep_state*)malloc(sizeof(lockstep_state));
+    if (state == NULL) return NULL;
+    state->num_contexts = num_contexts;
+    state->stride = (num_contexts + LOCKSTEP_LANE_MULTIPLE - 1) /
+                    LOCKSTEP_LANE_MULTIPLE * LOCKSTEP_LANE_MULTIPLE;
+    // A multiple of LOCKSTEP_LANE_MULTIPLE lanes, which is a multiple of 64
+    // bytes, as aligned_alloc requires
+    size_t size = (size_t)NUM_REGISTERS * state->stride * sizeof(int32_t);
+    if (size == 0) size = LOCKSTEP_LANE_MULTIPLE * sizeof(int32_t);
+    state->registers = (int32_t*)aligned_alloc(PROGRAM_ALIGNMENT, size);
+    if (state->registers == NULL) {
+        free(state);
+        return NULL;
+    }
+    memset(state->registers, 0, size);
+    // + 1 so that no contexts is still a non-NULL allocation
+    state->pcs = (uint32_t*)malloc(((size_t)num_contexts + 1) * sizeof(uint32_t));
+    state->memories = (guest_memory**)calloc((size_t)num_contexts + 1,
+                                             sizeof(guest_memory*));
+    if (state->pcs == NULL || state->memories == NULL) {
+        free(state->pcs);
+        free(state->memories);
+        free(state->registers);
+        free(state);
+        return NULL;
+    }
+    state->out_of_memory = false;
+    for (uint32_t c = 0; c < num_contexts; c++) state->pcs[c] = INITIAL_PC;
+    return state;
+}
+
+void free_lockstep_state(lockstep_state* state) {
+    if (state == NULL) return;
+    for (uint32_t c = 0; c < state->num_contexts; c++)
+        free_memory(state->memories[c]);
+    free(state->memories);
+    free(state->registers);
+    free(state->pcs);
+    free(state);
+}
+
+void lockstep_set_context(lockstep_state* state, uint32_t context,
+                          const int32_t* registers) {
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        state->registers[(size_t)r * state->stride + context] = registers[r];
+}
+
+void lockstep_get_context(const lockstep_state* state, uint32_t context,
+                          int32_t* registers) {
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        registers[r] = state->registers[(size_t)r * state->stride + context];
+}
+
+// Parses one line of a states file into registers, see load_lockstep_states
+static bool parse_state_line(const char* line, int32_t* registers) {
+    memset(registers, 0, NUM_REGISTERS * sizeof(int32_t));
+    int num_values = 0;
+    const char* p = line;
+    while (true) {
+        while (*p == ' ' || *p == '\t' || *p == ',' || *p == '[' ||
+               *p == ']' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p == '\0') return true;
+        if (num_values == NUM_REGISTERS) return false;
+        char* end;
+        long long value = strtoll(p, &end, 0);
+        if (end == p || value < INT32_MIN || value > (long long)UINT32_MAX)
+            return false;
+        registers[num_values++] = (int32_t)(uint32_t)value;
+        p = end;
+    }
+}
+
+image_status load_lockstep_states(const char* path, lockstep_state** state) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return IMAGE_OPEN_FAILED;
+
+    // Contexts are read in row (array of structs) form, then transposed
+    int32_t* contexts = NULL;
+    size_t num_contexts = 0, capacity = 0;
+    image_status status = IMAGE_OK;
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, file) != -1) {
+        const char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        if (num_contexts == UINT32_MAX - LOCKSTEP_LANE_MULTIPLE) {
+            status = IMAGE_TOO_LARGE;
+            break;
+        }
+        if (num_contexts == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            int32_t* grown = (int32_t*)realloc(
+                contexts, capacity * NUM_REGISTERS * sizeof(int32_t));
+            if (grown == NULL) {
+                status = IMAGE_NO_MEMORY;
+                break;
+            }
+            contexts = grown;
+        }
+        if (!parse_state_line(p, contexts + num_contexts * NUM_REGISTERS)) {
+            status = IMAGE_BAD_FORMAT;
+            break;
+        }
+        num_contexts++;
+    }
+    free(line);
+    fclose(file);
+
+    if (status == IMAGE_OK) {
+        *state = create_lockstep_state((uint32_t)num_contexts);
+        if (*state == NULL) status = IMAGE_NO_MEMORY;
+    }
+    if (status == IMAGE_OK)
+        for (size_t c = 0; c < num_contexts; c++)
+            lockstep_set_context(*state, (uint32_t)c,
+                                 contexts + c * NUM_REGISTERS);
+    free(contexts);
+    return status;
+}
+
+// GCC vector types (https://gcc.gnu.org/onlinedocs/gcc/Vector-Extensions.html)
+// for each lockstep_isa. Arithmetic on them compiles to one instruction per
+// vector when the enclosing function is built for the matching target
+typedef uint32_t u32x1;
+typedef int32_t i32x1;
+typedef uint32_t u32x8 __attribute__((vector_size(32), may_alias));
+typedef int32_t i32x8 __attribute__((vector_size(32), may_alias));
+typedef uint32_t u32x16 __attribute__((vector_size(64), may_alias));
+typedef int32_t i32x16 __attribute__((vector_size(64), may_alias));
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LOCKSTEP_HAS_VECTOR_ISAS 1
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+#else
+#define LOCKSTEP_HAS_VECTOR_ISAS 0
+#endif
+
+/**
+ * Defines a function NAME that runs straight-line instructions [begin, end) on
+ * num_lanes
+ * lanes, starting at regs (register r's lanes start at regs + r * stride),
+ * using U and S (unsigned and signed vectors of the same width) for each
+ * group of lanes
+ *
+ * Uses the same arithmetic as run_threaded in engine.c: shifts and add/sub are
+ * done unsigned, and immediates are sign extended
+ */
+#define DEFINE_RUN_TILE(NAME, TARGET, U, S)                                   \
+    TARGET static void NAME(const instruction* begin, const instruction* end, \
+                            int32_t* regs, size_t stride, size_t num_lanes) { \
+        const size_t n = num_lanes / (sizeof(U) / sizeof(uint32_t));          \
+        for (const instruction* instruct = begin; instruct < end;             \
+             instruct++) {                                                    \
+            r_fields r = instruct->_fields.r;                                 \
+            i_fields f = instruct->_fields.i;                                 \
+            U* rd = (U*)(regs + r.rd * stride);                               \
+            const U* rs = (const U*)(regs + r.rs * stride);                   \
+            const U* rt = (const U*)(regs + r.rt * stride);                   \
+            U* it = (U*)(regs + f.rt * stride);                               \
+            const U* is = (const U*)(regs + f.rs * stride);                   \
+            const uint32_t immediate = (uint32_t)(int32_t)f.immediate;        \
+            switch (instruct->name) {                                         \
+                case SLL:                                                     \
+                    for (size_t k = 0; k < n; k++) rd[k] = rt[k] << r.shamt;  \
+                    break;                                                    \
+                case SRA:                                                     \
+                    for (size_t k = 0; k < n; k++)                            \
+                        rd[k] = (U)((S)rt[k] >> r.shamt);                     \
+                    break;                                                    \
+                case ADD:                                                     \
+                    for (size_t k = 0; k < n; k++) rd[k] = rt[k] + rs[k];     \
+                    break;                                                    \
+                case SUB:                                                     \
+                    for (size_t k = 0; k < n; k++) rd[k] = rs[k] - rt[k];     \
+                    break;                                                    \
+                case AND:                                                     \
+                    for (size_t k = 0; k < n; k++) rd[k] = rt[k] & rs[k];     \
+                    break;                                                    \
+                case OR:                                                      \
+                    for (size_t k = 0; k < n; k++) rd[k] = rt[k] | rs[k];     \
+                    break;                                                    \
+                case NOR:                                                     \
+                    for (size_t k = 0; k < n; k++) rd[k] = ~(rt[k] | rs[k]);  \
+                    break;                                                    \
+                case ADDI:                                                    \
+                    for (size_t k = 0; k < n; k++) it[k] = is[k] + immediate; \
+                    break;                                                    \
+                case ANDI:                                                    \
+                    for (size_t k = 0; k < n; k++) it[k] = is[k] & immediate; \
+                    break;                                                    \
+                case ORI:                                                     \
+                    for (size_t k = 0; k < n; k++) it[k] = is[k] | immediate; \
+                    break;                                                    \
+                default:                                                      \
+                    break;                                                    \
+            }                                                                 \
+        }                                                                     \
+    }
+
+DEFINE_RUN_TILE(run_tile_scalar, , u32x1, i32x1)
+#if LOCKSTEP_HAS_VECTOR_ISAS
+DEFINE_RUN_TILE(run_tile_avx2, AVX2_TARGET, u32x8, i32x8)
+DEFINE_RUN_TILE(run_tile_avx512, AVX512_TARGET, u32x16, i32x16)
+#endif
+#undef DEFINE_RUN_TILE
+
+bool lockstep_supports(lockstep_isa isa) {
+    switch (isa) {
+        case LOCKSTEP_SCALAR:
+            return true;
+#if LOCKSTEP_HAS_VECTOR_ISAS
+        case LOCKSTEP_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case LOCKSTEP_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+lockstep_isa lockstep_best_isa(void) {
+    if (lockstep_supports(LOCKSTEP_AVX512)) return LOCKSTEP_AVX512;
+    if (lockstep_supports(LOCKSTEP_AVX2)) return LOCKSTEP_AVX2;
+    return LOCKSTEP_SCALAR;
+}
+
+typedef struct {
+    const program* prog;
+    lockstep_state* state;
+    uint64_t max_steps;
+    // Whether prog has memory instructions, i.e., contexts need memory
+    bool uses_memory;
+    void (*run_tile)(const instruction* begin, const instruction* end,
+                     int32_t* regs, size_t stride, size_t num_lanes);
+    // Summed over contexts, added to by every thread
+    uint64_t steps;
+} lockstep_job;
+
+// Computes where the control flow instruct at pc sends one context (whose
+// register r is regs[r * stride]), and whether it halts there instead
+static bool next_pc(const instruction* instruct, const int32_t* regs,
+                    size_t stride, uint32_t pc, uint32_t* next) {
+    i_fields f = instruct->_fields.i;
+    uint32_t offset = (uint32_t)(int32_t)f.immediate << 2;
+    uint32_t jump = ((pc + WORD_SIZE) & JUMP_REGION_MASK) |
+                    ((uint32_t)instruct->_fields.j.target << 2);
+    *next = pc + WORD_SIZE;
+    switch (instruct->name) {
+        case BEQ:
+            if (regs[f.rs * stride] == regs[f.rt * stride]) *next += offset;
+            return false;
+        case BNE:
+            if (regs[f.rs * stride] != regs[f.rt * stride]) *next += offset;
+            return false;
+        case J:
+        case JAL:
+            *next = jump;
+            return false;
+        case JR:
+            *next = (uint32_t)regs[instruct->_fields.r.rs * stride];
+            return false;
+        default:
+            // syscall
+            return regs[V0_REGISTER * stride] == EXIT_SYSCALL;
+    }
+}
+
+// Returns the memory of context, creating it on first use
+static guest_memory* context_memory(lockstep_state* state, size_t context) {
+    if (state->memories[context] == NULL) {
+        state->memories[context] = create_memory(false);
+        if (state->memories[context] == NULL)
+            __atomic_store_n(&state->out_of_memory, true, __ATOMIC_RELAXED);
+    }
+    return state->memories[context];
+}
+
+// Runs one context on its own from pc for at most max_steps instructions and
+// returns the number executed. Safe to call on several threads at once since
+// run_threaded doesn't modify prog
+static uint64_t run_context_alone(const lockstep_job* job, size_t context,
+                                  uint32_t pc, uint64_t max_steps) {
+    guest_memory* mem = NULL;
+    if (job->uses_memory) {
+        mem = context_memory(job->state, context);
+        // state->out_of_memory is set
+        if (mem == NULL) return 0;
+    }
+    int32_t registers[NUM_REGISTERS];
+    lockstep_get_context(job->state, (uint32_t)context, registers);
+    guest_memory* previous = memory_bind(mem);
+    uint64_t steps = run_threaded(job->prog, registers, &pc, max_steps);
+    memory_bind(previous);
+    lockstep_set_context(job->state, (uint32_t)context, registers);
+    job->state->pcs[context] = pc;
+    return steps;
+}
+
+// Runs a memory instruction for each of the contexts [first, first +
+// num_contexts) (whose registers start at regs)
+static void run_memory_access(lockstep_state* state, const instruction* instruct,
+                              int32_t* regs, size_t first,
+                              size_t num_contexts) {
+    const size_t stride = state->stride;
+    i_fields f = instruct->_fields.i;
+    for (size_t k = 0; k < num_contexts; k++) {
+        guest_memory* mem = context_memory(state, first + k);
+        if (mem == NULL) continue;
+        uint32_t address = (uint32_t)regs[f.rs * stride + k] + f.immediate;
+        int32_t* rt = &regs[f.rt * stride + k];
+        switch (instruct->name) {
+            case LW:
+                *rt = memory_load_word(mem, address);
+                break;
+            case SW:
+                memory_store_word(mem, address, *rt);
+                break;
+            case LB:
+                *rt = (int8_t)memory_load_byte(mem, address);
+                break;
+            default:
+                memory_store_byte(mem, address, (uint8_t)*rt);
+                break;
+        }
+    }
+}
+
+// Finishes each of the contexts [first, first + num_contexts), which have all
+// executed steps instructions and reached pc together, on its own
+static uint64_t finish_contexts_alone(const lockstep_job* job, size_t first,
+                                      size_t num_contexts, uint32_t pc,
+                                      uint64_t steps) {
+    uint64_t total = steps * num_contexts;
+    for (size_t k = 0; k < num_contexts; k++)
+        total += run_context_alone(job, first + k, pc, job->max_steps - steps);
+    return total;
+}
+
+// Runs the contexts in [first, first + num_lanes) of one tile, all starting
+// at pc, and returns the number of instructions executed summed over them
+static uint64_t run_tile_contexts(const lockstep_job* job, size_t first,
+                                  size_t num_lanes, size_t num_contexts,
+                                  uint32_t pc) {
+    const program* prog = job->prog;
+    const size_t stride = job->state->stride;
+    int32_t* regs = job->state->registers + first;
+    uint64_t steps = 0;
+
+    // While every context takes the same path, straight-line runs execute as
+    // vectors. Memory accesses (each context has its own memory) and control
+    // flow instructions are run for each context
+    while (steps < job->max_steps && pc % WORD_SIZE == 0 &&
+           pc / WORD_SIZE < prog->num_instructions) {
+        const uint32_t i = pc / WORD_SIZE;
+        uint32_t end = i;
+        while (end < prog->num_instructions &&
+               end - i < job->max_steps - steps &&
+               !is_control_flow(prog->decoded[end].name) &&
+               !is_memory_access(prog->decoded[end].name))
+            end++;
+        if (end > i) {
+            job->run_tile(prog->decoded + i, prog->decoded + end, regs, stride,
+                          num_lanes);
+            steps += end - i;
+            pc = end * WORD_SIZE;
+            continue;
+        }
+
+        const instruction* instruct = &prog->decoded[i];
+        // The reservation of ll and sc is per thread, not per context (see
+        // bound_reservation), so contexts that use them run on their own
+        if (instruct->name == LL || instruct->name == SC)
+            return finish_contexts_alone(job, first, num_contexts, pc, steps);
+        if (is_memory_access(instruct->name)) {
+            run_memory_access(job->state, instruct, regs, first, num_contexts);
+            steps++;
+            pc += WORD_SIZE;
+            continue;
+        }
+        uint32_t next;
+        bool halts = next_pc(instruct, regs, stride, pc, &next);
+        bool diverged = false;
+        for (size_t k = 1; k < num_contexts && !diverged; k++) {
+            uint32_t lane_next;
+            diverged = next_pc(instruct, regs + k, stride, pc, &lane_next) !=
+                           halts ||
+                       lane_next != next;
+        }
+        if (diverged)
+            return finish_contexts_alone(job, first, num_contexts, pc, steps);
+        if (halts) break;
+        if (instruct->name == JAL)
+            for (size_t k = 0; k < num_lanes; k++)
+                regs[RA_REGISTER * stride + k] = (int32_t)(pc + WORD_SIZE);
+        steps++;
+        pc = next;
+    }
+
+    for (size_t k = 0; k < num_contexts; k++) job->state->pcs[first + k] = pc;
+    return steps * num_contexts;
+}
+
+// parallel_for body: runs tiles [begin, end)
+static void run_tiles(size_t chunk, size_t begin, size_t end, void* ctx) {
+    (void)chunk;
+    lockstep_job* job = (lockstep_job*)ctx;
+    const lockstep_state* state = job->state;
+    uint64_t steps = 0;
+    for (size_t tile = begin; tile < end; tile++) {
+        size_t first = tile * LOCKSTEP_TILE;
+        size_t num_lanes = state->stride - first;
+        if (num_lanes > LOCKSTEP_TILE) num_lanes = LOCKSTEP_TILE;
+        size_t num_contexts = state->num_contexts - first;
+        if (num_contexts > num_lanes) num_contexts = num_lanes;
+
+        // Contexts that don't all start at the same pc run on their own
+        bool same_pc = true;
+        for (size_t k = 1; k < num_contexts; k++)
+            same_pc &= state->pcs[first + k] == state->pcs[first];
+        if (same_pc) {
+            steps += run_tile_contexts(job, first, num_lanes, num_contexts,
+                                       state->pcs[first]);
+            continue;
+        }
+        for (size_t k = 0; k < num_contexts; k++)
+            steps += run_context_alone(job, first + k, state->pcs[first + k],
+                                       job->max_steps);
+    }
+    __atomic_fetch_add(&job->steps, steps, __ATOMIC_RELAXED);
+}
+
+uint64_t run_lockstep(const program* prog, lockstep_state* state,
+                      uint64_t max_steps, lockstep_isa isa) {
+    lockstep_job job = {prog, state, max_steps, false, run_tile_scalar, 0};
+    for (uint32_t i = 0; i < prog->num_instructions && !job.uses_memory; i++)
+        job.uses_memory = is_memory_access(prog->decoded[i].name);
+#if LOCKSTEP_HAS_VECTOR_ISAS
+    if (isa == LOCKSTEP_AVX512)
+        job.run_tile = run_tile_avx512;
+    else if (isa == LOCKSTEP_AVX2)
+        job.run_tile = run_tile_avx2;
+#endif
+    size_t num_tiles = (state->num_contexts + LOCKSTEP_TILE - 1) / LOCKSTEP_TILE;
+    parallel_for(num_tiles, MIN_LOCKSTEP_CHUNK, run_tiles, &job);
+    for (uint32_t c = 0; c < state->num_contexts; c++)
+        if (state->memories[c] != NULL && state->memories[c]->out_of_memory)
+            state->out_of_memory = true;
+    return job.steps;
+}
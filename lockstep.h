@@ -0,0 +1,147 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "image.h"
+#include "memory.h"
+#include "program.h"
+
+// Contexts are stored in groups of this many lanes (one 512-bit vector), so
+// every group of every register row is 64-byte aligned
+#define LOCKSTEP_LANE_MULTIPLE 16
+// Contexts run through the whole program one tile at a time, so the tile's
+// register rows (32 registers x LOCKSTEP_TILE lanes x 4 bytes) stay in L1
+#define LOCKSTEP_TILE 256
+// Each thread runs at least this many tiles
+#define MIN_LOCKSTEP_CHUNK 16
+
+/**
+ * Register files for many independent contexts that all run the same program
+ *
+ * Stored as a structure of arrays: register r of context c is
+ * registers[r * stride + c], so each instruction updates a contiguous row of
+ * every register it touches. stride is num_contexts rounded up to a multiple
+ * of LOCKSTEP_LANE_MULTIPLE; the padding lanes are computed but never read
+ *
+ * pcs[c] is the PC of context c. Contexts that are at the same PC are run
+ * together until a branch sends them different ways
+ *
+ * Each context has its own memory, memories[c], created the first time the
+ * context runs a program with memory instructions (NULL until then)
+ */
+typedef struct {
+    int32_t* registers;
+    uint32_t* pcs;
+    guest_memory** memories;
+    // Set if a context's memory could not be allocated, in which case that
+    // context's final state is not valid
+    bool out_of_memory;
+    uint32_t num_contexts;
+    uint32_t stride;
+} lockstep_state;
+
+// How run_lockstep executes each instruction
+typedef enum {
+    // One lane at a time
+    LOCKSTEP_SCALAR,
+    // 8 lanes per 256-bit instruction
+    LOCKSTEP_AVX2,
+    // 16 lanes per 512-bit instruction
+    LOCKSTEP_AVX512
+} lockstep_isa;
+
+/**
+ * Creates a lockstep_state with every register of every context set to 0 and
+ * every PC set to INITIAL_PC
+ *
+ * @param num_contexts
+ * @return lockstep_state* (free with free_lockstep_state), or NULL if
+ * allocation fails
+ */
+lockstep_state* create_lockstep_state(uint32_t num_contexts);
+
+/**
+ * Frees a lockstep_state
+ *
+ * @param state may be NULL
+ */
+void free_lockstep_state(lockstep_state* state);
+
+/**
+ * Copies the registers of one context into state
+ *
+ * @param state
+ * @param context less than state->num_contexts
+ * @param registers NUM_REGISTERS values
+ */
+void lockstep_set_context(lockstep_state* state, uint32_t context,
+                          const int32_t* registers);
+
+/**
+ * Copies the registers of one context out of state
+ *
+ * @param state
+ * @param context less than state->num_contexts
+ * @param registers set to the context's NUM_REGISTERS values
+ */
+void lockstep_get_context(const lockstep_state* state, uint32_t context,
+                          int32_t* registers);
+
+/**
+ * Loads initial register states, one context per line
+ *
+ * Each line has up to NUM_REGISTERS integers ($0, $1, ... in order; missing
+ * ones are 0) in any base strtol accepts with base 0, e.g., -5 or 0xff. Values
+ * may be separated by whitespace or commas and surrounded by [ ], so the
+ * output of ./main -a (without its final PC value) can be used. Empty lines
+ * and lines starting with # are skipped
+ *
+ * @param path
+ * @param state set to the loaded states (free with free_lockstep_state)
+ * @return IMAGE_OK on success, else why loading failed
+ */
+image_status load_lockstep_states(const char* path, lockstep_state** state);
+
+/**
+ * Returns the widest ISA run_lockstep can use on this host
+ *
+ * @return lockstep_isa
+ */
+lockstep_isa lockstep_best_isa(void);
+
+/**
+ * Returns whether run_lockstep can use isa on this host
+ *
+ * @param isa
+ * @return true if supported, else false
+ */
+bool lockstep_supports(lockstep_isa isa);
+
+/**
+ * Executes prog on every context in state at once, mutating their registers
+ * and PCs
+ *
+ * Each context ends up exactly as if it had been run on its own by
+ * run_engine. Contexts are processed in tiles of LOCKSTEP_TILE lanes (on
+ * several threads for many contexts). While every context of a tile is at the
+ * same PC, each straight-line run of instructions is executed across the tile
+ * with isa's vector instructions, one instruction at a time. Branches and
+ * jumps are evaluated for every context, and if they don't all agree, the
+ * rest of the tile is run one context at a time by run_threaded. Loads and
+ * stores go to each context's own memory (see memories), one context at a
+ * time; if one can't be allocated, state->out_of_memory is set
+ *
+ * @param prog
+ * @param state
+ * @param max_steps stop each context after this many instructions
+ * @param isa must be supported (see lockstep_supports)
+ * @return number of instructions executed, summed over contexts
+ */
+uint64_t run_lockstep(const program* prog, lockstep_state* state,
+                      uint64_t max_steps, lockstep_isa isa);
+
+#endif  // LOCKSTEP_H
@@ -8,22 +8,290 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "hart.h"
+#include "hostperf.h"
 #include "instructions.h"
+#include "lockstep.h"
+#include "output.h"
+#include "reduce.h"
 #include "utils.h"
 
+// Runs every program in args.filepath on a pool of worker threads
+static int run_batch_main(cli_args args) {
+    size_t num_paths;
+    char** paths = batch_paths(args.filepath, args.format, &num_paths);
+    if (paths == NULL) {
+        fprintf(stderr, "Failed to read directory or list %s\n", args.filepath);
+        free(args.filepath);
+        return EXIT_FAILURE;
+    }
+    batch_options options = {.engine = args.engine,
+                             .format = args.format,
+                             .output = args.output,
+                             .disp_hex = args.disp_hex,
+                             .num_threads = args.num_threads,
+                             .flat_memory = args.flat_memory,
+                             .peephole = args.peephole,
+                             .max_steps = args.max_steps};
+    size_t num_failed = run_batch(paths, num_paths, &options, stdout);
+    free_batch_paths(paths, num_paths);
+    free(args.filepath);
+    return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs the program in args.filepath once per initial state in
+// args.states_path, all in lockstep
+static int run_lockstep_main(cli_args args) {
+    program_image image;
+    uint32_t num_instructions =
+        instruction_file_to_image(args.filepath, args.format, &image);
+    reduced_program reduced;
+    if (args.reduce) {
+        reduce_status reduce_result =
+            reduce_program(image.words, num_instructions, NULL, &reduced);
+        if (reduce_result != REDUCE_OK) {
+            fprintf(stderr, "Failed to reduce %s: %s\n", args.filepath,
+                    reduce_status_message(reduce_result));
+            free_image(&image);
+            free(args.states_path);
+            free(args.filepath);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // If every final register is known, no context needs to run at all
+    const bool run = !args.reduce || !reduced.final_known;
+    lockstep_state* state;
+    image_status status = load_lockstep_states(args.states_path, &state);
+    program* prog = NULL;
+    if (status == IMAGE_OK && run && args.reduce)
+        prog = create_program(reduced.words, reduced.num_instructions);
+    else if (status == IMAGE_OK && run)
+        prog = create_program(image.words, num_instructions);
+    if (status != IMAGE_OK || (run && prog == NULL)) {
+        fprintf(stderr, "Failed to load states file %s: %s\n",
+                args.states_path,
+                image_status_message(status == IMAGE_OK ? IMAGE_NO_MEMORY
+                                                        : status));
+        if (status == IMAGE_OK) free_lockstep_state(state);
+        if (args.reduce) free_reduced(&reduced);
+        free_image(&image);
+        free(args.states_path);
+        free(args.filepath);
+        return EXIT_FAILURE;
+    }
+
+    if (run) run_lockstep(prog, state, args.max_steps, lockstep_best_isa());
+    if (args.reduce) {
+        // Report the state the original program would end in: the same
+        // registers, and the PC after its last instruction
+        for (uint32_t c = 0; c < state->num_contexts; c++) {
+            if (reduced.final_known)
+                lockstep_set_context(state, c, reduced.final_registers);
+            state->pcs[c] = num_instructions * WORD_SIZE;
+        }
+        free_reduced(&reduced);
+    }
+    // There can be many contexts, so their states are written in as few
+    // system calls as possible
+    state_writer* writer = (state_writer*)malloc(sizeof(state_writer));
+    if (writer != NULL) {
+        fflush(stdout);
+        init_state_writer(writer, STDOUT_FILENO, args.output, args.disp_hex);
+    }
+    int32_t registers[NUM_REGISTERS];
+    for (uint32_t c = 0; c < state->num_contexts; c++) {
+        lockstep_get_context(state, c, registers);
+        if (writer != NULL)
+            write_state(writer, registers, state->pcs[c]);
+        else
+            print_state(registers, state->pcs[c], args.output, args.disp_hex);
+    }
+    if (writer != NULL) flush_state_writer(writer);
+    free(writer);
+    bool out_of_memory = state->out_of_memory;
+
+    free_program(prog);
+    free_lockstep_state(state);
+    free_image(&image);
+    free(args.states_path);
+    free(args.filepath);
+    if (out_of_memory) {
+        fprintf(stderr, "Out of memory for guest pages; some final states "
+                        "are not valid\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Prints the final state of the program in args.filepath, worked out by
+// reduce_program from the all-zero registers every run starts with
+static int run_reduce_main(cli_args args) {
+    program_image image;
+    uint32_t num_instructions =
+        instruction_file_to_image(args.filepath, args.format, &image);
+    const int32_t initial[NUM_REGISTERS] = {0};
+    reduced_program reduced;
+    reduce_status status =
+        reduce_program(image.words, num_instructions, initial, &reduced);
+    free_image(&image);
+    if (status != REDUCE_OK) {
+        fprintf(stderr, "Failed to reduce %s: %s\n", args.filepath,
+                reduce_status_message(status));
+        free(args.filepath);
+        return EXIT_FAILURE;
+    }
+
+    if (reduced.final_known) {
+        print_state(reduced.final_registers, num_instructions * WORD_SIZE,
+                    args.output, args.disp_hex);
+    } else {
+        for (uint32_t i = 0; i < reduced.num_instructions; i++)
+            printf("%08x\n", reduced.words[i]);
+    }
+    fprintf(stderr, "Reduced %u instructions to %u (%u dropped, %u folded)\n",
+            num_instructions, reduced.num_instructions, reduced.num_dropped,
+            reduced.num_folded);
+    free_reduced(&reduced);
+    free(args.filepath);
+    return EXIT_SUCCESS;
+}
+
+// Frees the paths of args that run_harts_main uses
+static void free_hart_paths(cli_args args) {
+    for (uint32_t k = 0; k < args.num_hart_paths; k++)
+        free(args.hart_paths[k]);
+    free(args.hart_paths);
+    free(args.filepath);
+}
+
+// Runs the programs in args.filepath and args.hart_paths on args.num_harts
+// harts that share one flat memory, and prints every hart's final state
+static int run_harts_main(cli_args args) {
+    const uint32_t num_images = 1 + args.num_hart_paths;
+    program_image* images =
+        (program_image*)calloc(num_images, sizeof(program_image));
+    hart* harts = (hart*)calloc(args.num_harts, sizeof(hart));
+    guest_memory* mem = create_memory(true);
+    if (images == NULL || harts == NULL || mem == NULL) {
+        fprintf(stderr, "Failed to allocate harts\n");
+        free(images);
+        free(harts);
+        free_memory(mem);
+        free_hart_paths(args);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t k = 0; k < num_images; k++)
+        instruction_file_to_image(
+            k == 0 ? args.filepath : args.hart_paths[k - 1], args.format,
+            &images[k]);
+
+    bool failed = false;
+    for (uint32_t k = 0; k < args.num_harts; k++) {
+        const program_image* image =
+            &images[k < num_images ? k : num_images - 1];
+        program* prog = create_program(image->words, image->num_instructions);
+        if (prog == NULL) {
+            fprintf(stderr, "Failed to allocate decoded program\n");
+            failed = true;
+            break;
+        }
+        prog->peephole = args.peephole;
+        init_hart(&harts[k], prog, k, args.num_harts);
+    }
+    if (!failed) {
+        hart_options options = {.engine = args.engine,
+                                .quantum = args.quantum,
+                                .max_steps = args.max_steps,
+                                .serial = args.serial_harts};
+        hart_status status = run_harts(harts, args.num_harts, mem, &options);
+        if (status != HARTS_OK) {
+            fprintf(stderr, "Failed to run harts: %s\n",
+                    hart_status_message(status));
+            failed = true;
+        }
+    }
+    for (uint32_t k = 0; k < args.num_harts && !failed; k++) {
+        if (!validate_pc(harts[k].pc)) {
+            fprintf(stderr,
+                    "Invalid PC on hart %u (not a multiple of word size %d): "
+                    "%d\n",
+                    k, WORD_SIZE, harts[k].pc);
+            failed = true;
+        }
+    }
+    for (uint32_t k = 0; k < args.num_harts && !failed; k++)
+        print_state(harts[k].registers, harts[k].pc, args.output,
+                    args.disp_hex);
+
+    for (uint32_t k = 0; k < args.num_harts; k++) free_program(harts[k].prog);
+    for (uint32_t k = 0; k < num_images; k++) free_image(&images[k]);
+    free(images);
+    free(harts);
+    free_memory(mem);
+    free_hart_paths(args);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Writes host's report to args.host_counters_path as JSON, if there is one
+static void report_host_json(const host_profile* host, cli_args args) {
+    if (args.host_counters_path == NULL) return;
+    FILE* out = fopen(args.host_counters_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open host counters output %s\n",
+                args.host_counters_path);
+        return;
+    }
+    write_host_report_json(out, host);
+    fclose(out);
+}
+
 int run_main(int argc, char* argv[]) {
     cli_args args = parse_cli(argc, argv);
+    if (args.batch) return run_batch_main(args);
+    if (args.states_path != NULL) return run_lockstep_main(args);
+    if (args.reduce) return run_reduce_main(args);
+    if (args.num_harts != 0) return run_harts_main(args);
 
-    uint32_t instructions[MAX_INSTRUCTIONS] = {0};
+    program_image image;
     int32_t registers[NUM_REGISTERS] = {0};
     uint32_t pc = INITIAL_PC;
 
+    host_profile* host = NULL;
+    if (args.host_counters) {
+        host = create_host_profile();
+        if (host == NULL) {
+            fprintf(stderr, "Failed to allocate host counters\n");
+            free(args.filepath);
+            return EXIT_FAILURE;
+        }
+    }
+
+    host_region_begin(host, HOST_REGION_LOAD);
     uint32_t num_instructions =
-        hex_instruction_file_to_array(args.filepath, instructions);
+        instruction_file_to_image(args.filepath, args.format, &image);
+    host_region_end(host, HOST_REGION_LOAD, num_instructions);
 
-    execute_all(instructions, num_instructions, registers, &pc, args);
+    execute_all(image.words, num_instructions, registers, &pc, args, host);
 
+    if (host != NULL) {
+        fflush(stdout);
+        print_host_report(stderr, host);
+        report_host_json(host, args);
+        free_host_profile(host);
+    }
+    free_image(&image);
+    free(args.profile_path);
+    free(args.host_counters_path);
+    free(args.translate_directory);
+    free(args.restore_path);
+    free(args.snapshot_path);
+    free(args.checkpoints_path);
+    free(args.trace_path);
+    free(args.gdb_address);
     free(args.filepath);
 
     return EXIT_SUCCESS;
@@ -0,0 +1,245 @@
+#include "memory.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of the flat mapping: the address space plus room for a word access at
+// the last address to run past the end
+#define FLAT_MEMORY_SIZE (((size_t)1 << 32) + PAGE_SIZE)
+
+__thread guest_memory* bound_memory = NULL;
+__thread memory_reservation bound_reservation = {0, 0, false};
+
+guest_memory* memory_bind(guest_memory* mem) {
+    guest_memory* previous = bound_memory;
+    bound_memory = mem;
+    bound_reservation.valid = false;
+    return previous;
+}
+
+// Reserves the flat mapping, or returns NULL if the host can't
+static uint8_t* map_flat(void) {
+#if UINTPTR_MAX > UINT32_MAX
+    // MAP_NORESERVE: nothing is committed until touched, like pages
+    void* flat = mmap(NULL, FLAT_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (flat == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    // Fewer host TLB misses for programs that touch a lot of memory
+    madvise(flat, FLAT_MEMORY_SIZE, MADV_HUGEPAGE);
+#endif
+    return (uint8_t*)flat;
+#else
+    return NULL;
+#endif
+}
+
+guest_memory* create_memory(bool flat) {
+    guest_memory* mem = (guest_memory*)calloc(1, sizeof(guest_memory));
+    if (mem == NULL) return NULL;
+    for (int i = 0; i < TLB_ENTRIES; i++)
+        mem->tlb[i].tag = mem->tlb[i].write_tag = TLB_INVALID_TAG;
+    if (flat) mem->flat = map_flat();
+    return mem;
+}
+
+// Returns whether host points into one of mem's adopted mappings
+static bool in_mapping(const guest_memory* mem, const uint8_t* host) {
+    for (const memory_mapping* m = mem->mappings; m != NULL; m = m->next) {
+        if (host >= (uint8_t*)m->base && host < (uint8_t*)m->base + m->size)
+            return true;
+    }
+    return false;
+}
+
+void free_memory(guest_memory* mem) {
+    if (mem == NULL) return;
+    if (mem->flat != NULL) munmap(mem->flat, FLAT_MEMORY_SIZE);
+    for (int d = 0; d < (1 << PAGE_DIRECTORY_BITS); d++) {
+        if (mem->directory[d] == NULL) continue;
+        for (int t = 0; t < (1 << PAGE_TABLE_BITS); t++) {
+            if (!in_mapping(mem, mem->directory[d][t]))
+                free(mem->directory[d][t]);
+        }
+        free(mem->directory[d]);
+        free(mem->dirty[d]);
+    }
+    while (mem->mappings != NULL) {
+        memory_mapping* next = mem->mappings->next;
+        munmap(mem->mappings->base, mem->mappings->size);
+        free(mem->mappings);
+        mem->mappings = next;
+    }
+    free(mem);
+}
+
+// Returns where the page with page_number is in the page table, allocating
+// its table if allocate is set. Returns NULL if the table isn't allocated (or
+// can't be)
+static uint8_t** find_entry(guest_memory* mem, uint32_t page_number,
+                            bool allocate) {
+    uint32_t d = page_number >> PAGE_TABLE_BITS;
+    if (mem->directory[d] == NULL) {
+        if (!allocate) return NULL;
+        mem->directory[d] =
+            (uint8_t**)calloc(1 << PAGE_TABLE_BITS, sizeof(uint8_t*));
+        mem->dirty[d] =
+            (uint32_t*)calloc((1 << PAGE_TABLE_BITS) / 32, sizeof(uint32_t));
+        if (mem->directory[d] == NULL || mem->dirty[d] == NULL) {
+            free(mem->directory[d]);
+            free(mem->dirty[d]);
+            mem->directory[d] = NULL;
+            mem->dirty[d] = NULL;
+            mem->out_of_memory = true;
+            return NULL;
+        }
+    }
+    return &mem->directory[d][page_number & ((1 << PAGE_TABLE_BITS) - 1)];
+}
+
+// Returns the word of mem->dirty that page_number's bit is in
+static uint32_t* dirty_word(guest_memory* mem, uint32_t page_number) {
+    uint32_t t = page_number & ((1 << PAGE_TABLE_BITS) - 1);
+    return &mem->dirty[page_number >> PAGE_TABLE_BITS][t / 32];
+}
+
+// Returns the page containing address and caches it in the TLB. If it hasn't
+// been allocated, allocates it for a store, else returns NULL. A store marks
+// the page dirty
+static uint8_t* find_page(guest_memory* mem, uint32_t address, bool store) {
+    uint32_t page_number = address >> PAGE_BITS;
+    uint8_t** page = find_entry(mem, page_number, store);
+    if (page == NULL) return NULL;
+    if (*page == NULL) {
+        if (!store) return NULL;
+        *page = (uint8_t*)calloc(1, PAGE_SIZE);
+        if (*page == NULL) {
+            mem->out_of_memory = true;
+            return NULL;
+        }
+        mem->num_pages++;
+    }
+    uint32_t* dirty = dirty_word(mem, page_number);
+    uint32_t bit = 1u << (page_number % 32);
+    if (store) *dirty |= bit;
+    tlb_entry* entry = &mem->tlb[page_number % TLB_ENTRIES];
+    entry->tag = page_number;
+    entry->write_tag = *dirty & bit ? page_number : TLB_INVALID_TAG;
+    entry->page = *page;
+    return *page;
+}
+
+// memory_for_each_page for a flat memory: the pages the host has backed
+static bool for_each_flat_page(guest_memory* mem,
+                               void (*visit)(uint32_t page_number,
+                                             const uint8_t* page,
+                                             void* context),
+                               void* context) {
+    size_t host_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t num_host_pages =
+        (FLAT_MEMORY_SIZE + host_page_size - 1) / host_page_size;
+    unsigned char* resident = (unsigned char*)malloc(num_host_pages);
+    if (resident == NULL) return false;
+    if (mincore(mem->flat, FLAT_MEMORY_SIZE, resident) != 0) {
+        free(resident);
+        return false;
+    }
+    for (uint64_t p = 0; p < ((uint64_t)1 << (32 - PAGE_BITS)); p++) {
+        size_t first = (size_t)(p * PAGE_SIZE / host_page_size);
+        size_t last = (size_t)(((p + 1) * PAGE_SIZE - 1) / host_page_size);
+        bool backed = false;
+        for (size_t h = first; h <= last; h++) backed |= resident[h] & 1;
+        if (backed) visit((uint32_t)p, mem->flat + p * PAGE_SIZE, context);
+    }
+    free(resident);
+    return true;
+}
+
+bool memory_for_each_page(guest_memory* mem, bool dirty_only,
+                          void (*visit)(uint32_t page_number,
+                                        const uint8_t* page, void* context),
+                          void* context) {
+    if (mem->flat != NULL) return for_each_flat_page(mem, visit, context);
+    for (uint32_t d = 0; d < (1 << PAGE_DIRECTORY_BITS); d++) {
+        if (mem->directory[d] == NULL) continue;
+        for (uint32_t t = 0; t < (1 << PAGE_TABLE_BITS); t++) {
+            const uint8_t* page = mem->directory[d][t];
+            if (page == NULL) continue;
+            if (dirty_only && !(mem->dirty[d][t / 32] & (1u << (t % 32))))
+                continue;
+            visit((d << PAGE_TABLE_BITS) | t, page, context);
+        }
+    }
+    return true;
+}
+
+void memory_clear_dirty(guest_memory* mem) {
+    for (int d = 0; d < (1 << PAGE_DIRECTORY_BITS); d++) {
+        if (mem->dirty[d] != NULL)
+            memset(mem->dirty[d], 0,
+                   (1 << PAGE_TABLE_BITS) / 32 * sizeof(uint32_t));
+    }
+    for (int i = 0; i < TLB_ENTRIES; i++)
+        mem->tlb[i].write_tag = TLB_INVALID_TAG;
+}
+
+bool memory_adopt_mapping(guest_memory* mem, void* base, size_t size) {
+    memory_mapping* mapping = (memory_mapping*)malloc(sizeof(memory_mapping));
+    if (mapping == NULL) return false;
+    mapping->base = base;
+    mapping->size = size;
+    mapping->next = mem->mappings;
+    mem->mappings = mapping;
+    return true;
+}
+
+bool memory_map_page(guest_memory* mem, uint32_t page_number, uint8_t* host) {
+    if (mem->flat != NULL) {
+        memcpy(mem->flat + (size_t)page_number * PAGE_SIZE, host, PAGE_SIZE);
+        return true;
+    }
+    uint8_t** page = find_entry(mem, page_number, true);
+    if (page == NULL) return false;
+    if (*page != NULL && !in_mapping(mem, *page)) {
+        memcpy(*page, host, PAGE_SIZE);
+    } else {
+        if (*page == NULL) mem->num_pages++;
+        *page = host;
+    }
+    *dirty_word(mem, page_number) &= ~(1u << (page_number % 32));
+    tlb_entry* entry = &mem->tlb[page_number % TLB_ENTRIES];
+    if (entry->tag == page_number)
+        entry->tag = entry->write_tag = TLB_INVALID_TAG;
+    return true;
+}
+
+uint32_t memory_load_slow(guest_memory* mem, uint32_t address, uint32_t size) {
+    // Byte by byte (little-endian), since the bytes may be on two pages
+    uint32_t value = 0;
+    for (uint32_t k = 0; k < size; k++) {
+        uint32_t byte_address = address + k;
+        uint8_t* host = memory_tlb_lookup(mem, byte_address);
+        if (host == NULL) {
+            uint8_t* page = find_page(mem, byte_address, false);
+            if (page == NULL) continue;
+            host = page + byte_address % PAGE_SIZE;
+        }
+        value |= (uint32_t)*host << (8 * k);
+    }
+    return value;
+}
+
+void memory_store_slow(guest_memory* mem, uint32_t address, uint32_t value,
+                       uint32_t size) {
+    for (uint32_t k = 0; k < size; k++) {
+        uint32_t byte_address = address + k;
+        uint8_t* host = memory_tlb_lookup_write(mem, byte_address);
+        if (host == NULL) {
+            uint8_t* page = find_page(mem, byte_address, true);
+            if (page == NULL) continue;
+            host = page + byte_address % PAGE_SIZE;
+        }
+        *host = (uint8_t)(value >> (8 * k));
+    }
+}
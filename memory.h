@@ -0,0 +1,348 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Guest memory is allocated in pages of PAGE_SIZE bytes
+#define PAGE_BITS 12
+#define PAGE_SIZE (1u << PAGE_BITS)
+// The page table has two levels: the top PAGE_DIRECTORY_BITS of a page number
+// select a table, and the rest select a page within it
+#define PAGE_DIRECTORY_BITS 10
+#define PAGE_TABLE_BITS (32 - PAGE_BITS - PAGE_DIRECTORY_BITS)
+// Entries in the direct-mapped TLB (a power of 2)
+#define TLB_ENTRIES 256
+// Tag of a TLB entry that maps nothing (no page number is this large)
+#define TLB_INVALID_TAG UINT32_MAX
+
+// One TLB entry: page number tag is at host address page. Stores only hit if
+// write_tag is tag too, which it is once the page has been marked dirty
+typedef struct {
+    uint32_t tag;
+    uint32_t write_tag;
+    uint8_t* page;
+} tlb_entry;
+
+// A host mapping that some pages point into (see memory_adopt_mapping)
+typedef struct memory_mapping {
+    void* base;
+    size_t size;
+    struct memory_mapping* next;
+} memory_mapping;
+
+/**
+ * A guest's data memory: the full 32-bit address space, little-endian
+ *
+ * Pages are allocated (zeroed) the first time they are written, and reading a
+ * page that was never written gives 0, so only the pages a program stores to
+ * use host memory. Recently used pages are cached in a direct-mapped TLB
+ * indexed by the low bits of the page number, so most accesses are a tag
+ * compare and a load or store (see memory_load_word)
+ *
+ * Alternatively, with flat set, the whole address space is one reserved host
+ * mapping (backed by huge pages where the host allows, and only by the pages
+ * actually touched), and accesses need no checks at all
+ *
+ * Word accesses don't need to be aligned. A word at one of the last 3
+ * addresses wraps around to address 0, except with flat, where its high bytes
+ * are past the end of the address space instead
+ *
+ * Pages remember whether they were stored to since the last
+ * memory_clear_dirty, so that a snapshot only needs to save the pages that
+ * changed since the previous one (see snapshot.h). Stores mark a page dirty
+ * the first time they reach it through the slow path, after which the TLB
+ * lets them through like loads
+ *
+ * Paged memory is for one thread at a time, since even loads update the TLB.
+ * A flat memory has nothing to update, so threads can share it (see hart.h)
+ */
+typedef struct {
+    tlb_entry tlb[TLB_ENTRIES];
+    // Non-NULL if the address space is one flat mapping
+    uint8_t* flat;
+    // directory[d][t] is the page with page number (d << PAGE_TABLE_BITS) | t,
+    // NULL if not allocated
+    uint8_t** directory[1 << PAGE_DIRECTORY_BITS];
+    // dirty[d] has one bit per page of directory[d], set if it was stored to
+    // since memory_clear_dirty. Allocated along with directory[d]
+    uint32_t* dirty[1 << PAGE_DIRECTORY_BITS];
+    // Mappings (e.g., of snapshot files) that pages may point into instead of
+    // being allocated on their own, unmapped by free_memory
+    memory_mapping* mappings;
+    // Id of the snapshot this memory is identical to apart from its dirty
+    // pages, or 0 if none (see snapshot.h)
+    uint64_t snapshot_id;
+    // Number of pages allocated
+    uint32_t num_pages;
+    // Set if a page could not be allocated, in which case the store that
+    // needed it was dropped
+    bool out_of_memory;
+} guest_memory;
+
+/**
+ * Creates an empty guest memory (every byte reads as 0)
+ *
+ * @param flat true to try to reserve the whole address space as one mapping
+ * (falls back to pages if the host can't reserve it)
+ * @return guest_memory* (free with free_memory), or NULL if allocation fails
+ */
+guest_memory* create_memory(bool flat);
+
+/**
+ * Frees a guest memory and all of its pages
+ *
+ * @param mem may be NULL
+ */
+void free_memory(guest_memory* mem);
+
+/**
+ * Memory that lw, sw, lb, sb, ll and sc access on the calling thread
+ *
+ * Registers and pc are passed to every handler, but memory is large and only
+ * used by a few instructions, so it is bound per thread instead (see
+ * memory_bind). Engines read it at most once per call
+ */
+extern __thread guest_memory* bound_memory;
+
+/**
+ * The word the last ll on a thread loaded, which the next sc on that thread
+ * only stores over if memory still holds the same value (see
+ * memory_store_conditional)
+ */
+typedef struct {
+    uint32_t address;
+    int32_t value;
+    bool valid;
+} memory_reservation;
+
+/**
+ * Reservation of ll and sc on the calling thread. Code that runs several
+ * programs on one thread (e.g., harts, see hart.h) saves and restores it
+ * along with their registers
+ */
+extern __thread memory_reservation bound_reservation;
+
+/**
+ * Makes mem the memory that memory instructions on the calling thread access,
+ * and drops the thread's reservation (see bound_reservation), as an
+ * exception would on hardware
+ *
+ * @param mem may be NULL if no memory instructions will run
+ * @return the previously bound memory
+ */
+guest_memory* memory_bind(guest_memory* mem);
+
+/**
+ * Calls visit(page_number, page, context) for every allocated page, in order
+ * of page number. With dirty_only, skips pages not stored to since
+ * memory_clear_dirty
+ *
+ * @note A flat memory doesn't track dirty pages, so every page the host has
+ * backed with memory (see mincore) is visited, even with dirty_only
+ * @param mem
+ * @param dirty_only
+ * @param visit
+ * @param context passed to visit
+ * @return true on success, else false (the pages of a flat memory couldn't be
+ * listed)
+ */
+bool memory_for_each_page(guest_memory* mem, bool dirty_only,
+                          void (*visit)(uint32_t page_number,
+                                        const uint8_t* page, void* context),
+                          void* context);
+
+/**
+ * Marks every page of mem clean
+ *
+ * @param mem
+ */
+void memory_clear_dirty(guest_memory* mem);
+
+/**
+ * Gives mem a host mapping of size bytes at base to unmap (with munmap) when
+ * mem is freed, so that pages can point into it (see memory_map_page)
+ *
+ * @param mem
+ * @param base
+ * @param size
+ * @return true on success, else false (and the mapping is left alone)
+ */
+bool memory_adopt_mapping(guest_memory* mem, void* base, size_t size);
+
+/**
+ * Makes the page with page_number the PAGE_SIZE bytes at host, which must be
+ * in a mapping adopted by mem, without copying them. The page is not dirty
+ *
+ * If mem already allocated the page on its own (or mem is flat), host is
+ * copied into it instead
+ *
+ * @param mem
+ * @param page_number
+ * @param host
+ * @return true on success, else false (out of memory)
+ */
+bool memory_map_page(guest_memory* mem, uint32_t page_number, uint8_t* host);
+
+/**
+ * Slow paths of the accessors below: accesses that miss in the TLB or cross a
+ * page boundary. size is 1 or 4. Loads zero-extend
+ */
+uint32_t memory_load_slow(guest_memory* mem, uint32_t address, uint32_t size);
+void memory_store_slow(guest_memory* mem, uint32_t address, uint32_t value,
+                       uint32_t size);
+
+// Returns the host address of address if its page is in mem's TLB, else NULL
+static inline uint8_t* memory_tlb_lookup(const guest_memory* mem,
+                                         uint32_t address) {
+    const tlb_entry* entry = &mem->tlb[(address >> PAGE_BITS) % TLB_ENTRIES];
+    return entry->tag == address >> PAGE_BITS
+               ? entry->page + address % PAGE_SIZE
+               : NULL;
+}
+
+// Same as memory_tlb_lookup, but for a store, which misses unless the page is
+// already dirty
+static inline uint8_t* memory_tlb_lookup_write(const guest_memory* mem,
+                                               uint32_t address) {
+    const tlb_entry* entry = &mem->tlb[(address >> PAGE_BITS) % TLB_ENTRIES];
+    return entry->write_tag == address >> PAGE_BITS
+               ? entry->page + address % PAGE_SIZE
+               : NULL;
+}
+
+/**
+ * Loads the word at address
+ *
+ * @param mem
+ * @param address
+ * @return int32_t
+ */
+static inline int32_t memory_load_word(guest_memory* mem, uint32_t address) {
+    int32_t value;
+    // memcpy compiles to a single (unaligned) load; the host is little-endian
+    if (mem->flat != NULL) {
+        memcpy(&value, mem->flat + address, sizeof(value));
+        return value;
+    }
+    uint8_t* host = memory_tlb_lookup(mem, address);
+    if (host == NULL || address % PAGE_SIZE > PAGE_SIZE - sizeof(value))
+        return (int32_t)memory_load_slow(mem, address, sizeof(value));
+    memcpy(&value, host, sizeof(value));
+    return value;
+}
+
+/**
+ * Stores value as the word at address
+ *
+ * @param mem
+ * @param address
+ * @param value
+ */
+static inline void memory_store_word(guest_memory* mem, uint32_t address,
+                                     int32_t value) {
+    if (mem->flat != NULL) {
+        memcpy(mem->flat + address, &value, sizeof(value));
+        return;
+    }
+    uint8_t* host = memory_tlb_lookup_write(mem, address);
+    if (host == NULL || address % PAGE_SIZE > PAGE_SIZE - sizeof(value))
+        memory_store_slow(mem, address, (uint32_t)value, sizeof(value));
+    else
+        memcpy(host, &value, sizeof(value));
+}
+
+/**
+ * Loads the byte at address
+ *
+ * @param mem
+ * @param address
+ * @return uint8_t
+ */
+static inline uint8_t memory_load_byte(guest_memory* mem, uint32_t address) {
+    if (mem->flat != NULL) return mem->flat[address];
+    uint8_t* host = memory_tlb_lookup(mem, address);
+    return host != NULL ? *host : (uint8_t)memory_load_slow(mem, address, 1);
+}
+
+/**
+ * Stores value as the byte at address
+ *
+ * @param mem
+ * @param address
+ * @param value
+ */
+static inline void memory_store_byte(guest_memory* mem, uint32_t address,
+                                     uint8_t value) {
+    if (mem->flat != NULL) {
+        mem->flat[address] = value;
+        return;
+    }
+    uint8_t* host = memory_tlb_lookup_write(mem, address);
+    if (host != NULL)
+        *host = value;
+    else
+        memory_store_slow(mem, address, value, 1);
+}
+
+/**
+ * Loads the word at address for ll: same as memory_load_word, and reserves
+ * it for the next memory_store_conditional on the calling thread
+ *
+ * @param mem
+ * @param address
+ * @return int32_t
+ */
+static inline int32_t memory_load_linked(guest_memory* mem, uint32_t address) {
+    int32_t value;
+    // Flat memory can be shared by threads (see hart.h), so an aligned word
+    // is loaded in one piece
+    if (mem->flat != NULL && address % sizeof(value) == 0)
+        value = __atomic_load_n((int32_t*)(mem->flat + address),
+                                __ATOMIC_SEQ_CST);
+    else
+        value = memory_load_word(mem, address);
+    bound_reservation = (memory_reservation){address, value, true};
+    return value;
+}
+
+/**
+ * Stores value as the word at address for sc, if the calling thread's last
+ * memory_load_linked was of address and the word still holds what it loaded.
+ * Drops the reservation either way
+ *
+ * On a flat memory, the check and the store are one atomic compare and
+ * exchange, so of several threads racing to store over the same loaded
+ * value, exactly one succeeds. A store by another thread that wrote back the
+ * value that was loaded goes unnoticed, which is harmless for the usual
+ * ll/sc loops (counters, locks and the like). Paged memory isn't thread-safe
+ * (see guest_memory), so there the check and the store are plain accesses.
+ * An unaligned sc always fails
+ *
+ * @param mem
+ * @param address
+ * @param value
+ * @return 1 if value was stored, else 0
+ */
+static inline int32_t memory_store_conditional(guest_memory* mem,
+                                               uint32_t address,
+                                               int32_t value) {
+    const memory_reservation reservation = bound_reservation;
+    bound_reservation.valid = false;
+    if (!reservation.valid || reservation.address != address ||
+        address % sizeof(value) != 0)
+        return 0;
+    if (mem->flat != NULL) {
+        int32_t expected = reservation.value;
+        return __atomic_compare_exchange_n((int32_t*)(mem->flat + address),
+                                           &expected, value, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    if (memory_load_word(mem, address) != reservation.value) return 0;
+    memory_store_word(mem, address, value);
+    return 1;
+}
+
+#endif  // MEMORY_H
@@ -0,0 +1,222 @@
+#include "mipssim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "program.h"
+
+struct mipssim {
+    mipssim_config config;
+    // NULL until a program is loaded
+    program* prog;
+    guest_memory* memory;
+    int32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    uint64_t steps;
+    // Kept between runs, so that an ll and its sc can be run by separate
+    // calls (see bound_reservation)
+    memory_reservation reservation;
+};
+
+void mipssim_default_config(mipssim_config* config) {
+    config->engine = ENGINE_INTERPRETER;
+    config->flat_memory = false;
+    config->peephole = false;
+}
+
+mipssim_status mipssim_create(const mipssim_config* config, mipssim** sim) {
+    mipssim* s = (mipssim*)calloc(1, sizeof(mipssim));
+    if (s == NULL) return MIPSSIM_NO_MEMORY;
+    if (config != NULL)
+        s->config = *config;
+    else
+        mipssim_default_config(&s->config);
+    s->pc = INITIAL_PC;
+    *sim = s;
+    return MIPSSIM_OK;
+}
+
+void mipssim_destroy(mipssim* sim) {
+    if (sim == NULL) return;
+    free_program(sim->prog);
+    free_memory(sim->memory);
+    free(sim);
+}
+
+// Replaces sim's program with one decoded from words, and resets it
+static mipssim_status load_program(mipssim* sim, const uint32_t* words,
+                                   uint32_t num_instructions) {
+    program* prog = create_program(words, num_instructions);
+    guest_memory* memory = create_memory(sim->config.flat_memory);
+    if (prog == NULL || memory == NULL) {
+        free_program(prog);
+        free_memory(memory);
+        return MIPSSIM_NO_MEMORY;
+    }
+    prog->peephole = sim->config.peephole;
+    free_program(sim->prog);
+    free_memory(sim->memory);
+    sim->prog = prog;
+    sim->memory = memory;
+    memset(sim->registers, 0, sizeof(sim->registers));
+    sim->pc = INITIAL_PC;
+    sim->steps = 0;
+    sim->reservation.valid = false;
+    return MIPSSIM_OK;
+}
+
+static mipssim_status from_image_status(image_status status) {
+    switch (status) {
+        case IMAGE_OK:
+            return MIPSSIM_OK;
+        case IMAGE_OPEN_FAILED:
+            return MIPSSIM_OPEN_FAILED;
+        case IMAGE_TOO_LARGE:
+            return MIPSSIM_TOO_LARGE;
+        case IMAGE_BAD_FORMAT:
+            return MIPSSIM_BAD_FORMAT;
+        case IMAGE_NO_MEMORY:
+        default:
+            return MIPSSIM_NO_MEMORY;
+    }
+}
+
+mipssim_status mipssim_load_file(mipssim* sim, const char* path,
+                                 image_format format) {
+    program_image image;
+    image_status status = load_image(path, format, &image);
+    if (status != IMAGE_OK) return from_image_status(status);
+    mipssim_status rv = load_program(sim, image.words, image.num_instructions);
+    free_image(&image);
+    return rv;
+}
+
+mipssim_status mipssim_load_buffer(mipssim* sim, const void* data,
+                                   size_t size, image_format format) {
+    program_image image;
+    image_status status = load_image_buffer(data, size, format, &image);
+    if (status != IMAGE_OK) return from_image_status(status);
+    mipssim_status rv = load_program(sim, image.words, image.num_instructions);
+    free_image(&image);
+    return rv;
+}
+
+mipssim_status mipssim_load_words(mipssim* sim, const uint32_t* words,
+                                  uint32_t num_instructions) {
+    return load_program(sim, words, num_instructions);
+}
+
+mipssim_status mipssim_reset(mipssim* sim) {
+    if (sim->prog == NULL) return MIPSSIM_NO_PROGRAM;
+    guest_memory* memory = create_memory(sim->config.flat_memory);
+    if (memory == NULL) return MIPSSIM_NO_MEMORY;
+    free_memory(sim->memory);
+    sim->memory = memory;
+    memset(sim->registers, 0, sizeof(sim->registers));
+    sim->pc = INITIAL_PC;
+    sim->steps = 0;
+    sim->reservation.valid = false;
+    return MIPSSIM_OK;
+}
+
+mipssim_status mipssim_run(mipssim* sim, uint64_t max_steps,
+                           uint64_t* steps) {
+    if (steps != NULL) *steps = 0;
+    if (sim->prog == NULL) return MIPSSIM_NO_PROGRAM;
+    // The caller's thread may have its own memory bound, e.g., another
+    // simulator's
+    guest_memory* previous = memory_bind(sim->memory);
+    bound_reservation = sim->reservation;
+    uint64_t executed = run_engine(sim->config.engine, sim->prog,
+                                   sim->registers, &sim->pc, max_steps);
+    sim->reservation = bound_reservation;
+    memory_bind(previous);
+    sim->steps += executed;
+    if (steps != NULL) *steps = executed;
+    if (sim->pc % WORD_SIZE != 0) return MIPSSIM_INVALID_PC;
+    if (sim->memory->out_of_memory) return MIPSSIM_OUT_OF_GUEST_MEMORY;
+    return MIPSSIM_OK;
+}
+
+mipssim_status mipssim_run_to_completion(mipssim* sim, uint64_t* steps) {
+    return mipssim_run(sim, UINT64_MAX, steps);
+}
+
+bool mipssim_done(const mipssim* sim) {
+    return sim->prog == NULL || engine_done(sim->prog, sim->registers, sim->pc);
+}
+
+uint64_t mipssim_steps(const mipssim* sim) { return sim->steps; }
+
+void mipssim_get_registers(const mipssim* sim, int32_t* registers) {
+    memcpy(registers, sim->registers, sizeof(sim->registers));
+}
+
+void mipssim_set_registers(mipssim* sim, const int32_t* registers) {
+    memcpy(sim->registers, registers, sizeof(sim->registers));
+}
+
+mipssim_status mipssim_set_register(mipssim* sim, int reg, int32_t value) {
+    if (reg < 0 || reg >= NUM_REGISTERS) return MIPSSIM_BAD_ARGUMENT;
+    sim->registers[reg] = value;
+    return MIPSSIM_OK;
+}
+
+uint32_t mipssim_get_pc(const mipssim* sim) { return sim->pc; }
+
+void mipssim_set_pc(mipssim* sim, uint32_t pc) { sim->pc = pc; }
+
+// Whether [address, address + size) fits in the 32-bit address space
+static bool valid_range(uint32_t address, size_t size) {
+    return size <= (uint64_t)UINT32_MAX + 1 - address;
+}
+
+mipssim_status mipssim_read_memory(const mipssim* sim, uint32_t address,
+                                   void* data, size_t size) {
+    if (!valid_range(address, size)) return MIPSSIM_BAD_ARGUMENT;
+    uint8_t* out = (uint8_t*)data;
+    for (size_t k = 0; k < size; k++)
+        out[k] = sim->memory != NULL
+                     ? memory_load_byte(sim->memory, address + (uint32_t)k)
+                     : 0;
+    return MIPSSIM_OK;
+}
+
+mipssim_status mipssim_write_memory(mipssim* sim, uint32_t address,
+                                    const void* data, size_t size) {
+    if (!valid_range(address, size)) return MIPSSIM_BAD_ARGUMENT;
+    if (sim->memory == NULL) return MIPSSIM_NO_PROGRAM;
+    const uint8_t* in = (const uint8_t*)data;
+    bool dropped = sim->memory->out_of_memory;
+    sim->memory->out_of_memory = false;
+    for (size_t k = 0; k < size; k++)
+        memory_store_byte(sim->memory, address + (uint32_t)k, in[k]);
+    bool failed = sim->memory->out_of_memory;
+    sim->memory->out_of_memory |= dropped;
+    return failed ? MIPSSIM_OUT_OF_GUEST_MEMORY : MIPSSIM_OK;
+}
+
+const char* mipssim_status_message(mipssim_status status) {
+    switch (status) {
+        case MIPSSIM_OK:
+            return "Success";
+        case MIPSSIM_NO_MEMORY:
+            return "Out of memory";
+        case MIPSSIM_OPEN_FAILED:
+            return "Failed to open file";
+        case MIPSSIM_TOO_LARGE:
+            return "Program has too many instructions";
+        case MIPSSIM_BAD_FORMAT:
+            return "File is not in the expected format";
+        case MIPSSIM_NO_PROGRAM:
+            return "No program is loaded";
+        case MIPSSIM_INVALID_PC:
+            return "Invalid PC (not a multiple of the word size)";
+        case MIPSSIM_OUT_OF_GUEST_MEMORY:
+            return "Out of memory for guest pages; some stores were dropped";
+        case MIPSSIM_BAD_ARGUMENT:
+        default:
+            return "Invalid argument";
+    }
+}
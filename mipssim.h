@@ -0,0 +1,243 @@
+#ifndef MIPSSIM_H
+#define MIPSSIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "image.h"
+
+/**
+ * The simulator as a library (libmipssim.a and libmipssim.so), for embedding
+ * in another process instead of running ./main
+ *
+ * Everything the simulator needs lives in a mipssim object: the decoded
+ * program, the registers and PC, guest memory and the configuration. Nothing
+ * here prints or exits the process; every failure is returned as a
+ * mipssim_status. Separate simulators are independent, so several can be used
+ * at once, and from different threads as long as each is used by one thread
+ * at a time
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    MIPSSIM_OK,
+    MIPSSIM_NO_MEMORY,
+    MIPSSIM_OPEN_FAILED,
+    MIPSSIM_TOO_LARGE,
+    MIPSSIM_BAD_FORMAT,
+    // Running or resetting before a program was loaded
+    MIPSSIM_NO_PROGRAM,
+    // Execution stopped at a PC that isn't a multiple of WORD_SIZE
+    MIPSSIM_INVALID_PC,
+    // Guest memory pages couldn't be allocated, so some stores were dropped
+    MIPSSIM_OUT_OF_GUEST_MEMORY,
+    // A register number, or a memory range that wraps around the address
+    // space
+    MIPSSIM_BAD_ARGUMENT
+} mipssim_status;
+
+typedef struct {
+    engine_kind engine;
+    // See create_memory
+    bool flat_memory;
+    // See program.peephole
+    bool peephole;
+} mipssim_config;
+
+// A simulator (see mipssim_create)
+typedef struct mipssim mipssim;
+
+/**
+ * Sets config to the defaults: the interpreter, paged memory, no peephole
+ * fusion (the same as ./main without options)
+ *
+ * @param config
+ */
+void mipssim_default_config(mipssim_config* config);
+
+/**
+ * Creates a simulator without a program
+ *
+ * @param config NULL for the defaults (see mipssim_default_config)
+ * @param sim set on success (free with mipssim_destroy)
+ * @return MIPSSIM_OK on success, else MIPSSIM_NO_MEMORY
+ */
+mipssim_status mipssim_create(const mipssim_config* config, mipssim** sim);
+
+/**
+ * Frees a simulator and everything it holds
+ *
+ * @param sim may be NULL
+ */
+void mipssim_destroy(mipssim* sim);
+
+/**
+ * Loads the program in a file (see load_image), replacing any program loaded
+ * before, and resets the simulator (see mipssim_reset)
+ *
+ * @param sim
+ * @param path
+ * @param format
+ * @return MIPSSIM_OK on success, else why loading failed (the simulator is
+ * left as it was)
+ */
+mipssim_status mipssim_load_file(mipssim* sim, const char* path,
+                                 image_format format);
+
+/**
+ * Same as mipssim_load_file, for a file's contents already in memory
+ *
+ * @param sim
+ * @param data copied, so it may be freed as soon as this returns
+ * @param size in bytes
+ * @param format
+ * @return MIPSSIM_OK on success, else why loading failed
+ */
+mipssim_status mipssim_load_buffer(mipssim* sim, const void* data,
+                                   size_t size, image_format format);
+
+/**
+ * Same as mipssim_load_file, for instructions in 32-bit form
+ *
+ * @param sim
+ * @param words copied, so they may be freed as soon as this returns
+ * @param num_instructions
+ * @return MIPSSIM_OK on success, else MIPSSIM_NO_MEMORY
+ */
+mipssim_status mipssim_load_words(mipssim* sim, const uint32_t* words,
+                                  uint32_t num_instructions);
+
+/**
+ * Sets every register to 0, the PC to INITIAL_PC, and every byte of memory
+ * to 0, as they are when a program is loaded
+ *
+ * @param sim
+ * @return MIPSSIM_OK on success, MIPSSIM_NO_PROGRAM, or MIPSSIM_NO_MEMORY
+ * (the state is left as it was)
+ */
+mipssim_status mipssim_reset(mipssim* sim);
+
+/**
+ * Executes at most max_steps instructions, stopping early once execution is
+ * over (see mipssim_done)
+ *
+ * @param sim
+ * @param max_steps
+ * @param steps if not NULL, set to the number of instructions executed
+ * @return MIPSSIM_OK, MIPSSIM_NO_PROGRAM, MIPSSIM_INVALID_PC if execution
+ * stopped at an invalid PC, or MIPSSIM_OUT_OF_GUEST_MEMORY if any store since
+ * the program was loaded was dropped
+ */
+mipssim_status mipssim_run(mipssim* sim, uint64_t max_steps,
+                           uint64_t* steps);
+
+/**
+ * Same as mipssim_run without a limit: runs until the program halts, runs
+ * past its last instruction, or reaches an invalid PC
+ */
+mipssim_status mipssim_run_to_completion(mipssim* sim, uint64_t* steps);
+
+/**
+ * Returns whether running would execute nothing (see engine_done)
+ *
+ * @param sim
+ * @return true if execution is over or no program is loaded, else false
+ */
+bool mipssim_done(const mipssim* sim);
+
+/**
+ * Returns the number of instructions executed since the program was loaded
+ * or the simulator reset
+ *
+ * @param sim
+ * @return uint64_t
+ */
+uint64_t mipssim_steps(const mipssim* sim);
+
+/**
+ * Copies out the registers
+ *
+ * @param sim
+ * @param registers NUM_REGISTERS values
+ */
+void mipssim_get_registers(const mipssim* sim, int32_t* registers);
+
+/**
+ * Sets the registers
+ *
+ * @param sim
+ * @param registers NUM_REGISTERS values
+ */
+void mipssim_set_registers(mipssim* sim, const int32_t* registers);
+
+/**
+ * Sets one register
+ *
+ * @param sim
+ * @param reg
+ * @param value
+ * @return MIPSSIM_OK on success, else MIPSSIM_BAD_ARGUMENT
+ */
+mipssim_status mipssim_set_register(mipssim* sim, int reg, int32_t value);
+
+/**
+ * Returns the PC
+ *
+ * @param sim
+ * @return uint32_t
+ */
+uint32_t mipssim_get_pc(const mipssim* sim);
+
+/**
+ * Sets the PC
+ *
+ * @param sim
+ * @param pc
+ */
+void mipssim_set_pc(mipssim* sim, uint32_t pc);
+
+/**
+ * Copies size bytes of guest memory starting at address into data (zeros if
+ * no program is loaded)
+ *
+ * @param sim
+ * @param address
+ * @param data
+ * @param size
+ * @return MIPSSIM_OK on success, else MIPSSIM_BAD_ARGUMENT
+ */
+mipssim_status mipssim_read_memory(const mipssim* sim, uint32_t address,
+                                   void* data, size_t size);
+
+/**
+ * Copies size bytes from data into guest memory starting at address
+ *
+ * @param sim
+ * @param address
+ * @param data
+ * @param size
+ * @return MIPSSIM_OK on success, MIPSSIM_BAD_ARGUMENT, MIPSSIM_NO_PROGRAM, or
+ * MIPSSIM_OUT_OF_GUEST_MEMORY if a page couldn't be allocated
+ */
+mipssim_status mipssim_write_memory(mipssim* sim, uint32_t address,
+                                    const void* data, size_t size);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* mipssim_status_message(mipssim_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MIPSSIM_H
@@ -0,0 +1,228 @@
+#include "output.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Indexed by output_mode
+static const char* const OUTPUT_MODE_NAMES[] = {"table", "array", "json",
+                                                "binary"};
+
+bool parse_output_mode(const char* name, output_mode* mode) {
+    for (unsigned int i = 0; i <= OUTPUT_BINARY; i++) {
+        if (strcmp(name, OUTPUT_MODE_NAMES[i]) == 0) {
+            *mode = (output_mode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends s (without its NUL terminator) at out and returns the new end
+static char* append_string(char* out, const char* s) {
+    size_t length = strlen(s);
+    memcpy(out, s, length);
+    return out + length;
+}
+
+// Appends value in decimal, with a minus sign if negative is set, padded
+// with spaces on the left to width characters
+static char* append_magnitude(char* out, uint32_t value, bool negative,
+                              int width) {
+    char digits[11];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    if (negative) digits[n++] = '-';
+    for (int i = n; i < width; i++) *out++ = ' ';
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+// Same as printf's %*d
+static char* append_decimal(char* out, int32_t value, int width) {
+    // 0u - keeps INT32_MIN's magnitude from overflowing
+    return value < 0 ? append_magnitude(out, 0u - (uint32_t)value, true, width)
+                     : append_magnitude(out, (uint32_t)value, false, width);
+}
+
+// Same as printf's 0x%08x
+static char* append_hex(char* out, uint32_t value) {
+    static const char DIGITS[] = "0123456789abcdef";
+    *out++ = '0';
+    *out++ = 'x';
+    for (int shift = 28; shift >= 0; shift -= 4)
+        *out++ = DIGITS[(value >> shift) & 0xf];
+    return out;
+}
+
+// Appends a row of the table for $index, or for the PC if index is -1
+static char* append_table_row(char* out, int index, int32_t value, bool hex) {
+    if (index < 0) {
+        out = append_string(out, "|   PC | ");
+        if (!hex) out = append_string(out, " ");
+    } else {
+        out = append_string(out, "|  $");
+        out = append_decimal(out, index, 2);
+        out = append_string(out, " | ");
+    }
+    out = hex ? append_hex(out, (uint32_t)value)
+              : append_decimal(out, value, index < 0 ? 9 : 10);
+    return append_string(out, " |\n");
+}
+
+// Appends value as 4 little-endian bytes
+static char* append_word(char* out, uint32_t value) {
+    for (int k = 0; k < 4; k++) *out++ = (char)(value >> (8 * k));
+    return out;
+}
+
+size_t format_registers(char* buf, output_mode mode, bool hex,
+                        const int32_t* registers, uint32_t pc) {
+    char* out = buf;
+    switch (mode) {
+        case OUTPUT_ARRAY:
+            *out++ = '[';
+            for (int i = 0; i <= NUM_REGISTERS; i++) {
+                int32_t value = i < NUM_REGISTERS ? registers[i] : (int32_t)pc;
+                out = hex ? append_hex(out, (uint32_t)value)
+                          : append_decimal(out, value, 0);
+                out = append_string(out, i < NUM_REGISTERS ? ", " : "]\n");
+            }
+            break;
+        case OUTPUT_JSON:
+            out = append_string(out, "{\"registers\": [");
+            for (int i = 0; i < NUM_REGISTERS; i++) {
+                if (i > 0) out = append_string(out, ", ");
+                out = append_decimal(out, registers[i], 0);
+            }
+            out = append_string(out, "], \"pc\": ");
+            out = append_magnitude(out, pc, false, 0);
+            out = append_string(out, "}\n");
+            break;
+        case OUTPUT_BINARY:
+            for (int i = 0; i < NUM_REGISTERS; i++)
+                out = append_word(out, (uint32_t)registers[i]);
+            out = append_word(out, pc);
+            break;
+        case OUTPUT_TABLE:
+        default:
+            out = append_string(out,
+                                "| Name |    Value   |\n"
+                                "---------------------\n");
+            for (int i = 0; i < NUM_REGISTERS; i++)
+                out = append_table_row(out, i, registers[i], hex);
+            out = append_table_row(out, -1, (int32_t)pc, hex);
+            break;
+    }
+    return out - buf;
+}
+
+size_t format_changes(char* buf, output_mode mode, bool hex,
+                      const int32_t* before, const int32_t* registers,
+                      uint32_t pc) {
+    char* out = buf;
+    switch (mode) {
+        case OUTPUT_TABLE:
+            out = append_string(out,
+                                "| Name |    Value   |\n"
+                                "---------------------\n");
+            for (int i = 0; i < NUM_REGISTERS; i++) {
+                if (registers[i] != before[i])
+                    out = append_table_row(out, i, registers[i], hex);
+            }
+            out = append_table_row(out, -1, (int32_t)pc, hex);
+            return out - buf;
+        case OUTPUT_JSON: {
+            out = append_string(out, "{\"changed\": {");
+            bool first = true;
+            for (int i = 0; i < NUM_REGISTERS; i++) {
+                if (registers[i] == before[i]) continue;
+                if (!first) out = append_string(out, ", ");
+                first = false;
+                *out++ = '"';
+                out = append_decimal(out, i, 0);
+                out = append_string(out, "\": ");
+                out = append_decimal(out, registers[i], 0);
+            }
+            out = append_string(out, "}, \"pc\": ");
+            out = append_magnitude(out, pc, false, 0);
+            out = append_string(out, "}\n");
+            return out - buf;
+        }
+        default:
+            return format_registers(buf, mode, hex, registers, pc);
+    }
+}
+
+size_t format_json_string(char* buf, const char* s) {
+    char* out = buf;
+    *out++ = '"';
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c < 0x20) {
+            out = append_string(out, "\\u00");
+            *out++ = "0123456789abcdef"[c >> 4];
+            *out++ = "0123456789abcdef"[c & 0xf];
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    return out - buf;
+}
+
+bool write_all(int fd, const char* buf, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buf, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+void init_state_writer(state_writer* writer, int fd, output_mode mode,
+                       bool hex) {
+    writer->fd = fd;
+    writer->mode = mode;
+    writer->hex = hex;
+    writer->length = 0;
+    writer->failed = false;
+}
+
+// Makes room in writer's buffer for one more state
+static void reserve_state(state_writer* writer) {
+    if (writer->length + OUTPUT_STATE_SIZE > OUTPUT_BUFFER_SIZE)
+        flush_state_writer(writer);
+}
+
+void write_state(state_writer* writer, const int32_t* registers, uint32_t pc) {
+    reserve_state(writer);
+    writer->length +=
+        format_registers(writer->buffer + writer->length, writer->mode,
+                         writer->hex, registers, pc);
+}
+
+void write_changes(state_writer* writer, const int32_t* before,
+                   const int32_t* registers, uint32_t pc) {
+    reserve_state(writer);
+    writer->length +=
+        format_changes(writer->buffer + writer->length, writer->mode,
+                       writer->hex, before, registers, pc);
+}
+
+bool flush_state_writer(state_writer* writer) {
+    if (!write_all(writer->fd, writer->buffer, writer->length))
+        writer->failed = true;
+    writer->length = 0;
+    return !writer->failed;
+}
@@ -0,0 +1,154 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Words in an OUTPUT_BINARY record: every register, then the PC
+#define OUTPUT_RECORD_WORDS (NUM_REGISTERS + 1)
+// Large enough for any single state formatted by format_registers or
+// format_changes
+#define OUTPUT_STATE_SIZE 1024
+// Size of a state_writer's buffer
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+// Ways to print the registers and PC (./main --output=<name>)
+typedef enum {
+    // A table with one row per register, then the PC
+    OUTPUT_TABLE,
+    // One line in array syntax, for autograding (-a)
+    OUTPUT_ARRAY,
+    // One JSON object per line: {"registers": [...], "pc": ...}
+    OUTPUT_JSON,
+    // OUTPUT_RECORD_WORDS 32-bit little-endian words, with nothing in between
+    OUTPUT_BINARY
+} output_mode;
+
+/**
+ * Parses an output mode name as given to --output
+ *
+ * @param name "table" | "array" | "json" | "binary"
+ * @param mode set to the parsed mode on success
+ * @return true on success, else false
+ */
+bool parse_output_mode(const char* name, output_mode* mode);
+
+/**
+ * Formats registers and PC into buf
+ *
+ * Numbers are formatted by hand rather than with printf, which matters when
+ * states are printed after every step or for thousands of runs
+ *
+ * @param buf at least OUTPUT_STATE_SIZE bytes. Not NUL-terminated
+ * @param mode
+ * @param hex true to print values in hex (ignored by OUTPUT_JSON and
+ * OUTPUT_BINARY, which always hold plain numbers)
+ * @param registers
+ * @param pc
+ * @return number of bytes written
+ */
+size_t format_registers(char* buf, output_mode mode, bool hex,
+                        const int32_t* registers, uint32_t pc);
+
+/**
+ * Same as format_registers, but only with the registers that differ from
+ * before, e.g., to show what each step of a program changed. The PC is always
+ * included
+ *
+ * With OUTPUT_TABLE, only the rows of changed registers are printed. With
+ * OUTPUT_JSON, "registers" is replaced by "changed", an object from register
+ * number to value. OUTPUT_ARRAY and OUTPUT_BINARY have fixed layouts, so they
+ * print the full state
+ *
+ * @param buf at least OUTPUT_STATE_SIZE bytes. Not NUL-terminated
+ * @param mode
+ * @param hex
+ * @param before
+ * @param registers
+ * @param pc
+ * @return number of bytes written
+ */
+size_t format_changes(char* buf, output_mode mode, bool hex,
+                      const int32_t* before, const int32_t* registers,
+                      uint32_t pc);
+
+/**
+ * Formats s as a JSON string, with quotes, into buf
+ *
+ * @param buf at least 6 * strlen(s) + 3 bytes. Not NUL-terminated
+ * @param s
+ * @return number of bytes written
+ */
+size_t format_json_string(char* buf, const char* s);
+
+/**
+ * Writes all of buf to fd, in a single write unless it is interrupted or
+ * only partly written
+ *
+ * @param fd
+ * @param buf
+ * @param length
+ * @return true on success, else false
+ */
+bool write_all(int fd, const char* buf, size_t length);
+
+/**
+ * Collects formatted states in a buffer and writes them to a file
+ * descriptor once it fills up, so printing many states takes few system
+ * calls
+ */
+typedef struct {
+    int fd;
+    output_mode mode;
+    bool hex;
+    size_t length;
+    // Set once a write fails
+    bool failed;
+    char buffer[OUTPUT_BUFFER_SIZE];
+} state_writer;
+
+/**
+ * Initializes writer to write to fd
+ *
+ * @note Flush stdio (e.g., fflush(stdout)) before the first state is written
+ * if it shares fd, so output stays in order
+ * @param writer
+ * @param fd
+ * @param mode
+ * @param hex
+ */
+void init_state_writer(state_writer* writer, int fd, output_mode mode,
+                       bool hex);
+
+/**
+ * Adds a state to writer (see format_registers)
+ *
+ * @param writer
+ * @param registers
+ * @param pc
+ */
+void write_state(state_writer* writer, const int32_t* registers, uint32_t pc);
+
+/**
+ * Adds the changes from before to a state to writer (see format_changes)
+ *
+ * @param writer
+ * @param before
+ * @param registers
+ * @param pc
+ */
+void write_changes(state_writer* writer, const int32_t* before,
+                   const int32_t* registers, uint32_t pc);
+
+/**
+ * Writes whatever writer has buffered
+ *
+ * @param writer
+ * @return false if any write by writer failed, else true
+ */
+bool flush_state_writer(state_writer* writer);
+
+#endif  // OUTPUT_H
@@ -0,0 +1,77 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+size_t default_num_threads(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
+}
+
+size_t parallel_num_chunks(size_t count, size_t min_chunk) {
+    if (min_chunk == 0) min_chunk = 1;
+    size_t chunks = count / min_chunk;
+    size_t threads = default_num_threads();
+    if (chunks > threads) chunks = threads;
+    return chunks == 0 ? 1 : chunks;
+}
+
+typedef struct {
+    void (*body)(size_t chunk, size_t begin, size_t end, void* ctx);
+    void* ctx;
+    size_t chunk;
+    size_t begin;
+    size_t end;
+} chunk_task;
+
+static void* run_chunk(void* arg) {
+    chunk_task* task = (chunk_task*)arg;
+    task->body(task->chunk, task->begin, task->end, task->ctx);
+    return NULL;
+}
+
+size_t parallel_for(size_t count, size_t min_chunk,
+                    void (*body)(size_t chunk, size_t begin, size_t end,
+                                 void* ctx),
+                    void* ctx) {
+    size_t num_chunks = parallel_num_chunks(count, min_chunk);
+    if (num_chunks == 1) {
+        body(0, 0, count, ctx);
+        return 1;
+    }
+
+    size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+    chunk_task* tasks = (chunk_task*)malloc(num_chunks * sizeof(chunk_task));
+    pthread_t* threads = (pthread_t*)malloc(num_chunks * sizeof(pthread_t));
+    bool* started = (bool*)calloc(num_chunks, sizeof(bool));
+    for (size_t k = 0; k < num_chunks; k++) {
+        size_t begin = k * chunk_size < count ? k * chunk_size : count;
+        size_t end = begin + chunk_size < count ? begin + chunk_size : count;
+        chunk_task task = {body, ctx, k, begin, end};
+        if (tasks == NULL || threads == NULL || started == NULL) {
+            // Out of memory: still do the work, just serially
+            body(k, begin, end, ctx);
+            continue;
+        }
+        tasks[k] = task;
+        // Chunk 0 runs on the calling thread once the others are started
+        if (k > 0)
+            started[k] =
+                pthread_create(&threads[k], NULL, run_chunk, &tasks[k]) == 0;
+    }
+    if (tasks != NULL && threads != NULL && started != NULL) {
+        run_chunk(&tasks[0]);
+        for (size_t k = 1; k < num_chunks; k++) {
+            if (started[k])
+                pthread_join(threads[k], NULL);
+            else
+                run_chunk(&tasks[k]);
+        }
+    }
+    free(tasks);
+    free(threads);
+    free(started);
+    return num_chunks;
+}
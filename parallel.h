@@ -0,0 +1,44 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+/**
+ * Returns the number of worker threads to use by default (the number of online
+ * host CPUs, at least 1)
+ *
+ * @return size_t
+ */
+size_t default_num_threads(void);
+
+/**
+ * Splits [0, count) into contiguous chunks and calls body on each chunk, with
+ * chunks running concurrently on up to default_num_threads() threads
+ *
+ * Chunks are never smaller than min_chunk items (except the last), so small
+ * inputs run on the calling thread without spawning any threads. The split
+ * depends only on count and min_chunk, which lets callers that need two passes
+ * (e.g., count then fill) get the same chunks both times
+ *
+ * @param count number of items
+ * @param min_chunk minimum items per chunk
+ * @param body called as body(chunk index, begin, end, ctx)
+ * @param ctx passed through to body
+ * @return number of chunks
+ */
+size_t parallel_for(size_t count, size_t min_chunk,
+                    void (*body)(size_t chunk, size_t begin, size_t end,
+                                 void* ctx),
+                    void* ctx);
+
+/**
+ * Returns the number of chunks parallel_for(count, min_chunk, ...) would use,
+ * e.g., to allocate per-chunk results before calling it
+ *
+ * @param count
+ * @param min_chunk
+ * @return size_t
+ */
+size_t parallel_num_chunks(size_t count, size_t min_chunk);
+
+#endif  // PARALLEL_H
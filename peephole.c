@@ -0,0 +1,87 @@
+#include "peephole.h"
+
+#include <stdbool.h>
+
+#include "instructions.h"
+
+void sll_add(fields fields, int32_t* registers, uint32_t* pc) {
+    r_fields r_fields = fields.r;
+    // Same order as the two handlers, so rs == rd reads the shifted value
+    registers[r_fields.rd] = registers[r_fields.rt] << r_fields.shamt;
+    registers[r_fields.rd] = registers[r_fields.rd] + registers[r_fields.rs];
+}
+
+// If next continues the chain of immediates in op (same instruction, reading
+// and writing op's destination), folds it into op and returns true
+static bool fold_immediate(instruction* op, const instruction* next) {
+    i_fields f = op->_fields.i;
+    i_fields g = next->_fields.i;
+    if (next->name != op->name || g.rs != f.rt || g.rt != f.rt) return false;
+    int32_t immediate;
+    switch (op->name) {
+        case ADDI:
+            // (s + a) + b == s + (a + b), with the same wrap-around
+            immediate = f.immediate + g.immediate;
+            if (immediate < INT16_MIN || immediate > INT16_MAX) return false;
+            break;
+        case ORI:
+            immediate = f.immediate | g.immediate;
+            break;
+        case ANDI:
+            immediate = f.immediate & g.immediate;
+            break;
+        default:
+            return false;
+    }
+    op->_fields.i.immediate = (int16_t)immediate;
+    return true;
+}
+
+// If first and second are sll $t, $x, k and add $t, $t, $y (either order),
+// writes the sll_add for them to op and returns true
+static bool fuse_sll_add(const instruction* first, const instruction* second,
+                         instruction* op) {
+    r_fields r = first->_fields.r;
+    r_fields s = second->_fields.r;
+    if (first->name != SLL || second->name != ADD || s.rd != r.rd ||
+        (s.rs != r.rd && s.rt != r.rd))
+        return false;
+    *op = *first;
+    op->_fields.r.rs = s.rs == r.rd ? s.rt : s.rs;
+    op->execute = sll_add;
+    return true;
+}
+
+uint32_t peephole_fuse(const instruction* instructions,
+                       uint32_t num_instructions, instruction* ops,
+                       uint32_t* op_start) {
+    uint32_t num_ops = 0;
+    // Start of the next op, which includes any nops dropped before it
+    uint32_t start = 0;
+    uint32_t i = 0;
+    while (i < num_instructions) {
+        const instruction* instruct = &instructions[i];
+        if (is_nop(instruct)) {
+            i++;
+            continue;
+        }
+        instruction* op = &ops[num_ops];
+        op_start[num_ops++] = start;
+        if (i + 1 < num_instructions &&
+            fuse_sll_add(instruct, &instructions[i + 1], op)) {
+            i += 2;
+        } else {
+            *op = *instruct;
+            i++;
+            const uint32_t folded_from = i;
+            while (i < num_instructions && fold_immediate(op, &instructions[i]))
+                i++;
+            // Its handler may be specialised on the immediate it had
+            if (i != folded_from) specialize_instruction(op);
+        }
+        start = i;
+    }
+    // Trailing nops belong to the last op
+    op_start[num_ops] = num_instructions;
+    return num_ops;
+}
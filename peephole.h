@@ -0,0 +1,50 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+/**
+ * Rewrites a straight-line run of decoded instructions into fewer ops, each
+ * an instruction that stands for one or more of the originals:
+ *
+ * - Instructions that have no effect other than advancing the PC (e.g., nop,
+ *   which is sll $0, $0, 0, or addi $t, $t, 0) are dropped
+ * - Chains of addi, ori or andi on the same register (addi $t, $s, a then
+ *   addi $t, $t, b) become one instruction with a folded immediate, as long
+ *   as it still fits in 16 bits
+ * - sll $t, $x, k followed by add $t, $t, $y (or add $t, $y, $t) becomes one
+ *   sll_add
+ *
+ * Ops don't keep pc up to date: whoever runs them must set pc to the address
+ * of the instruction after the run once they are done. Writes to $0 are kept,
+ * since $0 is an ordinary register in this simulator
+ *
+ * @param instructions none of which may be a control flow instruction (see
+ * is_control_flow)
+ * @param num_instructions
+ * @param ops filled with the ops, at least num_instructions entries
+ * @param op_start op k stands for instructions[op_start[k]] up to (not
+ * including) instructions[op_start[k + 1]], including any dropped ones, so
+ * every op maps back to exact guest PCs. At least num_instructions + 1
+ * entries, and the one after the last op is num_instructions (if every
+ * instruction is dropped, there are no ops)
+ * @return number of ops
+ */
+uint32_t peephole_fuse(const instruction* instructions,
+                       uint32_t num_instructions, instruction* ops,
+                       uint32_t* op_start);
+
+/**
+ * Superinstruction for sll $rd, $rt, shamt then add $rd, $rd, $rs
+ *
+ * Same signature as the handlers in instructions.h, but leaves pc alone
+ *
+ * @param fields r fields as above
+ * @param registers
+ * @param pc
+ */
+void sll_add(fields fields, int32_t* registers, uint32_t* pc);
+
+#endif  // PEEPHOLE_H
@@ -0,0 +1,196 @@
+#include "pipeline.h"
+
+#include <stdlib.h>
+
+#include "instructions.h"
+#include "profile.h"
+
+// Mask of register r, empty for $0
+#define REGISTER_BIT(r) ((1u << (r)) & ~1u)
+
+// Cycles after ID that an instruction's result can be forwarded to EX
+#define EX_LATENCY 2
+#define MEM_LATENCY 3
+
+static pipeline_op time_instruction(const instruction* instruct) {
+    r_fields r = instruct->_fields.r;
+    i_fields f = instruct->_fields.i;
+    pipeline_op op = {0, 0, 0, instruction_destination(instruct), EX_LATENCY};
+    switch (instruction_layout(instruct->name)) {
+        case LAYOUT_RD_RS_RT:
+            op.reads_ex = REGISTER_BIT(r.rs) | REGISTER_BIT(r.rt);
+            break;
+        case LAYOUT_RD_RT_SHAMT:
+            op.reads_ex = REGISTER_BIT(r.rt);
+            break;
+        case LAYOUT_RT_RS_IMMEDIATE:
+            op.reads_ex = REGISTER_BIT(f.rs);
+            if (is_memory_access(instruct->name)) op.latency = MEM_LATENCY;
+            break;
+        case LAYOUT_RS_RT_OFFSET:
+            if (is_memory_access(instruct->name)) {
+                op.reads_ex = REGISTER_BIT(f.rs);
+                op.reads_mem = REGISTER_BIT(f.rt);
+            } else {
+                op.reads_id = REGISTER_BIT(f.rs) | REGISTER_BIT(f.rt);
+            }
+            break;
+        case LAYOUT_RS_RT_OFFSET_RT:
+            op.reads_ex = REGISTER_BIT(f.rs);
+            op.reads_mem = REGISTER_BIT(f.rt);
+            op.latency = MEM_LATENCY;
+            break;
+        case LAYOUT_TARGET:
+            break;
+        case LAYOUT_RS:
+            op.reads_id = REGISTER_BIT(r.rs);
+            break;
+        case LAYOUT_NONE:
+            op.reads_ex = REGISTER_BIT(V0_REGISTER);
+            break;
+    }
+    if (op.destination == 0) op.destination = NO_DESTINATION;
+    return op;
+}
+
+pipeline* create_pipeline(const program* prog) {
+    pipeline* pipe = (pipeline*)calloc(1, sizeof(pipeline));
+    if (pipe == NULL) return NULL;
+    const uint32_t n = prog->num_instructions;
+    // + 1 so that an empty program is still a non-NULL allocation
+    pipe->ops = (pipeline_op*)malloc((n + 1) * sizeof(pipeline_op));
+    pipe->counts = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+    pipe->data_stalls = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+    pipe->control_stalls = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+    if (pipe->ops == NULL || pipe->counts == NULL ||
+        pipe->data_stalls == NULL || pipe->control_stalls == NULL) {
+        free_pipeline(pipe);
+        return NULL;
+    }
+    pipe->num_instructions = n;
+    for (uint32_t i = 0; i < n; i++)
+        pipe->ops[i] = time_instruction(&prog->decoded[i]);
+    // The first instruction is fetched in cycle 0
+    pipe->next_id = 1;
+    return pipe;
+}
+
+void free_pipeline(pipeline* pipe) {
+    if (pipe == NULL) return;
+    free(pipe->ops);
+    free(pipe->counts);
+    free(pipe->data_stalls);
+    free(pipe->control_stalls);
+    free(pipe);
+}
+
+// Returns the first cycle an instruction can be in ID to read the registers
+// in mask in the stage offset cycles after ID
+static inline uint64_t first_id(const uint64_t* ready, uint32_t mask,
+                                uint64_t offset) {
+    uint64_t rv = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        uint64_t cycle = ready[__builtin_ctz(mask)];
+        if (cycle > rv) rv = cycle;
+    }
+    return rv > offset ? rv - offset : 0;
+}
+
+uint64_t run_pipelined(const program* prog, int32_t* registers, uint32_t* pc,
+                       uint64_t max_steps, pipeline* pipe) {
+    const uint32_t end_pc = prog->num_instructions * WORD_SIZE;
+    uint64_t* const ready = pipe->ready;
+    uint64_t next_id = pipe->next_id;
+    uint64_t last_id = pipe->last_id;
+    uint64_t steps = 0;
+    while (steps < max_steps && (*pc) < end_pc && (*pc) % WORD_SIZE == 0) {
+        const uint32_t i = (*pc) >> 2;
+        const instruction* instruct = &prog->decoded[i];
+        if (instruction_halts(instruct, registers)) break;
+        const pipeline_op* op = &pipe->ops[i];
+
+        uint64_t id = next_id;
+        if (op->reads_id != 0) {
+            uint64_t cycle = first_id(ready, op->reads_id, 0);
+            if (cycle > id) {
+                pipe->branch_stalls += cycle - id;
+                pipe->data_stalls[i] += cycle - id;
+                id = cycle;
+            }
+        } else if ((op->reads_ex | op->reads_mem) != 0) {
+            uint64_t cycle = first_id(ready, op->reads_ex, 1);
+            uint64_t mem_cycle = first_id(ready, op->reads_mem, 2);
+            if (mem_cycle > cycle) cycle = mem_cycle;
+            if (cycle > id) {
+                pipe->load_use_stalls += cycle - id;
+                pipe->data_stalls[i] += cycle - id;
+                id = cycle;
+            }
+        }
+
+        const uint32_t next_pc = (*pc) + WORD_SIZE;
+        instruct->execute(instruct->_fields, registers, pc);
+        if (op->destination != NO_DESTINATION)
+            ready[op->destination] = id + op->latency;
+        next_id = id + 1;
+        if (*pc != next_pc) {
+            next_id += PIPELINE_CONTROL_PENALTY;
+            pipe->control_penalties += PIPELINE_CONTROL_PENALTY;
+            pipe->control_stalls[i] += PIPELINE_CONTROL_PENALTY;
+        }
+        last_id = id;
+        pipe->counts[i]++;
+        steps++;
+    }
+    pipe->next_id = next_id;
+    pipe->last_id = last_id;
+    pipe->instructions += steps;
+    return steps;
+}
+
+uint64_t pipeline_cycles(const pipeline* pipe) {
+    // Fetch is the cycle before ID, and WB three after
+    return pipe->instructions == 0 ? 0 : pipe->last_id + 4;
+}
+
+void print_pipeline_report(FILE* out, const program* prog,
+                           const pipeline* pipe) {
+    const uint64_t cycles = pipeline_cycles(pipe);
+    fprintf(out, "Pipeline: %llu instructions in %llu cycles (CPI %.3f)\n\n",
+            (unsigned long long)pipe->instructions,
+            (unsigned long long)cycles,
+            pipe->instructions == 0
+                ? 0
+                : (double)cycles / (double)pipe->instructions);
+
+    fprintf(out, "| Lost to          |       Cycles |       %% |\n");
+    fprintf(out, "---------------------------------------------\n");
+    fprintf(out, "| Load-use stalls  | %12llu | %6.2f%% |\n",
+            (unsigned long long)pipe->load_use_stalls,
+            profile_percent(pipe->load_use_stalls, cycles));
+    fprintf(out, "| Branch stalls    | %12llu | %6.2f%% |\n",
+            (unsigned long long)pipe->branch_stalls,
+            profile_percent(pipe->branch_stalls, cycles));
+    fprintf(out, "| Taken branches   | %12llu | %6.2f%% |\n",
+            (unsigned long long)pipe->control_penalties,
+            profile_percent(pipe->control_penalties, cycles));
+
+    // The PCs that lost the most cycles
+    uint32_t hot[PIPELINE_HOT_PCS];
+    size_t num_hot =
+        select_hottest(pipe->data_stalls, pipe->control_stalls,
+                       pipe->num_instructions, hot, PIPELINE_HOT_PCS);
+    fprintf(out,
+            "\n|     PC     | Instruction |     Executed |       Stalls |"
+            "      Squashed |\n");
+    fprintf(out,
+            "------------------------------------------------------------"
+            "-----------------\n");
+    for (size_t k = 0; k < num_hot; k++)
+        fprintf(out, "| 0x%08x | %-11s | %12llu | %12llu | %13llu |\n",
+                hot[k] * WORD_SIZE,
+                instruction_mnemonic(prog->decoded[hot[k]].name),
+                (unsigned long long)pipe->counts[hot[k]],
+                (unsigned long long)pipe->data_stalls[hot[k]],
+                (unsigned long long)pipe->control_stalls[hot[k]]);
+}
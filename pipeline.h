@@ -0,0 +1,128 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "constants.h"
+#include "program.h"
+
+// Cycles lost after an instruction that doesn't continue to the next PC (a
+// taken branch or a jump): control flow resolves in ID, so the one
+// instruction fetched behind it, the next one, is squashed
+#define PIPELINE_CONTROL_PENALTY 1
+// Number of PCs with the most stall cycles listed by print_pipeline_report
+#define PIPELINE_HOT_PCS 10
+
+/**
+ * Timing of one instruction in the pipeline, precomputed from its decoded
+ * form so that timing it takes no decoding
+ *
+ * Bit r of a mask is set if the instruction reads register r in that stage:
+ * branches and jr compare or jump in ID, stores need their data in MEM, and
+ * everything else reads in EX. $0 is never in a mask since it never waits
+ */
+typedef struct {
+    uint32_t reads_id;
+    uint32_t reads_ex;
+    uint32_t reads_mem;
+    // Register written, or NO_DESTINATION (also for $0)
+    uint8_t destination;
+    // Cycles after its ID that its result can be forwarded to the EX of
+    // another instruction: 2 if computed in EX, 3 if loaded in MEM
+    uint8_t latency;
+} pipeline_op;
+
+/**
+ * A timing model of the classic five-stage MIPS pipeline (IF, ID, EX, MEM,
+ * WB), gathered by run_pipelined
+ *
+ * One instruction is fetched per cycle. Results are forwarded from EX and
+ * MEM to wherever they're needed, so the only data hazards that stall are an
+ * instruction reading a register the instruction just before it loads
+ * (load-use, 1 cycle), and a branch or jr reading in ID a register one of
+ * the last two instructions writes (1 or 2 cycles). Fetch predicts not
+ * taken, and every instruction that doesn't continue to the next PC costs
+ * PIPELINE_CONTROL_PENALTY cycles. Memory always takes one cycle (there are
+ * no caches to miss in)
+ *
+ * Stall cycles are charged to the instruction that waits, and control
+ * penalties to the branch or jump that causes them
+ */
+typedef struct {
+    // Indexed by instruction (pc / WORD_SIZE), as are the counters below
+    pipeline_op* ops;
+    uint32_t num_instructions;
+    uint64_t* counts;
+    // Cycles each instruction waited in ID for its operands
+    uint64_t* data_stalls;
+    // Cycles squashed after each instruction
+    uint64_t* control_stalls;
+
+    uint64_t instructions;
+    // Totals of data_stalls: waits for a load's result in EX or MEM
+    // (load-use), and waits for an operand in ID (branches and jr)
+    uint64_t load_use_stalls;
+    uint64_t branch_stalls;
+    // Total of control_stalls
+    uint64_t control_penalties;
+
+    // Where the pipeline is, so that runs can be split up: the cycle the
+    // next instruction reaches ID if nothing stalls it, the cycle the last
+    // one was in ID, and the cycle each register's latest value can first be
+    // forwarded to EX
+    uint64_t next_id;
+    uint64_t last_id;
+    uint64_t ready[NUM_REGISTERS];
+} pipeline;
+
+/**
+ * Creates an empty pipeline for prog, with the timing of each of its
+ * instructions precomputed
+ *
+ * @param prog
+ * @return pipeline* (free with free_pipeline), or NULL if allocation fails
+ */
+pipeline* create_pipeline(const program* prog);
+
+/**
+ * Frees a pipeline
+ *
+ * @param pipe may be NULL
+ */
+void free_pipeline(pipeline* pipe);
+
+/**
+ * Same as run_interpreter, but also times every executed instruction in pipe
+ *
+ * @param prog
+ * @param registers
+ * @param pc
+ * @param max_steps
+ * @param pipe created for prog
+ * @return number of instructions executed
+ */
+uint64_t run_pipelined(const program* prog, int32_t* registers, uint32_t* pc,
+                       uint64_t max_steps, pipeline* pipe);
+
+/**
+ * Returns the number of cycles from the first instruction's fetch to the
+ * last one's write back
+ *
+ * @param pipe
+ * @return 0 if nothing was executed, else at least pipe->instructions + 4
+ */
+uint64_t pipeline_cycles(const pipeline* pipe);
+
+/**
+ * Prints a human-readable report: cycles, CPI, stall cycles by cause, and the
+ * PIPELINE_HOT_PCS PCs that lost the most cycles
+ *
+ * @param out
+ * @param prog
+ * @param pipe
+ */
+void print_pipeline_report(FILE* out, const program* prog,
+                           const pipeline* pipe);
+
+#endif  // PIPELINE_H
@@ -0,0 +1,192 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "instructions.h"
+
+profile* create_profile(const program* prog) {
+    profile* prof = (profile*)malloc(sizeof(profile));
+    if (prof == NULL) return NULL;
+    prof->num_instructions = prog->num_instructions;
+    // + 1 so that an empty program is still a non-NULL allocation
+    prof->pc_counts =
+        (uint64_t*)calloc((size_t)prog->num_instructions + 1, sizeof(uint64_t));
+    if (prof->pc_counts == NULL) {
+        free(prof);
+        return NULL;
+    }
+    return prof;
+}
+
+void free_profile(profile* prof) {
+    if (prof == NULL) return;
+    free(prof->pc_counts);
+    free(prof);
+}
+
+uint64_t run_profiled(const program* prog, int32_t* registers, uint32_t* pc,
+                      uint64_t max_steps, profile* prof) {
+    const uint32_t end_pc = prog->num_instructions * WORD_SIZE;
+    uint64_t* const pc_counts = prof->pc_counts;
+    uint64_t steps = 0;
+    while (steps < max_steps && (*pc) < end_pc && (*pc) % WORD_SIZE == 0) {
+        uint32_t i = (*pc) >> 2;
+        const instruction* instruct = &prog->decoded[i];
+        if (instruction_halts(instruct, registers)) break;
+        pc_counts[i]++;
+        instruct->execute(instruct->_fields, registers, pc);
+        steps++;
+    }
+    return steps;
+}
+
+void summarize_profile(const program* prog, const profile* prof,
+                       profile_summary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (uint32_t i = 0; i < prof->num_instructions; i++) {
+        uint64_t count = prof->pc_counts[i];
+        if (count == 0) continue;
+        const instruction* instruct = &prog->decoded[i];
+        summary->steps += count;
+        summary->name_counts[instruct->name] += count;
+        r_fields r = instruct->_fields.r;
+        i_fields f = instruct->_fields.i;
+        switch (instruction_layout(instruct->name)) {
+            case LAYOUT_RD_RS_RT:
+                summary->register_reads[r.rs] += count;
+                summary->register_reads[r.rt] += count;
+                summary->register_writes[r.rd] += count;
+                break;
+            case LAYOUT_RD_RT_SHAMT:
+                summary->register_reads[r.rt] += count;
+                summary->register_writes[r.rd] += count;
+                break;
+            case LAYOUT_RT_RS_IMMEDIATE:
+                summary->register_reads[f.rs] += count;
+                summary->register_writes[f.rt] += count;
+                break;
+            case LAYOUT_RS_RT_OFFSET:
+                summary->register_reads[f.rs] += count;
+                summary->register_reads[f.rt] += count;
+                break;
+            case LAYOUT_RS_RT_OFFSET_RT:
+                summary->register_reads[f.rs] += count;
+                summary->register_reads[f.rt] += count;
+                summary->register_writes[f.rt] += count;
+                break;
+            case LAYOUT_TARGET:
+                if (instruct->name == JAL)
+                    summary->register_writes[RA_REGISTER] += count;
+                break;
+            case LAYOUT_RS:
+                summary->register_reads[r.rs] += count;
+                break;
+            case LAYOUT_NONE:
+                // syscall reads the service number
+                summary->register_reads[V0_REGISTER] += count;
+                break;
+        }
+    }
+}
+
+size_t select_hottest(const uint64_t* a, const uint64_t* b, uint32_t n,
+                      uint32_t* out, size_t k) {
+    size_t num_hot = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t total = a[i] + (b != NULL ? b[i] : 0);
+        if (total == 0) continue;
+        size_t j = num_hot < k ? num_hot++ : k;
+        while (j > 0 &&
+               a[out[j - 1]] + (b != NULL ? b[out[j - 1]] : 0) < total) {
+            if (j < k) out[j] = out[j - 1];
+            j--;
+        }
+        if (j < k) out[j] = i;
+    }
+    return num_hot;
+}
+
+double profile_percent(uint64_t count, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * (double)count / (double)total;
+}
+
+void print_profile_report(FILE* out, const program* prog, const profile* prof) {
+    profile_summary summary;
+    summarize_profile(prog, prof, &summary);
+    fprintf(out, "Profile: %llu instructions executed\n\n",
+            (unsigned long long)summary.steps);
+
+    fprintf(out, "| Instruction |        Count |       %% |\n");
+    fprintf(out, "----------------------------------------\n");
+    for (int name = 0; name < NUM_INSTRUCTION_NAMES; name++) {
+        if (summary.name_counts[name] == 0) continue;
+        fprintf(out, "| %-11s | %12llu | %6.2f%% |\n",
+                instruction_mnemonic((instruction_name)name),
+                (unsigned long long)summary.name_counts[name],
+                profile_percent(summary.name_counts[name], summary.steps));
+    }
+
+    uint32_t hot[PROFILE_HOT_PCS];
+    size_t num_hot = select_hottest(prof->pc_counts, NULL,
+                                    prof->num_instructions, hot,
+                                    PROFILE_HOT_PCS);
+    fprintf(out, "\n|     PC     | Instruction |        Count |       %% |\n");
+    fprintf(out, "-----------------------------------------------------\n");
+    for (size_t k = 0; k < num_hot; k++)
+        fprintf(out, "| 0x%08x | %-11s | %12llu | %6.2f%% |\n",
+                hot[k] * WORD_SIZE,
+                instruction_mnemonic(prog->decoded[hot[k]].name),
+                (unsigned long long)prof->pc_counts[hot[k]],
+                profile_percent(prof->pc_counts[hot[k]], summary.steps));
+
+    fprintf(out, "\n| Register |        Reads |       Writes |\n");
+    fprintf(out, "-----------------------------------------\n");
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        if (summary.register_reads[r] == 0 && summary.register_writes[r] == 0)
+            continue;
+        fprintf(out, "|      $%2d | %12llu | %12llu |\n", r,
+                (unsigned long long)summary.register_reads[r],
+                (unsigned long long)summary.register_writes[r]);
+    }
+}
+
+void write_profile_folded(FILE* out, const program* prog, const profile* prof) {
+    for (uint32_t i = 0; i < prof->num_instructions; i++) {
+        if (prof->pc_counts[i] == 0) continue;
+        fprintf(out, "program;%s;0x%08x %llu\n",
+                instruction_mnemonic(prog->decoded[i].name), i * WORD_SIZE,
+                (unsigned long long)prof->pc_counts[i]);
+    }
+}
+
+void write_profile_json(FILE* out, const program* prog, const profile* prof) {
+    profile_summary summary;
+    summarize_profile(prog, prof, &summary);
+    fprintf(out, "{\"steps\": %llu, \"instructions\": {",
+            (unsigned long long)summary.steps);
+    for (int name = 0; name < NUM_INSTRUCTION_NAMES; name++)
+        fprintf(out, "%s\"%s\": %llu", name == 0 ? "" : ", ",
+                instruction_mnemonic((instruction_name)name),
+                (unsigned long long)summary.name_counts[name]);
+    fprintf(out, "}, \"register_reads\": [");
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        fprintf(out, "%s%llu", r == 0 ? "" : ", ",
+                (unsigned long long)summary.register_reads[r]);
+    fprintf(out, "], \"register_writes\": [");
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        fprintf(out, "%s%llu", r == 0 ? "" : ", ",
+                (unsigned long long)summary.register_writes[r]);
+    // Only executed PCs are listed
+    fprintf(out, "], \"pcs\": [");
+    bool first = true;
+    for (uint32_t i = 0; i < prof->num_instructions; i++) {
+        if (prof->pc_counts[i] == 0) continue;
+        fprintf(out, "%s{\"pc\": %u, \"instruction\": \"%s\", \"count\": %llu}",
+                first ? "" : ", ", i * WORD_SIZE,
+                instruction_mnemonic(prog->decoded[i].name),
+                (unsigned long long)prof->pc_counts[i]);
+        first = false;
+    }
+    fprintf(out, "]}\n");
+}
@@ -0,0 +1,135 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "constants.h"
+#include "program.h"
+#include "types.h"
+
+// Number of hottest PCs listed by print_profile_report
+#define PROFILE_HOT_PCS 10
+
+/**
+ * Execution counts gathered by run_profiled
+ *
+ * Only the count per PC is recorded while the program runs. Everything else
+ * (counts per instruction name, register reads and writes) follows from it
+ * because the instruction at each PC never changes, and is computed by
+ * summarize_profile afterwards
+ */
+typedef struct {
+    // pc_counts[i] is the number of times the instruction at i * WORD_SIZE ran
+    uint64_t* pc_counts;
+    uint32_t num_instructions;
+} profile;
+
+typedef struct {
+    uint64_t steps;
+    // Indexed by instruction_name
+    uint64_t name_counts[NUM_INSTRUCTION_NAMES];
+    uint64_t register_reads[NUM_REGISTERS];
+    uint64_t register_writes[NUM_REGISTERS];
+} profile_summary;
+
+/**
+ * Creates an empty profile for prog
+ *
+ * @param prog
+ * @return profile* (free with free_profile), or NULL if allocation fails
+ */
+profile* create_profile(const program* prog);
+
+/**
+ * Frees a profile
+ *
+ * @param prof may be NULL
+ */
+void free_profile(profile* prof);
+
+/**
+ * Same as run_interpreter, but also counts every executed instruction in prof
+ *
+ * This is a separate dispatch loop, so the engines pay nothing for profiling
+ * when it is not used
+ *
+ * @param prog
+ * @param registers
+ * @param pc
+ * @param max_steps
+ * @param prof created for prog
+ * @return number of instructions executed
+ */
+uint64_t run_profiled(const program* prog, int32_t* registers, uint32_t* pc,
+                      uint64_t max_steps, profile* prof);
+
+/**
+ * Computes totals per instruction name and per register from prof
+ *
+ * @param prog
+ * @param prof
+ * @param summary
+ */
+void summarize_profile(const program* prog, const profile* prof,
+                       profile_summary* summary);
+
+/**
+ * Selects the (at most) k indices below n with the highest a[i] + b[i],
+ * highest first and, among equal totals, lowest index first. Indices whose
+ * total is 0 are never selected
+ *
+ * Meant for reports' "hottest" tables: k is small, so this is an insertion
+ * sort into out
+ *
+ * @param a
+ * @param b added to a, or NULL to select by a alone
+ * @param n
+ * @param out room for k indices
+ * @param k
+ * @return number of indices selected
+ */
+size_t select_hottest(const uint64_t* a, const uint64_t* b, uint32_t n,
+                      uint32_t* out, size_t k);
+
+/**
+ * Returns count as a percentage of total, for reports
+ *
+ * @param count
+ * @param total
+ * @return double 0 if total is 0
+ */
+double profile_percent(uint64_t count, uint64_t total);
+
+/**
+ * Prints a human-readable report: instruction histogram, the
+ * PROFILE_HOT_PCS hottest PCs, and register read/write counts
+ *
+ * @param out
+ * @param prog
+ * @param prof
+ */
+void print_profile_report(FILE* out, const program* prog, const profile* prof);
+
+/**
+ * Writes prof in folded-stack format (one "program;mnemonic;pc count" line
+ * per executed PC), which flamegraph.pl and speedscope can render
+ *
+ * @param out
+ * @param prog
+ * @param prof
+ */
+void write_profile_folded(FILE* out, const program* prog, const profile* prof);
+
+/**
+ * Writes prof and its summary as a JSON object
+ *
+ * @param out
+ * @param prog
+ * @param prof
+ */
+void write_profile_json(FILE* out, const program* prog, const profile* prof);
+
+#endif  // PROFILE_H
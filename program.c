@@ -0,0 +1,54 @@
+#include "program.h"
+
+#include <stdlib.h>
+
+#include "block.h"
+#include "instructions.h"
+#include "jit.h"
+#include "parallel.h"
+
+typedef struct {
+    const uint32_t* instructions;
+    instruction* decoded;
+} decode_job;
+
+static void decode_chunk(size_t chunk, size_t begin, size_t end, void* ctx) {
+    decode_job* job = (decode_job*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        decode_instruction(job->instructions[i], &job->decoded[i]);
+        specialize_instruction(&job->decoded[i]);
+    }
+}
+
+program* create_program(const uint32_t* instructions,
+                        uint32_t num_instructions) {
+    program* prog = (program*)malloc(sizeof(program));
+    if (prog == NULL) return NULL;
+
+    // aligned_alloc requires size to be a multiple of the alignment
+    size_t size = (size_t)num_instructions * sizeof(instruction);
+    size = (size + PROGRAM_ALIGNMENT - 1) & ~(size_t)(PROGRAM_ALIGNMENT - 1);
+    if (size == 0) size = PROGRAM_ALIGNMENT;
+    prog->decoded = (instruction*)aligned_alloc(PROGRAM_ALIGNMENT, size);
+    if (prog->decoded == NULL) {
+        free(prog);
+        return NULL;
+    }
+
+    decode_job job = {instructions, prog->decoded};
+    parallel_for(num_instructions, MIN_DECODE_CHUNK, decode_chunk, &job);
+    prog->num_instructions = num_instructions;
+    prog->jit = NULL;
+    prog->blocks = NULL;
+    prog->peephole = false;
+
+    return prog;
+}
+
+void free_program(program* prog) {
+    if (prog == NULL) return;
+    jit_free(prog->jit);
+    free_block_cache(prog->blocks);
+    free(prog->decoded);
+    free(prog);
+}
@@ -0,0 +1,60 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+// Decoded instructions are stored in a cache-line-aligned array so that the
+// execution loop walks memory sequentially
+#define PROGRAM_ALIGNMENT 64
+// Large programs are decoded in parallel, at least this many instructions per
+// thread
+#define MIN_DECODE_CHUNK (1 << 16)
+
+// Native code generated for a program by the JIT engine (see jit.h)
+typedef struct jit_program jit_program;
+// Basic blocks of a program used by the interpreter (see block.h)
+typedef struct block_cache block_cache;
+
+/**
+ * A program image that has been decoded once, ahead of execution
+ *
+ * decoded[i] is the decoded form of the instruction at address i * WORD_SIZE,
+ * so executing the instruction at pc is a single indexed load followed by a
+ * call through decoded[pc >> 2].execute. Nothing is re-decoded while the
+ * program runs
+ *
+ * Engines that translate the program further cache the result here (NULL
+ * until first used) so that it is reused across calls, e.g., in step mode
+ */
+typedef struct {
+    instruction* decoded;
+    uint32_t num_instructions;
+    jit_program* jit;
+    block_cache* blocks;
+    // If true, the interpreter fuses each block's instructions with
+    // peephole_fuse (see peephole.h). false by default; set it before the
+    // first run
+    bool peephole;
+} program;
+
+/**
+ * Decodes every instruction in instructions into a newly allocated program
+ *
+ * @param instructions instructions in 32-bit form
+ * @param num_instructions number of instructions
+ * @return program* (free with free_program), or NULL if allocation fails
+ */
+program* create_program(const uint32_t* instructions,
+                        uint32_t num_instructions);
+
+/**
+ * Frees a program created by create_program, including any cached
+ * translations
+ *
+ * @param prog may be NULL
+ */
+void free_program(program* prog);
+
+#endif  // PROGRAM_H
@@ -0,0 +1,216 @@
+#include "reduce.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "instructions.h"
+
+// What becomes of each original instruction
+typedef enum { REDUCE_DROP, REDUCE_KEEP, REDUCE_FOLD } reduce_action;
+
+// Registers an instruction reads and writes
+typedef struct {
+    uint8_t reads[2];
+    uint8_t num_reads;
+    uint8_t write;
+} operands;
+
+static operands find_operands(const instruction* instruct) {
+    r_fields r = instruct->_fields.r;
+    i_fields f = instruct->_fields.i;
+    operands rv;
+    switch (instruction_layout(instruct->name)) {
+        case LAYOUT_RD_RS_RT:
+            rv = (operands){{r.rs, r.rt}, 2, r.rd};
+            break;
+        case LAYOUT_RD_RT_SHAMT:
+            rv = (operands){{r.rt, 0}, 1, r.rd};
+            break;
+        default:
+            rv = (operands){{f.rs, 0}, 1, f.rt};
+            break;
+    }
+    return rv;
+}
+
+// Returns whether instruct's result is the same whatever the values of its
+// unknown inputs, e.g., sub $d, $x, $x
+static bool ignores_unknown_inputs(const instruction* instruct,
+                                   const bool* known, const int32_t* values) {
+    r_fields r = instruct->_fields.r;
+    int16_t immediate = instruct->_fields.i.immediate;
+#define KNOWN_AS(reg, value) (known[reg] && values[reg] == (value))
+    switch (instruct->name) {
+        case SUB:
+            return r.rs == r.rt;
+        case AND:
+            return KNOWN_AS(r.rs, 0) || KNOWN_AS(r.rt, 0);
+        case OR:
+        case NOR:
+            return KNOWN_AS(r.rs, -1) || KNOWN_AS(r.rt, -1);
+        case ANDI:
+            return immediate == 0;
+        case ORI:
+            // The immediate is sign-extended
+            return immediate == -1;
+        default:
+            return false;
+    }
+#undef KNOWN_AS
+}
+
+static uint32_t encode_i_type(uint32_t opcode, uint32_t rt, uint32_t rs,
+                              int16_t immediate) {
+    return (opcode << OPCODE_END_BIT) | (rs << RS_END_BIT) |
+           (rt << RT_END_BIT) | (uint16_t)immediate;
+}
+
+// Writes instructions that set reg to value, whatever it was before, to out
+// and returns how many (at most 4)
+static uint32_t emit_constant(uint32_t* out, uint8_t reg, int32_t value) {
+    uint32_t n = 0;
+    out[n++] = encode_i_type(ANDI_OPCODE, reg, reg, 0);
+    if (value == 0) return n;
+    if (value >= INT16_MIN && value <= INT16_MAX) {
+        out[n++] = encode_i_type(ADDI_OPCODE, reg, reg, (int16_t)value);
+        return n;
+    }
+    // value is high << 16 plus the sign-extended low half, so high is
+    // rounded up when the low half is negative
+    int16_t low = (int16_t)(value & 0xffff);
+    int16_t high = (int16_t)((((uint32_t)value + 0x8000) >> 16) & 0xffff);
+    out[n++] = encode_i_type(ORI_OPCODE, reg, reg, high);
+    out[n++] = ((uint32_t)reg << RT_END_BIT) | ((uint32_t)reg << RD_END_BIT) |
+               (16 << SHAMT_END_BIT) | SLL_FUNCT;
+    if (low != 0) out[n++] = encode_i_type(ADDI_OPCODE, reg, reg, low);
+    return n;
+}
+
+// reduce_program with its scratch space: decoded, actions and results have
+// num_instructions entries, and words has room for the reduced program
+static reduce_status reduce(const uint32_t* instructions,
+                            uint32_t num_instructions, const int32_t* initial,
+                            instruction* decoded, uint8_t* actions,
+                            int32_t* results, uint32_t* words,
+                            reduced_program* out) {
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        decode_instruction(instructions[i], &decoded[i]);
+        if (is_control_flow(decoded[i].name) ||
+            is_memory_access(decoded[i].name))
+            return REDUCE_NOT_STRAIGHT_LINE;
+    }
+
+    // Forward: run every instruction on values, where only registers marked
+    // known hold meaningful values. actions marks folds for now
+    int32_t values[NUM_REGISTERS];
+    bool known[NUM_REGISTERS];
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        values[r] = initial != NULL ? initial[r] : 0;
+        known[r] = initial != NULL;
+    }
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        const instruction* instruct = &decoded[i];
+        operands ops = find_operands(instruct);
+        bool result_known = ignores_unknown_inputs(instruct, known, values);
+        if (!result_known) {
+            result_known = true;
+            for (int k = 0; k < ops.num_reads; k++)
+                result_known &= known[ops.reads[k]];
+        }
+        uint32_t pc = 0;
+        instruct->execute(instruct->_fields, values, &pc);
+        known[ops.write] = result_known;
+        actions[i] = result_known ? REDUCE_FOLD : REDUCE_KEEP;
+        results[i] = values[ops.write];
+    }
+    out->final_known = true;
+    for (int r = 0; r < NUM_REGISTERS; r++) out->final_known &= known[r];
+    if (out->final_known) {
+        memcpy(out->final_registers, values, sizeof(values));
+        out->num_dropped = num_instructions;
+        return REDUCE_OK;
+    }
+
+    // Backward: registers not known at the end are read by whoever runs the
+    // program. A write is dropped if nothing reads it before it's overwritten
+    bool live[NUM_REGISTERS];
+    for (int r = 0; r < NUM_REGISTERS; r++) live[r] = !known[r];
+    for (uint32_t i = num_instructions; i-- > 0;) {
+        operands ops = find_operands(&decoded[i]);
+        if (!live[ops.write]) {
+            actions[i] = REDUCE_DROP;
+            out->num_dropped++;
+            continue;
+        }
+        live[ops.write] = false;
+        if (actions[i] == REDUCE_FOLD) {
+            out->num_folded++;
+            continue;
+        }
+        for (int k = 0; k < ops.num_reads; k++) live[ops.reads[k]] = true;
+    }
+
+    // Emit, remembering which registers were last set to a constant so that
+    // final values already in place aren't set again
+    bool set[NUM_REGISTERS] = {false};
+    int32_t set_to[NUM_REGISTERS];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        uint8_t write = find_operands(&decoded[i]).write;
+        if (actions[i] == REDUCE_KEEP) {
+            words[n++] = instructions[i];
+            set[write] = false;
+        } else if (actions[i] == REDUCE_FOLD) {
+            n += emit_constant(&words[n], write, results[i]);
+            set[write] = true;
+            set_to[write] = results[i];
+        }
+    }
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        if (known[r] && !(set[r] && set_to[r] == values[r]))
+            n += emit_constant(&words[n], r, values[r]);
+    out->words = words;
+    out->num_instructions = n;
+    return REDUCE_OK;
+}
+
+reduce_status reduce_program(const uint32_t* instructions,
+                             uint32_t num_instructions, const int32_t* initial,
+                             reduced_program* out) {
+    memset(out, 0, sizeof(*out));
+    // + 1 so that an empty program is still a non-NULL allocation
+    size_t count = (size_t)num_instructions + 1;
+    instruction* decoded = (instruction*)malloc(count * sizeof(instruction));
+    uint8_t* actions = (uint8_t*)malloc(count);
+    int32_t* results = (int32_t*)malloc(count * sizeof(int32_t));
+    // Up to 4 instructions per folded instruction, and per register at the
+    // end
+    uint32_t* words = (uint32_t*)malloc(
+        ((size_t)num_instructions + NUM_REGISTERS) * 4 * sizeof(uint32_t));
+    reduce_status status = REDUCE_NO_MEMORY;
+    if (decoded != NULL && actions != NULL && results != NULL && words != NULL)
+        status = reduce(instructions, num_instructions, initial, decoded,
+                        actions, results, words, out);
+    if (out->words != words) free(words);
+    free(decoded);
+    free(actions);
+    free(results);
+    return status;
+}
+
+void free_reduced(reduced_program* reduced) {
+    free(reduced->words);
+    reduced->words = NULL;
+}
+
+const char* reduce_status_message(reduce_status status) {
+    switch (status) {
+        case REDUCE_OK:
+            return "Success";
+        case REDUCE_NOT_STRAIGHT_LINE:
+            return "Program has control flow or memory instructions";
+        case REDUCE_NO_MEMORY:
+        default:
+            return "Out of memory";
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+typedef enum {
+    REDUCE_OK,
+    // The program has control flow or memory instructions
+    REDUCE_NOT_STRAIGHT_LINE,
+    REDUCE_NO_MEMORY
+} reduce_status;
+
+/**
+ * A program reduced by reduce_program
+ *
+ * Running words from any initial state leaves the registers exactly as
+ * running the original program would (the final PC and step count are those
+ * of the shorter program, of course)
+ */
+typedef struct {
+    // Reduced program in 32-bit form, NULL if final_known
+    uint32_t* words;
+    uint32_t num_instructions;
+    // Original instructions dropped because nothing reads what they write
+    uint32_t num_dropped;
+    // Original instructions replaced by the constant they compute
+    uint32_t num_folded;
+    // If every register's final value is known (always the case when the
+    // initial state is), final_registers holds them and there is no program
+    bool final_known;
+    int32_t final_registers[NUM_REGISTERS];
+} reduced_program;
+
+/**
+ * Reduces a straight-line program (no control flow or memory instructions),
+ * which is a pure function from initial to final registers
+ *
+ * Values are propagated forward from initial: an instruction whose inputs
+ * are known (or whose result doesn't depend on them, e.g., sub $d, $x, $x) is
+ * replaced by instructions that set its result directly. Then, going
+ * backward from the end (where every register whose final value isn't known
+ * is read), instructions whose result is overwritten before it is read are
+ * dropped. Registers whose final value is known are set at the end
+ *
+ * @param instructions in 32-bit form
+ * @param num_instructions
+ * @param initial initial registers, or NULL if they are unknown
+ * @param out filled in on success (free with free_reduced)
+ * @return REDUCE_OK on success, else why the program can't be reduced
+ */
+reduce_status reduce_program(const uint32_t* instructions,
+                             uint32_t num_instructions, const int32_t* initial,
+                             reduced_program* out);
+
+/**
+ * Frees the program of a reduced_program filled in by reduce_program
+ *
+ * @param reduced
+ */
+void free_reduced(reduced_program* reduced);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* reduce_status_message(reduce_status status);
+
+#endif  // REDUCE_H
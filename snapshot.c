@@ -0,0 +1,302 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of page numbers in the address space
+#define NUM_PAGE_NUMBERS ((uint64_t)1 << (32 - PAGE_BITS))
+
+uint64_t program_hash(const uint32_t* words, uint32_t num_instructions) {
+    return program_hash_extend(PROGRAM_HASH_EMPTY, words, num_instructions);
+}
+
+uint64_t program_hash_extend(uint64_t hash, const uint32_t* words,
+                             uint32_t num_instructions) {
+    // 64-bit FNV-1a over the words' bytes
+    const uint8_t* bytes = (const uint8_t*)words;
+    for (size_t i = 0; i < (size_t)num_instructions * sizeof(uint32_t); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3u;
+    }
+    return hash;
+}
+
+// Returns an id that no other snapshot is likely to have, and never 0
+static uint64_t new_snapshot_id(void) {
+    static uint64_t counter = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    // splitmix64 of the time, process and a per-process counter
+    uint64_t x = ((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec) ^
+                 ((uint64_t)getpid() << 40) ^
+                 __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+    x += 0x9e3779b97f4a7c15u;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+    x ^= x >> 31;
+    return x != 0 ? x : 1;
+}
+
+// Offset of the first page's contents in a snapshot with num_pages pages
+static uint64_t pages_offset(uint32_t num_pages) {
+    uint64_t end = sizeof(snapshot_header) + (uint64_t)num_pages * 4;
+    return (end + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+// Checks the parts of header that don't depend on the rest of the file
+static snapshot_status check_header(const snapshot_header* header) {
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+        return SNAPSHOT_BAD_FORMAT;
+    if (header->version != SNAPSHOT_VERSION) return SNAPSHOT_BAD_VERSION;
+    // An incremental snapshot has both a parent path and id, else neither
+    bool has_parent = header->parent[0] != '\0';
+    if (memchr(header->parent, '\0', sizeof(header->parent)) == NULL ||
+        header->id == 0 || has_parent != (header->parent_id != 0))
+        return SNAPSHOT_BAD_FORMAT;
+    return SNAPSHOT_OK;
+}
+
+snapshot_status read_snapshot_header(const char* path,
+                                     snapshot_header* header) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return SNAPSHOT_OPEN_FAILED;
+    size_t read = fread(header, sizeof(*header), 1, file);
+    fclose(file);
+    if (read != 1) return SNAPSHOT_BAD_FORMAT;
+    return check_header(header);
+}
+
+// Pages of a memory, as collected by memory_for_each_page
+typedef struct {
+    uint32_t* numbers;
+    const uint8_t** pages;
+    uint32_t count;
+    uint32_t capacity;
+    bool out_of_memory;
+} page_list;
+
+static void collect_page(uint32_t page_number, const uint8_t* page,
+                         void* context) {
+    page_list* list = (page_list*)context;
+    if (list->out_of_memory) return;
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        uint32_t* numbers = (uint32_t*)realloc(
+            list->numbers, capacity * sizeof(uint32_t));
+        if (numbers != NULL) list->numbers = numbers;
+        const uint8_t** pages = (const uint8_t**)realloc(
+            list->pages, capacity * sizeof(const uint8_t*));
+        if (pages != NULL) list->pages = pages;
+        if (numbers == NULL || pages == NULL) {
+            list->out_of_memory = true;
+            return;
+        }
+        list->capacity = capacity;
+    }
+    list->numbers[list->count] = page_number;
+    list->pages[list->count++] = page;
+}
+
+// Writes header and the pages in list to file
+static bool write_snapshot(FILE* file, const snapshot_header* header,
+                           const page_list* list) {
+    static const uint8_t zeros[PAGE_SIZE] = {0};
+    uint64_t padding = pages_offset(list->count) - sizeof(*header) -
+                       (uint64_t)list->count * sizeof(uint32_t);
+    if (fwrite(header, sizeof(*header), 1, file) != 1 ||
+        fwrite(list->numbers, sizeof(uint32_t), list->count, file) !=
+            list->count ||
+        fwrite(zeros, 1, padding, file) != padding)
+        return false;
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (fwrite(list->pages[i], PAGE_SIZE, 1, file) != 1) return false;
+    }
+    return true;
+}
+
+snapshot_status save_snapshot(const char* path, const char* parent,
+                              const uint32_t* words, uint32_t num_instructions,
+                              const snapshot_state* state, guest_memory* mem) {
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.pc = state->pc;
+    header.steps = state->steps;
+    header.id = new_snapshot_id();
+    header.program_hash = program_hash(words, num_instructions);
+    header.num_instructions = num_instructions;
+    memcpy(header.registers, state->registers, sizeof(header.registers));
+    if (parent != NULL) {
+        snapshot_header parent_header;
+        snapshot_status status = read_snapshot_header(parent, &parent_header);
+        if (status != SNAPSHOT_OK) return status;
+        char parent_path[PATH_MAX];
+        if (parent_header.id != mem->snapshot_id ||
+            realpath(parent, parent_path) == NULL ||
+            strlen(parent_path) >= sizeof(header.parent))
+            return SNAPSHOT_BAD_PARENT;
+        strcpy(header.parent, parent_path);
+        header.parent_id = parent_header.id;
+    }
+
+    page_list list = {NULL, NULL, 0, 0, false};
+    if (!memory_for_each_page(mem, parent != NULL, collect_page, &list) ||
+        list.out_of_memory) {
+        free(list.numbers);
+        free(list.pages);
+        return SNAPSHOT_NO_MEMORY;
+    }
+    header.num_pages = list.count;
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path,
+                 (int)getpid()) >= (int)sizeof(temp_path)) {
+        free(list.numbers);
+        free(list.pages);
+        return SNAPSHOT_OPEN_FAILED;
+    }
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        free(list.numbers);
+        free(list.pages);
+        return SNAPSHOT_OPEN_FAILED;
+    }
+    bool written = write_snapshot(file, &header, &list);
+    written &= fclose(file) == 0;
+    free(list.numbers);
+    free(list.pages);
+    if (!written || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return SNAPSHOT_WRITE_FAILED;
+    }
+    memory_clear_dirty(mem);
+    mem->snapshot_id = header.id;
+    return SNAPSHOT_OK;
+}
+
+// Sets resolved to where the parent of the snapshot at path is (see
+// snapshot_header.parent)
+static bool resolve_parent(const char* path, const char* parent,
+                           char* resolved, size_t size) {
+    const char* name = strrchr(parent, '/');
+    const char* directory_end = strrchr(path, '/');
+    int length;
+    if (access(parent, F_OK) == 0 || name == NULL)
+        length = snprintf(resolved, size, "%s", parent);
+    else if (directory_end == NULL)
+        length = snprintf(resolved, size, "%s", name + 1);
+    else
+        length = snprintf(resolved, size, "%.*s/%s",
+                          (int)(directory_end - path), path, name + 1);
+    return length >= 0 && (size_t)length < size;
+}
+
+// restore_snapshot for the snapshot at path, which must have id expected_id
+// unless it's 0, and is the depth'th in a chain of incremental snapshots
+static snapshot_status restore_chain(const char* path, const uint32_t* words,
+                                     uint32_t num_instructions,
+                                     snapshot_state* state, guest_memory* mem,
+                                     uint64_t expected_id, int depth) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return depth == 0 ? SNAPSHOT_OPEN_FAILED : SNAPSHOT_BAD_PARENT;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        return SNAPSHOT_BAD_FORMAT;
+    }
+    // Private and writable, so stores to a page copy it instead of changing
+    // the file
+    size_t file_size = (size_t)st.st_size;
+    uint8_t* file = (uint8_t*)mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return SNAPSHOT_NO_MEMORY;
+
+    snapshot_header header;
+    memcpy(&header, file, sizeof(header));
+    const uint32_t* page_numbers =
+        (const uint32_t*)(file + sizeof(snapshot_header));
+    snapshot_status status = check_header(&header);
+    if (status == SNAPSHOT_OK &&
+        pages_offset(header.num_pages) +
+                (uint64_t)header.num_pages * PAGE_SIZE >
+            file_size)
+        status = SNAPSHOT_BAD_FORMAT;
+    for (uint32_t i = 0; status == SNAPSHOT_OK && i < header.num_pages; i++) {
+        if (page_numbers[i] >= NUM_PAGE_NUMBERS) status = SNAPSHOT_BAD_FORMAT;
+    }
+    if (status == SNAPSHOT_OK &&
+        (header.num_instructions > num_instructions ||
+         header.program_hash != program_hash(words, header.num_instructions)))
+        status = SNAPSHOT_PROGRAM_MISMATCH;
+    if (status == SNAPSHOT_OK && expected_id != 0 && header.id != expected_id)
+        status = SNAPSHOT_BAD_PARENT;
+    if (status == SNAPSHOT_OK && header.parent[0] != '\0') {
+        char parent[PATH_MAX];
+        if (depth + 1 >= SNAPSHOT_MAX_CHAIN ||
+            !resolve_parent(path, header.parent, parent, sizeof(parent)))
+            status = SNAPSHOT_BAD_PARENT;
+        else
+            status = restore_chain(parent, words, num_instructions, state, mem,
+                                   header.parent_id, depth + 1);
+    }
+    // A flat memory gets copies of the pages, so the file can go
+    bool keep_mapping = status == SNAPSHOT_OK && header.num_pages > 0 &&
+                        mem->flat == NULL;
+    if (keep_mapping && !memory_adopt_mapping(mem, file, file_size)) {
+        status = SNAPSHOT_NO_MEMORY;
+        keep_mapping = false;
+    }
+    uint8_t* pages = file + pages_offset(header.num_pages);
+    for (uint32_t i = 0; status == SNAPSHOT_OK && i < header.num_pages; i++) {
+        uint8_t* page = pages + (size_t)i * PAGE_SIZE;
+        if (!memory_map_page(mem, page_numbers[i], page))
+            status = SNAPSHOT_NO_MEMORY;
+    }
+    if (!keep_mapping) munmap(file, file_size);
+    if (status != SNAPSHOT_OK) return status;
+
+    memcpy(state->registers, header.registers, sizeof(state->registers));
+    state->pc = header.pc;
+    state->steps = header.steps;
+    mem->snapshot_id = header.id;
+    return SNAPSHOT_OK;
+}
+
+snapshot_status restore_snapshot(const char* path, const uint32_t* words,
+                                 uint32_t num_instructions,
+                                 snapshot_state* state, guest_memory* mem) {
+    return restore_chain(path, words, num_instructions, state, mem, 0, 0);
+}
+
+const char* snapshot_status_message(snapshot_status status) {
+    switch (status) {
+        case SNAPSHOT_OK:
+            return "Success";
+        case SNAPSHOT_OPEN_FAILED:
+            return "Failed to open file";
+        case SNAPSHOT_WRITE_FAILED:
+            return "Failed to write file";
+        case SNAPSHOT_BAD_FORMAT:
+            return "File is not a snapshot";
+        case SNAPSHOT_BAD_VERSION:
+            return "Snapshot was written by another version";
+        case SNAPSHOT_PROGRAM_MISMATCH:
+            return "Snapshot is of another program";
+        case SNAPSHOT_BAD_PARENT:
+            return "Parent snapshot is missing or doesn't match";
+        case SNAPSHOT_NO_MEMORY:
+        default:
+            return "Out of memory";
+    }
+}
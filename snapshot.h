@@ -0,0 +1,165 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "memory.h"
+
+// First bytes of every snapshot file
+#define SNAPSHOT_MAGIC "MIPSSNAP"
+// Bumped whenever the layout of snapshot files changes
+#define SNAPSHOT_VERSION 1
+// Longest parent path (including the NUL terminator) a snapshot can record
+#define SNAPSHOT_PARENT_MAX 1024
+// Longest chain of incremental snapshots restore_snapshot follows
+#define SNAPSHOT_MAX_CHAIN 64
+
+typedef enum {
+    SNAPSHOT_OK,
+    SNAPSHOT_OPEN_FAILED,
+    SNAPSHOT_WRITE_FAILED,
+    // Not a snapshot file, or a truncated or corrupt one
+    SNAPSHOT_BAD_FORMAT,
+    // A snapshot file written by another version of the simulator
+    SNAPSHOT_BAD_VERSION,
+    // The snapshot was taken while running another program
+    SNAPSHOT_PROGRAM_MISMATCH,
+    // The parent of an incremental snapshot isn't the snapshot its memory
+    // was taken relative to (or the chain of parents is too long)
+    SNAPSHOT_BAD_PARENT,
+    SNAPSHOT_NO_MEMORY
+} snapshot_status;
+
+// Registers, PC and step count of a run, as saved in a snapshot
+typedef struct {
+    int32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    // Instructions executed since the program started
+    uint64_t steps;
+} snapshot_state;
+
+/**
+ * Start of a snapshot file, in the host's byte order
+ *
+ * It's followed by num_pages page numbers (uint32_t, ascending), then, from
+ * the next multiple of PAGE_SIZE in the file, the contents of those pages,
+ * PAGE_SIZE bytes each. Since pages are aligned in the file, restoring maps
+ * the file and uses its pages in place
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pc;
+    uint64_t steps;
+    // Identifies this snapshot (never 0)
+    uint64_t id;
+    // id of the parent of an incremental snapshot, else 0
+    uint64_t parent_id;
+    // Identifies the first num_instructions instructions of the program,
+    // which are all the run depended on (see program_hash)
+    uint64_t program_hash;
+    uint32_t num_instructions;
+    uint32_t num_pages;
+    int32_t registers[NUM_REGISTERS];
+    // Absolute path of the parent of an incremental snapshot, else empty. If
+    // there's no file there (e.g., both were moved to another machine), the
+    // file with the same name in this one's directory is used
+    char parent[SNAPSHOT_PARENT_MAX];
+} snapshot_header;
+
+// program_hash of no instructions
+#define PROGRAM_HASH_EMPTY 0xcbf29ce484222325u
+
+/**
+ * Returns a hash of a program's instruction words, which snapshots record so
+ * that they are only restored for the program they were taken of
+ *
+ * @param words
+ * @param num_instructions
+ * @return uint64_t
+ */
+uint64_t program_hash(const uint32_t* words, uint32_t num_instructions);
+
+/**
+ * Returns the program_hash of the instructions hashed to hash followed by
+ * words, so the hashes of several prefixes of a program take one pass
+ *
+ * @param hash program_hash of the instructions before words
+ * @param words
+ * @param num_instructions
+ * @return uint64_t
+ */
+uint64_t program_hash_extend(uint64_t hash, const uint32_t* words,
+                             uint32_t num_instructions);
+
+/**
+ * Saves the state of a run of a program, along with its memory, to path
+ *
+ * Without a parent, every page of mem is saved. With one, the snapshot is
+ * incremental: only the pages stored to since mem was last saved to or
+ * restored from parent are, and restoring it restores parent first. Either
+ * way, mem's pages are then marked clean, so a later snapshot can be
+ * incremental to this one
+ *
+ * The file is written under a temporary name and renamed to path once
+ * complete, so path never holds a partial snapshot
+ *
+ * @param path
+ * @param parent path of the snapshot mem was last saved to or restored
+ * from, or NULL for a full snapshot
+ * @param words instruction words of the program being run
+ * @param num_instructions number of instructions of words the run depended
+ * on, i.e., at least one past every instruction executed so far. The snapshot
+ * can be restored for any program that starts with these instructions, which
+ * lets it survive edits further on (see checkpoint.h). Normally the whole
+ * program
+ * @param state
+ * @param mem
+ * @return SNAPSHOT_OK on success, else the reason saving failed
+ */
+snapshot_status save_snapshot(const char* path, const char* parent,
+                              const uint32_t* words, uint32_t num_instructions,
+                              const snapshot_state* state, guest_memory* mem);
+
+/**
+ * Restores a run of a program saved by save_snapshot (and the chain of
+ * parents of an incremental snapshot) into state and mem
+ *
+ * The snapshot files are mapped copy-on-write and mem's pages point into the
+ * mappings, so nothing is read until the program touches it and a page is
+ * only copied when stored to. mem keeps the mappings until it is freed
+ *
+ * @param path
+ * @param words instruction words of the program, which must start with the
+ * instructions the snapshot was taken of
+ * @param num_instructions
+ * @param state set on success
+ * @param mem an empty memory (see create_memory) that is filled in on success
+ * @return SNAPSHOT_OK on success, else the reason restoring failed
+ */
+snapshot_status restore_snapshot(const char* path, const uint32_t* words,
+                                 uint32_t num_instructions,
+                                 snapshot_state* state, guest_memory* mem);
+
+/**
+ * Reads the header of the snapshot at path, e.g., to see how many pages it
+ * saved
+ *
+ * @param path
+ * @param header set on success
+ * @return SNAPSHOT_OK on success, else the reason reading failed
+ */
+snapshot_status read_snapshot_header(const char* path,
+                                     snapshot_header* header);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* snapshot_status_message(snapshot_status status);
+
+#endif  // SNAPSHOT_H
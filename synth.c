@@ -0,0 +1,136 @@
+#include "synth.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "instructions.h"
+
+typedef struct {
+    // Opcode (funct for R-type)
+    uint32_t code;
+    instruction_type type;
+} synth_def;
+
+// Indexed by instruction_name
+static const synth_def SYNTH_DEFS[SYNTH_NUM_NAMES] = {
+    {SLL_FUNCT, R_TYPE},    {SRA_FUNCT, R_TYPE},   {ADD_FUNCT, R_TYPE},
+    {SUB_FUNCT, R_TYPE},    {AND_FUNCT, R_TYPE},   {OR_FUNCT, R_TYPE},
+    {NOR_FUNCT, R_TYPE},    {ADDI_OPCODE, I_TYPE}, {ANDI_OPCODE, I_TYPE},
+    {ORI_OPCODE, I_TYPE}};
+
+synth_options synth_default_options(void) {
+    synth_options options;
+    options.seed = 1;
+    options.num_instructions = 1 << 20;
+    for (int i = 0; i < SYNTH_NUM_NAMES; i++) options.weights[i] = 1;
+    options.dependency_distance = 0;
+    return options;
+}
+
+bool synth_parse_mix(const char* mix, uint32_t* weights) {
+    static const struct {
+        const char* name;
+        instruction_name first;
+        instruction_name last;
+    } PRESETS[] = {{"uniform", SLL, ORI},
+                   {"alu", ADD, NOR},
+                   {"shift", SLL, SRA},
+                   {"immediate", ADDI, ORI}};
+    uint32_t parsed[SYNTH_NUM_NAMES] = {0};
+
+    bool is_preset = false;
+    for (size_t k = 0; k < sizeof(PRESETS) / sizeof(PRESETS[0]); k++) {
+        if (strcmp(mix, PRESETS[k].name) != 0) continue;
+        for (int i = PRESETS[k].first; i <= PRESETS[k].last; i++)
+            parsed[i] = 1;
+        is_preset = true;
+    }
+    const char* p = mix;
+    while (!is_preset && *p != '\0') {
+        const char* equals = strchr(p, '=');
+        if (equals == NULL) return false;
+        int name = -1;
+        for (int i = 0; i < SYNTH_NUM_NAMES; i++) {
+            const char* mnemonic = instruction_mnemonic((instruction_name)i);
+            if (strlen(mnemonic) == (size_t)(equals - p) &&
+                strncmp(p, mnemonic, equals - p) == 0)
+                name = i;
+        }
+        char* end;
+        unsigned long weight = strtoul(equals + 1, &end, 10);
+        if (name < 0 || end == equals + 1 || weight > UINT32_MAX ||
+            (*end != ',' && *end != '\0'))
+            return false;
+        parsed[name] = (uint32_t)weight;
+        if (*end == ',' && end[1] == '\0') return false;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < SYNTH_NUM_NAMES; i++) total += parsed[i];
+    if (total == 0) return false;
+    memcpy(weights, parsed, sizeof(parsed));
+    return true;
+}
+
+// Small, fast, and (unlike rand) the same on every platform
+static uint32_t next_random(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(*state >> 33);
+}
+
+// Destination register of instruction k when dependencies are controlled
+#define ROTATING_REGISTER(k) (1 + (k) % (NUM_REGISTERS - 1))
+
+uint32_t* synth_program(const synth_options* options) {
+    uint64_t total = 0;
+    for (int i = 0; i < SYNTH_NUM_NAMES; i++) total += options->weights[i];
+    if (total == 0 ||
+        options->dependency_distance > SYNTH_MAX_DEPENDENCY_DISTANCE)
+        return NULL;
+    // + 1 so that an empty program is still a non-NULL allocation
+    uint32_t* instructions = (uint32_t*)malloc(
+        ((size_t)options->num_instructions + 1) * sizeof(uint32_t));
+    if (instructions == NULL) return NULL;
+
+    uint64_t state = options->seed;
+    const uint32_t distance = options->dependency_distance;
+    for (uint32_t k = 0; k < options->num_instructions; k++) {
+        uint64_t pick = ((uint64_t)next_random(&state) << 32 |
+                         next_random(&state)) % total;
+        int name = 0;
+        while (pick >= options->weights[name])
+            pick -= options->weights[name++];
+
+        uint32_t dest, source, other_source;
+        if (distance == 0) {
+            dest = next_random(&state) % NUM_REGISTERS;
+            source = next_random(&state) % NUM_REGISTERS;
+            other_source = next_random(&state) % NUM_REGISTERS;
+        } else {
+            dest = ROTATING_REGISTER(k);
+            // i.e., ROTATING_REGISTER(k - distance), without underflowing for
+            // the first few instructions
+            source =
+                ROTATING_REGISTER((uint64_t)k + NUM_REGISTERS - 1 - distance);
+            other_source = source;
+        }
+
+        const synth_def* def = &SYNTH_DEFS[name];
+        uint32_t random = next_random(&state);
+        if (def->type == I_TYPE) {
+            instructions[k] = (def->code << OPCODE_END_BIT) |
+                              (source << RS_END_BIT) | (dest << RT_END_BIT) |
+                              (random & 0xffff);
+        } else if (name == SLL || name == SRA) {
+            instructions[k] = (source << RT_END_BIT) | (dest << RD_END_BIT) |
+                              ((random % 32) << SHAMT_END_BIT) | def->code;
+        } else {
+            instructions[k] = (source << RS_END_BIT) |
+                              (other_source << RT_END_BIT) |
+                              (dest << RD_END_BIT) | def->code;
+        }
+    }
+    return instructions;
+}
@@ -0,0 +1,65 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "types.h"
+
+// Number of instruction_name values the generator can emit (everything before
+// the control flow instructions, so programs are straight-line)
+#define SYNTH_NUM_NAMES (ORI + 1)
+// Every generated instruction writes one of $1 through $31 in rotation, so
+// this is the furthest back an instruction can depend on
+#define SYNTH_MAX_DEPENDENCY_DISTANCE (NUM_REGISTERS - 1)
+
+/**
+ * Describes a synthetic program for benchmarking
+ */
+typedef struct {
+    unsigned int seed;
+    uint32_t num_instructions;
+    // Relative frequency of each instruction, indexed by instruction_name
+    uint32_t weights[SYNTH_NUM_NAMES];
+    // 0 for random source and destination registers. Otherwise, each
+    // instruction reads the register written dependency_distance instructions
+    // before it, e.g., 1 makes the whole program a single dependency chain and
+    // SYNTH_MAX_DEPENDENCY_DISTANCE gives the most independent instructions
+    uint32_t dependency_distance;
+} synth_options;
+
+/**
+ * Returns the default options: 1M instructions, every instruction equally
+ * likely, random registers
+ *
+ * @return synth_options
+ */
+synth_options synth_default_options(void);
+
+/**
+ * Parses an instruction mix into weights
+ *
+ * mix is either a preset ("uniform": every instruction, "alu": add, sub, and,
+ * or and nor, "shift": sll and sra, "immediate": addi, andi and ori) or a
+ * comma-separated list of mnemonic=weight, e.g., "add=3,sll=1". Instructions
+ * not listed get weight 0
+ *
+ * @param mix
+ * @param weights set to the parsed weights on success
+ * @return true on success (at least one weight is non-zero), else false
+ */
+bool synth_parse_mix(const char* mix, uint32_t* weights);
+
+/**
+ * Generates a program as described by options
+ *
+ * The same options always give the same program
+ *
+ * @param options
+ * @return instructions in 32-bit form (free with free), or NULL if every
+ * weight is 0, the dependency distance is too large, or allocation fails
+ */
+uint32_t* synth_program(const synth_options* options);
+
+#endif  // SYNTH_H
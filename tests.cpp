@@ -1,12 +1,47 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <algorithm>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "batch.h"
+#include "block.h"
+#include "checkpoint.h"
 #include "constants.h"
+#include "debug.h"
+#include "engine.h"
+#include "gdb.h"
+#include "hart.h"
+#include "hostperf.h"
 #include "gtest/gtest.h"
+#include "image.h"
 #include "instructions.h"
+#include "jit.h"
+#include "lockstep.h"
 #include "main.c"
+#include "memory.h"
+#include "mipssim.h"
+#include "output.h"
+#include "parallel.h"
+#include "peephole.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "program.h"
+#include "reduce.h"
+#include "snapshot.h"
+#include "synth.h"
+#include "trace.h"
+#include "translate.h"
 
 void run_with_signal_catching(void (*test_body)());
 
@@ -52,6 +87,18 @@ const uint32_t SLL_11_9_3 = 0b00000000000010010101100011000000;
 const uint32_t SRA_11_9_3 = 0b00000000000010010101100011000011;
 const uint32_t ADDI_11_9_3 = 0b00100001001010110000000000000011;
 
+const uint32_t BEQ_8_9_neg2 = 0b00010001000010011111111111111110;
+const uint32_t BNE_8_9_3 = 0b00010101000010010000000000000011;
+const uint32_t J_0x100 = 0b00001000000000000000000100000000;
+const uint32_t JAL_0x3ffffff = 0b00001111111111111111111111111111;
+const uint32_t JR_31 = 0b00000011111000000000000000001000;
+const uint32_t SYSCALL_0 = 0b00000000000000000000000000001100;
+
+const uint32_t LW_8_9_4 = 0b10001101001010000000000000000100;
+const uint32_t SW_8_9_neg4 = 0b10101101001010001111111111111100;
+const uint32_t LB_8_9_1 = 0b10000001001010000000000000000001;
+const uint32_t SB_8_9_3 = 0b10100001001010000000000000000011;
+
 // Map input file for main executable to expected output
 // Expected output has 33 values
 // First 32 values are the 32 general-purpose register values
@@ -63,6 +110,12 @@ const std::unordered_map<std::string, std::string> MAIN_FUNC_EXPECTED_OUTPUT = {
     {"data/addi_negative.hex",
      "[0, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "
      "0, 0, 0, 0, 0, 0, 0, 0, 0, 4]\n"},
+    {"data/load_store.hex",
+     "[0, 0, 0, 0, 0, 0, 0, 0, 4096, 298, -1, -256, 298, -1, 1, 0, 0, 0, 0, 0, "
+     "0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 44]\n"},
+    {"data/loop_sum.hex",
+     "[0, 0, 10, 0, 0, 0, 0, 0, 0, 110, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "
+     "0, 0, 0, 0, 0, 0, 0, 0, 0, 24, 28]\n"},
     {"data/addi.hex",
      "[0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "
      "0, 0, 0, 0, 0, 0, 0, 0, 8]\n"},
@@ -98,6 +151,13 @@ SAFE_TEST(DetermineInstructionType, IType, {
     EXPECT_EQ(I_TYPE, determine_instruction_type(ORI_10_9_1));
 })
 
+SAFE_TEST(DetermineInstructionType, JType, {
+    EXPECT_EQ(J_TYPE, determine_instruction_type(J_0x100));
+    EXPECT_EQ(J_TYPE, determine_instruction_type(JAL_0x3ffffff));
+    EXPECT_EQ(I_TYPE, determine_instruction_type(BEQ_8_9_neg2));
+    EXPECT_EQ(R_TYPE, determine_instruction_type(JR_31));
+})
+
 SAFE_TEST(CreateFields, sll, {
     fields* r_fields = create_fields(SLL_8_9_5);
 
@@ -235,6 +295,90 @@ SAFE_TEST(DetermineInstructionName, andi,
 SAFE_TEST(DetermineInstructionName, ori,
           { EXPECT_EQ(ORI, determine_instruction_name(ORI_17_9_12)); })
 
+SAFE_TEST(DetermineInstructionName, ControlFlow, {
+    EXPECT_EQ(BEQ, determine_instruction_name(BEQ_8_9_neg2));
+    EXPECT_EQ(BNE, determine_instruction_name(BNE_8_9_3));
+    EXPECT_EQ(J, determine_instruction_name(J_0x100));
+    EXPECT_EQ(JAL, determine_instruction_name(JAL_0x3ffffff));
+    EXPECT_EQ(JR, determine_instruction_name(JR_31));
+    EXPECT_EQ(SYSCALL, determine_instruction_name(SYSCALL_0));
+})
+
+SAFE_TEST(DetermineInstructionName, Memory, {
+    EXPECT_EQ(LW, determine_instruction_name(LW_8_9_4));
+    EXPECT_EQ(SW, determine_instruction_name(SW_8_9_neg4));
+    EXPECT_EQ(LB, determine_instruction_name(LB_8_9_1));
+    EXPECT_EQ(SB, determine_instruction_name(SB_8_9_3));
+})
+
+SAFE_TEST(LookupInstruction, RType, {
+    const decode_entry* entry = lookup_instruction(SRA_11_9_3);
+
+    EXPECT_TRUE(entry->valid);
+    EXPECT_EQ(SRA, entry->name);
+    EXPECT_EQ(R_TYPE, entry->type);
+    EXPECT_EQ(LAYOUT_RD_RT_SHAMT, entry->layout);
+    EXPECT_EQ(sra, entry->execute);
+    EXPECT_EQ(LAYOUT_RD_RS_RT, lookup_instruction(NOR_17_9_10)->layout);
+})
+
+SAFE_TEST(LookupInstruction, IType, {
+    const decode_entry* entry = lookup_instruction(ANDI_17_9_12);
+
+    EXPECT_TRUE(entry->valid);
+    EXPECT_EQ(ANDI, entry->name);
+    EXPECT_EQ(I_TYPE, entry->type);
+    EXPECT_EQ(LAYOUT_RT_RS_IMMEDIATE, entry->layout);
+    EXPECT_EQ(andi, entry->execute);
+})
+
+SAFE_TEST(LookupInstruction, ControlFlow, {
+    instruction instr;
+    decode_instruction(BEQ_8_9_neg2, &instr);
+    EXPECT_EQ(8, instr._fields.i.rs);
+    EXPECT_EQ(9, instr._fields.i.rt);
+    EXPECT_EQ(-2, instr._fields.i.immediate);
+    EXPECT_EQ(LAYOUT_RS_RT_OFFSET, lookup_instruction(BNE_8_9_3)->layout);
+
+    decode_instruction(JAL_0x3ffffff, &instr);
+    EXPECT_EQ(0x3ffffffu, instr._fields.j.target);
+    EXPECT_EQ(jal, instr.execute);
+    EXPECT_EQ(LAYOUT_TARGET, lookup_instruction(J_0x100)->layout);
+    EXPECT_EQ(LAYOUT_RS, lookup_instruction(JR_31)->layout);
+    EXPECT_EQ(LAYOUT_NONE, lookup_instruction(SYSCALL_0)->layout);
+
+    EXPECT_FALSE(is_control_flow(ORI));
+    EXPECT_TRUE(is_control_flow(BEQ));
+    EXPECT_TRUE(is_control_flow(SYSCALL));
+    EXPECT_STREQ("syscall", instruction_mnemonic(SYSCALL));
+})
+
+SAFE_TEST(LookupInstruction, Memory, {
+    instruction instr;
+    decode_instruction(SW_8_9_neg4, &instr);
+    EXPECT_EQ(9, instr._fields.i.rs);
+    EXPECT_EQ(8, instr._fields.i.rt);
+    EXPECT_EQ(-4, instr._fields.i.immediate);
+    EXPECT_EQ(sw, instr.execute);
+    EXPECT_EQ(LAYOUT_RS_RT_OFFSET, lookup_instruction(SB_8_9_3)->layout);
+    EXPECT_EQ(LAYOUT_RT_RS_IMMEDIATE, lookup_instruction(LW_8_9_4)->layout);
+
+    EXPECT_TRUE(is_memory_access(LB));
+    EXPECT_FALSE(is_memory_access(ORI));
+    EXPECT_FALSE(is_memory_access(BEQ));
+    EXPECT_FALSE(is_control_flow(SW));
+    EXPECT_STREQ("lw", instruction_mnemonic(LW));
+})
+
+SAFE_TEST(LookupInstruction, Unsupported, {
+    // funct 0b111111 and opcode 0b111111 are not supported
+    EXPECT_FALSE(lookup_instruction(0x0000003f)->valid);
+    EXPECT_FALSE(lookup_instruction(0xfc000000)->valid);
+    EXPECT_EQ(I_TYPE, lookup_instruction(0xfc000000)->type);
+    // Unsupported encodings fall back to sll, as before the table decoder
+    EXPECT_EQ(SLL, determine_instruction_name(0xfc000000));
+})
+
 SAFE_TEST(CreateInstruction, sll, {
     instruction* instr = create_instruction(SLL_11_9_3);
 
@@ -345,6 +489,65 @@ SAFE_TEST(CreateInstruction, ori, {
     free(instr);
 })
 
+// Uses TEST directly (like MainFunc) because SAFE_TEST can't take a body
+// containing brace initializers
+TEST(DecodeInstruction, MatchesCreateInstruction) {
+    run_with_signal_catching([]() {
+        const uint32_t instructs[] = {SLL_11_9_3,   SRA_11_9_3,  ADD_3_1_2,
+                                      SUB_3_1_2,    AND_12_9_27, OR_3_1_3,
+                                      NOR_17_9_10,  ADDI_11_9_3, ANDI_17_9_12,
+                                      ORI_10_9_1};
+        for (uint32_t instruct : instructs) {
+            instruction decoded;
+            decode_instruction(instruct, &decoded);
+            instruction* created = create_instruction(instruct);
+
+            EXPECT_EQ(determine_instruction_name(instruct), decoded.name);
+            EXPECT_EQ(created->execute, decoded.execute);
+            EXPECT_EQ(created->_fields.r.rs, decoded._fields.r.rs);
+            EXPECT_EQ(created->_fields.r.rt, decoded._fields.r.rt);
+            if (determine_instruction_type(instruct) == R_TYPE) {
+                EXPECT_EQ(created->_fields.r.rd, decoded._fields.r.rd);
+                EXPECT_EQ(created->_fields.r.shamt, decoded._fields.r.shamt);
+            } else {
+                EXPECT_EQ(created->_fields.i.immediate,
+                          decoded._fields.i.immediate);
+            }
+
+            free(created);
+        }
+    });
+}
+
+TEST(CreateProgram, DecodesEveryInstruction) {
+    run_with_signal_catching([]() {
+        const uint32_t instructs[] = {ADDI_11_9_3, SLL_11_9_3, NOR_17_9_10};
+        program* prog = create_program(instructs, 3);
+
+        ASSERT_NE(nullptr, prog);
+        EXPECT_EQ(3u, prog->num_instructions);
+        EXPECT_EQ(0u, (uintptr_t)prog->decoded % PROGRAM_ALIGNMENT);
+        EXPECT_EQ(ADDI, prog->decoded[0].name);
+        EXPECT_EQ(addi, prog->decoded[0].execute);
+        EXPECT_EQ(3, prog->decoded[0]._fields.i.immediate);
+        EXPECT_EQ(SLL, prog->decoded[1].name);
+        EXPECT_EQ(3, prog->decoded[1]._fields.r.shamt);
+        EXPECT_EQ(nor, prog->decoded[2].execute);
+        EXPECT_EQ(17, prog->decoded[2]._fields.r.rd);
+
+        free_program(prog);
+    });
+}
+
+SAFE_TEST(CreateProgram, Empty, {
+    program* prog = create_program(NULL, 0);
+
+    ASSERT_NE(nullptr, prog);
+    EXPECT_EQ(0u, prog->num_instructions);
+
+    free_program(prog);
+})
+
 SAFE_TEST(sll, Basic, {
     uint32_t pc = 0;
     int32_t registers[NUM_REGISTERS] = {0};
@@ -503,6 +706,1395 @@ SAFE_TEST(ori, Basic, {
     EXPECT_EQ(40, pc);
 })
 
+SAFE_TEST(beq, Basic, {
+    uint32_t pc = 40;
+    int32_t registers[NUM_REGISTERS] = {0};
+    fields f;
+    f.i.rs = 8;
+    f.i.rt = 9;
+    f.i.immediate = -3;
+
+    beq(f, registers, &pc);
+    EXPECT_EQ(32, pc);
+
+    registers[9] = 1;
+    beq(f, registers, &pc);
+    EXPECT_EQ(36, pc);
+})
+
+SAFE_TEST(bne, Basic, {
+    uint32_t pc = 40;
+    int32_t registers[NUM_REGISTERS] = {0};
+    fields f;
+    f.i.rs = 8;
+    f.i.rt = 9;
+    f.i.immediate = 5;
+
+    bne(f, registers, &pc);
+    EXPECT_EQ(44, pc);
+
+    registers[8] = -1;
+    bne(f, registers, &pc);
+    EXPECT_EQ(68, pc);
+})
+
+SAFE_TEST(j, KeepsRegion, {
+    uint32_t pc = 0x10000040;
+    int32_t registers[NUM_REGISTERS] = {0};
+    fields f;
+    f.j.target = 0x100;
+
+    j(f, registers, &pc);
+
+    EXPECT_EQ(0x10000400u, pc);
+})
+
+SAFE_TEST(jal, LinksAndJumps, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    fields f;
+    f.j.target = 2;
+
+    jal(f, registers, &pc);
+
+    EXPECT_EQ(16, registers[RA_REGISTER]);
+    EXPECT_EQ(8, pc);
+})
+
+SAFE_TEST(jr, Basic, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[31] = 100;
+    fields f;
+    f.r.rs = 31;
+
+    jr(f, registers, &pc);
+
+    EXPECT_EQ(100, pc);
+})
+
+SAFE_TEST(syscall, ExitHalts, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    instruction instr;
+    decode_instruction(SYSCALL_0, &instr);
+
+    EXPECT_FALSE(instruction_halts(&instr, registers));
+    syscall_op(instr._fields, registers, &pc);
+    EXPECT_EQ(16, pc);
+
+    registers[V0_REGISTER] = EXIT_SYSCALL;
+    EXPECT_TRUE(instruction_halts(&instr, registers));
+    syscall_op(instr._fields, registers, &pc);
+    EXPECT_EQ(16, pc);
+})
+
+SAFE_TEST(lw, Basic, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[9] = 0x1000;
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    memory_store_word(mem, 0x1004, -5);
+    fields f;
+    f.i.rs = 9;
+    f.i.rt = 8;
+    f.i.immediate = 4;
+
+    lw(f, registers, &pc);
+
+    EXPECT_EQ(-5, registers[8]);
+    EXPECT_EQ(16, pc);
+    memory_bind(NULL);
+    free_memory(mem);
+})
+
+SAFE_TEST(sw, Basic, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[8] = 0x12345678;
+    registers[9] = 0x1000;
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    fields f;
+    f.i.rs = 9;
+    f.i.rt = 8;
+    f.i.immediate = -4;
+
+    sw(f, registers, &pc);
+
+    EXPECT_EQ(0x12345678, memory_load_word(mem, 0xffc));
+    // Little-endian
+    EXPECT_EQ(0x78, memory_load_byte(mem, 0xffc));
+    EXPECT_EQ(16, pc);
+    memory_bind(NULL);
+    free_memory(mem);
+})
+
+SAFE_TEST(lb, SignExtends, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[9] = 0x1000;
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    memory_store_byte(mem, 0x1001, 0x80);
+    fields f;
+    f.i.rs = 9;
+    f.i.rt = 8;
+    f.i.immediate = 1;
+
+    lb(f, registers, &pc);
+    EXPECT_EQ(-128, registers[8]);
+
+    memory_store_byte(mem, 0x1001, 0x7f);
+    lb(f, registers, &pc);
+    EXPECT_EQ(127, registers[8]);
+    EXPECT_EQ(20, pc);
+    memory_bind(NULL);
+    free_memory(mem);
+})
+
+SAFE_TEST(sb, StoresLowByte, {
+    uint32_t pc = 12;
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[8] = 0x1234;
+    registers[9] = 0x1000;
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    memory_store_word(mem, 0x1000, -1);
+    fields f;
+    f.i.rs = 9;
+    f.i.rt = 8;
+    f.i.immediate = 3;
+
+    sb(f, registers, &pc);
+
+    EXPECT_EQ(0x34ffffff, memory_load_word(mem, 0x1000));
+    EXPECT_EQ(16, pc);
+    memory_bind(NULL);
+    free_memory(mem);
+})
+
+SAFE_TEST(sc, NeedsReservationOfUnchangedWord, {
+    for (bool flat : {false, true}) {
+        uint32_t pc = 0;
+        int32_t registers[NUM_REGISTERS] = {0};
+        registers[9] = 0x1000;
+        guest_memory* mem = create_memory(flat);
+        memory_bind(mem);
+        memory_store_word(mem, 0x1004, 5);
+        fields f;
+        f.i.rs = 9;
+        f.i.rt = 8;
+        f.i.immediate = 4;
+
+        // No ll yet
+        registers[8] = 6;
+        sc(f, registers, &pc);
+        EXPECT_EQ(0, registers[8]);
+        ll(f, registers, &pc);
+        EXPECT_EQ(5, registers[8]);
+        registers[8] = 6;
+        sc(f, registers, &pc);
+        EXPECT_EQ(1, registers[8]);
+        EXPECT_EQ(6, memory_load_word(mem, 0x1004));
+        // The reservation is used up
+        registers[8] = 7;
+        sc(f, registers, &pc);
+        EXPECT_EQ(0, registers[8]);
+
+        // The word changed since the ll
+        ll(f, registers, &pc);
+        memory_store_word(mem, 0x1004, 9);
+        sc(f, registers, &pc);
+        EXPECT_EQ(0, registers[8]);
+        // Another address
+        ll(f, registers, &pc);
+        f.i.immediate = 8;
+        sc(f, registers, &pc);
+        EXPECT_EQ(0, registers[8]);
+        // Binding memory drops the reservation
+        f.i.immediate = 4;
+        ll(f, registers, &pc);
+        memory_bind(mem);
+        sc(f, registers, &pc);
+        EXPECT_EQ(0, registers[8]);
+        EXPECT_EQ(9, memory_load_word(mem, 0x1004));
+        EXPECT_EQ(40u, pc);
+        memory_bind(NULL);
+        free_memory(mem);
+    }
+})
+
+// Runs the same accesses on a paged and a flat memory
+void expect_memory_accesses_work(bool flat) {
+    guest_memory* mem = create_memory(flat);
+    ASSERT_NE(nullptr, mem);
+
+    // Nothing written reads as 0, and reading doesn't allocate
+    EXPECT_EQ(0, memory_load_word(mem, 0x7fff0000));
+    EXPECT_EQ(0, memory_load_byte(mem, 0xffffffff));
+    EXPECT_EQ(0u, mem->num_pages);
+
+    memory_store_word(mem, 0x10, 0x01020304);
+    EXPECT_EQ(0x01020304, memory_load_word(mem, 0x10));
+    EXPECT_EQ(0x0203, memory_load_word(mem, 0x11) & 0xffff);
+    // Unaligned and across a page boundary (and the end of the address
+    // space, which wraps)
+    memory_store_word(mem, PAGE_SIZE - 2, -2);
+    EXPECT_EQ(-2, memory_load_word(mem, PAGE_SIZE - 2));
+    EXPECT_EQ(0xff, memory_load_byte(mem, PAGE_SIZE + 1));
+    memory_store_word(mem, 0xfffffffe, 0x11223344);
+    EXPECT_EQ(0x11223344, memory_load_word(mem, 0xfffffffe));
+    if (mem->flat == NULL) {
+        EXPECT_EQ(0x11, memory_load_byte(mem, 1));
+        EXPECT_EQ(3u, mem->num_pages);
+    }
+
+    // Pages that share a TLB entry
+    for (uint32_t k = 0; k < 4; k++)
+        memory_store_word(mem, 0x20000000 + k * TLB_ENTRIES * PAGE_SIZE, k);
+    for (uint32_t k = 0; k < 4; k++)
+        EXPECT_EQ((int32_t)k,
+                  memory_load_word(mem, 0x20000000 + k * TLB_ENTRIES * PAGE_SIZE));
+    EXPECT_FALSE(mem->out_of_memory);
+    free_memory(mem);
+}
+
+SAFE_TEST(GuestMemory, Paged, {
+    expect_memory_accesses_work(false);
+    guest_memory* mem = create_memory(false);
+    EXPECT_EQ(nullptr, mem->flat);
+    free_memory(mem);
+})
+
+SAFE_TEST(GuestMemory, Flat, { expect_memory_accesses_work(true); })
+
+SAFE_TEST(GuestMemory, BindIsPerThread, {
+    guest_memory* mem = create_memory(false);
+    EXPECT_EQ(nullptr, memory_bind(mem));
+    guest_memory* other = mem;
+    std::thread([&other]() { other = bound_memory; }).join();
+    EXPECT_EQ(nullptr, other);
+    EXPECT_EQ(mem, memory_bind(NULL));
+    free_memory(mem);
+})
+
+// Returns the page numbers memory_for_each_page visits
+std::vector<uint32_t> visited_pages(guest_memory* mem, bool dirty_only) {
+    std::vector<uint32_t> rv;
+    EXPECT_TRUE(memory_for_each_page(
+        mem, dirty_only,
+        [](uint32_t page_number, const uint8_t*, void* context) {
+            ((std::vector<uint32_t>*)context)->push_back(page_number);
+        },
+        &rv));
+    return rv;
+}
+
+TEST(GuestMemory, TracksDirtyPages) {
+    run_with_signal_catching([]() {
+        guest_memory* mem = create_memory(false);
+        memory_store_word(mem, 0x1000, 1);
+        memory_store_byte(mem, 0x5000, 2);
+        // Crosses into page 0x7
+        memory_store_word(mem, 0x6ffe, 3);
+        EXPECT_EQ(std::vector<uint32_t>({1, 5, 6, 7}),
+                  visited_pages(mem, true));
+
+        memory_clear_dirty(mem);
+        EXPECT_EQ(std::vector<uint32_t>(), visited_pages(mem, true));
+        // A load puts the page in the TLB, but a store still marks it dirty
+        EXPECT_EQ(1, memory_load_word(mem, 0x1000));
+        memory_store_word(mem, 0x1004, 4);
+        memory_store_word(mem, 0x1008, 5);
+        EXPECT_EQ(std::vector<uint32_t>({1}), visited_pages(mem, true));
+        EXPECT_EQ(std::vector<uint32_t>({1, 5, 6, 7}),
+                  visited_pages(mem, false));
+        EXPECT_EQ(5, memory_load_word(mem, 0x1008));
+        free_memory(mem);
+    });
+}
+
+// Returns num_instructions random instructions covering every supported
+// instruction name, with random registers, shift amounts, and immediates
+std::vector<uint32_t> random_instructions(unsigned int seed,
+                                          uint32_t num_instructions) {
+    const uint32_t functs[] = {SLL_FUNCT, SRA_FUNCT, ADD_FUNCT, SUB_FUNCT,
+                               AND_FUNCT, OR_FUNCT,  NOR_FUNCT};
+    const uint32_t opcodes[] = {ADDI_OPCODE, ANDI_OPCODE, ORI_OPCODE};
+    std::vector<uint32_t> rv;
+    srand(seed);
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        uint32_t rs = rand() % NUM_REGISTERS, rt = rand() % NUM_REGISTERS;
+        uint32_t kind = rand() % 10;
+        if (kind < 7) {
+            uint32_t rd = rand() % NUM_REGISTERS, shamt = rand() % 32;
+            rv.push_back((rs << RS_END_BIT) | (rt << RT_END_BIT) |
+                         (rd << RD_END_BIT) | (shamt << SHAMT_END_BIT) |
+                         functs[kind]);
+        } else {
+            rv.push_back((opcodes[kind - 7] << OPCODE_END_BIT) |
+                         (rs << RS_END_BIT) | (rt << RT_END_BIT) |
+                         (rand() & 0xffff));
+        }
+    }
+    return rv;
+}
+
+// Runs instructions with engine and with the reference interpreter (starting
+// from the same non-zero registers), and expects identical final state. With
+// $0 not 0, programs with loops in data may never halt, hence the step limit
+void expect_engine_matches_interpreter(engine_kind engine,
+                                       const std::vector<uint32_t>& instructs) {
+    program* prog = create_program(instructs.data(), instructs.size());
+    int32_t expected[NUM_REGISTERS], actual[NUM_REGISTERS];
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        expected[i] = actual[i] = i * 0x01010101 - 7;
+    uint32_t expected_pc = INITIAL_PC, actual_pc = INITIAL_PC;
+
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    uint64_t expected_steps =
+        run_interpreter(prog, expected, &expected_pc, 1 << 20);
+    free_memory(mem);
+    mem = create_memory(false);
+    memory_bind(mem);
+    uint64_t actual_steps =
+        run_engine(engine, prog, actual, &actual_pc, 1 << 20);
+    memory_bind(NULL);
+    free_memory(mem);
+
+    EXPECT_EQ(expected_steps, actual_steps) << engine_name(engine);
+    EXPECT_EQ(expected_pc, actual_pc) << engine_name(engine);
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        EXPECT_EQ(expected[i], actual[i])
+            << engine_name(engine) << " $" << i;
+
+    free_program(prog);
+}
+
+// Returns random_instructions(seed, num_instructions) with about a quarter of
+// the instructions replaced by branches (on $0 to $3, so they go both ways),
+// jumps, jr $31, syscalls, and addi $2, $0, 10 so that some syscalls halt.
+// Targets are within the program and loops are likely, so run it with a step
+// limit
+std::vector<uint32_t> random_program_with_branches(unsigned int seed,
+                                                   uint32_t num_instructions) {
+    std::vector<uint32_t> rv = random_instructions(seed, num_instructions);
+    for (uint32_t k = 0; k < num_instructions; k++) {
+        uint32_t rs = rand() % 4, rt = rand() % 4;
+        uint32_t offset = (uint32_t)(rand() % 17 - 8) & 0xffff;
+        uint32_t target = rand() % num_instructions;
+        switch (rand() % 28) {
+            case 0:
+                rv[k] = (BEQ_OPCODE << OPCODE_END_BIT) | (rs << RS_END_BIT) |
+                        (rt << RT_END_BIT) | offset;
+                break;
+            case 1:
+            case 2:
+                rv[k] = (BNE_OPCODE << OPCODE_END_BIT) | (rs << RS_END_BIT) |
+                        (rt << RT_END_BIT) | offset;
+                break;
+            case 3:
+                rv[k] = (J_OPCODE << OPCODE_END_BIT) | target;
+                break;
+            case 4:
+                rv[k] = (JAL_OPCODE << OPCODE_END_BIT) | target;
+                break;
+            case 5:
+                rv[k] = (RA_REGISTER << RS_END_BIT) | JR_FUNCT;
+                break;
+            case 6:
+                rv[k] = SYSCALL_FUNCT;
+                break;
+            case 7:
+                rv[k] = (ADDI_OPCODE << OPCODE_END_BIT) |
+                        (V0_REGISTER << RT_END_BIT) | EXIT_SYSCALL;
+                break;
+        }
+    }
+    return rv;
+}
+
+// Returns random_program_with_branches(seed, num_instructions) with about an
+// eighth of the instructions replaced by loads and stores based on $1 to $3,
+// so that addresses start out near 0 (and wrap around below it), unaligned,
+// and sometimes on another page
+std::vector<uint32_t> random_program_with_memory(unsigned int seed,
+                                                 uint32_t num_instructions) {
+    const uint32_t opcodes[] = {LW_OPCODE, SW_OPCODE, LB_OPCODE,
+                                SB_OPCODE, LL_OPCODE, SC_OPCODE};
+    std::vector<uint32_t> rv =
+        random_program_with_branches(seed, num_instructions);
+    for (uint32_t k = 0; k < num_instructions; k++) {
+        if (rand() % 8 != 0) continue;
+        uint32_t rs = 1 + rand() % 3, rt = rand() % NUM_REGISTERS;
+        uint32_t offset = (uint32_t)(rand() % 9000 - 4500) & 0xffff;
+        rv[k] = (opcodes[rand() % 6] << OPCODE_END_BIT) | (rs << RS_END_BIT) |
+                (rt << RT_END_BIT) | offset;
+    }
+    return rv;
+}
+
+// Reference for the engines: calls each instruction's handler in turn,
+// checking pc and for halt before every instruction
+uint64_t run_reference(const program* prog, int32_t* registers, uint32_t* pc,
+                       uint64_t max_steps) {
+    uint64_t steps = 0;
+    while (steps < max_steps && !engine_done(prog, registers, *pc)) {
+        const instruction* instruct = &prog->decoded[(*pc) >> 2];
+        instruct->execute(instruct->_fields, registers, pc);
+        steps++;
+    }
+    return steps;
+}
+
+// Runs prog for max_steps with every engine (split over two calls, so that
+// execution resumes in the middle of a block) and with run_reference, and
+// expects identical final state
+void expect_engines_match_reference(program* prog, uint64_t max_steps) {
+    int32_t expected[NUM_REGISTERS];
+    for (int i = 0; i < NUM_REGISTERS; i++) expected[i] = i % 4;
+    uint32_t expected_pc = INITIAL_PC;
+    // Every run starts from an empty memory
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    uint64_t expected_steps =
+        run_reference(prog, expected, &expected_pc, max_steps);
+    free_memory(mem);
+
+    for (int engine = 0; engine < NUM_ENGINES; engine++) {
+        const char* name = engine_name((engine_kind)engine);
+        int32_t actual[NUM_REGISTERS];
+        for (int i = 0; i < NUM_REGISTERS; i++) actual[i] = i % 4;
+        uint32_t actual_pc = INITIAL_PC;
+        mem = create_memory(false);
+        memory_bind(mem);
+        uint64_t steps = run_engine((engine_kind)engine, prog, actual,
+                                    &actual_pc, max_steps / 3);
+        steps += run_engine((engine_kind)engine, prog, actual, &actual_pc,
+                            max_steps - steps);
+        memory_bind(NULL);
+        free_memory(mem);
+
+        EXPECT_EQ(expected_steps, steps) << name << ", " << max_steps;
+        EXPECT_EQ(expected_pc, actual_pc) << name << ", " << max_steps;
+        EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+            << name << ", " << max_steps;
+    }
+}
+
+SAFE_TEST(ParseEngine, Names, {
+    engine_kind engine;
+    EXPECT_TRUE(parse_engine("interpreter", &engine));
+    EXPECT_EQ(ENGINE_INTERPRETER, engine);
+    EXPECT_TRUE(parse_engine("threaded", &engine));
+    EXPECT_EQ(ENGINE_THREADED, engine);
+    EXPECT_FALSE(parse_engine("bogus", &engine));
+    EXPECT_TRUE(parse_engine("jit", &engine));
+    EXPECT_EQ(ENGINE_JIT, engine);
+    EXPECT_STREQ("threaded", engine_name(ENGINE_THREADED));
+})
+
+// Checks engine against the interpreter on random programs and data/*.hex
+void expect_engine_matches_interpreter_on_all(engine_kind engine) {
+    expect_engine_matches_interpreter(engine, random_instructions(211, 5000));
+    for (const fs::directory_entry& dir_entry :
+         fs::recursive_directory_iterator(DATA_DIR)) {
+        if (dir_entry.path().extension() != ".hex") continue;
+        program_image image;
+        uint32_t num_instructions = hex_instruction_file_to_array(
+            dir_entry.path().string().c_str(), &image);
+        expect_engine_matches_interpreter(
+            engine, std::vector<uint32_t>(image.words,
+                                          image.words + num_instructions));
+        free_image(&image);
+    }
+}
+
+SAFE_TEST(RunEngine, ThreadedMatchesInterpreter,
+          { expect_engine_matches_interpreter_on_all(ENGINE_THREADED); })
+
+SAFE_TEST(RunEngine, JitMatchesInterpreter, {
+    expect_engine_matches_interpreter_on_all(ENGINE_JIT);
+    // Few distinct registers, so every block uses all host registers
+    std::vector<uint32_t> instructs = random_instructions(7, 3000);
+    for (uint32_t& instruct : instructs) instruct &= ~0x00e0e000u;
+    expect_engine_matches_interpreter(ENGINE_JIT, instructs);
+})
+
+SAFE_TEST(JitCompile, SplitsBlocks, {
+    std::vector<uint32_t> instructs = random_instructions(3, 2500);
+    program* prog = create_program(instructs.data(), instructs.size());
+    jit_program* jit = jit_compile(prog);
+
+    ASSERT_NE(nullptr, jit);
+    EXPECT_EQ((uint32_t)JIT_MAX_BLOCK_LENGTH, jit->length[0]);
+    EXPECT_EQ((uint32_t)JIT_MAX_BLOCK_LENGTH,
+              jit->length[JIT_MAX_BLOCK_LENGTH]);
+    EXPECT_EQ(2500u - 2 * JIT_MAX_BLOCK_LENGTH,
+              jit->length[2 * JIT_MAX_BLOCK_LENGTH]);
+    EXPECT_EQ(0u, jit->length[1]);
+    EXPECT_EQ(nullptr, jit->entry[1]);
+
+    jit_free(jit);
+    free_program(prog);
+})
+
+SAFE_TEST(RunEngine, StopsAfterMaxSteps, {
+    std::vector<uint32_t> instructs = random_instructions(541, 10);
+    program* prog = create_program(instructs.data(), instructs.size());
+    for (engine_kind engine :
+         {ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT}) {
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+
+        EXPECT_EQ(3u, run_engine(engine, prog, registers, &pc, 3));
+        EXPECT_EQ(12u, pc);
+        EXPECT_EQ(7u, run_engine(engine, prog, registers, &pc, UINT64_MAX));
+        EXPECT_EQ(40u, pc);
+        EXPECT_EQ(0u, run_engine(engine, prog, registers, &pc, UINT64_MAX));
+    }
+    free_program(prog);
+})
+
+SAFE_TEST(RunEngine, BranchesMatchReference, {
+    for (unsigned int seed = 1; seed <= 40; seed++) {
+        std::vector<uint32_t> instructs =
+            random_program_with_branches(seed, 300);
+        program* prog = create_program(instructs.data(), instructs.size());
+        for (uint64_t max_steps : {1, 2, 10, 333, 5000, 40000})
+            expect_engines_match_reference(prog, max_steps);
+        free_program(prog);
+    }
+})
+
+SAFE_TEST(RunEngine, MemoryMatchesReference, {
+    for (unsigned int seed = 1; seed <= 40; seed++) {
+        std::vector<uint32_t> instructs = random_program_with_memory(seed, 300);
+        program* prog = create_program(instructs.data(), instructs.size());
+        for (uint64_t max_steps : {1, 10, 333, 5000, 40000})
+            expect_engines_match_reference(prog, max_steps);
+        free_program(prog);
+    }
+})
+
+SAFE_TEST(RunEngine, HaltsOnExitSyscall, {
+    program_image image;
+    uint32_t num_instructions =
+        hex_instruction_file_to_array("data/loop_sum.hex", &image);
+    program* prog = create_program(image.words, num_instructions);
+    for (int engine = 0; engine < NUM_ENGINES; engine++) {
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+
+        // 2 + 10 iterations of 3 + jal, add, jr, addi, not the syscall
+        EXPECT_EQ(36u, run_engine((engine_kind)engine, prog, registers, &pc,
+                                  UINT64_MAX));
+        EXPECT_EQ(28u, pc);
+        EXPECT_TRUE(engine_done(prog, registers, pc));
+        EXPECT_EQ(0u, run_engine((engine_kind)engine, prog, registers, &pc,
+                                 UINT64_MAX));
+        EXPECT_EQ(28u, pc);
+    }
+    free_program(prog);
+    free_image(&image);
+})
+
+// Runs words translated into directory and with run_reference for several
+// step limits (split over two calls, so that execution resumes in the middle
+// of a block), on paged and flat memory, and expects identical final state
+void expect_translation_matches_reference(const std::vector<uint32_t>& words,
+                                          const char* directory) {
+    program* prog = create_program(words.data(), words.size());
+    translation* native = NULL;
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, words.data(), directory, &native));
+    for (bool flat : {false, true}) {
+        for (uint64_t max_steps : {1, 2, 10, 333, 40000}) {
+            int32_t expected[NUM_REGISTERS], actual[NUM_REGISTERS];
+            for (int i = 0; i < NUM_REGISTERS; i++)
+                expected[i] = actual[i] = i % 4;
+            uint32_t expected_pc = INITIAL_PC, actual_pc = INITIAL_PC;
+            guest_memory* mem = create_memory(flat);
+            memory_bind(mem);
+            uint64_t expected_steps =
+                run_reference(prog, expected, &expected_pc, max_steps);
+            free_memory(mem);
+            mem = create_memory(flat);
+            memory_bind(mem);
+            uint64_t steps = run_translated(prog, actual, &actual_pc,
+                                            max_steps / 3, native);
+            steps += run_translated(prog, actual, &actual_pc,
+                                    max_steps - steps, native);
+            memory_bind(NULL);
+            free_memory(mem);
+
+            EXPECT_EQ(expected_steps, steps) << flat << ", " << max_steps;
+            EXPECT_EQ(expected_pc, actual_pc) << flat << ", " << max_steps;
+            EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+                << flat << ", " << max_steps;
+        }
+    }
+    free_translation(native);
+    free_program(prog);
+}
+
+SAFE_TEST(RunTranslated, MatchesReference, {
+    char directory[] = "/tmp/mips_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    // Each program takes the host compiler a while, so there are only a few
+    for (unsigned int seed = 1; seed <= 4; seed++)
+        expect_translation_matches_reference(
+            random_program_with_memory(seed, 300), directory);
+
+    // Halts on the exit syscall without executing it
+    program_image image;
+    uint32_t num_instructions =
+        hex_instruction_file_to_array("data/loop_sum.hex", &image);
+    program* prog = create_program(image.words, num_instructions);
+    translation* native = NULL;
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, image.words, directory, &native));
+    int32_t registers[NUM_REGISTERS] = {0};
+    uint32_t pc = INITIAL_PC;
+    EXPECT_EQ(36u, run_translated(prog, registers, &pc, UINT64_MAX, native));
+    EXPECT_EQ(28u, pc);
+    EXPECT_EQ(110, registers[9]);
+    EXPECT_EQ(0u, run_translated(prog, registers, &pc, UINT64_MAX, native));
+    free_translation(native);
+    free_program(prog);
+    free_image(&image);
+    fs::remove_all(directory);
+})
+
+SAFE_TEST(LoadTranslation, CachesByProgram, {
+    char directory[] = "/tmp/mips_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    std::vector<uint32_t> first = random_instructions(5, 20);
+    std::vector<uint32_t> second = random_instructions(6, 20);
+    program* prog = create_program(first.data(), first.size());
+    translation* native = NULL;
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, first.data(), directory, &native));
+    EXPECT_FALSE(native->cached);
+    free_translation(native);
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, first.data(), directory, &native));
+    EXPECT_TRUE(native->cached);
+    free_translation(native);
+    free_program(prog);
+
+    // The cache is keyed by the words, and a failed compile leaves nothing
+    // behind
+    prog = create_program(second.data(), second.size());
+    setenv("CC", "false", 1);
+    EXPECT_EQ(TRANSLATE_COMPILE_FAILED,
+              load_translation(prog, second.data(), directory, &native));
+    unsetenv("CC");
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, second.data(), directory, &native));
+    EXPECT_FALSE(native->cached);
+    free_translation(native);
+    free_program(prog);
+    // A source file and a shared object per program
+    size_t num_files = 0;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory))
+        num_files += entry.path().extension() == ".c" ||
+                     entry.path().extension() == ".so";
+    EXPECT_EQ(4u, num_files);
+
+    EXPECT_EQ(TRANSLATE_BAD_DIRECTORY,
+              load_translation(prog, second.data(), "/nonexistent/cache",
+                               &native));
+    EXPECT_STREQ("compiler failed",
+                 translate_status_message(TRANSLATE_COMPILE_FAILED));
+    fs::remove_all(directory);
+})
+
+SAFE_TEST(LoadTranslation, RefusesSharedDirectories, {
+    char directory[] = "/tmp/mips_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    std::string cache = std::string(directory) + "/cache";
+    std::string link = std::string(directory) + "/link";
+    std::vector<uint32_t> words = random_instructions(7, 20);
+    program* prog = create_program(words.data(), words.size());
+    translation* native = NULL;
+
+    // Whatever .so is in a directory others can write to could be theirs
+    ASSERT_EQ(0, mkdir(cache.c_str(), 0700));
+    ASSERT_EQ(0, chmod(cache.c_str(), 0777));
+    EXPECT_EQ(TRANSLATE_UNSAFE_DIRECTORY,
+              load_translation(prog, words.data(), cache.c_str(), &native));
+    ASSERT_EQ(0, chmod(cache.c_str(), 0720));
+    EXPECT_EQ(TRANSLATE_UNSAFE_DIRECTORY,
+              load_translation(prog, words.data(), cache.c_str(), &native));
+    ASSERT_EQ(0, symlink(cache.c_str(), link.c_str()));
+    ASSERT_EQ(0, chmod(cache.c_str(), 0700));
+    EXPECT_EQ(TRANSLATE_UNSAFE_DIRECTORY,
+              load_translation(prog, words.data(), link.c_str(), &native));
+    EXPECT_TRUE(fs::is_empty(cache));
+
+    // A directory it creates is private
+    fs::remove(cache);
+    ASSERT_EQ(TRANSLATE_OK,
+              load_translation(prog, words.data(), cache.c_str(), &native));
+    free_translation(native);
+    struct stat st;
+    ASSERT_EQ(0, stat(cache.c_str(), &st));
+    EXPECT_EQ(0700u, st.st_mode & 0777);
+
+    // The default is per user
+    const char* saved = getenv("XDG_CACHE_HOME");
+    std::string saved_value = saved != NULL ? saved : "";
+    std::string xdg = std::string(directory) + "/xdg";
+    setenv("XDG_CACHE_HOME", xdg.c_str(), 1);
+    char* default_directory = default_translation_directory();
+    ASSERT_NE(nullptr, default_directory);
+    EXPECT_EQ(xdg + "/" TRANSLATE_CACHE_NAME, default_directory);
+    EXPECT_EQ(TRANSLATE_OK,
+              load_translation(prog, words.data(), default_directory,
+                               &native));
+    free_translation(native);
+    free(default_directory);
+    if (saved != NULL)
+        setenv("XDG_CACHE_HOME", saved_value.c_str(), 1);
+    else
+        unsetenv("XDG_CACHE_HOME");
+    free_program(prog);
+    fs::remove_all(directory);
+})
+
+SAFE_TEST(RunInterpreter, ChainsBlocks, {
+    program_image image;
+    uint32_t num_instructions =
+        hex_instruction_file_to_array("data/loop_sum.hex", &image);
+    program* prog = create_program(image.words, num_instructions);
+    int32_t registers[NUM_REGISTERS] = {0};
+    uint32_t pc = INITIAL_PC;
+    run_interpreter(prog, registers, &pc, UINT64_MAX);
+
+    ASSERT_NE(nullptr, prog->blocks);
+    // The loop body ends at the bne and links to itself and to the jal
+    basic_block* loop = prog->blocks->by_start[2];
+    ASSERT_NE(nullptr, loop);
+    EXPECT_EQ(3u, loop->length);
+    EXPECT_TRUE(loop->ends_in_control_flow);
+    EXPECT_EQ(loop, loop->successor[0]);
+    EXPECT_EQ(8u, loop->successor_pc[0]);
+    EXPECT_EQ(prog->blocks->by_start[5], loop->successor[1]);
+    EXPECT_EQ(20u, loop->successor_pc[1]);
+    // The first block runs through the first iteration of the loop, and
+    // nothing jumps to the instruction after the syscall
+    EXPECT_EQ(5u, prog->blocks->by_start[0]->length);
+    EXPECT_EQ(nullptr, prog->blocks->by_start[8]);
+
+    free_program(prog);
+    free_image(&image);
+})
+
+// Encodes an R-type instruction
+uint32_t r_type(uint32_t funct, uint32_t rd, uint32_t rs, uint32_t rt,
+                uint32_t shamt) {
+    return (rs << RS_END_BIT) | (rt << RT_END_BIT) | (rd << RD_END_BIT) |
+           (shamt << SHAMT_END_BIT) | funct;
+}
+
+// Encodes an I-type instruction
+uint32_t i_type(uint32_t opcode, uint32_t rt, uint32_t rs, int16_t immediate) {
+    return (opcode << OPCODE_END_BIT) | (rs << RS_END_BIT) |
+           (rt << RT_END_BIT) | (uint16_t)immediate;
+}
+
+TEST(SpecializeInstruction, MatchesGeneralHandlers) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words;
+        for (uint32_t shamt = 0; shamt < 32; shamt++) {
+            words.push_back(r_type(SLL_FUNCT, 9, 0, 10, shamt));
+            words.push_back(r_type(SRA_FUNCT, 9, 0, 10, shamt));
+            words.push_back(r_type(SLL_FUNCT, 10, 0, 10, shamt));
+        }
+        for (uint32_t funct :
+             {ADD_FUNCT, SUB_FUNCT, AND_FUNCT, OR_FUNCT, NOR_FUNCT}) {
+            words.push_back(r_type(funct, 8, 8, 9, 0));
+            words.push_back(r_type(funct, 8, 8, 8, 0));
+            words.push_back(r_type(funct, 0, 0, 9, 0));
+            words.push_back(r_type(funct, 8, 9, 10, 0));
+        }
+        for (int immediate = -20; immediate <= 20; immediate++) {
+            words.push_back(i_type(ADDI_OPCODE, 8, 8, immediate));
+            words.push_back(i_type(ADDI_OPCODE, 0, 0, immediate));
+            words.push_back(i_type(ADDI_OPCODE, 8, 9, immediate));
+        }
+        for (uint32_t opcode : {ADDI_OPCODE, ORI_OPCODE, ANDI_OPCODE}) {
+            words.push_back(i_type(opcode, 8, 9, 0));
+            words.push_back(i_type(opcode, 8, 8, 0));
+        }
+        std::vector<uint32_t> random = random_instructions(29, 500);
+        words.insert(words.end(), random.begin(), random.end());
+
+        int specialised = 0;
+        for (uint32_t word : words) {
+            instruction general, special;
+            decode_instruction(word, &general);
+            special = general;
+            specialize_instruction(&special);
+            if (special.execute != general.execute) specialised++;
+            int32_t expected[NUM_REGISTERS], actual[NUM_REGISTERS];
+            for (int r = 0; r < NUM_REGISTERS; r++)
+                expected[r] = actual[r] = (int32_t)(r * 0x9e3779b9u);
+            uint32_t expected_pc = 8, actual_pc = 8;
+            general.execute(general._fields, expected, &expected_pc);
+            special.execute(special._fields, actual, &actual_pc);
+            EXPECT_EQ(expected_pc, actual_pc) << std::hex << word;
+            EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+                << std::hex << word;
+        }
+        // Most of the hand-picked shapes above
+        EXPECT_LT(80, specialised);
+
+        // Only create_program specialises
+        const uint32_t step = i_type(ADDI_OPCODE, 8, 8, 4);
+        program* prog = create_program(&step, 1);
+        instruction decoded;
+        decode_instruction(step, &decoded);
+        EXPECT_EQ(addi, decoded.execute);
+        EXPECT_NE(addi, prog->decoded[0].execute);
+        EXPECT_EQ(ADDI, prog->decoded[0].name);
+        free_program(prog);
+
+        // A chain folded by peephole_fuse is specialised again for its new
+        // immediate
+        instruction chain[2], ops[2];
+        decode_instruction(i_type(ADDI_OPCODE, 8, 8, 1), &chain[0]);
+        decode_instruction(i_type(ADDI_OPCODE, 8, 8, 2), &chain[1]);
+        specialize_instruction(&chain[0]);
+        specialize_instruction(&chain[1]);
+        uint32_t op_start[3];
+        ASSERT_EQ(1u, peephole_fuse(chain, 2, ops, op_start));
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = 0;
+        ops[0].execute(ops[0]._fields, registers, &pc);
+        EXPECT_EQ(3, registers[8]);
+    });
+}
+
+TEST(PeepholeFuse, Patterns) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = {
+            0,  // nop
+            i_type(ADDI_OPCODE, 8, 9, 1),
+            i_type(ADDI_OPCODE, 8, 8, 2),
+            i_type(ADDI_OPCODE, 8, 8, -5),
+            r_type(SLL_FUNCT, 9, 0, 10, 2),
+            r_type(ADD_FUNCT, 9, 11, 9, 0),
+            i_type(ORI_OPCODE, 12, 12, 0),  // nop
+            i_type(ADDI_OPCODE, 8, 8, 0x7fff),
+            i_type(ADDI_OPCODE, 8, 8, 1),  // the sum doesn't fit
+            i_type(ORI_OPCODE, 8, 8, 0x0f0),
+            i_type(ORI_OPCODE, 8, 8, 0x00f),
+            r_type(OR_FUNCT, 3, 3, 3, 0),  // nop
+            r_type(SLL_FUNCT, 9, 0, 10, 2),
+            r_type(ADD_FUNCT, 7, 11, 9, 0),  // writes another register
+        };
+        std::vector<instruction> decoded(words.size());
+        for (size_t k = 0; k < words.size(); k++)
+            decode_instruction(words[k], &decoded[k]);
+        std::vector<instruction> ops(words.size());
+        std::vector<uint32_t> op_start(words.size() + 1);
+
+        uint32_t num_ops = peephole_fuse(decoded.data(), decoded.size(),
+                                         ops.data(), op_start.data());
+
+        ASSERT_EQ(7u, num_ops);
+        EXPECT_EQ(addi, ops[0].execute);
+        EXPECT_EQ(9, ops[0]._fields.i.rs);
+        EXPECT_EQ(-2, ops[0]._fields.i.immediate);
+        EXPECT_EQ(sll_add, ops[1].execute);
+        EXPECT_EQ(11, ops[1]._fields.r.rs);
+        EXPECT_EQ(0x7fff, ops[2]._fields.i.immediate);
+        EXPECT_EQ(1, ops[3]._fields.i.immediate);
+        EXPECT_EQ(ori, ops[4].execute);
+        EXPECT_EQ(0x0ff, ops[4]._fields.i.immediate);
+        EXPECT_EQ(sll, ops[5].execute);
+        EXPECT_EQ(add, ops[6].execute);
+        // Dropped instructions belong to the op after them
+        std::vector<uint32_t> expected_start = {0, 4, 6, 8, 9, 11, 13, 14};
+        for (uint32_t k = 0; k <= num_ops; k++)
+            EXPECT_EQ(expected_start[k], op_start[k]) << k;
+
+        // The fused ops compute the same registers
+        int32_t expected[NUM_REGISTERS], actual[NUM_REGISTERS];
+        for (int r = 0; r < NUM_REGISTERS; r++)
+            expected[r] = actual[r] = r * 0x01234567;
+        uint32_t pc = INITIAL_PC;
+        for (const instruction& instruct : decoded)
+            instruct.execute(instruct._fields, expected, &pc);
+        for (uint32_t k = 0; k < num_ops; k++)
+            ops[k].execute(ops[k]._fields, actual, &pc);
+        EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)));
+    });
+}
+
+SAFE_TEST(PeepholeFuse, SllAddReadingItsOwnResult, {
+    // sll $9, $10, 3 then add $9, $9, $9
+    instruction decoded[2];
+    instruction ops[2];
+    decode_instruction(r_type(SLL_FUNCT, 9, 0, 10, 3), &decoded[0]);
+    decode_instruction(r_type(ADD_FUNCT, 9, 9, 9, 0), &decoded[1]);
+    uint32_t op_start[3];
+
+    ASSERT_EQ(1u, peephole_fuse(decoded, 2, ops, op_start));
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[10] = 5;
+    uint32_t pc = 0;
+    ops[0].execute(ops[0]._fields, registers, &pc);
+    EXPECT_EQ(80, registers[9]);
+    EXPECT_EQ(0u, pc);
+})
+
+// Returns random_program_with_memory(seed, num_instructions) with about a
+// quarter of the instructions replaced by the sequences peephole_fuse looks
+// for: nops, chains of addi, ori and andi on one register, and sll then add
+std::vector<uint32_t> random_program_with_idioms(unsigned int seed,
+                                                 uint32_t num_instructions) {
+    const uint32_t opcodes[] = {ADDI_OPCODE, ORI_OPCODE, ANDI_OPCODE};
+    std::vector<uint32_t> rv =
+        random_program_with_memory(seed, num_instructions);
+    for (uint32_t k = 0; k + 3 < num_instructions; k++) {
+        uint32_t t = rand() % NUM_REGISTERS, x = rand() % NUM_REGISTERS;
+        // Sometimes large enough that addi chains can't be folded
+        int16_t immediate = (int16_t)(rand() % 2 ? rand() % 64 : rand());
+        switch (rand() % 16) {
+            case 0:
+                rv[k] = r_type(SLL_FUNCT, t, 0, t, 0);
+                break;
+            case 1:
+                rv[k] = i_type(ADDI_OPCODE, t, t, 0);
+                break;
+            case 2:
+            case 3: {
+                uint32_t opcode = opcodes[rand() % 3];
+                rv[k] = i_type(opcode, t, x, immediate);
+                for (uint32_t n = rand() % 3; n > 0; n--)
+                    rv[++k] = i_type(opcode, t, t, (int16_t)rand());
+                break;
+            }
+            case 4:
+                rv[k] = r_type(SLL_FUNCT, t, 0, x, rand() % 32);
+                rv[++k] = rand() % 2 ? r_type(ADD_FUNCT, t, t, x, 0)
+                                     : r_type(ADD_FUNCT, t, x, t, 0);
+                break;
+        }
+    }
+    return rv;
+}
+
+SAFE_TEST(RunInterpreter, PeepholeMatchesReference, {
+    for (unsigned int seed = 1; seed <= 40; seed++) {
+        std::vector<uint32_t> instructs = random_program_with_idioms(seed, 300);
+        program* prog = create_program(instructs.data(), instructs.size());
+        prog->peephole = true;
+        for (uint64_t max_steps : {1, 10, 333, 5000, 40000})
+            expect_engines_match_reference(prog, max_steps);
+        free_program(prog);
+    }
+})
+
+TEST(RunInterpreter, PeepholeFusesBlocks) {
+    run_with_signal_catching([]() {
+        // nop, addi $8, $8, 1 twice, addi $9, $0, 3, and a bne that isn't
+        // taken
+        std::vector<uint32_t> instructs = {0, i_type(ADDI_OPCODE, 8, 8, 1),
+                                           i_type(ADDI_OPCODE, 8, 8, 1),
+                                           i_type(ADDI_OPCODE, 9, 0, 3),
+                                           i_type(BNE_OPCODE, 9, 9, -1)};
+        program* prog = create_program(instructs.data(), instructs.size());
+        prog->peephole = true;
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+
+        EXPECT_EQ(5u, run_interpreter(prog, registers, &pc, UINT64_MAX));
+        EXPECT_EQ(20u, pc);
+        EXPECT_EQ(2, registers[8]);
+        basic_block* block = prog->blocks->by_start[0];
+        EXPECT_EQ(5u, block->length);
+        EXPECT_EQ(2u, block->num_ops);
+        ASSERT_NE(nullptr, block->op_start);
+        EXPECT_EQ(0u, block->op_start[0]);
+        EXPECT_EQ(3u, block->op_start[1]);
+
+        free_program(prog);
+    });
+}
+
+// Runs words with the interpreter from initial and returns the final
+// registers
+std::vector<int32_t> run_words(const uint32_t* words, uint32_t num_words,
+                               const int32_t* initial) {
+    program* prog = create_program(words, num_words);
+    std::vector<int32_t> registers(initial, initial + NUM_REGISTERS);
+    uint32_t pc = INITIAL_PC;
+    run_interpreter(prog, registers.data(), &pc, UINT64_MAX);
+    free_program(prog);
+    return registers;
+}
+
+// Returns random_instructions(seed, num_instructions) with some of the
+// instructions replaced by ones whose result doesn't depend on the initial
+// registers (sub $t, $x, $x and andi $t, $x, 0), so that values can be folded
+std::vector<uint32_t> random_program_with_constants(unsigned int seed,
+                                                    uint32_t num_instructions) {
+    std::vector<uint32_t> rv = random_instructions(seed, num_instructions);
+    for (uint32_t k = 0; k < num_instructions; k++) {
+        uint32_t t = rand() % NUM_REGISTERS, x = rand() % NUM_REGISTERS;
+        switch (rand() % 8) {
+            case 0:
+                rv[k] = r_type(SUB_FUNCT, t, x, x, 0);
+                break;
+            case 1:
+                rv[k] = i_type(ANDI_OPCODE, t, x, 0);
+                break;
+        }
+    }
+    return rv;
+}
+
+SAFE_TEST(ReduceProgram, MatchesOriginal, {
+    for (unsigned int seed = 1; seed <= 20; seed++) {
+        for (uint32_t length : {1u, 10u, 2000u}) {
+            std::vector<uint32_t> words =
+                seed % 2 ? random_instructions(seed, length)
+                         : random_program_with_constants(seed, length);
+            reduced_program reduced;
+            ASSERT_EQ(REDUCE_OK, reduce_program(words.data(), words.size(),
+                                                NULL, &reduced));
+            if (length == 2000) {
+                EXPECT_GT(reduced.num_dropped, 0u) << seed;
+            }
+            for (int trial = 0; trial < 4; trial++) {
+                int32_t initial[NUM_REGISTERS];
+                for (int r = 0; r < NUM_REGISTERS; r++)
+                    initial[r] = (int32_t)(rand() * 2654435761u);
+                std::vector<int32_t> expected =
+                    run_words(words.data(), words.size(), initial);
+                std::vector<int32_t> actual =
+                    reduced.final_known
+                        ? std::vector<int32_t>(
+                              reduced.final_registers,
+                              reduced.final_registers + NUM_REGISTERS)
+                        : run_words(reduced.words, reduced.num_instructions,
+                                    initial);
+                EXPECT_EQ(expected, actual) << seed << ", " << length;
+            }
+            free_reduced(&reduced);
+        }
+    }
+})
+
+TEST(ReduceProgram, FoldsConstants) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = {
+            r_type(SUB_FUNCT, 8, 9, 9, 0),          // $8 = 0
+            i_type(ORI_OPCODE, 8, 8, 0x1234),       // $8 = 0x1234
+            r_type(SLL_FUNCT, 8, 0, 8, 16),         // $8 = 0x12340000
+            i_type(ADDI_OPCODE, 8, 8, -0x7000),     // $8 = 0x1233 9000
+            r_type(ADD_FUNCT, 10, 11, 8, 0),        // $10 = $11 + $8
+            i_type(ADDI_OPCODE, 12, 13, 1),         // dead
+            i_type(ADDI_OPCODE, 12, 14, 2),
+            i_type(ANDI_OPCODE, 15, 16, 0),         // $15 = 0
+            r_type(NOR_FUNCT, 15, 15, 15, 0),       // $15 = -1
+            r_type(OR_FUNCT, 17, 18, 15, 0),        // $17 = -1
+        };
+        reduced_program reduced;
+        ASSERT_EQ(REDUCE_OK,
+                  reduce_program(words.data(), words.size(), NULL, &reduced));
+        EXPECT_FALSE(reduced.final_known);
+        // Only the last write to $8 is read before the end (by the add), and
+        // the final values of $8, $15 and $17 are set at the end instead
+        EXPECT_EQ(7u, reduced.num_dropped);
+        EXPECT_EQ(1u, reduced.num_folded);
+
+        int32_t initial[NUM_REGISTERS];
+        for (int r = 0; r < NUM_REGISTERS; r++) initial[r] = r * 1000 - 7;
+        std::vector<int32_t> actual =
+            run_words(reduced.words, reduced.num_instructions, initial);
+        EXPECT_EQ(0x12339000, actual[8]);
+        EXPECT_EQ(11 * 1000 - 7 + 0x12339000, actual[10]);
+        EXPECT_EQ(14 * 1000 - 7 + 2, actual[12]);
+        EXPECT_EQ(-1, actual[15]);
+        EXPECT_EQ(-1, actual[17]);
+        EXPECT_EQ(run_words(words.data(), words.size(), initial), actual);
+        free_reduced(&reduced);
+    });
+}
+
+SAFE_TEST(ReduceProgram, KnownInitialStateGivesFinalState, {
+    std::vector<uint32_t> words = random_instructions(17, 500);
+    int32_t initial[NUM_REGISTERS];
+    for (int r = 0; r < NUM_REGISTERS; r++) initial[r] = r * 3;
+    reduced_program reduced;
+
+    ASSERT_EQ(REDUCE_OK,
+              reduce_program(words.data(), words.size(), initial, &reduced));
+
+    EXPECT_TRUE(reduced.final_known);
+    EXPECT_EQ(nullptr, reduced.words);
+    EXPECT_EQ(0u, reduced.num_instructions);
+    std::vector<int32_t> expected =
+        run_words(words.data(), words.size(), initial);
+    EXPECT_EQ(0, memcmp(expected.data(), reduced.final_registers,
+                        sizeof(reduced.final_registers)));
+    free_reduced(&reduced);
+})
+
+SAFE_TEST(ReduceProgram, RejectsControlFlowAndMemory, {
+    reduced_program reduced;
+    EXPECT_EQ(REDUCE_NOT_STRAIGHT_LINE,
+              reduce_program(&BEQ_8_9_neg2, 1, NULL, &reduced));
+    EXPECT_EQ(REDUCE_NOT_STRAIGHT_LINE,
+              reduce_program(&LW_8_9_4, 1, NULL, &reduced));
+    EXPECT_STREQ("Program has control flow or memory instructions",
+                 reduce_status_message(REDUCE_NOT_STRAIGHT_LINE));
+})
+
+// Writes contents to a new temporary file and returns its path
+std::string write_temp_file(const std::string& contents) {
+    char path[] = "/tmp/mips_test_XXXXXX";
+    int fd = mkstemp(path);
+    EXPECT_EQ((ssize_t)contents.size(),
+              write(fd, contents.data(), contents.size()));
+    close(fd);
+    return path;
+}
+
+SAFE_TEST(LoadHexImage, ParsesLikeStrtoul, {
+    std::string path =
+        write_temp_file("3508001f\n0x00084040\n\n  2008ffff\r\nFFFFFFFF");
+    program_image image;
+
+    ASSERT_EQ(IMAGE_OK, load_hex_image(path.c_str(), &image));
+    ASSERT_EQ(5u, image.num_instructions);
+    EXPECT_EQ(0x3508001fu, image.words[0]);
+    EXPECT_EQ(0x00084040u, image.words[1]);
+    EXPECT_EQ(0u, image.words[2]);
+    EXPECT_EQ(0x2008ffffu, image.words[3]);
+    EXPECT_EQ(0xffffffffu, image.words[4]);
+
+    free_image(&image);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(LoadHexImage, Errors, {
+    program_image image;
+    EXPECT_EQ(IMAGE_OPEN_FAILED, load_hex_image("data/missing.hex", &image));
+
+    std::string path = write_temp_file("");
+    ASSERT_EQ(IMAGE_OK, load_hex_image(path.c_str(), &image));
+    EXPECT_EQ(0u, image.num_instructions);
+    free_image(&image);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(LoadHexImage, LargeFile, {
+    // Large enough to be split into chunks and stored in a mapping
+    const uint32_t num_instructions = 600000;
+    std::string contents;
+    char line[16];
+    for (uint32_t i = 0; i < num_instructions; i++) {
+        snprintf(line, sizeof(line), "%08x\n", i * 2654435761u);
+        contents += line;
+    }
+    std::string path = write_temp_file(contents);
+    program_image image;
+
+    ASSERT_EQ(IMAGE_OK, load_hex_image(path.c_str(), &image));
+    ASSERT_EQ(num_instructions, image.num_instructions);
+    EXPECT_NE(0u, image.mapped_size);
+    for (uint32_t i = 0; i < num_instructions; i++)
+        ASSERT_EQ(i * 2654435761u, image.words[i]) << i;
+
+    free_image(&image);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(LoadHexImage, Pipe, {
+    char path[] = "/tmp/mips_test_fifo_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(path));
+    std::string fifo = std::string(path) + "/fifo";
+    ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600));
+    if (fork() == 0) {
+        FILE* writer = fopen(fifo.c_str(), "w");
+        for (int i = 0; i < 5000; i++) fprintf(writer, "%08x\n", i);
+        fclose(writer);
+        _Exit(0);
+    }
+    program_image image;
+
+    ASSERT_EQ(IMAGE_OK, load_hex_image(fifo.c_str(), &image));
+    ASSERT_EQ(5000u, image.num_instructions);
+    for (uint32_t i = 0; i < 5000; i++) ASSERT_EQ(i, image.words[i]);
+
+    free_image(&image);
+    wait(NULL);
+    unlink(fifo.c_str());
+    rmdir(path);
+})
+
+// Stores the low size bytes of value at offset in file, in the given byte
+// order
+void put_bytes(std::string& file, size_t offset, uint32_t value, size_t size,
+               bool big_endian) {
+    if (file.size() < offset + size) file.resize(offset + size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        size_t shift = 8 * (big_endian ? size - 1 - i : i);
+        file[offset + i] = (char)(value >> shift);
+    }
+}
+
+// Returns a MARS binary dump of words
+std::string make_binary(const std::vector<uint32_t>& words, bool big_endian) {
+    std::string file;
+    for (size_t i = 0; i < words.size(); i++)
+        put_bytes(file, i * 4, words[i], 4, big_endian);
+    return file;
+}
+
+// Returns a minimal 32-bit MIPS ELF executable whose .text section, at
+// text_offset in the file, holds words
+std::string make_elf(const std::vector<uint32_t>& words, bool big_endian,
+                     size_t text_offset) {
+    const char shstrtab[] = "\0.text\0.shstrtab";
+    std::string file = make_binary(words, big_endian);
+    file.insert(0, text_offset, '\0');
+    size_t strtab_offset = file.size();
+    file.append(shstrtab, sizeof(shstrtab));
+    size_t shoff = (file.size() + 3) & ~(size_t)3;
+
+    memcpy(&file[0], ELFMAG, SELFMAG);
+    file[EI_CLASS] = ELFCLASS32;
+    file[EI_DATA] = big_endian ? ELFDATA2MSB : ELFDATA2LSB;
+    file[EI_VERSION] = EV_CURRENT;
+    put_bytes(file, offsetof(Elf32_Ehdr, e_type), ET_EXEC, 2, big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_machine), EM_MIPS, 2, big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_shoff), shoff, 4, big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_ehsize), sizeof(Elf32_Ehdr), 2,
+              big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_shentsize), sizeof(Elf32_Shdr), 2,
+              big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_shnum), 3, 2, big_endian);
+    put_bytes(file, offsetof(Elf32_Ehdr, e_shstrndx), 2, 2, big_endian);
+
+    // Section 0 is the null section
+    size_t text = shoff + sizeof(Elf32_Shdr);
+    put_bytes(file, text + offsetof(Elf32_Shdr, sh_name), 1, 4, big_endian);
+    put_bytes(file, text + offsetof(Elf32_Shdr, sh_type), SHT_PROGBITS, 4,
+              big_endian);
+    put_bytes(file, text + offsetof(Elf32_Shdr, sh_addr), 0x00400000, 4,
+              big_endian);
+    put_bytes(file, text + offsetof(Elf32_Shdr, sh_offset), text_offset, 4,
+              big_endian);
+    put_bytes(file, text + offsetof(Elf32_Shdr, sh_size), words.size() * 4, 4,
+              big_endian);
+    size_t strtab = text + sizeof(Elf32_Shdr);
+    put_bytes(file, strtab + offsetof(Elf32_Shdr, sh_name), 7, 4, big_endian);
+    put_bytes(file, strtab + offsetof(Elf32_Shdr, sh_type), SHT_STRTAB, 4,
+              big_endian);
+    put_bytes(file, strtab + offsetof(Elf32_Shdr, sh_offset), strtab_offset,
+              4, big_endian);
+    put_bytes(file, strtab + offsetof(Elf32_Shdr, sh_size), sizeof(shstrtab),
+              4, big_endian);
+    file.resize(strtab + sizeof(Elf32_Shdr), '\0');
+    return file;
+}
+
+// Loads contents (written to a temporary file) in format and expects words
+void expect_image_words(const std::string& contents, image_format format,
+                        const std::vector<uint32_t>& words) {
+    std::string path = write_temp_file(contents);
+    program_image image;
+
+    ASSERT_EQ(IMAGE_OK, load_image(path.c_str(), format, &image));
+    EXPECT_EQ(std::vector<uint32_t>(words),
+              std::vector<uint32_t>(image.words,
+                                    image.words + image.num_instructions));
+
+    free_image(&image);
+    unlink(path.c_str());
+}
+
+SAFE_TEST(LoadImage, BinaryDumps, {
+    std::vector<uint32_t> words = random_instructions(17, 100);
+    expect_image_words(make_binary(words, false), IMAGE_FORMAT_BINARY_LE,
+                       words);
+    expect_image_words(make_binary(words, true), IMAGE_FORMAT_BINARY_BE,
+                       words);
+    // A partial trailing word is ignored
+    expect_image_words(make_binary(words, false) + "ab",
+                       IMAGE_FORMAT_BINARY_LE, words);
+})
+
+SAFE_TEST(LoadImage, BinaryIsMappedInPlace, {
+    std::vector<uint32_t> words = random_instructions(19, 10);
+    std::string path = write_temp_file(make_binary(words, false));
+    program_image image;
+
+    ASSERT_EQ(IMAGE_OK,
+              load_image(path.c_str(), IMAGE_FORMAT_BINARY_LE, &image));
+    EXPECT_EQ((void*)image.words, image.mapping);
+    EXPECT_EQ(40u, image.mapped_size);
+
+    free_image(&image);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(LoadImage, Elf, {
+    std::vector<uint32_t> words = random_instructions(23, 50);
+    expect_image_words(make_elf(words, false, 64), IMAGE_FORMAT_ELF, words);
+    expect_image_words(make_elf(words, true, 64), IMAGE_FORMAT_ELF, words);
+    // Misaligned .text is copied rather than used in place
+    expect_image_words(make_elf(words, true, 66), IMAGE_FORMAT_ELF, words);
+    // auto detects ELF files by their magic number, and hex otherwise
+    expect_image_words(make_elf(words, false, 64), IMAGE_FORMAT_AUTO, words);
+    expect_image_words("3508001f\n00084040\n", IMAGE_FORMAT_AUTO,
+                       {0x3508001f, 0x00084040});
+})
+
+SAFE_TEST(LoadImage, BadElf, {
+    std::string not_mips = make_elf({ADD_3_1_2}, false, 64);
+    put_bytes(not_mips, offsetof(Elf32_Ehdr, e_machine), EM_X86_64, 2, false);
+    std::string truncated = make_elf({ADD_3_1_2}, false, 64).substr(0, 40);
+    for (const std::string& contents : {not_mips, truncated}) {
+        std::string path = write_temp_file(contents);
+        program_image image;
+        EXPECT_EQ(IMAGE_BAD_FORMAT,
+                  load_image(path.c_str(), IMAGE_FORMAT_ELF, &image));
+        unlink(path.c_str());
+    }
+})
+
+SAFE_TEST(ParseImageFormat, Names, {
+    image_format format;
+    EXPECT_TRUE(parse_image_format("binary-be", &format));
+    EXPECT_EQ(IMAGE_FORMAT_BINARY_BE, format);
+    EXPECT_TRUE(parse_image_format("elf", &format));
+    EXPECT_EQ(IMAGE_FORMAT_ELF, format);
+    EXPECT_FALSE(parse_image_format("srec", &format));
+})
+
+SAFE_TEST(ParallelFor, CoversEveryItemOnce, {
+    std::vector<int> hits(100000, 0);
+    parallel_for(
+        hits.size(), 1000,
+        [](size_t chunk, size_t begin, size_t end, void* ctx) {
+            std::vector<int>& hits = *(std::vector<int>*)ctx;
+            for (size_t i = begin; i < end; i++) hits[i]++;
+        },
+        &hits);
+    for (size_t i = 0; i < hits.size(); i++) ASSERT_EQ(1, hits[i]) << i;
+})
+
 // This test runs main.c's run_main function on data/*.hex
 // and compares the output with our expected output
 // To see how to use the main executable, see README section Input/output
@@ -558,6 +2150,1659 @@ TEST(MainFunc, AllHexFilesInDataDir) {
     });
 }
 
+TEST(MainFunc, ReduceGivesFinalState) {
+    run_with_signal_catching([]() {
+        // Programs --reduce accepts print the same final state as running
+        // them; the others print nothing (and why to stderr)
+        size_t num_reduced = 0;
+        for (const auto& entry : MAIN_FUNC_EXPECTED_OUTPUT) {
+            std::string out_path = write_temp_file("");
+            const char* args[] = {"./main", "-a", "--reduce",
+                                  entry.first.c_str()};
+            const int argc = 4;
+            char** argv = new char*[argc + 1];
+            for (int i = 0; i < argc; i++) argv[i] = strdup(args[i]);
+            argv[argc] = NULL;
+            int original_stdout_fd = dup(STDOUT_FILENO);
+            int original_stderr_fd = dup(STDERR_FILENO);
+            int out_fd = open(out_path.c_str(), O_WRONLY);
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            run_main(argc, argv);
+            fflush(stdout);
+            fflush(stderr);
+            dup2(original_stdout_fd, STDOUT_FILENO);
+            dup2(original_stderr_fd, STDERR_FILENO);
+            close(original_stdout_fd);
+            close(original_stderr_fd);
+            close(out_fd);
+            close(null_fd);
+            for (int i = 0; i < argc; i++) free(argv[i]);
+            delete[] argv;
+
+            std::ifstream in(out_path);
+            std::stringstream output;
+            output << in.rdbuf();
+            unlink(out_path.c_str());
+            if (output.str().empty()) continue;
+            EXPECT_EQ(entry.second, output.str()) << entry.first;
+            num_reduced++;
+        }
+        EXPECT_GE(num_reduced, 2u);
+    });
+}
+
+// Runs instructions on num_contexts random initial states in lockstep with
+// isa, and expects each context to match running it alone with the
+// interpreter
+void expect_lockstep_matches_interpreter(const std::vector<uint32_t>& instructs,
+                                         uint32_t num_contexts,
+                                         lockstep_isa isa,
+                                         uint64_t max_steps = UINT64_MAX) {
+    program* prog = create_program(instructs.data(), instructs.size());
+    lockstep_state* state = create_lockstep_state(num_contexts);
+    srand(num_contexts);
+    std::vector<int32_t> initial(num_contexts * NUM_REGISTERS);
+    for (int32_t& value : initial) value = (int32_t)(rand() * 2654435761u);
+    // Branches in random_program_with_branches compare $0 to $3, so give them
+    // few distinct values for contexts to agree on some branches but not all
+    for (uint32_t c = 0; c < num_contexts; c++)
+        for (int r = 1; r < 4; r++)
+            initial[c * NUM_REGISTERS + r] &= c % 64 == 0 ? 3 : 1;
+    for (uint32_t c = 0; c < num_contexts; c++)
+        lockstep_set_context(state, c, &initial[c * NUM_REGISTERS]);
+
+    uint64_t steps = run_lockstep(prog, state, max_steps, isa);
+    uint64_t expected_steps = 0;
+    for (uint32_t c = 0; c < num_contexts; c++) {
+        int32_t* expected = &initial[c * NUM_REGISTERS];
+        uint32_t expected_pc = INITIAL_PC;
+        guest_memory* mem = create_memory(false);
+        memory_bind(mem);
+        expected_steps +=
+            run_interpreter(prog, expected, &expected_pc, max_steps);
+        memory_bind(NULL);
+        free_memory(mem);
+        int32_t actual[NUM_REGISTERS];
+        lockstep_get_context(state, c, actual);
+        ASSERT_EQ(expected_pc, state->pcs[c]) << "context " << c;
+        for (int r = 0; r < NUM_REGISTERS; r++)
+            ASSERT_EQ(expected[r], actual[r])
+                << "context " << c << ", register " << r;
+    }
+    EXPECT_EQ(expected_steps, steps);
+
+    free_lockstep_state(state);
+    free_program(prog);
+}
+
+SAFE_TEST(RunLockstep, MatchesInterpreter, {
+    for (lockstep_isa isa : {LOCKSTEP_SCALAR, LOCKSTEP_AVX2, LOCKSTEP_AVX512}) {
+        if (!lockstep_supports(isa)) continue;
+        // Fewer than one vector, not a multiple of the vector width, and
+        // enough tiles to run on several threads
+        for (uint32_t num_contexts : {0u, 1u, 37u, 5000u}) {
+            expect_lockstep_matches_interpreter(random_instructions(5, 300),
+                                                num_contexts, isa);
+            expect_lockstep_matches_interpreter(
+                random_program_with_branches(9, 300), num_contexts, isa,
+                3000);
+            expect_lockstep_matches_interpreter(
+                random_program_with_memory(13, 300), num_contexts, isa, 3000);
+        }
+    }
+})
+
+SAFE_TEST(RunLockstep, StopsAfterMaxSteps, {
+    std::vector<uint32_t> instructs(10, 0x21080001);  // addi $8, $8, 1
+    program* prog = create_program(instructs.data(), instructs.size());
+    lockstep_state* state = create_lockstep_state(20);
+
+    EXPECT_EQ(4u * 20, run_lockstep(prog, state, 4, lockstep_best_isa()));
+    EXPECT_EQ(16u, state->pcs[0]);
+    EXPECT_EQ(6u * 20, run_lockstep(prog, state, 100, lockstep_best_isa()));
+    EXPECT_EQ(40u, state->pcs[19]);
+    EXPECT_EQ(0u, run_lockstep(prog, state, 100, lockstep_best_isa()));
+    int32_t registers[NUM_REGISTERS];
+    lockstep_get_context(state, 19, registers);
+    EXPECT_EQ(10, registers[8]);
+
+    free_lockstep_state(state);
+    free_program(prog);
+})
+
+TEST(LoadLockstepStates, Parses) {
+    run_with_signal_catching([]() {
+        std::string path = write_temp_file(
+            "# $0 $1 $2\n1 -2 0xff\n\n[0, 0, 0, 0, 0, 0, 0, 0, 7]\r\n"
+            "  0xffffffff,3\n");
+        lockstep_state* state;
+        ASSERT_EQ(IMAGE_OK, load_lockstep_states(path.c_str(), &state));
+        ASSERT_EQ(3u, state->num_contexts);
+        EXPECT_EQ(0u, state->stride % LOCKSTEP_LANE_MULTIPLE);
+
+        int32_t registers[NUM_REGISTERS];
+        lockstep_get_context(state, 0, registers);
+        EXPECT_EQ(1, registers[0]);
+        EXPECT_EQ(-2, registers[1]);
+        EXPECT_EQ(255, registers[2]);
+        EXPECT_EQ(0, registers[3]);
+        lockstep_get_context(state, 1, registers);
+        EXPECT_EQ(7, registers[8]);
+        lockstep_get_context(state, 2, registers);
+        EXPECT_EQ(-1, registers[0]);
+        EXPECT_EQ(3, registers[1]);
+        free_lockstep_state(state);
+        unlink(path.c_str());
+
+        for (const char* bad :
+             {"1 2 x\n", "0x100000000\n",
+              "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
+              "0\n"}) {
+            path = write_temp_file(bad);
+            EXPECT_EQ(IMAGE_BAD_FORMAT,
+                      load_lockstep_states(path.c_str(), &state))
+                << bad;
+            unlink(path.c_str());
+        }
+        EXPECT_EQ(IMAGE_OPEN_FAILED,
+                  load_lockstep_states("/nonexistent", &state));
+    });
+}
+
+TEST(SynthParseMix, PresetsAndWeights) {
+    uint32_t weights[SYNTH_NUM_NAMES];
+    ASSERT_TRUE(synth_parse_mix("alu", weights));
+    for (int i = 0; i < SYNTH_NUM_NAMES; i++)
+        EXPECT_EQ(i >= ADD && i <= NOR ? 1u : 0u, weights[i]) << i;
+    ASSERT_TRUE(synth_parse_mix("add=3,sll=1,ori=0", weights));
+    EXPECT_EQ(3u, weights[ADD]);
+    EXPECT_EQ(1u, weights[SLL]);
+    EXPECT_EQ(0u, weights[ORI]);
+    EXPECT_EQ(0u, weights[ADDI]);
+    for (const char* bad : {"", "nope", "add=", "add=1,", "ad=1", "add=0",
+                            "add=1;sub=2"})
+        EXPECT_FALSE(synth_parse_mix(bad, weights)) << bad;
+}
+
+TEST(SynthProgram, MixAndDependencies) {
+    synth_options options = synth_default_options();
+    options.num_instructions = 10000;
+    ASSERT_TRUE(synth_parse_mix("add=3,sll=1", options.weights));
+    options.dependency_distance = 1;
+    uint32_t* instructs = synth_program(&options);
+    ASSERT_NE(nullptr, instructs);
+
+    int counts[SYNTH_NUM_NAMES] = {0};
+    for (uint32_t k = 0; k < options.num_instructions; k++) {
+        instruction decoded;
+        decode_instruction(instructs[k], &decoded);
+        ASSERT_TRUE(lookup_instruction(instructs[k])->valid);
+        counts[decoded.name]++;
+        if (k == 0) continue;
+        // Reads what the previous instruction wrote
+        instruction previous;
+        decode_instruction(instructs[k - 1], &previous);
+        EXPECT_EQ(previous._fields.r.rd, decoded._fields.r.rt);
+    }
+    EXPECT_EQ(options.num_instructions, (uint32_t)(counts[ADD] + counts[SLL]));
+    EXPECT_NEAR(3.0, (double)counts[ADD] / counts[SLL], 0.3);
+
+    // Same options, same program
+    uint32_t* again = synth_program(&options);
+    EXPECT_EQ(0, memcmp(instructs, again,
+                        options.num_instructions * sizeof(uint32_t)));
+    free(again);
+    free(instructs);
+
+    options.dependency_distance = SYNTH_MAX_DEPENDENCY_DISTANCE + 1;
+    EXPECT_EQ(nullptr, synth_program(&options));
+}
+
+TEST(SelectHottest, SumsCountsAndKeepsTiesInOrder) {
+    run_with_signal_catching([]() {
+        uint64_t a[] = {3, 0, 5, 1, 0, 3, 2};
+        uint64_t b[] = {0, 0, 0, 4, 0, 0, 1};
+        uint32_t hot[4];
+        ASSERT_EQ(4u, select_hottest(a, NULL, 7, hot, 4));
+        EXPECT_EQ(std::vector<uint32_t>({2, 0, 5, 6}),
+                  std::vector<uint32_t>(hot, hot + 4));
+        ASSERT_EQ(4u, select_hottest(a, b, 7, hot, 4));
+        EXPECT_EQ(std::vector<uint32_t>({2, 3, 0, 5}),
+                  std::vector<uint32_t>(hot, hot + 4));
+        // Zero totals are never selected
+        uint32_t all[7];
+        EXPECT_EQ(5u, select_hottest(a, NULL, 7, all, 7));
+        EXPECT_EQ(0u, select_hottest(a, NULL, 0, all, 7));
+    });
+}
+
+TEST(RunProfiled, MatchesInterpreterAndCounts) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> instructs = random_instructions(17, 2000);
+        program* prog = create_program(instructs.data(), instructs.size());
+        profile* prof = create_profile(prog);
+        int32_t expected[NUM_REGISTERS] = {0}, actual[NUM_REGISTERS] = {0};
+        uint32_t expected_pc = INITIAL_PC, actual_pc = INITIAL_PC;
+
+        run_interpreter(prog, expected, &expected_pc, UINT64_MAX);
+        EXPECT_EQ(700u, run_profiled(prog, actual, &actual_pc, 700, prof));
+        EXPECT_EQ(1300u,
+                  run_profiled(prog, actual, &actual_pc, UINT64_MAX, prof));
+        EXPECT_EQ(expected_pc, actual_pc);
+        EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)));
+        for (uint32_t i = 0; i < instructs.size(); i++)
+            EXPECT_EQ(1u, prof->pc_counts[i]);
+
+        profile_summary summary;
+        summarize_profile(prog, prof, &summary);
+        EXPECT_EQ(2000u, summary.steps);
+        uint64_t total = 0, writes = 0;
+        for (uint64_t count : summary.name_counts) total += count;
+        for (uint64_t count : summary.register_writes) writes += count;
+        EXPECT_EQ(2000u, total);
+        EXPECT_EQ(2000u, writes);
+
+        free_profile(prof);
+        free_program(prog);
+    });
+}
+
+// Runs words to completion on a pipeline, returning its cycles
+uint64_t pipeline_cycles_of(std::vector<uint32_t> words, pipeline** pipe) {
+    program* prog = create_program(words.data(), words.size());
+    *pipe = create_pipeline(prog);
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    int32_t registers[NUM_REGISTERS] = {0};
+    uint32_t pc = INITIAL_PC;
+    run_pipelined(prog, registers, &pc, UINT64_MAX, *pipe);
+    memory_bind(NULL);
+    free_memory(mem);
+    free_program(prog);
+    return pipeline_cycles(*pipe);
+}
+
+TEST(RunPipelined, HazardsAndStalls) {
+    run_with_signal_catching([]() {
+        pipeline* pipe;
+        // Independent instructions complete one per cycle after the first
+        // fills the pipeline
+        EXPECT_EQ(4u + 4, pipeline_cycles_of({i_type(ADDI_OPCODE, 8, 0, 1),
+                                              i_type(ADDI_OPCODE, 9, 0, 1),
+                                              i_type(ADDI_OPCODE, 10, 8, 1),
+                                              r_type(ADD_FUNCT, 11, 8, 9, 0)},
+                                             &pipe));
+        EXPECT_EQ(0u, pipe->load_use_stalls + pipe->branch_stalls +
+                          pipe->control_penalties);
+        free_pipeline(pipe);
+
+        // Load-use: the add waits a cycle for the load, charged to its PC
+        EXPECT_EQ(2u + 4 + 1,
+                  pipeline_cycles_of({i_type(LW_OPCODE, 8, 0, 0),
+                                      r_type(ADD_FUNCT, 9, 8, 8, 0)},
+                                     &pipe));
+        EXPECT_EQ(1u, pipe->load_use_stalls);
+        EXPECT_EQ(0u, pipe->data_stalls[0]);
+        EXPECT_EQ(1u, pipe->data_stalls[1]);
+        free_pipeline(pipe);
+
+        // A store's data is forwarded to MEM, but its address is needed in
+        // EX
+        EXPECT_EQ(2u + 4, pipeline_cycles_of({i_type(LW_OPCODE, 8, 0, 0),
+                                              i_type(SW_OPCODE, 8, 9, 0)},
+                                             &pipe));
+        free_pipeline(pipe);
+        EXPECT_EQ(2u + 4 + 1,
+                  pipeline_cycles_of({i_type(LW_OPCODE, 8, 0, 0),
+                                      i_type(SW_OPCODE, 9, 8, 0)},
+                                     &pipe));
+        free_pipeline(pipe);
+
+        // Branches compare in ID: a cycle behind an ALU result, two behind a
+        // load
+        EXPECT_EQ(2u + 4 + 1,
+                  pipeline_cycles_of({i_type(ADDI_OPCODE, 8, 0, 1),
+                                      i_type(BEQ_OPCODE, 0, 8, 5)},
+                                     &pipe));
+        EXPECT_EQ(1u, pipe->branch_stalls);
+        free_pipeline(pipe);
+        EXPECT_EQ(2u + 4 + 2,
+                  pipeline_cycles_of({i_type(LW_OPCODE, 8, 0, 0),
+                                      i_type(BNE_OPCODE, 0, 8, 5)},
+                                     &pipe));
+        EXPECT_EQ(2u, pipe->branch_stalls);
+        EXPECT_EQ(0u, pipe->load_use_stalls);
+        free_pipeline(pipe);
+
+        // A taken branch squashes the instruction fetched behind it
+        EXPECT_EQ(2u + 4 + PIPELINE_CONTROL_PENALTY,
+                  pipeline_cycles_of({i_type(BEQ_OPCODE, 0, 0, 1),
+                                      i_type(ADDI_OPCODE, 8, 0, 1),
+                                      i_type(ADDI_OPCODE, 9, 0, 1)},
+                                     &pipe));
+        EXPECT_EQ(2u, pipe->instructions);
+        EXPECT_EQ((uint64_t)PIPELINE_CONTROL_PENALTY, pipe->control_stalls[0]);
+        EXPECT_EQ(0u, pipe->counts[1]);
+        free_pipeline(pipe);
+
+        // Writes to $0 are never waited for
+        EXPECT_EQ(2u + 4, pipeline_cycles_of({i_type(LW_OPCODE, 0, 0, 0),
+                                              r_type(ADD_FUNCT, 9, 0, 0, 0)},
+                                             &pipe));
+        free_pipeline(pipe);
+
+        EXPECT_EQ(0u, pipeline_cycles_of({}, &pipe));
+        free_pipeline(pipe);
+    });
+}
+
+TEST(RunPipelined, MatchesInterpreter) {
+    run_with_signal_catching([]() {
+        for (unsigned int seed = 1; seed <= 10; seed++) {
+            std::vector<uint32_t> instructs =
+                random_program_with_memory(seed, 300);
+            program* prog = create_program(instructs.data(), instructs.size());
+            pipeline* pipe = create_pipeline(prog);
+            int32_t expected[NUM_REGISTERS] = {0}, actual[NUM_REGISTERS] = {0};
+            uint32_t expected_pc = INITIAL_PC, actual_pc = INITIAL_PC;
+
+            guest_memory* mem = create_memory(false);
+            memory_bind(mem);
+            uint64_t steps =
+                run_interpreter(prog, expected, &expected_pc, 5000);
+            free_memory(mem);
+            mem = create_memory(false);
+            memory_bind(mem);
+            uint64_t actual_steps =
+                run_pipelined(prog, actual, &actual_pc, 1000, pipe);
+            actual_steps +=
+                run_pipelined(prog, actual, &actual_pc, 5000 - actual_steps,
+                              pipe);
+            memory_bind(NULL);
+            free_memory(mem);
+
+            EXPECT_EQ(steps, actual_steps) << seed;
+            EXPECT_EQ(expected_pc, actual_pc) << seed;
+            EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected))) << seed;
+            // Every cycle is either an instruction reaching ID or lost to a
+            // stall
+            uint64_t executed = 0, data = 0, control = 0;
+            for (uint32_t i = 0; i < instructs.size(); i++) {
+                executed += pipe->counts[i];
+                data += pipe->data_stalls[i];
+                control += pipe->control_stalls[i];
+            }
+            EXPECT_EQ(steps, executed) << seed;
+            EXPECT_EQ(pipe->load_use_stalls + pipe->branch_stalls, data)
+                << seed;
+            EXPECT_EQ(pipe->control_penalties, control) << seed;
+            EXPECT_EQ(1 + steps + data + control, pipe->next_id) << seed;
+            EXPECT_LE(steps + 4 + data, pipeline_cycles(pipe)) << seed;
+            free_pipeline(pipe);
+            free_program(prog);
+        }
+    });
+}
+
+// Returns every page of mem, by page number
+std::map<uint32_t, std::vector<uint8_t>> memory_contents(guest_memory* mem) {
+    std::map<uint32_t, std::vector<uint8_t>> rv;
+    memory_for_each_page(
+        mem, false,
+        [](uint32_t page_number, const uint8_t* page, void* context) {
+            (*(std::map<uint32_t, std::vector<uint8_t>>*)context)[page_number] =
+                std::vector<uint8_t>(page, page + PAGE_SIZE);
+        },
+        &rv);
+    // Untouched pages read as 0 whether or not they are backed
+    for (auto it = rv.begin(); it != rv.end();) {
+        bool zero = std::all_of(it->second.begin(), it->second.end(),
+                                [](uint8_t byte) { return byte == 0; });
+        it = zero ? rv.erase(it) : std::next(it);
+    }
+    return rv;
+}
+
+// Runs a random program with memory for 6000 steps in one go, and again in
+// three parts: saving a full snapshot after the first, an incremental one
+// after the second, and restoring each into a fresh memory to run the rest.
+// Expects every run to end in the same state
+void expect_snapshots_resume(bool flat) {
+    std::string first_path = write_temp_file("");
+    std::string second_path = write_temp_file("");
+    for (unsigned int seed = 1; seed <= 10; seed++) {
+        std::vector<uint32_t> words = random_program_with_memory(seed, 300);
+        program* prog = create_program(words.data(), words.size());
+        int32_t expected[NUM_REGISTERS];
+        for (int i = 0; i < NUM_REGISTERS; i++) expected[i] = i % 4;
+        snapshot_state state;
+        memcpy(state.registers, expected, sizeof(expected));
+        state.pc = INITIAL_PC;
+        uint32_t expected_pc = INITIAL_PC;
+
+        guest_memory* expected_mem = create_memory(flat);
+        memory_bind(expected_mem);
+        uint64_t expected_steps =
+            run_interpreter(prog, expected, &expected_pc, 6000);
+
+        guest_memory* mem = create_memory(flat);
+        memory_bind(mem);
+        state.steps = run_interpreter(prog, state.registers, &state.pc, 2000);
+        ASSERT_EQ(SNAPSHOT_OK, save_snapshot(first_path.c_str(), NULL,
+                                             words.data(), words.size(),
+                                             &state, mem));
+        state.steps +=
+            run_interpreter(prog, state.registers, &state.pc, 2000);
+        ASSERT_EQ(SNAPSHOT_OK,
+                  save_snapshot(second_path.c_str(), first_path.c_str(),
+                                words.data(), words.size(), &state, mem));
+        memory_bind(NULL);
+        free_memory(mem);
+
+        snapshot_header first, second;
+        ASSERT_EQ(SNAPSHOT_OK, read_snapshot_header(first_path.c_str(), &first));
+        ASSERT_EQ(SNAPSHOT_OK,
+                  read_snapshot_header(second_path.c_str(), &second));
+        EXPECT_EQ(first.id, second.parent_id);
+        EXPECT_EQ(0u, first.parent_id);
+
+        for (const std::string& path : {first_path, second_path}) {
+            snapshot_state restored;
+            mem = create_memory(flat);
+            ASSERT_EQ(SNAPSHOT_OK,
+                      restore_snapshot(path.c_str(), words.data(),
+                                       words.size(), &restored, mem));
+            memory_bind(mem);
+            restored.steps += run_interpreter(prog, restored.registers,
+                                              &restored.pc,
+                                              6000 - restored.steps);
+            memory_bind(NULL);
+            EXPECT_EQ(expected_steps, restored.steps) << seed;
+            EXPECT_EQ(expected_pc, restored.pc) << seed;
+            EXPECT_EQ(0, memcmp(expected, restored.registers,
+                                sizeof(expected)))
+                << seed;
+            EXPECT_EQ(memory_contents(expected_mem), memory_contents(mem))
+                << seed;
+            free_memory(mem);
+        }
+        free_memory(expected_mem);
+        free_program(prog);
+    }
+    unlink(first_path.c_str());
+    unlink(second_path.c_str());
+}
+
+SAFE_TEST(Snapshot, ResumesPaged, { expect_snapshots_resume(false); })
+
+SAFE_TEST(Snapshot, ResumesFlat, { expect_snapshots_resume(true); })
+
+SAFE_TEST(Snapshot, RestoredPagesAreCopyOnWrite, {
+    std::string path = write_temp_file("");
+    uint32_t word = LW_8_9_4;
+    snapshot_state state;
+    memset(&state, 0, sizeof(state));
+    guest_memory* mem = create_memory(false);
+    memory_store_word(mem, 0x2000, 7);
+    ASSERT_EQ(SNAPSHOT_OK,
+              save_snapshot(path.c_str(), NULL, &word, 1, &state, mem));
+    free_memory(mem);
+
+    for (int k = 0; k < 2; k++) {
+        mem = create_memory(false);
+        ASSERT_EQ(SNAPSHOT_OK,
+                  restore_snapshot(path.c_str(), &word, 1, &state, mem));
+        EXPECT_EQ(7, memory_load_word(mem, 0x2000));
+        EXPECT_EQ(std::vector<uint32_t>(), visited_pages(mem, true));
+        memory_store_word(mem, 0x2000, 8);
+        EXPECT_EQ(8, memory_load_word(mem, 0x2000));
+        EXPECT_EQ(std::vector<uint32_t>({2}), visited_pages(mem, true));
+        free_memory(mem);
+    }
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Snapshot, FindsMovedParent, {
+    std::string parent_path = write_temp_file("");
+    std::string child_path = write_temp_file("");
+    uint32_t word = LW_8_9_4;
+    snapshot_state state;
+    memset(&state, 0, sizeof(state));
+    guest_memory* mem = create_memory(false);
+    memory_store_word(mem, 0x2000, 7);
+    ASSERT_EQ(SNAPSHOT_OK,
+              save_snapshot(parent_path.c_str(), NULL, &word, 1, &state, mem));
+    memory_store_word(mem, 0x3000, 9);
+    state.steps = 5;
+    ASSERT_EQ(SNAPSHOT_OK, save_snapshot(child_path.c_str(),
+                                         parent_path.c_str(), &word, 1, &state,
+                                         mem));
+    free_memory(mem);
+
+    // Move both to another directory, as if to another machine
+    char directory[] = "/tmp/mips_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    std::string parent_name = parent_path.substr(parent_path.rfind('/'));
+    std::string child_name = child_path.substr(child_path.rfind('/'));
+    std::string moved_child = directory + child_name;
+    rename(parent_path.c_str(), (directory + parent_name).c_str());
+    rename(child_path.c_str(), moved_child.c_str());
+
+    mem = create_memory(false);
+    EXPECT_EQ(SNAPSHOT_OK,
+              restore_snapshot(moved_child.c_str(), &word, 1, &state, mem));
+    EXPECT_EQ(5u, state.steps);
+    EXPECT_EQ(7, memory_load_word(mem, 0x2000));
+    EXPECT_EQ(9, memory_load_word(mem, 0x3000));
+    free_memory(mem);
+
+    // Without the parent, the child can't be restored
+    unlink((directory + parent_name).c_str());
+    mem = create_memory(false);
+    EXPECT_EQ(SNAPSHOT_BAD_PARENT,
+              restore_snapshot(moved_child.c_str(), &word, 1, &state, mem));
+    free_memory(mem);
+    unlink(moved_child.c_str());
+    rmdir(directory);
+})
+
+TEST(Snapshot, RejectsMismatches) {
+    run_with_signal_catching([]() {
+        std::string path = write_temp_file("");
+        std::string other_path = write_temp_file("");
+        std::string garbage_path = write_temp_file("not a snapshot");
+        uint32_t words[] = {LW_8_9_4, BEQ_8_9_neg2};
+        snapshot_state state;
+        memset(&state, 0, sizeof(state));
+        guest_memory* mem = create_memory(false);
+        ASSERT_EQ(SNAPSHOT_OK,
+                  save_snapshot(path.c_str(), NULL, words, 2, &state, mem));
+        ASSERT_EQ(SNAPSHOT_OK,
+                  save_snapshot(other_path.c_str(), NULL, words, 2, &state, mem));
+        // mem was last saved to other_path, so it can't be incremental to path
+        EXPECT_EQ(SNAPSHOT_BAD_PARENT,
+                  save_snapshot(other_path.c_str(), path.c_str(), words, 2,
+                                &state, mem));
+        free_memory(mem);
+
+        mem = create_memory(false);
+        EXPECT_EQ(SNAPSHOT_PROGRAM_MISMATCH,
+                  restore_snapshot(path.c_str(), words, 1, &state, mem));
+        EXPECT_EQ(SNAPSHOT_PROGRAM_MISMATCH,
+                  restore_snapshot(path.c_str(), &words[1], 1, &state, mem));
+        EXPECT_EQ(SNAPSHOT_BAD_FORMAT,
+                  restore_snapshot(garbage_path.c_str(), words, 2, &state, mem));
+        EXPECT_EQ(SNAPSHOT_OPEN_FAILED,
+                  restore_snapshot("/nonexistent", words, 2, &state, mem));
+        free_memory(mem);
+        unlink(path.c_str());
+        unlink(other_path.c_str());
+        unlink(garbage_path.c_str());
+    });
+}
+
+// A loop that stores 1000 words, followed by a few instructions and an exit
+// syscall. It runs for 5004 steps, and execution only reaches instruction 6
+// after the loop, at step 5001
+std::vector<uint32_t> checkpointed_program() {
+    return {
+        i_type(ADDI_OPCODE, 8, 0, 1000),
+        i_type(ADDI_OPCODE, 9, 9, 3),
+        i_type(SW_OPCODE, 9, 10, 0),
+        i_type(ADDI_OPCODE, 10, 10, 4),
+        i_type(ADDI_OPCODE, 8, 8, -1),
+        i_type(BNE_OPCODE, 0, 8, -5),
+        i_type(ADDI_OPCODE, 11, 9, 1),
+        r_type(SLL_FUNCT, 11, 0, 11, 2),
+        i_type(ADDI_OPCODE, 2, 0, EXIT_SYSCALL),
+        r_type(SYSCALL_FUNCT, 0, 0, 0, 0),
+    };
+}
+
+// Runs words for up to max_steps with checkpoints every 1000 steps in
+// directory, expecting to resume from expected_resume steps (0 for the start)
+// and to end as a run from scratch would
+void expect_checkpointed_run(const std::string& directory,
+                             const std::vector<uint32_t>& words,
+                             uint64_t expected_resume,
+                             uint64_t max_steps = UINT64_MAX) {
+    program* prog = create_program(words.data(), words.size());
+    int32_t expected[NUM_REGISTERS] = {0};
+    uint32_t expected_pc = INITIAL_PC;
+    guest_memory* expected_mem = create_memory(false);
+    memory_bind(expected_mem);
+    uint64_t expected_steps =
+        run_interpreter(prog, expected, &expected_pc, max_steps);
+    free_program(prog);
+
+    prog = create_program(words.data(), words.size());
+    checkpoint_log* log = open_checkpoints(directory.c_str(), 1000);
+    ASSERT_NE(nullptr, log);
+    snapshot_state state;
+    memset(&state, 0, sizeof(state));
+    guest_memory* mem = create_memory(false);
+    EXPECT_EQ(expected_resume != 0,
+              resume_from_checkpoint(log, words.data(), words.size(),
+                                     max_steps, &state, &mem));
+    EXPECT_EQ(expected_resume, state.steps);
+    memory_bind(mem);
+    EXPECT_EQ(SNAPSHOT_OK, run_checkpointed(log, prog, words.data(), &state,
+                                            max_steps, mem));
+    memory_bind(NULL);
+
+    EXPECT_EQ(expected_steps, state.steps);
+    EXPECT_EQ(expected_pc, state.pc);
+    EXPECT_EQ(0, memcmp(expected, state.registers, sizeof(expected)));
+    EXPECT_EQ(memory_contents(expected_mem), memory_contents(mem));
+    close_checkpoints(log);
+    free_memory(mem);
+    free_memory(expected_mem);
+    free_program(prog);
+}
+
+// Returns the names of the files in directory, sorted
+std::vector<std::string> directory_files(const std::string& directory) {
+    std::vector<std::string> rv;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory))
+        rv.push_back(entry.path().filename().string());
+    std::sort(rv.begin(), rv.end());
+    return rv;
+}
+
+SAFE_TEST(Checkpoints, ResumeFromLastUnaffectedCheckpoint, {
+    char directory[] = "/tmp/mips_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    std::vector<uint32_t> words = checkpointed_program();
+
+    expect_checkpointed_run(directory, words, 0);
+    std::vector<std::string> files = directory_files(directory);
+    ASSERT_EQ(6u, files.size());
+    EXPECT_EQ("checkpoint-00000000000000001000.snap", files[0]);
+    EXPECT_EQ("checkpoint-00000000000000005004.snap", files[5]);
+
+    // Unchanged: nothing left to run
+    expect_checkpointed_run(directory, words, 5004);
+    // A lower limit than before resumes from before it, and the later
+    // checkpoints are kept
+    expect_checkpointed_run(directory, words, 2000, 2500);
+    expect_checkpointed_run(directory, words, 0, 999);
+    std::vector<std::string> with_limits = directory_files(directory);
+    // Plus one at the end of each limited run
+    EXPECT_EQ(8u, with_limits.size());
+    EXPECT_EQ(files.back(), with_limits.back());
+    // Edited after the loop: the checkpoints in the loop are still good
+    words[7] = r_type(SLL_FUNCT, 11, 0, 11, 3);
+    expect_checkpointed_run(directory, words, 5000);
+    // Appending instructions doesn't change any prefix
+    words.push_back(i_type(ADDI_OPCODE, 12, 0, 1));
+    expect_checkpointed_run(directory, words, 5004);
+    // Edited in the loop: every checkpoint is stale and is replaced
+    words[3] = i_type(ADDI_OPCODE, 10, 10, 8);
+    expect_checkpointed_run(directory, words, 0);
+    EXPECT_EQ(files, directory_files(directory));
+
+    for (const std::string& file : directory_files(directory))
+        unlink((std::string(directory) + "/" + file).c_str());
+    rmdir(directory);
+})
+
+// Runs a program with main's --profile=path option (or another option taking
+// an output path) and returns what was written to path
+std::string profile_output(const char* hex_path, const char* extension,
+                           const char* option_name = "--profile=") {
+    std::string temp_path = write_temp_file("");
+    unlink(temp_path.c_str());
+    std::string path = temp_path + extension;
+    std::string option = option_name + path;
+    const char* args[] = {"./main", "-a", option.c_str(), hex_path};
+    const int argc = 4;
+    char** argv = new char*[argc + 1];
+    for (int i = 0; i < argc; i++) argv[i] = strdup(args[i]);
+    argv[argc] = NULL;
+    // The report goes to stderr and the state to stdout
+    int original_stdout_fd = dup(STDOUT_FILENO);
+    int original_stderr_fd = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    run_main(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(original_stdout_fd, STDOUT_FILENO);
+    dup2(original_stderr_fd, STDERR_FILENO);
+    close(original_stdout_fd);
+    close(original_stderr_fd);
+    close(null_fd);
+    for (int i = 0; i < argc; i++) free(argv[i]);
+    delete[] argv;
+
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    unlink(path.c_str());
+    return contents.str();
+}
+
+TEST(MainFunc, ProfileExports) {
+    run_with_signal_catching([]() {
+        // addi, add, sub, ori
+        EXPECT_EQ(
+            "program;addi;0x00000000 1\nprogram;add;0x00000004 1\n"
+            "program;sub;0x00000008 1\nprogram;ori;0x0000000c 1\n",
+            profile_output("data/addi_add_sub_ori.hex", ".folded"));
+        std::string json =
+            profile_output("data/addi_add_sub_ori.hex", ".json");
+        EXPECT_EQ(0u, json.find("{\"steps\": 4, \"instructions\": {\"sll\": "
+                                "0, \"sra\": 0, \"add\": 1, \"sub\": 1,"))
+            << json;
+        EXPECT_NE(std::string::npos,
+                  json.find("{\"pc\": 12, \"instruction\": \"ori\", "
+                            "\"count\": 1}]}"))
+            << json;
+    });
+}
+
+TEST(MainFunc, HostCountersExport) {
+    run_with_signal_catching([]() {
+        std::string json = profile_output("data/loop_sum.hex", ".json",
+                                          "--host-counters=");
+        EXPECT_EQ(0u, json.find("{\"load\": {\"guest_instructions\": 11, "))
+            << json;
+        EXPECT_NE(std::string::npos,
+                  json.find("\"decode\": {\"guest_instructions\": 11, "))
+            << json;
+        EXPECT_NE(std::string::npos,
+                  json.find("\"run\": {\"guest_instructions\": 36, "))
+            << json;
+        // The tests don't link alloccount.o
+        EXPECT_NE(std::string::npos,
+                  json.find("\"allocations\": null, "
+                            "\"allocations_per_instruction\": null}}\n"))
+            << json;
+    });
+}
+
+SAFE_TEST(HostProfile, SumsRegions, {
+    host_profile* host = create_host_profile();
+    ASSERT_NE(nullptr, host);
+    EXPECT_FALSE(host->available[HOST_ALLOCATIONS]);
+    volatile uint64_t sum = 0;
+    for (int k = 0; k < 2; k++) {
+        host_region_begin(host, HOST_REGION_RUN);
+        for (uint64_t i = 0; i < 100000; i++) sum += i;
+        host_region_end(host, HOST_REGION_RUN, 50);
+    }
+    EXPECT_EQ(100u, host->units[HOST_REGION_RUN]);
+    EXPECT_EQ(0u, host->units[HOST_REGION_LOAD]);
+    if (host->available[HOST_TSC_TICKS]) {
+        EXPECT_LT(0u, host->totals[HOST_REGION_RUN][HOST_TSC_TICKS]);
+    }
+    if (host->available[HOST_INSTRUCTIONS]) {
+        EXPECT_LT(200000u, host->totals[HOST_REGION_RUN][HOST_INSTRUCTIONS]);
+    }
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++)
+        EXPECT_EQ(0u, host->totals[HOST_REGION_DECODE][c]);
+    // Doing nothing without a profile
+    host_region_begin(NULL, HOST_REGION_RUN);
+    host_region_end(NULL, HOST_REGION_RUN, 1);
+    free_host_profile(host);
+})
+
+// Runs a batch and returns everything it wrote
+std::string run_batch_to_string(char* const* paths, size_t num_paths,
+                                const batch_options& options,
+                                size_t* num_failed) {
+    char* buf = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&buf, &size);
+    *num_failed = run_batch(paths, num_paths, &options, out);
+    fclose(out);
+    std::string output(buf, size);
+    free(buf);
+    return output;
+}
+
+TEST(RunBatch, DataDirMatchesMain) {
+    run_with_signal_catching([]() {
+        size_t num_paths;
+        char** paths =
+            batch_paths(DATA_DIR.c_str(), IMAGE_FORMAT_AUTO, &num_paths);
+        ASSERT_NE(nullptr, paths);
+        ASSERT_EQ(MAIN_FUNC_EXPECTED_OUTPUT.size(), num_paths);
+
+        // Results must come back in (sorted) input order
+        std::string expected;
+        for (size_t i = 0; i < num_paths; i++) {
+            if (i > 0) {
+                EXPECT_LT(strcmp(paths[i - 1], paths[i]), 0);
+            }
+            expected += std::string(paths[i]) + "\n" +
+                        MAIN_FUNC_EXPECTED_OUTPUT.at(paths[i]);
+        }
+        for (size_t num_threads : {1, 3, 16}) {
+            for (engine_kind engine :
+                 {ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT}) {
+                batch_options options = {engine,       IMAGE_FORMAT_AUTO,
+                                         OUTPUT_ARRAY, false,
+                                         num_threads,  false,
+                                         false,        UINT64_MAX};
+                size_t num_failed;
+                EXPECT_EQ(expected, run_batch_to_string(paths, num_paths,
+                                                        options, &num_failed));
+                EXPECT_EQ(0u, num_failed);
+            }
+        }
+        free_batch_paths(paths, num_paths);
+    });
+}
+
+TEST(RunBatch, ListWithManyProgramsAndErrors) {
+    run_with_signal_catching([]() {
+        // Programs of very different lengths so that workers steal from each
+        // other, plus a path that doesn't exist
+        std::vector<std::string> programs;
+        std::string list;
+        for (int i = 0; i < 40; i++) {
+            std::string contents;
+            for (int j = 0; j < (i % 7) * 500 + 1; j++)
+                contents += "21080001\n";
+            programs.push_back(write_temp_file(contents));
+            list += programs.back() + "\n";
+            if (i == 20) list += "/nonexistent/program.hex\n\n";
+        }
+        std::string list_path = write_temp_file(list);
+
+        size_t num_paths;
+        char** paths =
+            batch_paths(list_path.c_str(), IMAGE_FORMAT_HEX, &num_paths);
+        ASSERT_EQ(41u, num_paths);
+        std::string expected;
+        for (int i = 0; i < 40; i++) {
+            int32_t registers[NUM_REGISTERS] = {0};
+            registers[8] = (i % 7) * 500 + 1;
+            char state[OUTPUT_STATE_SIZE];
+            size_t length = format_registers(state, OUTPUT_ARRAY, true,
+                                             registers, registers[8] * 4);
+            expected += programs[i] + "\n" + std::string(state, length);
+            if (i == 20)
+                expected += "/nonexistent/program.hex\nerror: " +
+                            std::string(image_status_message(
+                                IMAGE_OPEN_FAILED)) +
+                            "\n";
+        }
+        batch_options options = {ENGINE_THREADED, IMAGE_FORMAT_HEX,
+                                 OUTPUT_ARRAY,    true,
+                                 4,               false,
+                                 false,           UINT64_MAX};
+        size_t num_failed;
+        EXPECT_EQ(expected,
+                  run_batch_to_string(paths, num_paths, options, &num_failed));
+        EXPECT_EQ(1u, num_failed);
+
+        free_batch_paths(paths, num_paths);
+        for (const std::string& path : programs) unlink(path.c_str());
+        unlink(list_path.c_str());
+        EXPECT_EQ(nullptr, batch_paths("/nonexistent", IMAGE_FORMAT_AUTO,
+                                       &num_paths));
+    });
+}
+
+// Formats registers and pc with format_registers
+std::string formatted(output_mode mode, bool hex, const int32_t* registers,
+                      uint32_t pc) {
+    char buf[OUTPUT_STATE_SIZE];
+    return std::string(buf, format_registers(buf, mode, hex, registers, pc));
+}
+
+// Formats registers and pc the way print_state did with printf
+std::string formatted_with_printf(bool disp_array, bool disp_hex,
+                                  const int32_t* registers, uint32_t pc) {
+    char buf[OUTPUT_STATE_SIZE];
+    int length = 0;
+    if (disp_array) {
+        length += sprintf(buf + length, "[");
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            length += sprintf(buf + length, disp_hex ? "0x%08x, " : "%d, ",
+                              registers[i]);
+        length += sprintf(buf + length, disp_hex ? "0x%08x]\n" : "%d]\n", pc);
+    } else {
+        length += sprintf(buf + length, "| Name |    Value   |\n");
+        length += sprintf(buf + length, "---------------------\n");
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            length += sprintf(buf + length,
+                              disp_hex ? "|  $%2d | 0x%08x |\n"
+                                       : "|  $%2d | %10d |\n",
+                              i, registers[i]);
+        length += sprintf(buf + length,
+                          disp_hex ? "|   PC | 0x%08x |\n"
+                                   : "|   PC |  %9d |\n",
+                          pc);
+    }
+    return std::string(buf, length);
+}
+
+SAFE_TEST(FormatRegisters, MatchesPrintf, {
+    int32_t registers[NUM_REGISTERS];
+    srand(17);
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        registers[i] = (int32_t)(rand() * 2654435761u) >> (i % 32);
+    registers[1] = 0;
+    registers[2] = INT32_MIN;
+    registers[3] = INT32_MAX;
+    registers[4] = -1;
+    for (uint32_t pc : {0u, 40u, 0x80000000u, 0xfffffffcu}) {
+        for (bool hex : {false, true}) {
+            EXPECT_EQ(formatted_with_printf(false, hex, registers, pc),
+                      formatted(OUTPUT_TABLE, hex, registers, pc));
+            EXPECT_EQ(formatted_with_printf(true, hex, registers, pc),
+                      formatted(OUTPUT_ARRAY, hex, registers, pc));
+        }
+    }
+})
+
+SAFE_TEST(FormatRegisters, JsonAndBinary, {
+    int32_t registers[NUM_REGISTERS];
+    for (int i = 0; i < NUM_REGISTERS; i++) registers[i] = i * 1000 - 3;
+    registers[31] = INT32_MIN;
+    std::string json = formatted(OUTPUT_JSON, true, registers, 0xfffffffc);
+    EXPECT_EQ(0u, json.find("{\"registers\": [-3, 997, 1997, "));
+    EXPECT_NE(std::string::npos,
+              json.find(", 29997, -2147483648], \"pc\": 4294967292}\n"))
+        << json;
+
+    std::string binary = formatted(OUTPUT_BINARY, false, registers, 0x1234);
+    ASSERT_EQ(OUTPUT_RECORD_WORDS * 4u, binary.size());
+    const unsigned char* bytes = (const unsigned char*)binary.data();
+    for (int i = 0; i < OUTPUT_RECORD_WORDS; i++) {
+        uint32_t word = bytes[4 * i] | bytes[4 * i + 1] << 8 |
+                        bytes[4 * i + 2] << 16 | (uint32_t)bytes[4 * i + 3]
+                                                     << 24;
+        EXPECT_EQ(i < NUM_REGISTERS ? (uint32_t)registers[i] : 0x1234u, word);
+    }
+
+    output_mode mode;
+    EXPECT_TRUE(parse_output_mode("json", &mode));
+    EXPECT_EQ(OUTPUT_JSON, mode);
+    EXPECT_TRUE(parse_output_mode("binary", &mode));
+    EXPECT_EQ(OUTPUT_BINARY, mode);
+    EXPECT_FALSE(parse_output_mode("csv", &mode));
+    char buf[64];
+    EXPECT_EQ("\"a\\\"b\\\\c\\u000a\"",
+              std::string(buf, format_json_string(buf, "a\"b\\c\n")));
+})
+
+SAFE_TEST(FormatChanges, OnlyChangedRegisters, {
+    int32_t before[NUM_REGISTERS] = {0};
+    int32_t after[NUM_REGISTERS] = {0};
+    after[9] = 110;
+    after[31] = -4;
+    char buf[OUTPUT_STATE_SIZE];
+    EXPECT_EQ("| Name |    Value   |\n"
+              "---------------------\n"
+              "|  $ 9 |        110 |\n"
+              "|  $31 |         -4 |\n"
+              "|   PC |         28 |\n",
+              std::string(buf, format_changes(buf, OUTPUT_TABLE, false, before,
+                                              after, 28)));
+    EXPECT_EQ("{\"changed\": {\"9\": 110, \"31\": -4}, \"pc\": 28}\n",
+              std::string(buf, format_changes(buf, OUTPUT_JSON, false, before,
+                                              after, 28)));
+    EXPECT_EQ("{\"changed\": {}, \"pc\": 4}\n",
+              std::string(buf, format_changes(buf, OUTPUT_JSON, false, after,
+                                              after, 4)));
+    // Fixed layouts print everything
+    EXPECT_EQ(formatted(OUTPUT_ARRAY, true, after, 28),
+              std::string(buf, format_changes(buf, OUTPUT_ARRAY, true, before,
+                                              after, 28)));
+})
+
+TEST(StateWriter, BuffersManyStates) {
+    run_with_signal_catching([]() {
+        int pipe_fd[2];
+        ASSERT_EQ(0, pipe(pipe_fd));
+        state_writer* writer = (state_writer*)malloc(sizeof(state_writer));
+        init_state_writer(writer, pipe_fd[1], OUTPUT_JSON, false);
+        // Enough to fill the buffer a few times over, read back concurrently
+        // since that's more than a pipe holds
+        const int num_states = 1000;
+        std::string expected;
+        std::string read_back;
+        std::thread reader([&]() {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(pipe_fd[0], buf, sizeof(buf))) > 0)
+                read_back.append(buf, n);
+        });
+        int32_t registers[NUM_REGISTERS] = {0};
+        for (int i = 0; i < num_states; i++) {
+            registers[i % NUM_REGISTERS] = i * 7919;
+            write_state(writer, registers, 4 * i);
+            expected += formatted(OUTPUT_JSON, false, registers, 4 * i);
+        }
+        EXPECT_TRUE(flush_state_writer(writer));
+        close(pipe_fd[1]);
+        reader.join();
+        close(pipe_fd[0]);
+        EXPECT_EQ(expected, read_back);
+        free(writer);
+    });
+}
+
+TEST(RunBatch, Json) {
+    run_with_signal_catching([]() {
+        std::string program = write_temp_file("21080005\n");
+        std::string list_path =
+            write_temp_file(program + "\n/nonexistent/\"quoted\".hex\n");
+        size_t num_paths;
+        char** paths =
+            batch_paths(list_path.c_str(), IMAGE_FORMAT_HEX, &num_paths);
+        ASSERT_EQ(2u, num_paths);
+        int32_t registers[NUM_REGISTERS] = {0};
+        registers[8] = 5;
+        std::string state = formatted(OUTPUT_JSON, false, registers, 4);
+        std::string expected =
+            "{\"path\": \"" + program + "\", " + state.substr(1) +
+            "{\"path\": \"/nonexistent/\\\"quoted\\\".hex\", \"error\": \"" +
+            image_status_message(IMAGE_OPEN_FAILED) + "\"}\n";
+        batch_options options = {ENGINE_INTERPRETER, IMAGE_FORMAT_HEX,
+                                 OUTPUT_JSON,        false,
+                                 2,                  false,
+                                 false,              UINT64_MAX};
+        size_t num_failed;
+        EXPECT_EQ(expected,
+                  run_batch_to_string(paths, num_paths, options, &num_failed));
+        EXPECT_EQ(1u, num_failed);
+        free_batch_paths(paths, num_paths);
+        unlink(program.c_str());
+        unlink(list_path.c_str());
+    });
+}
+
+TEST(RunBatch, MaxStepsStopsProgramsThatDontHalt) {
+    run_with_signal_catching([]() {
+        // j 0 loops forever; the program after it must still be reported
+        std::string looping = write_temp_file("08000000\n");
+        std::string halting = write_temp_file("2008000a\n");
+        std::string list_path = write_temp_file(looping + "\n" + halting);
+        size_t num_paths;
+        char** paths =
+            batch_paths(list_path.c_str(), IMAGE_FORMAT_HEX, &num_paths);
+        ASSERT_EQ(2u, num_paths);
+        int32_t registers[NUM_REGISTERS] = {0};
+        registers[8] = 10;
+        std::string expected =
+            looping + "\nerror: Didn't halt within the step limit\n" +
+            halting + "\n" + formatted(OUTPUT_ARRAY, false, registers, 4);
+        for (engine_kind engine :
+             {ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT}) {
+            batch_options options = {engine,       IMAGE_FORMAT_HEX,
+                                     OUTPUT_ARRAY, false,
+                                     2,            false,
+                                     false,        100000};
+            size_t num_failed;
+            EXPECT_EQ(expected, run_batch_to_string(paths, num_paths, options,
+                                                    &num_failed));
+            EXPECT_EQ(1u, num_failed);
+        }
+        free_batch_paths(paths, num_paths);
+        unlink(looping.c_str());
+        unlink(halting.c_str());
+        unlink(list_path.c_str());
+    });
+}
+
+// Runs words for up to max_steps with run_traced, writing a trace to a
+// temporary file, and returns its path. Sets states to the registers and PC
+// before each step and after the last, taken from a run of the interpreter
+// one step at a time
+std::string traced_run(const std::vector<uint32_t>& words, uint64_t max_steps,
+                       std::vector<std::vector<int32_t>>* states) {
+    std::string path = write_temp_file("");
+    program* prog = create_program(words.data(), words.size());
+    guest_memory* mem = create_memory(false);
+    memory_bind(mem);
+    int32_t registers[NUM_REGISTERS] = {0};
+    registers[1] = 12345;
+    uint32_t pc = INITIAL_PC;
+    trace_writer* writer;
+    EXPECT_EQ(TRACE_OK, open_trace(path.c_str(), registers, pc, &writer));
+    uint64_t steps = run_traced(prog, words.data(), registers, &pc, max_steps,
+                                writer);
+    EXPECT_EQ(TRACE_OK, close_trace(writer, registers, pc));
+    memory_bind(NULL);
+    free_memory(mem);
+
+    mem = create_memory(false);
+    memory_bind(mem);
+    memset(registers, 0, sizeof(registers));
+    registers[1] = 12345;
+    pc = INITIAL_PC;
+    states->clear();
+    for (uint64_t k = 0; k <= steps; k++) {
+        std::vector<int32_t> state(registers, registers + NUM_REGISTERS);
+        state.push_back((int32_t)pc);
+        states->push_back(state);
+        if (k < steps) {
+            EXPECT_EQ(1u, run_interpreter(prog, registers, &pc, 1));
+        }
+    }
+    memory_bind(NULL);
+    free_memory(mem);
+    free_program(prog);
+    return path;
+}
+
+// Returns reader's state before record index as in traced_run
+std::vector<int32_t> trace_state(trace_reader* reader, uint64_t index) {
+    int32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    EXPECT_EQ(TRACE_OK, trace_state_at(reader, index, registers, &pc));
+    std::vector<int32_t> state(registers, registers + NUM_REGISTERS);
+    state.push_back((int32_t)pc);
+    return state;
+}
+
+TEST(Trace, RecordsEveryStep) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = random_program_with_memory(41, 300);
+        std::vector<std::vector<int32_t>> states;
+        std::string path = traced_run(words, 20000, &states);
+        uint64_t steps = states.size() - 1;
+        ASSERT_GT(steps, 3u * TRACE_CHUNK_RECORDS);
+
+        trace_reader reader;
+        ASSERT_EQ(TRACE_OK, open_trace_reader(path.c_str(), &reader));
+        EXPECT_TRUE(reader.complete);
+        EXPECT_EQ(steps, reader.num_records);
+        std::vector<trace_record> records(steps);
+        ASSERT_EQ(TRACE_OK, read_trace(&reader, 0, steps, records.data()));
+        for (uint64_t k = 0; k < steps; k++) {
+            const trace_record& record = records[k];
+            ASSERT_EQ((uint32_t)states[k][NUM_REGISTERS], record.pc) << k;
+            ASSERT_EQ(words[record.pc / 4], record.instruction) << k;
+            // The destination holds its new value after the step, and no
+            // other register changed
+            for (int r = 0; r < NUM_REGISTERS; r++) {
+                if (r == record.dest)
+                    ASSERT_EQ(states[k + 1][r], record.value) << k;
+                else
+                    ASSERT_EQ(states[k + 1][r], states[k][r]) << k << " " << r;
+            }
+        }
+        // Compressed well below the 13 bytes per record of the raw fields
+        struct stat st;
+        ASSERT_EQ(0, stat(path.c_str(), &st));
+        EXPECT_LT((uint64_t)st.st_size, steps * 8);
+
+        // Seeking to any step, including across chunks and the end
+        for (uint64_t k : {(uint64_t)0, (uint64_t)1,
+                           (uint64_t)TRACE_CHUNK_RECORDS - 1,
+                           (uint64_t)TRACE_CHUNK_RECORDS,
+                           (uint64_t)TRACE_CHUNK_RECORDS * 2 + 17, steps / 2,
+                           steps - 1, steps})
+            EXPECT_EQ(states[k], trace_state(&reader, k)) << k;
+        trace_record record;
+        EXPECT_EQ(TRACE_OK, read_trace(&reader, TRACE_CHUNK_RECORDS - 1, 1,
+                                       &record));
+        EXPECT_EQ(records[TRACE_CHUNK_RECORDS - 1].pc, record.pc);
+        EXPECT_EQ(TRACE_OUT_OF_RANGE, read_trace(&reader, steps, 1, &record));
+        int32_t registers[NUM_REGISTERS];
+        uint32_t pc;
+        EXPECT_EQ(TRACE_OUT_OF_RANGE,
+                  trace_state_at(&reader, steps + 1, registers, &pc));
+        close_trace_reader(&reader);
+        unlink(path.c_str());
+    });
+}
+
+TEST(Trace, UnclosedTraceIsReadable) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = random_program_with_branches(43, 200);
+        std::vector<std::vector<int32_t>> states;
+        std::string path = traced_run(words, 3 * TRACE_CHUNK_RECORDS, &states);
+        ASSERT_EQ(3u * TRACE_CHUNK_RECORDS + 1, states.size());
+        // Drop the final chunk and half of the last full one, as if the
+        // simulator was killed while writing it
+        trace_reader reader;
+        ASSERT_EQ(TRACE_OK, open_trace_reader(path.c_str(), &reader));
+        ASSERT_EQ(3u, reader.num_chunks);
+        off_t length =
+            reader.chunks[2].offset + reader.chunks[2].header.size / 2;
+        close_trace_reader(&reader);
+        ASSERT_EQ(0, truncate(path.c_str(), length));
+
+        ASSERT_EQ(TRACE_OK, open_trace_reader(path.c_str(), &reader));
+        EXPECT_FALSE(reader.complete);
+        EXPECT_EQ(2u * TRACE_CHUNK_RECORDS, reader.num_records);
+        uint64_t last = 2 * TRACE_CHUNK_RECORDS - 1;
+        EXPECT_EQ(states[last], trace_state(&reader, last));
+        int32_t registers[NUM_REGISTERS];
+        uint32_t pc;
+        EXPECT_EQ(TRACE_OUT_OF_RANGE,
+                  trace_state_at(&reader, last + 1, registers, &pc));
+        close_trace_reader(&reader);
+
+        std::string not_trace = write_temp_file("not a trace");
+        EXPECT_EQ(TRACE_BAD_FORMAT,
+                  open_trace_reader(not_trace.c_str(), &reader));
+        EXPECT_EQ(TRACE_OPEN_FAILED,
+                  open_trace_reader("/nonexistent/trace", &reader));
+        unlink(not_trace.c_str());
+        unlink(path.c_str());
+    });
+}
+
+// Runs checkpointed_program for steps with the interpreter, and returns the
+// registers and PC it ends with
+std::vector<int32_t> checkpointed_state(uint64_t steps) {
+    std::vector<uint32_t> words = checkpointed_program();
+    program* prog = create_program(words.data(), words.size());
+    guest_memory* mem = create_memory(false);
+    guest_memory* previous = memory_bind(mem);
+    int32_t registers[NUM_REGISTERS] = {0};
+    uint32_t pc = INITIAL_PC;
+    run_interpreter(prog, registers, &pc, steps);
+    memory_bind(previous);
+    free_memory(mem);
+    free_program(prog);
+    std::vector<int32_t> state(registers, registers + NUM_REGISTERS);
+    state.push_back((int32_t)pc);
+    return state;
+}
+
+std::vector<int32_t> state_of(const int32_t* registers, uint32_t pc) {
+    std::vector<int32_t> state(registers, registers + NUM_REGISTERS);
+    state.push_back((int32_t)pc);
+    return state;
+}
+
+TEST(Debugger, StopsAtBreakpointsAndWatchpoints) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = checkpointed_program();
+        for (int e = 0; e < NUM_ENGINES; e++) {
+            engine_kind engine = (engine_kind)e;
+            SCOPED_TRACE(engine_name(engine));
+            program* prog = create_program(words.data(), words.size());
+            guest_memory* mem = create_memory(false);
+            memory_bind(mem);
+            int32_t registers[NUM_REGISTERS] = {0};
+            uint32_t pc = INITIAL_PC;
+            debugger* dbg = create_debugger(prog, words.data(), engine);
+            ASSERT_NE(nullptr, dbg);
+
+            // $8 is set by the first instruction, then counts down
+            ASSERT_TRUE(debug_set_watchpoint(dbg, 8, true));
+            EXPECT_EQ(DEBUG_WATCHPOINT,
+                      debug_run(dbg, registers, &pc, UINT64_MAX));
+            EXPECT_EQ(checkpointed_state(1), state_of(registers, pc));
+            EXPECT_EQ(0, dbg->watch_old_value);
+            EXPECT_EQ(DEBUG_WATCHPOINT,
+                      debug_run(dbg, registers, &pc, UINT64_MAX));
+            EXPECT_EQ(5u, dbg->steps);
+            EXPECT_EQ(8, dbg->watch_register);
+            EXPECT_EQ(1000, dbg->watch_old_value);
+            EXPECT_EQ(999, registers[8]);
+
+            // The breakpoint at the current pc is next reached a loop
+            // iteration later, and the other one after the loop, at step 5001
+            ASSERT_TRUE(debug_set_watchpoint(dbg, 8, false));
+            ASSERT_TRUE(debug_set_breakpoint(dbg, 6 * WORD_SIZE, true));
+            ASSERT_TRUE(debug_set_breakpoint(dbg, 5 * WORD_SIZE, true));
+            EXPECT_FALSE(debug_set_breakpoint(dbg, 2, true));
+            EXPECT_FALSE(debug_set_breakpoint(dbg, 40, true));
+            EXPECT_EQ(DEBUG_BREAKPOINT,
+                      debug_run(dbg, registers, &pc, UINT64_MAX));
+            EXPECT_EQ(checkpointed_state(10), state_of(registers, pc));
+            ASSERT_TRUE(debug_set_breakpoint(dbg, 5 * WORD_SIZE, false));
+            EXPECT_EQ(DEBUG_BREAKPOINT,
+                      debug_run(dbg, registers, &pc, UINT64_MAX));
+            EXPECT_EQ(checkpointed_state(5001), state_of(registers, pc));
+            EXPECT_EQ(DEBUG_STEPPED, debug_run(dbg, registers, &pc, 1));
+            EXPECT_EQ(checkpointed_state(5002), state_of(registers, pc));
+            EXPECT_EQ(DEBUG_DONE, debug_run(dbg, registers, &pc, UINT64_MAX));
+            EXPECT_EQ(checkpointed_state(5004), state_of(registers, pc));
+            EXPECT_EQ(5004u, dbg->steps);
+
+            // Freeing the debugger unpatches the program
+            free_debugger(dbg);
+            program* original = create_program(words.data(), words.size());
+            for (uint32_t i = 0; i < prog->num_instructions; i++)
+                EXPECT_EQ(original->decoded[i].name, prog->decoded[i].name);
+            pc = INITIAL_PC;
+            memset(registers, 0, sizeof(registers));
+            EXPECT_EQ(5004u,
+                      run_engine(engine, prog, registers, &pc, UINT64_MAX));
+            free_program(original);
+            memory_bind(NULL);
+            free_memory(mem);
+            free_program(prog);
+        }
+    });
+}
+
+// Frames data as a GDB remote protocol packet
+std::string gdb_packet(const std::string& data) {
+    uint8_t checksum = 0;
+    for (char c : data) checksum += (uint8_t)c;
+    char suffix[4];
+    snprintf(suffix, sizeof(suffix), "#%02x", checksum);
+    return "$" + data + suffix;
+}
+
+// The hex encoding of text, as in qRcmd packets
+std::string gdb_hex(const std::string& text) {
+    std::string hex;
+    char digits[3];
+    for (char c : text) {
+        snprintf(digits, sizeof(digits), "%02x", (uint8_t)c);
+        hex += digits;
+    }
+    return hex;
+}
+
+SAFE_TEST(Gdb, AcceptLeavesOtherFilesAlone, {
+    std::string path = write_temp_file("not a socket\n");
+    errno = 0;
+    EXPECT_EQ(-1, gdb_accept(path.c_str()));
+    EXPECT_EQ(EEXIST, errno);
+    std::ifstream in(path);
+    std::string contents;
+    std::getline(in, contents);
+    EXPECT_EQ("not a socket", contents);
+    unlink(path.c_str());
+})
+
+TEST(Gdb, ServesRemoteProtocol) {
+    run_with_signal_catching([]() {
+        std::vector<uint32_t> words = checkpointed_program();
+        program* prog = create_program(words.data(), words.size());
+        guest_memory* mem = create_memory(false);
+        memory_bind(mem);
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+        debugger* dbg = create_debugger(prog, words.data(), ENGINE_JIT);
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+        // The whole session is sent up front, so the stub runs without
+        // waiting for anything
+        const char* requests[] = {
+            "qSupported:multiprocess+", "?", "Z0,18,4", "c", "p25", "p9",
+            "m18,4", "M1000,4:2a000000", "m1000,2", "Gbad", "z0,18,4",
+            "qRcmd,", "c", "p25", "c", "qRcmd,", "g", "c", "vCont?", "k"};
+        std::string session = "+";
+        bool watching = false;
+        for (const char* request : requests) {
+            std::string data = request;
+            session += "+";
+            if (data == "qRcmd,") {
+                // Preceded by a packet with a bad checksum, answered with -
+                session += "$qRcmd,zz#00";
+                data += gdb_hex(watching ? "unwatch $11" : "watch $11");
+                watching = !watching;
+            }
+            session += gdb_packet(data);
+        }
+        ASSERT_EQ((ssize_t)session.size(),
+                  write(fds[1], session.data(), session.size()));
+        EXPECT_EQ(GDB_KILLED, serve_gdb(dbg, fds[0], registers, &pc));
+        close(fds[0]);
+
+        std::string received;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fds[1], buf, sizeof(buf))) > 0)
+            received.append(buf, n);
+        close(fds[1]);
+        std::vector<std::string> replies;
+        size_t acks = 0, naks = 0;
+        for (size_t k = 0; k < received.size(); k++) {
+            if (received[k] == '+') acks++;
+            if (received[k] == '-') naks++;
+            if (received[k] != '$') continue;
+            size_t end = received.find('#', k);
+            ASSERT_NE(std::string::npos, end);
+            std::string data = received.substr(k + 1, end - k - 1);
+            EXPECT_EQ(gdb_packet(data), received.substr(k, end - k + 3));
+            replies.push_back(data);
+            k = end + 2;
+        }
+        EXPECT_EQ(sizeof(requests) / sizeof(requests[0]), acks);
+        EXPECT_EQ(2u, naks);
+
+        char word[9];
+        uint32_t instruction = words[6];
+        snprintf(word, sizeof(word), "%02x%02x%02x%02x", instruction & 0xff,
+                 (instruction >> 8) & 0xff, (instruction >> 16) & 0xff,
+                 instruction >> 24);
+        ASSERT_EQ(23u, replies.size());
+        EXPECT_EQ("PacketSize=1000;qXfer:features:read+", replies[0]);
+        EXPECT_EQ("S05", replies[1]);
+        EXPECT_EQ("OK", replies[2]);
+        EXPECT_EQ("S05", replies[3]);
+        EXPECT_EQ("18000000", replies[4]);
+        EXPECT_EQ("b80b0000", replies[5]);  // 3000
+        EXPECT_EQ(word, replies[6]);
+        EXPECT_EQ("OK", replies[7]);
+        EXPECT_EQ("2a00", replies[8]);
+        EXPECT_EQ("OK", replies[9]);
+        EXPECT_EQ("OK", replies[10]);
+        EXPECT_EQ("O" + gdb_hex("Watching $11\n"), replies[11]);
+        EXPECT_EQ("OK", replies[12]);
+        // $11 = $9 + 1, then $11 <<= 2
+        EXPECT_EQ("O" + gdb_hex("$11 changed from 0 to 3001\n"), replies[13]);
+        EXPECT_EQ("S05", replies[14]);
+        EXPECT_EQ("1c000000", replies[15]);
+        EXPECT_EQ("O" + gdb_hex("$11 changed from 3001 to 12004\n"),
+                  replies[16]);
+        EXPECT_EQ("S05", replies[17]);
+        EXPECT_EQ("O" + gdb_hex("No longer watching $11\n"), replies[18]);
+        EXPECT_EQ("OK", replies[19]);
+        ASSERT_EQ(38u * 8, replies[20].size());
+        EXPECT_EQ("20000000", replies[20].substr(37 * 8));
+        EXPECT_EQ("e42e0000", replies[20].substr(11 * 8, 8));  // 12004
+        EXPECT_EQ("W00", replies[21]);
+        EXPECT_EQ("", replies[22]);
+        EXPECT_EQ(checkpointed_state(5004), state_of(registers, pc));
+        EXPECT_EQ(42, memory_load_word(mem, 0x1000));
+
+        free_debugger(dbg);
+        memory_bind(NULL);
+        free_memory(mem);
+        free_program(prog);
+    });
+}
+
+TEST(MipsSim, LoadsRunsAndExposesState) {
+    run_with_signal_catching([]() {
+        mipssim* sim;
+        ASSERT_EQ(MIPSSIM_OK, mipssim_create(NULL, &sim));
+        uint64_t steps = 1;
+        EXPECT_EQ(MIPSSIM_NO_PROGRAM, mipssim_run(sim, 10, &steps));
+        EXPECT_EQ(0u, steps);
+        EXPECT_TRUE(mipssim_done(sim));
+        EXPECT_EQ(MIPSSIM_OPEN_FAILED,
+                  mipssim_load_file(sim, "/nonexistent.hex", IMAGE_FORMAT_AUTO));
+        EXPECT_EQ(MIPSSIM_BAD_FORMAT,
+                  mipssim_load_buffer(sim, "junk", 4, IMAGE_FORMAT_ELF));
+
+        // Run in parts, with another simulator running on the same thread in
+        // between
+        std::vector<uint32_t> words = checkpointed_program();
+        ASSERT_EQ(MIPSSIM_OK,
+                  mipssim_load_words(sim, words.data(), words.size()));
+        ASSERT_EQ(MIPSSIM_OK, mipssim_run(sim, 1000, &steps));
+        EXPECT_EQ(1000u, steps);
+        mipssim_config config;
+        mipssim_default_config(&config);
+        config.engine = ENGINE_JIT;
+        config.flat_memory = true;
+        mipssim* other;
+        ASSERT_EQ(MIPSSIM_OK, mipssim_create(&config, &other));
+        std::string hex = "21080001\n21080001\n2108ffff\n";
+        ASSERT_EQ(MIPSSIM_OK, mipssim_load_buffer(other, hex.data(), hex.size(),
+                                                  IMAGE_FORMAT_AUTO));
+        EXPECT_EQ(MIPSSIM_OK, mipssim_run_to_completion(other, &steps));
+        EXPECT_EQ(3u, steps);
+        EXPECT_EQ(12u, mipssim_get_pc(other));
+        ASSERT_EQ(MIPSSIM_OK, mipssim_run_to_completion(sim, &steps));
+        EXPECT_EQ(4004u, steps);
+        EXPECT_EQ(5004u, mipssim_steps(sim));
+        EXPECT_TRUE(mipssim_done(sim));
+        int32_t registers[NUM_REGISTERS];
+        mipssim_get_registers(sim, registers);
+        EXPECT_EQ(checkpointed_state(5004),
+                  state_of(registers, mipssim_get_pc(sim)));
+        mipssim_get_registers(other, registers);
+        EXPECT_EQ(1, registers[8]);
+        int32_t stored[2];
+        ASSERT_EQ(MIPSSIM_OK,
+                  mipssim_read_memory(sim, 3992, stored, sizeof(stored)));
+        EXPECT_EQ(2997, stored[0]);
+        EXPECT_EQ(3000, stored[1]);
+        EXPECT_EQ(MIPSSIM_BAD_ARGUMENT,
+                  mipssim_read_memory(sim, UINT32_MAX, stored, 2));
+
+        // State written by the caller is what the program sees
+        ASSERT_EQ(MIPSSIM_OK, mipssim_reset(sim));
+        EXPECT_EQ(0u, mipssim_steps(sim));
+        int32_t value = 77;
+        ASSERT_EQ(MIPSSIM_OK,
+                  mipssim_write_memory(sim, 3992, &value, sizeof(value)));
+        ASSERT_EQ(MIPSSIM_OK, mipssim_read_memory(sim, 3992, stored, 4));
+        EXPECT_EQ(77, stored[0]);
+        EXPECT_EQ(MIPSSIM_OK, mipssim_set_register(sim, 10, 3));
+        EXPECT_EQ(MIPSSIM_BAD_ARGUMENT, mipssim_set_register(sim, 32, 0));
+        mipssim_set_pc(sim, 2);
+        EXPECT_TRUE(mipssim_done(sim));
+        EXPECT_EQ(MIPSSIM_INVALID_PC, mipssim_run(sim, 1, &steps));
+        mipssim_set_pc(sim, 4);
+        EXPECT_EQ(MIPSSIM_OK, mipssim_run(sim, 2, &steps));
+        mipssim_get_registers(sim, registers);
+        EXPECT_EQ(3, registers[9]);
+        EXPECT_EQ(3, registers[10]);
+
+        mipssim_destroy(other);
+        mipssim_destroy(sim);
+    });
+}
+
+// Runs words on the first num_harts - 1 harts and other on the last one with
+// options, and returns the steps each hart executed
+std::vector<uint64_t> run_counting_harts(const std::vector<uint32_t>& words,
+                                         const std::vector<uint32_t>& other,
+                                         uint32_t num_harts,
+                                         const hart_options& options,
+                                         guest_memory* mem) {
+    std::vector<hart> harts(num_harts);
+    for (uint32_t k = 0; k < num_harts; k++) {
+        const std::vector<uint32_t>& image = k + 1 < num_harts ? words : other;
+        init_hart(&harts[k], create_program(image.data(), image.size()), k,
+                  num_harts);
+    }
+    EXPECT_EQ(HARTS_OK, run_harts(harts.data(), num_harts, mem, &options));
+    std::vector<uint64_t> steps;
+    for (uint32_t k = 0; k < num_harts; k++) {
+        steps.push_back(harts[k].steps);
+        if (k + 1 < num_harts && options.max_steps == UINT64_MAX) {
+            EXPECT_EQ(44u, harts[k].pc);
+            EXPECT_EQ(0, harts[k].registers[8]);
+            EXPECT_EQ(1, harts[k].registers[10]);
+            EXPECT_EQ((int32_t)k, harts[k].registers[HART_ID_REGISTER]);
+        }
+        free_program(harts[k].prog);
+    }
+    return steps;
+}
+
+TEST(Harts, ShareMemoryWithAtomics) {
+    run_with_signal_catching([]() {
+        // Adds 1 to the word at 0x100 1000 times with ll and sc, then stores
+        // the number of harts at 0x200 + 4 * its index
+        std::vector<uint32_t> words = {
+            i_type(ADDI_OPCODE, 8, 0, 1000),
+            i_type(ADDI_OPCODE, 9, 0, 0x100),
+            i_type(LL_OPCODE, 10, 9, 0),
+            i_type(ADDI_OPCODE, 10, 10, 1),
+            i_type(SC_OPCODE, 10, 9, 0),
+            i_type(BEQ_OPCODE, 0, 10, -4),
+            i_type(ADDI_OPCODE, 8, 8, -1),
+            i_type(BNE_OPCODE, 0, 8, -6),
+            r_type(SLL_FUNCT, 11, 0, HART_ID_REGISTER, 2),
+            i_type(SW_OPCODE, NUM_HARTS_REGISTER, 11, 0x200),
+            i_type(ADDI_OPCODE, V0_REGISTER, 0, EXIT_SYSCALL),
+            SYSCALL_FUNCT,
+        };
+        std::vector<uint32_t> other = {i_type(ADDI_OPCODE, 8, 0, 7)};
+        EXPECT_EQ(LL, determine_instruction_name(words[2]));
+        EXPECT_EQ(SC, determine_instruction_name(words[4]));
+
+        for (int engine = 0; engine < NUM_ENGINES; engine++) {
+            for (bool serial : {false, true}) {
+                guest_memory* mem = create_memory(true);
+                ASSERT_NE(nullptr, mem->flat);
+                hart_options options = {(engine_kind)engine, 37, UINT64_MAX,
+                                        serial};
+                std::vector<uint64_t> steps =
+                    run_counting_harts(words, other, 5, options, mem);
+                EXPECT_EQ(4000, memory_load_word(mem, 0x100))
+                    << engine_name((engine_kind)engine) << ", " << serial;
+                for (uint32_t k = 0; k < 4; k++)
+                    EXPECT_EQ(5, memory_load_word(mem, 0x200 + 4 * k));
+                EXPECT_EQ(1u, steps[4]);
+                if (serial) {
+                    // Same interleaving, so the same number of failed sc
+                    memory_store_word(mem, 0x100, 0);
+                    EXPECT_EQ(steps, run_counting_harts(words, other, 5,
+                                                        options, mem));
+                }
+                free_memory(mem);
+            }
+        }
+
+        // Every hart stops after max_steps
+        guest_memory* mem = create_memory(true);
+        hart_options options = {ENGINE_THREADED, 4, 10, false};
+        EXPECT_EQ(std::vector<uint64_t>({10, 10, 1}),
+                  run_counting_harts(words, other, 3, options, mem));
+        free_memory(mem);
+
+        // Paged memory can't be shared
+        mem = create_memory(false);
+        std::vector<hart> harts(2);
+        EXPECT_EQ(HARTS_NOT_FLAT, run_harts(harts.data(), 2, mem, &options));
+        free_memory(mem);
+    });
+}
+
+// Programs used to be limited to 1000 instructions (and overflowed the stack
+// past that)
+TEST(MainFunc, LongProgram) {
+    run_with_signal_catching([]() {
+        // 5000 x addi $8, $8, 1
+        std::string contents;
+        for (int i = 0; i < 5000; i++) contents += "21080001\n";
+        std::string path = write_temp_file(contents);
+        program_image image;
+        uint32_t num_instructions =
+            hex_instruction_file_to_array(path.c_str(), &image);
+        program* prog = create_program(image.words, num_instructions);
+        int32_t registers[NUM_REGISTERS] = {0};
+        uint32_t pc = INITIAL_PC;
+
+        EXPECT_EQ(5000u,
+                  run_interpreter(prog, registers, &pc, UINT64_MAX));
+        EXPECT_EQ(5000, registers[8]);
+        EXPECT_EQ(20000u, pc);
+
+        free_program(prog);
+        free_image(&image);
+        unlink(path.c_str());
+    });
+}
+
 void run_with_signal_catching(void (*test_body)()) {
     int pipefd[2];
 
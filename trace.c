@@ -0,0 +1,484 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "instructions.h"
+
+// Flags in the first byte of an encoded record. The destination register, if
+// any, is in the remaining bits
+// The PC isn't the one after the previous record's, and follows as a varint
+#define TRACE_FLAG_JUMP 0x1
+// The instruction isn't the cached one, and follows as 4 little-endian bytes
+#define TRACE_FLAG_NEW_INSTRUCTION 0x2
+// A register was written, and the difference follows as a varint
+#define TRACE_FLAG_WRITES 0x4
+#define TRACE_DEST_SHIFT 3
+// Longest encoded record: flags, varint, instruction, varint
+#define TRACE_MAX_RECORD_BYTES (1 + 5 + 4 + 5)
+// Instructions remembered per chunk, by the low bits of their word address
+// (a power of 2)
+#define TRACE_CACHE_SIZE 256
+// The simulation thread tells the writer thread about new records once per
+// this many (a power of 2), so they don't fight over the cache line
+#define TRACE_PUBLISH_RECORDS 256
+// How long the writer thread sleeps when it has caught up
+#define TRACE_POLL_NS 50000
+
+struct trace_writer {
+    FILE* file;
+    trace_record* ring;
+    // Records added by the simulation thread so far. Only it writes this
+    uint64_t head;
+    // Keeps head and tail on separate cache lines
+    char padding[64];
+    // Records taken by the writer thread so far. Only it writes this
+    uint64_t tail;
+    // Set once the simulation thread is done adding records
+    bool closing;
+    pthread_t thread;
+
+    // The rest is only used by the writer thread until it is joined
+    trace_status status;
+    uint64_t num_records;
+    // State after the last record taken
+    int32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    // Chunk being encoded, and its records so far
+    trace_chunk_header chunk;
+    uint8_t* payload;
+    uint32_t payload_size;
+    uint32_t cache[TRACE_CACHE_SIZE];
+    // Set by close_trace before closing
+    int32_t final_registers[NUM_REGISTERS];
+    uint32_t final_pc;
+};
+
+// Maps signed differences to small unsigned numbers (0, -1, 1, -2, ... to
+// 0, 1, 2, 3, ...) so that they encode as short varints
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)((value >> 1) ^ (0u - (value & 1)));
+}
+
+// Appends value 7 bits at a time, least significant first, with the high bit
+// of each byte set if more follow
+static uint8_t* put_varint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Reads a varint from *in (advancing it), or returns false if it runs past
+// end
+static bool get_varint(const uint8_t** in, const uint8_t* end,
+                       uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*in == end) return false;
+        uint8_t byte = *(*in)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Writes the chunk being encoded, if any, and starts a new one
+static void write_chunk(trace_writer* w) {
+    if (w->chunk.num_records == 0) return;
+    w->chunk.size = w->payload_size;
+    if (w->status == TRACE_OK &&
+        (fwrite(&w->chunk, sizeof(w->chunk), 1, w->file) != 1 ||
+         fwrite(w->payload, 1, w->payload_size, w->file) != w->payload_size))
+        w->status = TRACE_WRITE_FAILED;
+    w->chunk.num_records = 0;
+    w->payload_size = 0;
+}
+
+static void encode_record(trace_writer* w, const trace_record* record) {
+    if (w->chunk.num_records == 0) {
+        w->chunk.first_index = w->num_records;
+        w->chunk.pc = record->pc;
+        memcpy(w->chunk.registers, w->registers, sizeof(w->registers));
+        memset(w->cache, 0, sizeof(w->cache));
+        w->pc = record->pc - WORD_SIZE;
+    }
+    uint8_t* out = w->payload + w->payload_size;
+    uint8_t* flags = out++;
+    *flags = 0;
+    if (record->pc != w->pc + WORD_SIZE) {
+        *flags |= TRACE_FLAG_JUMP;
+        out = put_varint(out,
+                         zigzag((int32_t)(record->pc - (w->pc + WORD_SIZE))));
+    }
+    uint32_t* cached = &w->cache[(record->pc >> 2) & (TRACE_CACHE_SIZE - 1)];
+    if (record->instruction != *cached) {
+        *flags |= TRACE_FLAG_NEW_INSTRUCTION;
+        for (int k = 0; k < 4; k++)
+            *out++ = (uint8_t)(record->instruction >> (8 * k));
+        *cached = record->instruction;
+    }
+    if (record->dest != TRACE_NO_DEST) {
+        *flags |= TRACE_FLAG_WRITES | record->dest << TRACE_DEST_SHIFT;
+        out = put_varint(out, zigzag((int32_t)((uint32_t)record->value -
+                                               (uint32_t)w->registers
+                                                   [record->dest])));
+        w->registers[record->dest] = record->value;
+    }
+    w->payload_size = out - w->payload;
+    w->pc = record->pc;
+    w->num_records++;
+    if (++w->chunk.num_records == TRACE_CHUNK_RECORDS) write_chunk(w);
+}
+
+static void* trace_writer_main(void* arg) {
+    trace_writer* w = (trace_writer*)arg;
+    uint64_t tail = w->tail;
+    for (;;) {
+        uint64_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // head is final once closing is set, so check it again after
+            if (__atomic_load_n(&w->closing, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail)
+                break;
+            struct timespec pause = {0, TRACE_POLL_NS};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        // Hand space back to the simulation thread at least once per chunk
+        if (head - tail > TRACE_CHUNK_RECORDS)
+            head = tail + TRACE_CHUNK_RECORDS;
+        for (; tail != head; tail++)
+            encode_record(w, &w->ring[tail & (TRACE_RING_RECORDS - 1)]);
+        __atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
+    }
+    write_chunk(w);
+    // The final chunk has no records, only the final state
+    trace_chunk_header end;
+    memset(&end, 0, sizeof(end));
+    end.first_index = w->num_records;
+    end.pc = w->final_pc;
+    memcpy(end.registers, w->final_registers, sizeof(end.registers));
+    if (w->status == TRACE_OK && fwrite(&end, sizeof(end), 1, w->file) != 1)
+        w->status = TRACE_WRITE_FAILED;
+    return NULL;
+}
+
+static void free_writer(trace_writer* w) {
+    free(w->ring);
+    free(w->payload);
+    free(w);
+}
+
+trace_status open_trace(const char* path, const int32_t* registers,
+                        uint32_t pc, trace_writer** writer) {
+    trace_writer* w = (trace_writer*)calloc(1, sizeof(trace_writer));
+    if (w == NULL) return TRACE_NO_MEMORY;
+    w->ring = (trace_record*)malloc(TRACE_RING_RECORDS * sizeof(trace_record));
+    w->payload = (uint8_t*)malloc(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD_BYTES);
+    if (w->ring == NULL || w->payload == NULL) {
+        free_writer(w);
+        return TRACE_NO_MEMORY;
+    }
+    w->file = fopen(path, "wb");
+    if (w->file == NULL) {
+        free_writer(w);
+        return TRACE_OPEN_FAILED;
+    }
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.pc = pc;
+    memcpy(header.registers, registers, sizeof(header.registers));
+    if (fwrite(&header, sizeof(header), 1, w->file) != 1) {
+        fclose(w->file);
+        free_writer(w);
+        return TRACE_WRITE_FAILED;
+    }
+    w->status = TRACE_OK;
+    memcpy(w->registers, registers, sizeof(w->registers));
+    if (pthread_create(&w->thread, NULL, trace_writer_main, w) != 0) {
+        fclose(w->file);
+        free_writer(w);
+        return TRACE_THREAD_FAILED;
+    }
+    *writer = w;
+    return TRACE_OK;
+}
+
+uint64_t run_traced(const program* prog, const uint32_t* words,
+                    int32_t* registers, uint32_t* pc, uint64_t max_steps,
+                    trace_writer* writer) {
+    // Looked up once per instruction of the program rather than every step
+    uint8_t* dests = (uint8_t*)malloc(prog->num_instructions);
+    if (dests != NULL) {
+        for (uint32_t i = 0; i < prog->num_instructions; i++)
+            dests[i] = instruction_destination(&prog->decoded[i]);
+    }
+    const uint32_t end_pc = prog->num_instructions * WORD_SIZE;
+    trace_record* const ring = writer->ring;
+    uint64_t head = writer->head;
+    // head can't pass this until the writer thread takes more records
+    uint64_t limit =
+        __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE) + TRACE_RING_RECORDS;
+    uint64_t steps = 0;
+    while (steps < max_steps && (*pc) < end_pc && (*pc) % WORD_SIZE == 0) {
+        uint32_t i = (*pc) >> 2;
+        const instruction* instruct = &prog->decoded[i];
+        if (instruction_halts(instruct, registers)) break;
+        if (head == limit) {
+            __atomic_store_n(&writer->head, head, __ATOMIC_RELEASE);
+            while ((limit = __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE) +
+                            TRACE_RING_RECORDS) == head)
+                sched_yield();
+        }
+        trace_record* record = &ring[head & (TRACE_RING_RECORDS - 1)];
+        uint8_t dest =
+            dests != NULL ? dests[i] : instruction_destination(instruct);
+        record->pc = *pc;
+        record->instruction = words[i];
+        record->dest = dest;
+        instruct->execute(instruct->_fields, registers, pc);
+        record->value = dest != TRACE_NO_DEST ? registers[dest] : 0;
+        if (++head % TRACE_PUBLISH_RECORDS == 0)
+            __atomic_store_n(&writer->head, head, __ATOMIC_RELEASE);
+        steps++;
+    }
+    __atomic_store_n(&writer->head, head, __ATOMIC_RELEASE);
+    free(dests);
+    return steps;
+}
+
+trace_status close_trace(trace_writer* writer, const int32_t* registers,
+                         uint32_t pc) {
+    memcpy(writer->final_registers, registers,
+           sizeof(writer->final_registers));
+    writer->final_pc = pc;
+    __atomic_store_n(&writer->closing, true, __ATOMIC_RELEASE);
+    pthread_join(writer->thread, NULL);
+    trace_status status = writer->status;
+    if (fclose(writer->file) != 0 && status == TRACE_OK)
+        status = TRACE_WRITE_FAILED;
+    free_writer(writer);
+    return status;
+}
+
+trace_status open_trace_reader(const char* path, trace_reader* reader) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) return TRACE_OPEN_FAILED;
+    struct stat st;
+    trace_status status = TRACE_OK;
+    if (fstat(fileno(reader->file), &st) != 0 ||
+        fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+        memcmp(reader->header.magic, TRACE_MAGIC,
+               sizeof(reader->header.magic)) != 0)
+        status = TRACE_BAD_FORMAT;
+    else if (reader->header.version != TRACE_VERSION)
+        status = TRACE_BAD_VERSION;
+
+    // Only the headers are read; each chunk's records are skipped over
+    size_t capacity = 0;
+    trace_chunk_header header;
+    while (status == TRACE_OK &&
+           fread(&header, sizeof(header), 1, reader->file) == 1) {
+        if (header.first_index != reader->num_records) {
+            status = TRACE_BAD_FORMAT;
+        } else if (header.num_records == 0) {
+            reader->complete = true;
+            reader->final_pc = header.pc;
+            memcpy(reader->final_registers, header.registers,
+                   sizeof(header.registers));
+            break;
+        } else if (header.num_records > TRACE_CHUNK_RECORDS ||
+                   header.size > header.num_records * TRACE_MAX_RECORD_BYTES) {
+            status = TRACE_BAD_FORMAT;
+        } else {
+            long offset = ftell(reader->file);
+            // A chunk cut short is where a trace that wasn't closed ends
+            if (offset < 0 || offset + (long)header.size > st.st_size) break;
+            if (reader->num_chunks == capacity) {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                trace_chunk* grown = (trace_chunk*)realloc(
+                    reader->chunks, capacity * sizeof(trace_chunk));
+                if (grown == NULL) {
+                    status = TRACE_NO_MEMORY;
+                    break;
+                }
+                reader->chunks = grown;
+            }
+            reader->chunks[reader->num_chunks].header = header;
+            reader->chunks[reader->num_chunks++].offset = offset;
+            reader->num_records += header.num_records;
+            if (fseek(reader->file, header.size, SEEK_CUR) != 0)
+                status = TRACE_BAD_FORMAT;
+        }
+    }
+    if (status != TRACE_OK) close_trace_reader(reader);
+    return status;
+}
+
+void close_trace_reader(trace_reader* reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    free(reader->chunks);
+    reader->file = NULL;
+    reader->chunks = NULL;
+    reader->num_chunks = 0;
+}
+
+// Returns the chunk holding record index, which must be in the trace
+static const trace_chunk* find_chunk(const trace_reader* reader,
+                                     uint64_t index) {
+    size_t low = 0;
+    size_t high = reader->num_chunks - 1;
+    while (low < high) {
+        size_t middle = low + (high - low + 1) / 2;
+        if (reader->chunks[middle].header.first_index <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return &reader->chunks[low];
+}
+
+// Decodes every record of chunk into records (at least TRACE_CHUNK_RECORDS)
+static trace_status decode_chunk(trace_reader* reader,
+                                 const trace_chunk* chunk,
+                                 trace_record* records) {
+    const trace_chunk_header* header = &chunk->header;
+    uint8_t* payload = (uint8_t*)malloc(header->size);
+    if (payload == NULL) return TRACE_NO_MEMORY;
+    if (fseek(reader->file, chunk->offset, SEEK_SET) != 0 ||
+        fread(payload, 1, header->size, reader->file) != header->size) {
+        free(payload);
+        return TRACE_BAD_FORMAT;
+    }
+
+    // Mirrors encode_record
+    const uint8_t* in = payload;
+    const uint8_t* end = payload + header->size;
+    int32_t registers[NUM_REGISTERS];
+    memcpy(registers, header->registers, sizeof(registers));
+    uint32_t cache[TRACE_CACHE_SIZE] = {0};
+    uint32_t pc = header->pc - WORD_SIZE;
+    bool valid = true;
+    for (uint32_t n = 0; valid && n < header->num_records; n++) {
+        trace_record* record = &records[n];
+        if (in == end) {
+            valid = false;
+            break;
+        }
+        uint8_t flags = *in++;
+        uint32_t value;
+        record->pc = pc + WORD_SIZE;
+        if (flags & TRACE_FLAG_JUMP) {
+            valid = get_varint(&in, end, &value);
+            record->pc += (uint32_t)unzigzag(value);
+        }
+        uint32_t* cached = &cache[(record->pc >> 2) & (TRACE_CACHE_SIZE - 1)];
+        if (flags & TRACE_FLAG_NEW_INSTRUCTION) {
+            valid = valid && end - in >= 4;
+            if (!valid) break;
+            *cached = 0;
+            for (int k = 0; k < 4; k++) *cached |= (uint32_t)*in++ << (8 * k);
+        }
+        record->instruction = *cached;
+        record->dest = TRACE_NO_DEST;
+        record->value = 0;
+        if (flags & TRACE_FLAG_WRITES) {
+            valid = valid && get_varint(&in, end, &value);
+            record->dest = flags >> TRACE_DEST_SHIFT;
+            record->value = (int32_t)((uint32_t)registers[record->dest] +
+                                      (uint32_t)unzigzag(value));
+            registers[record->dest] = record->value;
+        }
+        pc = record->pc;
+    }
+    free(payload);
+    return valid && in == end ? TRACE_OK : TRACE_BAD_FORMAT;
+}
+
+trace_status read_trace(trace_reader* reader, uint64_t first, uint64_t count,
+                        trace_record* records) {
+    if (first > reader->num_records || count > reader->num_records - first)
+        return TRACE_OUT_OF_RANGE;
+    if (count == 0) return TRACE_OK;
+    trace_record* decoded =
+        (trace_record*)malloc(TRACE_CHUNK_RECORDS * sizeof(trace_record));
+    if (decoded == NULL) return TRACE_NO_MEMORY;
+    trace_status status = TRACE_OK;
+    for (const trace_chunk* chunk = find_chunk(reader, first);
+         status == TRACE_OK && count > 0; chunk++) {
+        status = decode_chunk(reader, chunk, decoded);
+        uint64_t skip = first - chunk->header.first_index;
+        uint64_t n = chunk->header.num_records - skip;
+        if (n > count) n = count;
+        memcpy(records, decoded + skip, n * sizeof(trace_record));
+        records += n;
+        first += n;
+        count -= n;
+    }
+    free(decoded);
+    return status;
+}
+
+trace_status trace_state_at(trace_reader* reader, uint64_t index,
+                            int32_t* registers, uint32_t* pc) {
+    if (index == reader->num_records && reader->complete) {
+        memcpy(registers, reader->final_registers,
+               sizeof(reader->final_registers));
+        *pc = reader->final_pc;
+        return TRACE_OK;
+    }
+    if (index >= reader->num_records) return TRACE_OUT_OF_RANGE;
+    const trace_chunk* chunk = find_chunk(reader, index);
+    trace_record* decoded =
+        (trace_record*)malloc(TRACE_CHUNK_RECORDS * sizeof(trace_record));
+    if (decoded == NULL) return TRACE_NO_MEMORY;
+    trace_status status = decode_chunk(reader, chunk, decoded);
+    if (status == TRACE_OK) {
+        memcpy(registers, chunk->header.registers,
+               sizeof(chunk->header.registers));
+        uint64_t n = index - chunk->header.first_index;
+        for (uint64_t k = 0; k < n; k++) {
+            if (decoded[k].dest != TRACE_NO_DEST)
+                registers[decoded[k].dest] = decoded[k].value;
+        }
+        *pc = decoded[n].pc;
+    }
+    free(decoded);
+    return status;
+}
+
+const char* trace_status_message(trace_status status) {
+    switch (status) {
+        case TRACE_OK:
+            return "Success";
+        case TRACE_OPEN_FAILED:
+            return "Failed to open file";
+        case TRACE_WRITE_FAILED:
+            return "Failed to write file";
+        case TRACE_BAD_FORMAT:
+            return "File is not a trace";
+        case TRACE_BAD_VERSION:
+            return "Trace was written by another version";
+        case TRACE_OUT_OF_RANGE:
+            return "Past the end of the trace";
+        case TRACE_THREAD_FAILED:
+            return "Failed to start trace writer thread";
+        case TRACE_NO_MEMORY:
+        default:
+            return "Out of memory";
+    }
+}
@@ -0,0 +1,214 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "constants.h"
+#include "program.h"
+
+// First bytes of every trace file
+#define TRACE_MAGIC "MIPSTRCE"
+// Bumped whenever the layout of trace files changes
+#define TRACE_VERSION 1
+// trace_record.dest of an instruction that writes no register
+#define TRACE_NO_DEST NO_DESTINATION
+// Records the simulation thread can get ahead of the writer thread by (a
+// power of 2)
+#define TRACE_RING_RECORDS (1 << 16)
+// Records per chunk of a trace file. Seeking decodes at most this many
+#define TRACE_CHUNK_RECORDS 4096
+
+typedef enum {
+    TRACE_OK,
+    TRACE_OPEN_FAILED,
+    TRACE_WRITE_FAILED,
+    // Not a trace file, or a corrupt one
+    TRACE_BAD_FORMAT,
+    // A trace file written by another version of the simulator
+    TRACE_BAD_VERSION,
+    // Past the last record of the trace
+    TRACE_OUT_OF_RANGE,
+    TRACE_NO_MEMORY,
+    TRACE_THREAD_FAILED
+} trace_status;
+
+// One executed instruction
+typedef struct {
+    uint32_t pc;
+    // The raw instruction word
+    uint32_t instruction;
+    // Register the instruction wrote, or TRACE_NO_DEST
+    uint8_t dest;
+    // Value written to dest
+    int32_t value;
+} trace_record;
+
+/**
+ * Start of a trace file, in the host's byte order. It's followed by chunks,
+ * each a trace_chunk_header and its encoded records
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pc;
+    // Registers when tracing started
+    int32_t registers[NUM_REGISTERS];
+} trace_header;
+
+/**
+ * Start of a chunk of a trace file, in the host's byte order
+ *
+ * Each chunk starts with the full state, so decoding can start at any chunk.
+ * Records are then encoded relative to the previous one: a byte with flags
+ * and the destination register, the PC only if it isn't the next one, the
+ * instruction only if it isn't the last one seen at a PC with the same low
+ * bits, and the destination's new value as a difference from its old one
+ * (see trace.c). A trace that was closed ends with a chunk without records
+ * whose state is the final one
+ */
+typedef struct {
+    uint32_t num_records;
+    // Bytes of encoded records following the header
+    uint32_t size;
+    // Index of the chunk's first record in the whole trace
+    uint64_t first_index;
+    // State before the first record
+    uint32_t pc;
+    int32_t registers[NUM_REGISTERS];
+} trace_chunk_header;
+
+// Records executed instructions into a trace file (see open_trace)
+typedef struct trace_writer trace_writer;
+
+/**
+ * Starts writing a trace to path, starting from registers and pc
+ *
+ * A background thread compresses records and writes them to the file, so
+ * the simulation thread (see run_traced) only copies each record into a
+ * ring buffer
+ *
+ * @param path
+ * @param registers
+ * @param pc
+ * @param writer set on success (close with close_trace)
+ * @return TRACE_OK on success, else the reason opening failed
+ */
+trace_status open_trace(const char* path, const int32_t* registers,
+                        uint32_t pc, trace_writer** writer);
+
+/**
+ * Same as run_interpreter, but also records every executed instruction in
+ * writer
+ *
+ * This is a separate dispatch loop, so the engines pay nothing for tracing
+ * when it is not used. If writer's thread falls TRACE_RING_RECORDS behind,
+ * this waits for it
+ *
+ * @param prog
+ * @param words the instructions prog was created from
+ * @param registers
+ * @param pc
+ * @param max_steps
+ * @param writer
+ * @return number of instructions executed
+ */
+uint64_t run_traced(const program* prog, const uint32_t* words,
+                    int32_t* registers, uint32_t* pc, uint64_t max_steps,
+                    trace_writer* writer);
+
+/**
+ * Writes whatever writer still has buffered, ends the trace with the final
+ * state, and frees writer
+ *
+ * @param writer
+ * @param registers the final registers
+ * @param pc the final PC
+ * @return TRACE_OK if the whole trace was written, else why the first write
+ * that failed did
+ */
+trace_status close_trace(trace_writer* writer, const int32_t* registers,
+                         uint32_t pc);
+
+// Where each chunk of a trace file is
+typedef struct {
+    trace_chunk_header header;
+    // Offset of the chunk's encoded records in the file
+    long offset;
+} trace_chunk;
+
+/**
+ * An open trace file
+ */
+typedef struct {
+    FILE* file;
+    trace_header header;
+    // In order, not counting the final one
+    trace_chunk* chunks;
+    size_t num_chunks;
+    uint64_t num_records;
+    // Whether the trace was closed, i.e., final_pc and final_registers are
+    // known
+    bool complete;
+    uint32_t final_pc;
+    int32_t final_registers[NUM_REGISTERS];
+} trace_reader;
+
+/**
+ * Opens a trace file written by open_trace, reading only its chunk headers
+ *
+ * A trace whose writer never closed it (e.g., the simulator crashed) can be
+ * read up to its last complete chunk
+ *
+ * @param path
+ * @param reader set on success (close with close_trace_reader)
+ * @return TRACE_OK on success, else the reason opening failed
+ */
+trace_status open_trace_reader(const char* path, trace_reader* reader);
+
+/**
+ * Closes a trace file opened by open_trace_reader
+ *
+ * @param reader
+ */
+void close_trace_reader(trace_reader* reader);
+
+/**
+ * Decodes records first to first + count - 1 of a trace, decoding only the
+ * chunks they're in
+ *
+ * @param reader
+ * @param first
+ * @param count
+ * @param records set to the records on success
+ * @return TRACE_OK on success, TRACE_OUT_OF_RANGE if the trace has fewer
+ * than first + count records, else the reason reading failed
+ */
+trace_status read_trace(trace_reader* reader, uint64_t first, uint64_t count,
+                        trace_record* records);
+
+/**
+ * Reconstructs the registers and PC before record index of a trace was
+ * executed, from the start of its chunk
+ *
+ * @param reader
+ * @param index at most reader->num_records, which gives the final state if
+ * the trace is complete
+ * @param registers set on success
+ * @param pc set on success
+ * @return TRACE_OK on success, TRACE_OUT_OF_RANGE if index is past the
+ * trace, else the reason reading failed
+ */
+trace_status trace_state_at(trace_reader* reader, uint64_t index,
+                            int32_t* registers, uint32_t* pc);
+
+/**
+ * Returns a human-readable description of status
+ *
+ * @param status
+ * @return const char*
+ */
+const char* trace_status_message(trace_status status);
+
+#endif  // TRACE_H
@@ -0,0 +1,164 @@
+/**
+ * Decodes a trace written by ./main --trace
+ *
+ * Prints the executed instructions, or with --state the registers and PC at
+ * any point of the run. See ./tracedump -h for options
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "instructions.h"
+#include "output.h"
+#include "trace.h"
+
+static void print_usage(void) {
+    printf(
+        "Usage: ./tracedump [-ax] [--from=N] [--count=N] trace_file\n"
+        "       ./tracedump [-ax] [--output=name] --state=N trace_file\n\n"
+        "Prints the instructions recorded in trace_file, one per line: their "
+        "index, PC, instruction word and mnemonic, and the register they "
+        "wrote.\n\n"
+        "Options:\n"
+        "\t-a: same as --output=array\n"
+        "\t-x: print values in hex\n"
+        "\t--from=N: start at the Nth instruction executed (default: 0)\n"
+        "\t--count=N: print at most N instructions (default: all)\n"
+        "\t--state=N: instead, print the registers and PC before the Nth "
+        "instruction was executed. N may be the number of instructions in "
+        "the trace, for the final state\n"
+        "\t--output=name: how --state prints, one of table (default), array, "
+        "json or binary (see ./main -h)\n");
+}
+
+// Parses a non-negative integer, or exits
+static uint64_t parse_number(const char* arg) {
+    char* end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    if (*arg == '\0' || *arg == '-' || *end != '\0') {
+        fprintf(stderr, "Invalid number %s. For correct usage, type "
+                        "./tracedump -h\n", arg);
+        exit(1);
+    }
+    return value;
+}
+
+// Prints count records of reader starting at first, a chunk at a time
+static trace_status print_records(trace_reader* reader, uint64_t first,
+                                  uint64_t count, bool hex) {
+    static trace_record records[TRACE_CHUNK_RECORDS];
+    while (count > 0) {
+        uint64_t n = count < TRACE_CHUNK_RECORDS ? count : TRACE_CHUNK_RECORDS;
+        trace_status status = read_trace(reader, first, n, records);
+        if (status != TRACE_OK) return status;
+        for (uint64_t k = 0; k < n; k++) {
+            const trace_record* record = &records[k];
+            const decode_entry* entry = lookup_instruction(record->instruction);
+            const char* mnemonic =
+                entry->valid ? instruction_mnemonic(entry->name) : "?";
+            printf("%llu: 0x%08x %08x ", (unsigned long long)(first + k),
+                   record->pc, record->instruction);
+            if (record->dest == TRACE_NO_DEST)
+                printf("%s\n", mnemonic);
+            else
+                printf(hex ? "%-7s $%d = 0x%08x\n" : "%-7s $%d = %d\n",
+                       mnemonic, record->dest, record->value);
+        }
+        first += n;
+        count -= n;
+    }
+    return TRACE_OK;
+}
+
+int main(int argc, char* argv[]) {
+    output_mode mode = OUTPUT_TABLE;
+    bool hex = false;
+    uint64_t first = 0;
+    uint64_t count = UINT64_MAX;
+    bool state = false;
+    uint64_t state_index = 0;
+
+    static const struct option long_options[] = {
+        {"from", required_argument, NULL, 'f'},
+        {"count", required_argument, NULL, 'c'},
+        {"state", required_argument, NULL, 's'},
+        {"output", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ahx", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                mode = OUTPUT_ARRAY;
+                break;
+            case 'x':
+                hex = true;
+                break;
+            case 'f':
+                first = parse_number(optarg);
+                break;
+            case 'c':
+                count = parse_number(optarg);
+                break;
+            case 's':
+                state = true;
+                state_index = parse_number(optarg);
+                break;
+            case 'o':
+                if (!parse_output_mode(optarg, &mode)) {
+                    fprintf(stderr, "Unknown output %s. For correct usage, "
+                                    "type ./tracedump -h\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_usage();
+                return 0;
+            default:
+                fprintf(stderr, "For correct usage, type ./tracedump -h\n");
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Expected 1 trace file after option(s), if any. For "
+                        "correct usage, type ./tracedump -h\n");
+        return 1;
+    }
+
+    trace_reader reader;
+    trace_status status = open_trace_reader(argv[optind], &reader);
+    if (status != TRACE_OK) {
+        fprintf(stderr, "Failed to open trace %s: %s\n", argv[optind],
+                trace_status_message(status));
+        return 1;
+    }
+    if (!reader.complete)
+        fprintf(stderr, "Trace %s was not closed; it ends after %llu "
+                        "instructions\n", argv[optind],
+                (unsigned long long)reader.num_records);
+    if (state) {
+        int32_t registers[NUM_REGISTERS];
+        uint32_t pc;
+        status = trace_state_at(&reader, state_index, registers, &pc);
+        if (status == TRACE_OK) {
+            char buf[OUTPUT_STATE_SIZE];
+            write_all(STDOUT_FILENO, buf,
+                      format_registers(buf, mode, hex, registers, pc));
+        }
+    } else {
+        if (first > reader.num_records) first = reader.num_records;
+        if (count > reader.num_records - first)
+            count = reader.num_records - first;
+        status = print_records(&reader, first, count, hex);
+    }
+    close_trace_reader(&reader);
+    if (status != TRACE_OK) {
+        fprintf(stderr, "Failed to read trace %s: %s\n", argv[optind],
+                trace_status_message(status));
+        return 1;
+    }
+    return 0;
+}
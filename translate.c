@@ -0,0 +1,460 @@
+#include "translate.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "instructions.h"
+#include "memory.h"
+#include "snapshot.h"
+
+extern char** environ;
+
+// Name of the function write_translation generates
+#define TRANSLATED_FUNCTION "mipssim_translated"
+
+// Declarations every translation starts with. translation_env must match
+// translate.h, and the memory helpers the accessors in memory.h
+static const char PROLOGUE[] =
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "typedef struct {\n"
+    "    uint8_t* flat;\n"
+    "    int32_t (*load_word)(uint32_t address);\n"
+    "    void (*store_word)(uint32_t address, int32_t value);\n"
+    "    uint8_t (*load_byte)(uint32_t address);\n"
+    "    void (*store_byte)(uint32_t address, uint8_t value);\n"
+    "    int32_t (*load_linked)(uint32_t address);\n"
+    "    int32_t (*store_conditional)(uint32_t address, int32_t value);\n"
+    "} translation_env;\n"
+    "\n"
+    "#define U(x) ((uint32_t)(x))\n"
+    "#define S(x) ((int32_t)(x))\n"
+    "\n"
+    "static inline int32_t lw(uint8_t* flat, const translation_env* env,\n"
+    "                         uint32_t address) {\n"
+    "    int32_t value;\n"
+    "    if (flat == 0) return env->load_word(address);\n"
+    "    memcpy(&value, flat + address, sizeof(value));\n"
+    "    return value;\n"
+    "}\n"
+    "\n"
+    "static inline void sw(uint8_t* flat, const translation_env* env,\n"
+    "                      uint32_t address, int32_t value) {\n"
+    "    if (flat == 0)\n"
+    "        env->store_word(address, value);\n"
+    "    else\n"
+    "        memcpy(flat + address, &value, sizeof(value));\n"
+    "}\n"
+    "\n"
+    "static inline uint8_t lb(uint8_t* flat, const translation_env* env,\n"
+    "                         uint32_t address) {\n"
+    "    return flat == 0 ? env->load_byte(address) : flat[address];\n"
+    "}\n"
+    "\n"
+    "static inline void sb(uint8_t* flat, const translation_env* env,\n"
+    "                      uint32_t address, uint8_t value) {\n"
+    "    if (flat == 0)\n"
+    "        env->store_byte(address, value);\n"
+    "    else\n"
+    "        flat[address] = value;\n"
+    "}\n"
+    "\n";
+
+// Returns the index of the instruction a beq, bne, j or jal at index i
+// branches to when taken (setting *target_pc to its PC), which may be past
+// the end of the program
+static uint32_t static_target(const instruction* instruct, uint32_t i,
+                              uint32_t* target_pc) {
+    uint32_t next_pc = (i + 1) * WORD_SIZE;
+    if (instruct->name == BEQ || instruct->name == BNE)
+        *target_pc = next_pc +
+                     ((uint32_t)(int32_t)instruct->_fields.i.immediate << 2);
+    else
+        *target_pc = (next_pc & JUMP_REGION_MASK) |
+                     ((uint32_t)instruct->_fields.j.target << 2);
+    return *target_pc / WORD_SIZE;
+}
+
+static bool has_static_target(instruction_name name) {
+    return name == BEQ || name == BNE || name == J || name == JAL;
+}
+
+// Emits a jump to the instruction at target_pc: a goto if it's in the
+// program, else leaving with that PC
+static void emit_goto(FILE* out, uint32_t target_pc, uint32_t n) {
+    if (target_pc % WORD_SIZE == 0 && target_pc / WORD_SIZE < n)
+        fprintf(out, "goto L%" PRIu32 ";", target_pc / WORD_SIZE);
+    else
+        fprintf(out, "{ next = 0x%08" PRIx32 "u; goto out; }", target_pc);
+}
+
+// Emits the statement that executes instruct, the instruction at index i.
+// Arithmetic is done on uint32_t, like the threaded engine, to give the same
+// two's complement results as the handlers without signed overflow
+static void emit_statement(FILE* out, const instruction* instruct,
+                           uint32_t i, uint32_t n) {
+    r_fields r = instruct->_fields.r;
+    i_fields f = instruct->_fields.i;
+    const uint32_t offset = (uint32_t)(int32_t)f.immediate;
+    uint32_t target_pc;
+    switch (instruct->name) {
+        case SLL:
+            fprintf(out, "r%d = S(U(r%d) << %d);", r.rd, r.rt, r.shamt);
+            break;
+        case SRA:
+            fprintf(out, "r%d = r%d >> %d;", r.rd, r.rt, r.shamt);
+            break;
+        case ADD:
+            fprintf(out, "r%d = S(U(r%d) + U(r%d));", r.rd, r.rt, r.rs);
+            break;
+        case SUB:
+            fprintf(out, "r%d = S(U(r%d) - U(r%d));", r.rd, r.rs, r.rt);
+            break;
+        case AND:
+            fprintf(out, "r%d = r%d & r%d;", r.rd, r.rt, r.rs);
+            break;
+        case OR:
+            fprintf(out, "r%d = r%d | r%d;", r.rd, r.rt, r.rs);
+            break;
+        case NOR:
+            fprintf(out, "r%d = ~(r%d | r%d);", r.rd, r.rt, r.rs);
+            break;
+        case ADDI:
+            fprintf(out, "r%d = S(U(r%d) + %" PRIu32 "u);", f.rt, f.rs,
+                    offset);
+            break;
+        // The handlers sign-extend these immediates too
+        case ANDI:
+            fprintf(out, "r%d = r%d & %d;", f.rt, f.rs, f.immediate);
+            break;
+        case ORI:
+            fprintf(out, "r%d = r%d | %d;", f.rt, f.rs, f.immediate);
+            break;
+        case LW:
+            fprintf(out, "r%d = lw(flat, env, U(r%d) + %" PRIu32 "u);", f.rt,
+                    f.rs, offset);
+            break;
+        case SW:
+            fprintf(out, "sw(flat, env, U(r%d) + %" PRIu32 "u, r%d);", f.rs,
+                    offset, f.rt);
+            break;
+        case LB:
+            fprintf(out,
+                    "r%d = (int8_t)lb(flat, env, U(r%d) + %" PRIu32 "u);",
+                    f.rt, f.rs, offset);
+            break;
+        case SB:
+            fprintf(out,
+                    "sb(flat, env, U(r%d) + %" PRIu32 "u, (uint8_t)r%d);",
+                    f.rs, offset, f.rt);
+            break;
+        case LL:
+            fprintf(out, "r%d = env->load_linked(U(r%d) + %" PRIu32 "u);",
+                    f.rt, f.rs, offset);
+            break;
+        case SC:
+            fprintf(out,
+                    "r%d = env->store_conditional(U(r%d) + %" PRIu32
+                    "u, r%d);",
+                    f.rt, f.rs, offset, f.rt);
+            break;
+        case BEQ:
+        case BNE:
+            static_target(instruct, i, &target_pc);
+            fprintf(out, "if (r%d %s r%d) ", f.rs,
+                    instruct->name == BEQ ? "==" : "!=", f.rt);
+            emit_goto(out, target_pc, n);
+            break;
+        case JAL:
+            fprintf(out, "r%d = %" PRId32 "; ", RA_REGISTER,
+                    (int32_t)((i + 1) * WORD_SIZE));
+            // Fall through
+        case J:
+            static_target(instruct, i, &target_pc);
+            emit_goto(out, target_pc, n);
+            break;
+        case JR:
+            fprintf(out, "next = U(r%d); goto dispatch;", r.rs);
+            break;
+        // A halting syscall or a breakpoint isn't executed, so the step the
+        // block was charged for it is given back. Both end their block
+        case SYSCALL:
+            fprintf(out,
+                    "if (r%d == %d) { steps--; next = 0x%08" PRIx32
+                    "u; goto out; }",
+                    V0_REGISTER, EXIT_SYSCALL, i * WORD_SIZE);
+            break;
+        case BREAKPOINT:
+        default:
+            fprintf(out, "steps--; next = 0x%08" PRIx32 "u; goto out;",
+                    i * WORD_SIZE);
+            break;
+    }
+}
+
+bool write_translation(FILE* out, const program* prog) {
+    const uint32_t n = prog->num_instructions;
+    const instruction* decoded = prog->decoded;
+    // left[i] is the number of instructions from i to the end of its basic
+    // block, which a block starting at i is charged on entry
+    bool* leader = (bool*)calloc(n + 1, sizeof(bool));
+    uint32_t* left = (uint32_t*)calloc(n + 1, sizeof(uint32_t));
+    if (leader == NULL || left == NULL) {
+        free(leader);
+        free(left);
+        return false;
+    }
+    leader[0] = true;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!is_control_flow(decoded[i].name)) continue;
+        leader[i + 1] = true;
+        uint32_t target_pc;
+        if (has_static_target(decoded[i].name) &&
+            static_target(&decoded[i], i, &target_pc) < n &&
+            target_pc % WORD_SIZE == 0)
+            leader[target_pc / WORD_SIZE] = true;
+    }
+    for (uint32_t i = n; i-- > 0;)
+        left[i] = leader[i + 1] || i + 1 == n ? 1 : left[i + 1] + 1;
+
+    fputs(PROLOGUE, out);
+    fprintf(out,
+            "uint64_t " TRANSLATED_FUNCTION
+            "(int32_t* registers, uint32_t* pc,\n"
+            "                            uint64_t max_steps,\n"
+            "                            const translation_env* env) {\n"
+            "    uint8_t* const flat = env->flat;\n"
+            "    uint64_t steps = 0;\n"
+            "    uint32_t next = *pc;\n");
+    for (int k = 0; k < NUM_REGISTERS; k++)
+        fprintf(out, "    int32_t r%d = registers[%d];\n", k, k);
+
+    // Entry, and jr. Only block starts can be entered: a switch into the
+    // middle of blocks too would take the host compiler far longer
+    fprintf(out,
+            "dispatch:\n"
+            "    if (next %% %d != 0) goto out;\n"
+            "    switch (next / %d) {\n",
+            WORD_SIZE, WORD_SIZE);
+    for (uint32_t i = 0; i < n; i++)
+        if (leader[i])
+            fprintf(out, "        case %" PRIu32 ": goto L%" PRIu32 ";\n", i,
+                    i);
+    fprintf(out, "        default: goto out;\n    }\n");
+
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(out, "    // 0x%08" PRIx32 ": %s\n", i * WORD_SIZE,
+                instruction_mnemonic(decoded[i].name));
+        // Entering a block charges all of it
+        if (leader[i])
+            fprintf(out,
+                    "L%" PRIu32 ":\n"
+                    "    if (max_steps - steps < %" PRIu32
+                    "u) { next = 0x%08" PRIx32
+                    "u; goto out; }\n"
+                    "    steps += %" PRIu32 "u;\n",
+                    i, left[i], i * WORD_SIZE, left[i]);
+        fprintf(out, "    ");
+        emit_statement(out, &decoded[i], i, n);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "    next = 0x%08" PRIx32 "u;\nout:\n", n * WORD_SIZE);
+    for (int k = 0; k < NUM_REGISTERS; k++)
+        fprintf(out, "    registers[%d] = r%d;\n", k, k);
+    fprintf(out, "    *pc = next;\n    return steps;\n}\n");
+
+    free(leader);
+    free(left);
+    return !ferror(out);
+}
+
+// Compiles the C source at source into a shared object at object, returning
+// whether the compiler succeeded
+static bool compile_translation(const char* source, const char* object) {
+    const char* compiler = getenv("CC");
+    if (compiler == NULL || compiler[0] == '\0')
+        compiler = TRANSLATE_DEFAULT_COMPILER;
+    const char* const argv[] = {compiler, "-O2",  "-shared", "-fPIC",
+                                "-o",     object, source,    NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, compiler, NULL, NULL, (char* const*)argv,
+                     environ) != 0)
+        return false;
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Opens the shared object at path and finds its entry point
+static translation* open_translation(const char* path) {
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) return NULL;
+    translated_function run =
+        (translated_function)dlsym(handle, TRANSLATED_FUNCTION);
+    translation* native =
+        run == NULL ? NULL : (translation*)calloc(1, sizeof(translation));
+    if (native == NULL) {
+        dlclose(handle);
+        return NULL;
+    }
+    native->handle = handle;
+    native->run = run;
+    return native;
+}
+
+char* default_translation_directory(void) {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    bool xdg = cache != NULL && cache[0] == '/';
+    if (!xdg && (home == NULL || home[0] != '/')) return NULL;
+    const char* parent = xdg ? cache : home;
+    // Room for "/.cache/" and the name
+    size_t size = strlen(parent) + sizeof(TRANSLATE_CACHE_NAME) + 8;
+    char* directory = (char*)malloc(size);
+    if (directory == NULL) return NULL;
+    snprintf(directory, size, "%s%s", parent, xdg ? "" : "/.cache");
+    mkdir(directory, 0700);
+    snprintf(directory, size, "%s%s/%s", parent, xdg ? "" : "/.cache",
+             TRANSLATE_CACHE_NAME);
+    return directory;
+}
+
+// Whether only the effective user can create or replace files in directory
+static bool private_directory(const char* directory) {
+    struct stat st;
+    return lstat(directory, &st) == 0 && S_ISDIR(st.st_mode) &&
+           st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+translate_status load_translation(const program* prog, const uint32_t* words,
+                                  const char* directory, translation** out) {
+    if (mkdir(directory, 0700) != 0 && errno != EEXIST)
+        return TRANSLATE_BAD_DIRECTORY;
+    if (!private_directory(directory)) return TRANSLATE_UNSAFE_DIRECTORY;
+    // Leaves room for the longest suffix below
+    char base[PATH_MAX - 32];
+    int length = snprintf(
+        base, sizeof(base), "%s/translation-v%d-%016" PRIx64, directory,
+        TRANSLATE_VERSION, program_hash(words, prog->num_instructions));
+    if (length < 0 || (size_t)length >= sizeof(base))
+        return TRANSLATE_BAD_DIRECTORY;
+    char object[PATH_MAX], source[PATH_MAX];
+    snprintf(object, sizeof(object), "%s.so", base);
+    snprintf(source, sizeof(source), "%s.c", base);
+
+    *out = open_translation(object);
+    if (*out != NULL) {
+        (*out)->cached = true;
+        return TRANSLATE_OK;
+    }
+
+    // Built under temporary names, then renamed into place, so that runs
+    // translating the same program at the same time never see half a file
+    char temp_object[PATH_MAX], temp_source[PATH_MAX];
+    snprintf(temp_object, sizeof(temp_object), "%s.%ld.so", base,
+             (long)getpid());
+    snprintf(temp_source, sizeof(temp_source), "%s.%ld.c", base,
+             (long)getpid());
+    FILE* file = fopen(temp_source, "w");
+    if (file == NULL) return TRANSLATE_BAD_DIRECTORY;
+    bool written = write_translation(file, prog);
+    if (fclose(file) != 0 || !written) {
+        unlink(temp_source);
+        return TRANSLATE_WRITE_FAILED;
+    }
+    if (!compile_translation(temp_source, temp_object)) {
+        unlink(temp_source);
+        unlink(temp_object);
+        return TRANSLATE_COMPILE_FAILED;
+    }
+    if (rename(temp_source, source) != 0) unlink(temp_source);
+    if (rename(temp_object, object) != 0) {
+        unlink(temp_object);
+        return TRANSLATE_WRITE_FAILED;
+    }
+    *out = open_translation(object);
+    return *out != NULL ? TRANSLATE_OK : TRANSLATE_LOAD_FAILED;
+}
+
+const char* translate_status_message(translate_status status) {
+    switch (status) {
+        case TRANSLATE_OK:
+            return "success";
+        case TRANSLATE_BAD_DIRECTORY:
+            return "cache directory can't be used";
+        case TRANSLATE_UNSAFE_DIRECTORY:
+            return "cache directory isn't private (it must be a directory "
+                   "owned by this user and not writable by others)";
+        case TRANSLATE_WRITE_FAILED:
+            return "translation couldn't be written";
+        case TRANSLATE_COMPILE_FAILED:
+            return "compiler failed";
+        case TRANSLATE_LOAD_FAILED:
+        default:
+            return "shared object couldn't be loaded";
+    }
+}
+
+void free_translation(translation* native) {
+    if (native == NULL) return;
+    dlclose(native->handle);
+    free(native);
+}
+
+// translation_env callbacks, for paged memory
+static int32_t load_word(uint32_t address) {
+    return memory_load_word(bound_memory, address);
+}
+
+static void store_word(uint32_t address, int32_t value) {
+    memory_store_word(bound_memory, address, value);
+}
+
+static uint8_t load_byte(uint32_t address) {
+    return memory_load_byte(bound_memory, address);
+}
+
+static void store_byte(uint32_t address, uint8_t value) {
+    memory_store_byte(bound_memory, address, value);
+}
+
+static int32_t load_linked(uint32_t address) {
+    return memory_load_linked(bound_memory, address);
+}
+
+static int32_t store_conditional(uint32_t address, int32_t value) {
+    return memory_store_conditional(bound_memory, address, value);
+}
+
+uint64_t run_translated(program* prog, int32_t* registers, uint32_t* pc,
+                        uint64_t max_steps, const translation* native) {
+    guest_memory* const mem = bound_memory;
+    const translation_env env = {mem != NULL ? mem->flat : NULL,
+                                 load_word,
+                                 store_word,
+                                 load_byte,
+                                 store_byte,
+                                 load_linked,
+                                 store_conditional};
+    uint64_t steps = 0;
+    while (true) {
+        steps += native->run(registers, pc, max_steps - steps, &env);
+        if (steps == max_steps || engine_done(prog, registers, *pc)) break;
+        // The translation stopped before a block longer than the steps left,
+        // or at a PC in the middle of a block: step up to the next block
+        steps += run_interpreter(prog, registers, pc, 1);
+    }
+    return steps;
+}
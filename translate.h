@@ -0,0 +1,151 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "program.h"
+
+// Directory translations are cached in, under $XDG_CACHE_HOME or else
+// ~/.cache, unless --translate says otherwise
+#define TRANSLATE_CACHE_NAME "mipssim"
+// Compiler translations are built with unless the CC environment variable
+// names another one (a command without arguments, looked up in PATH)
+#define TRANSLATE_DEFAULT_COMPILER "cc"
+// Part of the name of every cached translation. Change it along with the
+// code write_translation generates or translation_env, so that shared
+// objects built by an older simulator aren't loaded
+#define TRANSLATE_VERSION 1
+
+/**
+ * What translated code needs from the simulator, passed to it on every call
+ * since it can't link against the simulator itself. The callbacks access the
+ * calling thread's bound memory (see memory_bind)
+ *
+ * write_translation declares the same struct in the code it generates: keep
+ * the two in sync
+ */
+typedef struct {
+    // bound_memory->flat, accessed directly instead of through the callbacks
+    // if not NULL
+    uint8_t* flat;
+    int32_t (*load_word)(uint32_t address);
+    void (*store_word)(uint32_t address, int32_t value);
+    uint8_t (*load_byte)(uint32_t address);
+    void (*store_byte)(uint32_t address, uint8_t value);
+    int32_t (*load_linked)(uint32_t address);
+    int32_t (*store_conditional)(uint32_t address, int32_t value);
+} translation_env;
+
+/**
+ * Translated code's entry point: runs the program from *pc like
+ * run_interpreter, except that it also stops before any basic block longer
+ * than the steps left, and at any PC that doesn't start a basic block, for
+ * the interpreter to step from (see run_translated)
+ */
+typedef uint64_t (*translated_function)(int32_t* registers, uint32_t* pc,
+                                        uint64_t max_steps,
+                                        const translation_env* env);
+
+/**
+ * A program translated to C and compiled to a shared object, loaded with
+ * dlopen
+ */
+typedef struct {
+    void* handle;
+    translated_function run;
+    // Whether the shared object was already in the cache, i.e., nothing was
+    // compiled
+    bool cached;
+} translation;
+
+typedef enum {
+    TRANSLATE_OK,
+    TRANSLATE_BAD_DIRECTORY,
+    TRANSLATE_UNSAFE_DIRECTORY,
+    TRANSLATE_WRITE_FAILED,
+    TRANSLATE_COMPILE_FAILED,
+    TRANSLATE_LOAD_FAILED
+} translate_status;
+
+/**
+ * Writes C source equivalent to prog: one function (translated_function,
+ * named mipssim_translated) with one statement per instruction over local
+ * copies of the registers
+ *
+ * Basic blocks start at every static branch and jump target and after every
+ * control flow instruction. Static branches and jumps within the program are
+ * gotos, so the host compiler sees (and optimises) all of the program's
+ * control flow. jr goes through a switch over every block start. Steps are
+ * counted, and checked against max_steps, once per block
+ *
+ * @param out
+ * @param prog
+ * @return true on success, else false (out couldn't be written)
+ */
+bool write_translation(FILE* out, const program* prog);
+
+/**
+ * Returns the current user's translation cache: TRANSLATE_CACHE_NAME in
+ * $XDG_CACHE_HOME if that is set to an absolute path, else in ~/.cache.
+ * That parent is created (private to the user) if needed
+ *
+ * @return char* (free with free), or NULL if the user has no home directory
+ */
+char* default_translation_directory(void);
+
+/**
+ * Loads prog's translation from directory, first translating and compiling
+ * it there (with TRANSLATE_DEFAULT_COMPILER, or $CC) if it isn't there yet
+ *
+ * Translations are cached by program_hash of words, so running the same
+ * program again only loads its shared object. The generated source is kept
+ * next to it, with the same name ending in .c instead of .so
+ *
+ * Since whatever shared object is in the cache gets loaded, and its name is
+ * predictable, directory is only used if nobody but the effective user can
+ * put files in it: it must be a directory (not a symbolic link) owned by
+ * that user and not writable by its group or others
+ *
+ * @param prog
+ * @param words prog's instructions, as decoded by create_program
+ * @param directory created with mode 0700 if needed (but not its parents)
+ * @param out set to the translation (free with free_translation) on success
+ * @return TRANSLATE_OK on success, else why it failed
+ */
+translate_status load_translation(const program* prog, const uint32_t* words,
+                                  const char* directory, translation** out);
+
+/**
+ * Returns a human-readable description of status, e.g., for error messages
+ *
+ * @param status
+ * @return const char*
+ */
+const char* translate_status_message(translate_status status);
+
+/**
+ * Unloads a translation and frees it. Its files stay in the cache
+ *
+ * @param native may be NULL
+ */
+void free_translation(translation* native);
+
+/**
+ * Same as run_interpreter, but runs prog's native translation. Wherever the
+ * translation stops short (before a block longer than the steps left, or in
+ * the middle of a block, e.g., where an earlier call ended), the interpreter
+ * steps up to the start of the next block
+ *
+ * @param prog
+ * @param registers
+ * @param pc
+ * @param max_steps
+ * @param native prog's translation (see load_translation)
+ * @return number of instructions executed
+ */
+uint64_t run_translated(program* prog, int32_t* registers, uint32_t* pc,
+                        uint64_t max_steps, const translation* native);
+
+#endif  // TRANSLATE_H
@@ -1,11 +1,12 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // @note For info about enum, see README.md and/or
 // https://www.w3schools.com/c/c_enums.php
-typedef enum { R_TYPE, I_TYPE } instruction_type;
+typedef enum { R_TYPE, I_TYPE, J_TYPE } instruction_type;
 
 typedef enum {
     SLL,
@@ -17,9 +18,53 @@ typedef enum {
     NOR,
     ADDI,
     ANDI,
-    ORI
+    ORI,
+    // Memory access (see is_memory_access in instructions.h)
+    LW,
+    SW,
+    LB,
+    SB,
+    // Atomics for programs that share memory (see memory_load_linked)
+    LL,
+    SC,
+    // Control flow: everything from here on can change the PC other than by
+    // advancing it to the next instruction (see is_control_flow in
+    // instructions.h)
+    BEQ,
+    BNE,
+    J,
+    JAL,
+    JR,
+    SYSCALL,
+    // Not a MIPS instruction: the debugger renames instructions it has to
+    // stop at to this, keeping their fields and handler (see debug.h).
+    // Engines stop before it as they do before a halting syscall
+    BREAKPOINT
 } instruction_name;
 
+// Number of MIPS instruction_name values, i.e., not counting BREAKPOINT (keep
+// in sync with the last one above it)
+#define NUM_INSTRUCTION_NAMES (SYSCALL + 1)
+
+// Which fields an instruction reads and writes, e.g., LAYOUT_RD_RS_RT means
+// rd = rs op rt
+typedef enum {
+    LAYOUT_RD_RS_RT,
+    LAYOUT_RD_RT_SHAMT,
+    LAYOUT_RT_RS_IMMEDIATE,
+    // Branches and stores: read rs and rt, with immediate as an offset (loads
+    // are LAYOUT_RT_RS_IMMEDIATE)
+    LAYOUT_RS_RT_OFFSET,
+    // sc: reads rs and rt, with immediate as an offset, and writes rt
+    LAYOUT_RS_RT_OFFSET_RT,
+    // j and jal (which also writes $ra)
+    LAYOUT_TARGET,
+    // jr
+    LAYOUT_RS,
+    // syscall (which reads $v0)
+    LAYOUT_NONE
+} operand_layout;
+
 // @note The : 5 is a bit field that tells the compiler a specific number
 // of bits to use for storing each struct member (may save space)
 typedef struct {
@@ -37,11 +82,17 @@ typedef struct {
     int16_t immediate : 16;
 } i_fields;
 
+// target is the low 26 bits of the jump target's word address
+typedef struct {
+    uint32_t target : 26;
+} j_fields;
+
 // @note For info about union, see README.md and/or
 // https://www.tutorialspoint.com/cprogramming/c_unions.htm
 typedef union {
     r_fields r;
     i_fields i;
+    j_fields j;
 } fields;
 
 /**
@@ -62,9 +113,27 @@ typedef union {
  */
 typedef struct {
     fields _fields;
+    // Kept alongside the handler so decoded programs can be inspected (and
+    // dispatched on) without re-decoding the raw 32-bit instruction
+    instruction_name name;
     // For info about this function signature, see comments at the bottom of
     // instructions.h
     void (*execute)(fields fields, int32_t* registers, uint32_t* pc);
 } instruction;
 
+/**
+ * Everything needed to decode one opcode (or, for R-type instructions, one
+ * funct), so decoding an instruction is a single table lookup (see
+ * lookup_instruction in instructions.h)
+ *
+ * valid is false for encodings this simulator does not support
+ */
+typedef struct {
+    instruction_name name;
+    instruction_type type;
+    operand_layout layout;
+    void (*execute)(fields fields, int32_t* registers, uint32_t* pc);
+    bool valid;
+} decode_entry;
+
 #endif  // TYPES_H
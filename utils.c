@@ -16,12 +16,80 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "checkpoint.h"
+#include "debug.h"
+#include "gdb.h"
+#include "hart.h"
+#include "hostperf.h"
+#include "memory.h"
+#include "output.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "program.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "translate.h"
+
 cli_args parse_cli(int argc, char* argv[]) {
     char* filepath = (char*)malloc(PATH_MAX * sizeof(char));
     cli_args rv = {.filepath = filepath,
-                   .disp_array = false,
+                   .output = OUTPUT_TABLE,
                    .step_mode = false,
-                   .disp_hex = false};
+                   .disp_hex = false,
+                   .engine = ENGINE_INTERPRETER,
+                   .format = IMAGE_FORMAT_AUTO,
+                   .batch = false,
+                   .num_threads = 0,
+                   .states_path = NULL,
+                   .profile = false,
+                   .profile_path = NULL,
+                   .pipeline = false,
+                   .host_counters = false,
+                   .host_counters_path = NULL,
+                   .translate = false,
+                   .translate_directory = NULL,
+                   .flat_memory = false,
+                   .peephole = false,
+                   .reduce = false,
+                   .restore_path = NULL,
+                   .snapshot_path = NULL,
+                   .max_steps = UINT64_MAX,
+                   .checkpoints_path = NULL,
+                   .checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL,
+                   .show_changes = false,
+                   .trace_path = NULL,
+                   .gdb_address = NULL,
+                   .num_harts = 0,
+                   .hart_paths = NULL,
+                   .num_hart_paths = 0,
+                   .quantum = DEFAULT_HART_QUANTUM,
+                   .serial_harts = false};
+    static const struct option long_options[] = {
+        {"engine", required_argument, NULL, 'e'},
+        {"format", required_argument, NULL, 'f'},
+        {"batch", no_argument, NULL, 'b'},
+        {"lockstep", required_argument, NULL, 'l'},
+        {"profile", optional_argument, NULL, 'p'},
+        {"pipeline", no_argument, NULL, 'L'},
+        {"host-counters", optional_argument, NULL, 'K'},
+        {"translate", optional_argument, NULL, 'X'},
+        {"flat-memory", no_argument, NULL, 'F'},
+        {"peephole", no_argument, NULL, 'P'},
+        {"reduce", no_argument, NULL, 'R'},
+        {"restore", required_argument, NULL, 'r'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"max-steps", required_argument, NULL, 'n'},
+        {"checkpoints", required_argument, NULL, 'C'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"output", required_argument, NULL, 'o'},
+        {"changes", no_argument, NULL, 'c'},
+        {"trace", required_argument, NULL, 'T'},
+        {"gdb", required_argument, NULL, 'g'},
+        {"harts", required_argument, NULL, 'H'},
+        {"quantum", required_argument, NULL, 'Q'},
+        {"serial-harts", no_argument, NULL, 'Z'},
+        {NULL, 0, NULL, 0}};
 
     // See https://linux.die.net/man/3/getopt, notes section
     // Without this, freeing argv will corrupt memory because getopt mutates
@@ -29,20 +97,49 @@ cli_args parse_cli(int argc, char* argv[]) {
     // and not freed But not okay given that we need to dynamically allocate it
     // in tests.cpp
     optind = 0;
+    // Copied into rv once all options are valid
+    const char* states_path = NULL;
+    const char* profile_path = NULL;
+    const char* host_counters_path = NULL;
+    const char* translate_directory = NULL;
+    const char* restore_path = NULL;
+    const char* snapshot_path = NULL;
+    const char* checkpoints_path = NULL;
+    const char* trace_path = NULL;
+    const char* gdb_address = NULL;
+    bool quantum_set = false;
     char opt;
-    while ((opt = getopt(argc, argv, "ashmx")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ashmxj:", long_options, NULL)) !=
+           -1) {
         switch (opt) {
             case 'a':
-                rv.disp_array = true;
+                rv.output = OUTPUT_ARRAY;
                 break;
             case 's':
                 rv.step_mode = true;
                 break;
             case 'h':
                 printf(
-                    "Usage: ./main [-ashmx] hex_file\n\n"
+                    "Usage: ./main [-ashmx] [--engine=name] [--format=name] "
+                    "[--profile[=path]] [--pipeline] [--host-counters[=path]] "
+                    "[--translate[=dir]] [--flat-memory] [--peephole] "
+                    "[--restore=path] "
+                    "[--snapshot=path] [--max-steps=N] [--checkpoints=dir] "
+                    "[--checkpoint-interval=N] "
+                    "[--output=name] [--changes] [--trace=path] "
+                    "[--gdb=address] hex_file\n"
+                    "       ./main --harts=N [-ax] [--engine=name] "
+                    "[--format=name] [--peephole] [--max-steps=N] "
+                    "[--quantum=N] [--serial-harts] hex_file...\n"
+                    "       ./main --batch [-ax] [-j N] [--engine=name] "
+                    "[--format=name] [--flat-memory] [--peephole] "
+                    "[--max-steps=N] dir_or_list\n"
+                    "       ./main --lockstep=states_file [-ax] "
+                    "[--format=name] [--reduce] [--max-steps=N] hex_file\n"
+                    "       ./main --reduce [-ax] [--format=name] hex_file\n\n"
                     "hex_file must contain MIPS instructions in hex format "
-                    "(i.e., each line is a single string of 8 hexits).\n"
+                    "(i.e., each line is a single string of 8 hexits), unless "
+                    "--format says otherwise.\n"
                     "To see how to generate such a file, run with flag -m.\n\n"
                     "Options:\n"
                     "\t-a: print registers as array (for autograding)\n"
@@ -51,7 +148,116 @@ cli_args parse_cli(int argc, char* argv[]) {
                     "\t-m: print steps for using Mars as an IDE for writing "
                     "MIPS code and translating multiple MIPS instructions to "
                     "hex\n"
-                    "\t-x: print register values in hex\n");
+                    "\t-x: print register values in hex\n"
+                    "\t--engine=name: execution engine, one of interpreter "
+                    "(default), threaded, or jit\n"
+                    "\t--format=name: input format, one of auto (default: elf "
+                    "if the file is an ELF executable, else hex), hex, binary "
+                    "(MARS binary dump, little-endian), binary-be, or elf\n"
+                    "\t--batch: run every program in dir_or_list (a directory "
+                    "of .hex files, or a file listing one path per line) to "
+                    "completion and print each one's path and final state, in "
+                    "order\n"
+                    "\t-j N: number of worker threads for --batch (default: "
+                    "number of CPUs)\n"
+                    "\t--lockstep=states_file: run the program once per line "
+                    "of states_file, which gives the initial values of $0, "
+                    "$1, ... (e.g., 1 -2 0xff), and print every final state in "
+                    "order. All runs execute together using SIMD "
+                    "instructions\n"
+                    "\t--profile[=path]: count how often each instruction, "
+                    "PC and register is used and print a report to stderr at "
+                    "exit (ignores --engine). With a path, also write the "
+                    "profile there, as JSON if path ends in .json, else as "
+                    "folded stacks for flame graphs\n"
+                    "\t--pipeline: time execution on a model of the classic "
+                    "five-stage pipeline (IF, ID, EX, MEM, WB) with "
+                    "forwarding, and print its cycles, CPI, stalls by cause "
+                    "and the PCs that lost the most cycles to stderr at exit "
+                    "(ignores --engine)\n"
+                    "\t--host-counters[=path]: measure what loading, decoding "
+                    "and running the program cost on the host (TSC ticks, "
+                    "and where Linux perf events are available cycles, "
+                    "instructions, branch misses, L1 data cache misses and "
+                    "page faults, plus heap allocations) and print them per "
+                    "guest instruction to stderr at exit. With a path, also "
+                    "write them there as JSON\n"
+                    "\t--translate[=dir]: translate the program to C, compile "
+                    "it with the host compiler (cc, or $CC) into a shared "
+                    "object and run that as native code (ignores --engine). "
+                    "Shared objects are cached in dir (default: "
+                    "$XDG_CACHE_HOME/" TRANSLATE_CACHE_NAME
+                    ", or ~/.cache/" TRANSLATE_CACHE_NAME
+                    "), so running the same program again skips compiling "
+                    "it. dir must be owned by you and not writable by "
+                    "others\n"
+                    "\t--flat-memory: back guest memory with one reserved "
+                    "mapping of the whole 4 GiB address space (faster loads "
+                    "and stores) instead of pages allocated on first write\n"
+                    "\t--peephole: with the interpreter engine, fuse common "
+                    "instruction sequences into single handlers and drop "
+                    "instructions that do nothing\n"
+                    "\t--reduce: for a program without branches, jumps, "
+                    "syscalls or memory instructions, work out its final "
+                    "state from the all-zero initial registers by folding "
+                    "constants instead of running it. With --lockstep, drop "
+                    "every write that is overwritten before it is read and "
+                    "fold every value that doesn't depend on the initial "
+                    "registers, then run the reduced program for each state "
+                    "(or, if every final register is known, print it without "
+                    "running anything)\n"
+                    "\t--restore=path: start from the registers, PC and "
+                    "memory saved in snapshot path (taken of the same "
+                    "program) instead of from the start\n"
+                    "\t--snapshot=path: save the registers, PC and memory "
+                    "the run ends in to path, which --restore can start from "
+                    "later. With --restore, only the memory pages changed "
+                    "since are saved, and the snapshot restored from must be "
+                    "kept\n"
+                    "\t--max-steps=N: stop once N instructions have been "
+                    "executed since the start of the program (counting those "
+                    "before the snapshot given to --restore), e.g., to "
+                    "--snapshot partway. With --batch or --lockstep, applies "
+                    "to each program or state, and with --batch a program "
+                    "stopped by it is reported as an error\n"
+                    "\t--checkpoints=dir: save checkpoints of the run in dir "
+                    "(created if needed), and if dir has checkpoints of an "
+                    "earlier run of this program, resume from the last one "
+                    "taken before that run reached an instruction that has "
+                    "since been edited (ignores --engine)\n"
+                    "\t--checkpoint-interval=N: steps between checkpoints "
+                    "(default: 1000000)\n"
+                    "\t--output=name: how states are printed, one of table "
+                    "(default), array (same as -a), json (one object per "
+                    "line; with --batch, each has the program's path), or "
+                    "binary (33 little-endian 32-bit words: the registers, "
+                    "then the PC; not with --batch)\n"
+                    "\t--changes: in step mode, print only the registers each "
+                    "instruction changed, and the PC\n"
+                    "\t--trace=path: record every executed instruction (its "
+                    "PC, instruction word and the register it wrote) in a "
+                    "compressed trace file at path, which ./tracedump decodes "
+                    "(ignores --engine)\n"
+                    "\t--gdb=address: wait for gdb to connect to address (a "
+                    "TCP port on localhost, or else a Unix socket path), "
+                    "e.g., with gdb-multiarch -ex 'set endian little' -ex "
+                    "'target remote :1234', and run under its control. The "
+                    "program runs at full speed between breakpoints. "
+                    "\"monitor watch $N\" in gdb stops after any instruction "
+                    "that changes register $N\n"
+                    "\t--harts=N: run N harts (simulated cores, each on a "
+                    "thread of its own) that share one flat memory (see "
+                    "--flat-memory), where ll and sc are atomic, and print "
+                    "every final state in order. Hart k starts with k in $a0 "
+                    "and N in $a1, and runs the k-th hex_file, or the last "
+                    "one if there are fewer. --max-steps applies to each "
+                    "hart\n"
+                    "\t--quantum=N: with --harts, instructions each hart "
+                    "executes before waiting for the others to catch up "
+                    "(default: 10000)\n"
+                    "\t--serial-harts: with --harts, run one hart at a time "
+                    "in turn each quantum, so that even harts racing on "
+                    "memory give the same result every run\n");
                 free(filepath);
                 exit(0);
             case 'm':
@@ -87,88 +293,678 @@ cli_args parse_cli(int argc, char* argv[]) {
             case 'x':
                 rv.disp_hex = true;
                 break;
+            case 'f':
+                if (!parse_image_format(optarg, &rv.format)) {
+                    fprintf(stderr,
+                            "Unknown format %s. For correct usage, type "
+                            "./main -h\n",
+                            optarg);
+                    free(filepath);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                if (!parse_engine(optarg, &rv.engine)) {
+                    fprintf(stderr,
+                            "Unknown engine %s. For correct usage, type "
+                            "./main -h\n",
+                            optarg);
+                    free(filepath);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                rv.batch = true;
+                break;
+            case 'l':
+                states_path = optarg;
+                break;
+            case 'p':
+                rv.profile = true;
+                profile_path = optarg;
+                break;
+            case 'L':
+                rv.pipeline = true;
+                break;
+            case 'K':
+                rv.host_counters = true;
+                host_counters_path = optarg;
+                break;
+            case 'X':
+                rv.translate = true;
+                translate_directory = optarg;
+                break;
+            case 'F':
+                rv.flat_memory = true;
+                break;
+            case 'P':
+                rv.peephole = true;
+                break;
+            case 'R':
+                rv.reduce = true;
+                break;
+            case 'r':
+                restore_path = optarg;
+                break;
+            case 'S':
+                snapshot_path = optarg;
+                break;
+            case 'n':
+            case 'I':
+            case 'Q': {
+                char* end;
+                unsigned long long steps = strtoull(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || *optarg == '-' ||
+                    (opt != 'n' && steps == 0)) {
+                    fprintf(stderr,
+                            "Invalid number of steps %s. For correct usage, "
+                            "type ./main -h\n",
+                            optarg);
+                    free(filepath);
+                    exit(1);
+                }
+                if (opt == 'n') {
+                    rv.max_steps = steps;
+                } else if (opt == 'I') {
+                    rv.checkpoint_interval = steps;
+                } else {
+                    rv.quantum = steps;
+                    quantum_set = true;
+                }
+                break;
+            }
+            case 'C':
+                checkpoints_path = optarg;
+                break;
+            case 'o':
+                if (!parse_output_mode(optarg, &rv.output)) {
+                    fprintf(stderr,
+                            "Unknown output %s. For correct usage, type "
+                            "./main -h\n",
+                            optarg);
+                    free(filepath);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                rv.show_changes = true;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'g':
+                gdb_address = optarg;
+                break;
+            case 'H': {
+                char* end;
+                unsigned long num_harts = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || num_harts == 0 ||
+                    num_harts > MAX_HARTS) {
+                    fprintf(stderr,
+                            "Invalid number of harts %s (at most %d). For "
+                            "correct usage, type ./main -h\n",
+                            optarg, MAX_HARTS);
+                    free(filepath);
+                    exit(1);
+                }
+                rv.num_harts = num_harts;
+                break;
+            }
+            case 'Z':
+                rv.serial_harts = true;
+                break;
+            case 'j': {
+                char* end;
+                unsigned long num_threads = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || num_threads == 0 ||
+                    num_threads > MAX_BATCH_THREADS) {
+                    fprintf(stderr,
+                            "Invalid number of threads %s. For correct usage, "
+                            "type ./main -h\n",
+                            optarg);
+                    free(filepath);
+                    exit(1);
+                }
+                rv.num_threads = num_threads;
+                break;
+            }
             default:
                 fprintf(stderr, "For correct usage, type ./main -h\n");
                 free(filepath);
                 exit(1);
         }
     }
-    if (optind != argc - 1) {
+    if (rv.num_harts == 0 && optind != argc - 1) {
         fprintf(stderr,
                 "Expected 1 file after option(s), if any. For correct usage, "
                 "type ./main -h\n");
         free(filepath);
         exit(1);
     }
+    if (rv.num_harts != 0 &&
+        (optind == argc || (uint32_t)(argc - optind) > rv.num_harts)) {
+        fprintf(stderr,
+                "Expected 1 to %u files after option(s) with --harts=%u. For "
+                "correct usage, type ./main -h\n",
+                rv.num_harts, rv.num_harts);
+        free(filepath);
+        exit(1);
+    }
+    if ((quantum_set || rv.serial_harts) && rv.num_harts == 0) {
+        fprintf(stderr,
+                "--quantum and --serial-harts can only be used with --harts. "
+                "For correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.num_harts != 0 &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.step_mode || restore_path != NULL || snapshot_path != NULL ||
+         checkpoints_path != NULL || trace_path != NULL ||
+         gdb_address != NULL)) {
+        fprintf(stderr,
+                "--harts can't be used with --batch, --lockstep, --reduce, "
+                "--profile, step mode, --restore, --snapshot, --checkpoints, "
+                "--trace or --gdb. For correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if ((rv.batch || states_path != NULL) && rv.profile) {
+        fprintf(stderr,
+                "--profile can't be used with --batch or --lockstep. For "
+                "correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.pipeline &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.step_mode || checkpoints_path != NULL || trace_path != NULL ||
+         gdb_address != NULL || rv.num_harts != 0)) {
+        fprintf(stderr,
+                "--pipeline can't be used with --batch, --lockstep, --reduce, "
+                "--profile, step mode, --checkpoints, --trace, --gdb or "
+                "--harts. For correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.host_counters &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.step_mode ||
+         checkpoints_path != NULL || gdb_address != NULL ||
+         rv.num_harts != 0)) {
+        fprintf(stderr,
+                "--host-counters can't be used with --batch, --lockstep, "
+                "--reduce, step mode, --checkpoints, --gdb or --harts. For "
+                "correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.translate &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.pipeline || rv.step_mode || checkpoints_path != NULL ||
+         trace_path != NULL || gdb_address != NULL || rv.num_harts != 0)) {
+        fprintf(stderr,
+                "--translate can't be used with --batch, --lockstep, "
+                "--reduce, --profile, --pipeline, step mode, --checkpoints, "
+                "--trace, --gdb or --harts. For correct usage, type ./main "
+                "-h\n");
+        free(filepath);
+        exit(1);
+    }
+    if ((rv.batch || states_path != NULL) && rv.step_mode) {
+        fprintf(stderr,
+                "Step mode can't be used with --batch or --lockstep. For "
+                "correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.reduce && (rv.batch || rv.profile || rv.step_mode)) {
+        fprintf(stderr,
+                "--reduce can't be used with --batch, --profile or step mode. "
+                "For correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (states_path != NULL && rv.flat_memory) {
+        fprintf(stderr,
+                "--flat-memory can't be used with --lockstep. For correct "
+                "usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.batch && states_path != NULL) {
+        fprintf(stderr,
+                "--batch can't be used with --lockstep. For correct usage, "
+                "type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if ((restore_path != NULL || snapshot_path != NULL) &&
+        (rv.batch || states_path != NULL || rv.reduce)) {
+        fprintf(stderr,
+                "--restore and --snapshot can't be used with --batch, "
+                "--lockstep or --reduce. For correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.max_steps != UINT64_MAX && rv.reduce) {
+        fprintf(stderr,
+                "--max-steps can't be used with --reduce. For correct usage, "
+                "type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (checkpoints_path != NULL &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.step_mode || restore_path != NULL || snapshot_path != NULL)) {
+        fprintf(stderr,
+                "--checkpoints can't be used with --batch, --lockstep, "
+                "--reduce, --profile, step mode, --restore or --snapshot. For "
+                "correct usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.batch && rv.output == OUTPUT_BINARY) {
+        fprintf(stderr,
+                "--output=binary can't be used with --batch. For correct "
+                "usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (rv.show_changes && !rv.step_mode) {
+        fprintf(stderr,
+                "--changes can only be used in step mode. For correct usage, "
+                "type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (trace_path != NULL &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.step_mode || checkpoints_path != NULL)) {
+        fprintf(stderr,
+                "--trace can't be used with --batch, --lockstep, --reduce, "
+                "--profile, step mode or --checkpoints. For correct usage, "
+                "type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (gdb_address != NULL &&
+        (rv.batch || states_path != NULL || rv.reduce || rv.profile ||
+         rv.step_mode || checkpoints_path != NULL || trace_path != NULL)) {
+        fprintf(stderr,
+                "--gdb can't be used with --batch, --lockstep, --reduce, "
+                "--profile, step mode, --checkpoints or --trace. For correct "
+                "usage, type ./main -h\n");
+        free(filepath);
+        exit(1);
+    }
+    if (states_path != NULL) rv.states_path = strdup(states_path);
+    if (gdb_address != NULL) rv.gdb_address = strdup(gdb_address);
+    if (trace_path != NULL) rv.trace_path = strdup(trace_path);
+    if (checkpoints_path != NULL)
+        rv.checkpoints_path = strdup(checkpoints_path);
+    if (restore_path != NULL) rv.restore_path = strdup(restore_path);
+    if (snapshot_path != NULL) rv.snapshot_path = strdup(snapshot_path);
+    if (profile_path != NULL) rv.profile_path = strdup(profile_path);
+    if (host_counters_path != NULL)
+        rv.host_counters_path = strdup(host_counters_path);
+    if (translate_directory != NULL)
+        rv.translate_directory = strdup(translate_directory);
+    if (rv.num_harts != 0 && argc - optind > 1) {
+        rv.num_hart_paths = argc - optind - 1;
+        rv.hart_paths = (char**)malloc(rv.num_hart_paths * sizeof(char*));
+        if (rv.hart_paths == NULL) {
+            fprintf(stderr, "Failed to allocate hart paths\n");
+            free(filepath);
+            exit(1);
+        }
+        for (uint32_t k = 0; k < rv.num_hart_paths; k++)
+            rv.hart_paths[k] = strdup(argv[optind + 1 + k]);
+    }
     strcpy(rv.filepath, argv[optind]);
 
     return rv;
 }
 
-void print_state(int32_t* registers, uint32_t pc, bool disp_array,
+void print_state(const int32_t* registers, uint32_t pc, output_mode mode,
                  bool disp_hex) {
-    if (disp_array) {
-        printf("[");
-        for (int i = 0; i < NUM_REGISTERS; i++)
-            printf(disp_hex ? "0x%08x, " : "%d, ", registers[i]);
-        printf(disp_hex ? "0x%08x]\n" : "%d]\n", pc);
+    char buf[OUTPUT_STATE_SIZE];
+    size_t length = format_registers(buf, mode, disp_hex, registers, pc);
+    // Anything printf'd before has to come out first
+    fflush(stdout);
+    write_all(STDOUT_FILENO, buf, length);
+}
+
+// Same as print_state, but with only the registers that differ from before
+static void print_changes(const int32_t* before, const int32_t* registers,
+                          uint32_t pc, cli_args flags) {
+    char buf[OUTPUT_STATE_SIZE];
+    size_t length = format_changes(buf, flags.output, flags.disp_hex, before,
+                                   registers, pc);
+    fflush(stdout);
+    write_all(STDOUT_FILENO, buf, length);
+}
+
+bool validate_pc(uint32_t pc) { return pc % WORD_SIZE == 0; }
+
+// Prints the invalid PC error message and exits
+static void invalid_pc_exit(uint32_t pc, cli_args flags) {
+    fprintf(stderr, "Invalid PC (not a multiple of word size %d): %d\n",
+            WORD_SIZE, pc);
+    fprintf(stderr,
+            "Consider running the program in step mode to find what caused "
+            "this error\n");
+    free(flags.filepath);
+    exit(1);
+}
+
+// Runs prog (created from instructions) with checkpoints in
+// flags.checkpoints_path, resuming from the latest valid one within
+// flags.max_steps. *mem may be replaced by a new memory, and is bound on
+// return
+static void run_with_checkpoints(const uint32_t* instructions, program* prog,
+                                 int32_t* registers, uint32_t* pc,
+                                 guest_memory** mem, cli_args flags) {
+    checkpoint_log* log =
+        open_checkpoints(flags.checkpoints_path, flags.checkpoint_interval);
+    if (log == NULL) {
+        fprintf(stderr,
+                "Failed to open checkpoint directory %s; running from the "
+                "start without checkpoints\n",
+                flags.checkpoints_path);
+        memory_bind(*mem);
+        run_interpreter(prog, registers, pc, flags.max_steps);
+        return;
+    }
+    snapshot_state state;
+    memcpy(state.registers, registers, sizeof(state.registers));
+    state.pc = *pc;
+    state.steps = 0;
+    if (resume_from_checkpoint(log, instructions, prog->num_instructions,
+                               flags.max_steps, &state, mem))
+        fprintf(stderr, "Resumed from checkpoint at step %llu\n",
+                (unsigned long long)state.steps);
+    memory_bind(*mem);
+    snapshot_status status = run_checkpointed(log, prog, instructions, &state,
+                                              flags.max_steps, *mem);
+    if (status != SNAPSHOT_OK)
+        fprintf(stderr, "Failed to save checkpoint in %s: %s\n",
+                flags.checkpoints_path, snapshot_status_message(status));
+    memcpy(registers, state.registers, sizeof(state.registers));
+    *pc = state.pc;
+    close_checkpoints(log);
+}
+
+// Runs prog (created from instructions) with run_traced, writing the trace to
+// flags.trace_path, or without tracing if it can't be opened. Sets *traced to
+// whether the whole trace was written
+static uint64_t run_with_trace(const uint32_t* instructions, program* prog,
+                               int32_t* registers, uint32_t* pc,
+                               uint64_t max_steps, cli_args flags,
+                               bool* traced) {
+    trace_writer* writer;
+    trace_status status = open_trace(flags.trace_path, registers, *pc, &writer);
+    uint64_t steps;
+    if (status == TRACE_OK) {
+        steps =
+            run_traced(prog, instructions, registers, pc, max_steps, writer);
+        status = close_trace(writer, registers, *pc);
     } else {
-        printf("| Name |    Value   |\n");
-        printf("---------------------\n");
-        for (int i = 0; i < NUM_REGISTERS; i++)
-            printf(disp_hex ? "|  $%2d | 0x%08x |\n" : "|  $%2d | %10d |\n", i,
-                   registers[i]);
-        printf(disp_hex ? "|   PC | 0x%08x |\n" : "|   PC |  %9d |\n", pc);
+        steps = run_interpreter(prog, registers, pc, max_steps);
     }
+    if (status != TRACE_OK)
+        fprintf(stderr, "Failed to write trace %s: %s\n", flags.trace_path,
+                trace_status_message(status));
+    *traced = status == TRACE_OK;
+    return steps;
 }
 
-bool validate_pc(uint32_t pc) { return pc % WORD_SIZE == 0; }
+// Runs prog (created from instructions) under the control of gdb, which
+// connects to flags.gdb_address, and then the rest of it unless gdb killed it.
+// Sets *connected to whether gdb connected
+static uint64_t run_with_gdb(const uint32_t* instructions, program* prog,
+                             int32_t* registers, uint32_t* pc,
+                             uint64_t max_steps, cli_args flags,
+                             bool* connected) {
+    debugger* dbg = create_debugger(prog, instructions, flags.engine);
+    if (dbg == NULL) {
+        fprintf(stderr, "Failed to allocate debugger\n");
+        *connected = false;
+        return 0;
+    }
+    fprintf(stderr, "Waiting for gdb to connect to %s\n", flags.gdb_address);
+    int fd = gdb_accept(flags.gdb_address);
+    *connected = fd >= 0;
+    if (fd < 0) {
+        perror("Failed to accept gdb connection");
+        free_debugger(dbg);
+        return 0;
+    }
+    gdb_result result = serve_gdb(dbg, fd, registers, pc);
+    close(fd);
+    uint64_t steps = dbg->steps;
+    free_debugger(dbg);
+    if (result == GDB_KILLED) return steps;
+    return steps + run_engine(flags.engine, prog, registers, pc,
+                              max_steps > steps ? max_steps - steps : 0);
+}
+
+// Prints prof's report to stderr and writes it to flags.profile_path, if any
+static void report_profile(const program* prog, const profile* prof,
+                           cli_args flags) {
+    print_profile_report(stderr, prog, prof);
+    if (flags.profile_path == NULL) return;
+    FILE* out = fopen(flags.profile_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open profile output %s\n",
+                flags.profile_path);
+        return;
+    }
+    size_t length = strlen(flags.profile_path);
+    if (length >= 5 && strcmp(flags.profile_path + length - 5, ".json") == 0)
+        write_profile_json(out, prog, prof);
+    else
+        write_profile_folded(out, prog, prof);
+    fclose(out);
+}
+
+// Returns prog's native translation for --translate, or NULL (after printing
+// why) if it can't be translated
+static translation* load_native(const program* prog,
+                                const uint32_t* instructions,
+                                cli_args flags) {
+    char* directory = flags.translate_directory != NULL
+                          ? strdup(flags.translate_directory)
+                          : default_translation_directory();
+    if (directory == NULL) {
+        fprintf(stderr,
+                "Failed to find a cache directory for translations (set "
+                "$HOME or pass one to --translate). Running the program "
+                "with the %s engine instead\n",
+                engine_name(flags.engine));
+        return NULL;
+    }
+    translation* native = NULL;
+    translate_status status =
+        load_translation(prog, instructions, directory, &native);
+    if (status != TRANSLATE_OK)
+        fprintf(stderr,
+                "Failed to translate program in %s: %s. Running it with the "
+                "%s engine instead\n",
+                directory, translate_status_message(status),
+                engine_name(flags.engine));
+    free(directory);
+    return native;
+}
+
+// Unbinds and frees everything execute_all allocated (any of which may be
+// NULL)
+static void free_run(program* prog, profile* prof, pipeline* pipe,
+                     guest_memory* mem) {
+    memory_bind(NULL);
+    free_memory(mem);
+    free_pipeline(pipe);
+    free_profile(prof);
+    free_program(prog);
+}
+
+// Frees what execute_all allocated and flags.filepath, and exits with an
+// error
+static void free_run_exit(program* prog, profile* prof, pipeline* pipe,
+                          guest_memory* mem, cli_args flags) {
+    free_run(prog, prof, pipe, mem);
+    free(flags.filepath);
+    exit(1);
+}
 
 void execute_all(uint32_t* instructions, uint32_t num_instructions,
-                 int32_t* registers, uint32_t* pc, cli_args flags) {
-    if (flags.step_mode)
+                 int32_t* registers, uint32_t* pc, cli_args flags,
+                 host_profile* host) {
+    // Decode everything up front so the loops below only index into
+    // prog->decoded
+    host_region_begin(host, HOST_REGION_DECODE);
+    program* prog = create_program(instructions, num_instructions);
+    host_region_end(host, HOST_REGION_DECODE, num_instructions);
+    profile* prof = NULL;
+    pipeline* pipe = NULL;
+    if (prog != NULL && flags.profile) prof = create_profile(prog);
+    if (prog != NULL && flags.pipeline) pipe = create_pipeline(prog);
+    if (prog == NULL || (flags.profile && prof == NULL) ||
+        (flags.pipeline && pipe == NULL)) {
+        fprintf(stderr, "Failed to allocate decoded program\n");
+        free_run_exit(prog, prof, pipe, NULL, flags);
+    }
+    prog->peephole = flags.peephole;
+    guest_memory* mem = create_memory(flags.flat_memory);
+    if (mem == NULL) {
+        fprintf(stderr, "Failed to allocate guest memory\n");
+        free_run_exit(prog, prof, pipe, NULL, flags);
+    }
+    memory_bind(mem);
+    // Instructions executed since the start of the program
+    uint64_t steps = 0;
+    bool traced = true;
+    if (flags.restore_path != NULL) {
+        snapshot_state state;
+        snapshot_status status = restore_snapshot(
+            flags.restore_path, instructions, num_instructions, &state, mem);
+        if (status != SNAPSHOT_OK) {
+            fprintf(stderr, "Failed to restore snapshot %s: %s\n",
+                    flags.restore_path, snapshot_status_message(status));
+            free_run_exit(prog, prof, pipe, mem, flags);
+        }
+        memcpy(registers, state.registers, sizeof(state.registers));
+        *pc = state.pc;
+        steps = state.steps;
+    }
+    if (flags.step_mode) {
         printf("Press enter to execute the next instruction\n");
-    while ((*pc) < num_instructions * WORD_SIZE) {
-        if (flags.step_mode) getchar();
-
+        int32_t before[NUM_REGISTERS];
+        while (steps < flags.max_steps && !engine_done(prog, registers, *pc)) {
+            getchar();
+            memcpy(before, registers, sizeof(before));
+            if (prof != NULL)
+                steps += run_profiled(prog, registers, pc, 1, prof);
+            else
+                steps += run_engine(flags.engine, prog, registers, pc, 1);
+            if (!validate_pc(*pc)) {
+                free_run(prog, prof, pipe, mem);
+                invalid_pc_exit(*pc, flags);
+            }
+            if (flags.show_changes)
+                print_changes(before, registers, *pc, flags);
+            else
+                print_state(registers, *pc, flags.output, flags.disp_hex);
+        }
+    } else if (flags.checkpoints_path != NULL) {
+        run_with_checkpoints(instructions, prog, registers, pc, &mem, flags);
+        if (mem == NULL) {
+            fprintf(stderr, "Failed to allocate guest memory\n");
+            free_run_exit(prog, prof, pipe, NULL, flags);
+        }
         if (!validate_pc(*pc)) {
-            fprintf(stderr, "Invalid PC (not a multiple of word size %d): %d\n",
-                    WORD_SIZE, *pc);
-            fprintf(stderr,
-                    "Consider running the program in step mode to find what "
-                    "caused this error\n");
-            free(flags.filepath);
-            exit(1);
+            free_run(prog, prof, pipe, mem);
+            invalid_pc_exit(*pc, flags);
         }
+        print_state(registers, *pc, flags.output, flags.disp_hex);
+    } else {
+        uint64_t max_steps =
+            flags.max_steps > steps ? flags.max_steps - steps : 0;
+        bool connected = true;
+        translation* native =
+            flags.translate ? load_native(prog, instructions, flags) : NULL;
+        const uint64_t steps_before = steps;
+        host_region_begin(host, HOST_REGION_RUN);
+        if (prof != NULL)
+            steps += run_profiled(prog, registers, pc, max_steps, prof);
+        else if (pipe != NULL)
+            steps += run_pipelined(prog, registers, pc, max_steps, pipe);
+        else if (flags.trace_path != NULL)
+            steps += run_with_trace(instructions, prog, registers, pc,
+                                    max_steps, flags, &traced);
+        else if (flags.gdb_address != NULL)
+            steps += run_with_gdb(instructions, prog, registers, pc, max_steps,
+                                  flags, &connected);
+        else if (native != NULL)
+            steps += run_translated(prog, registers, pc, max_steps, native);
+        else
+            steps += run_engine(flags.engine, prog, registers, pc, max_steps);
+        host_region_end(host, HOST_REGION_RUN, steps - steps_before);
+        free_translation(native);
+        if (!connected) free_run_exit(prog, prof, pipe, mem, flags);
+        if (!validate_pc(*pc)) {
+            free_run(prog, prof, pipe, mem);
+            invalid_pc_exit(*pc, flags);
+        }
+        print_state(registers, *pc, flags.output, flags.disp_hex);
+    }
 
-        instruction* instruct = create_instruction(instructions[(*pc) >> 2]);
-        execute_instruction(instruct, registers, pc);
-        free(instruct);
-
-        if (flags.step_mode)
-            print_state(registers, *pc, flags.disp_array, flags.disp_hex);
+    if (prof != NULL) {
+        fflush(stdout);
+        report_profile(prog, prof, flags);
     }
-    if (!flags.step_mode)
-        print_state(registers, *pc, flags.disp_array, flags.disp_hex);
+    if (pipe != NULL) {
+        fflush(stdout);
+        print_pipeline_report(stderr, prog, pipe);
+    }
+    bool saved = true;
+    if (flags.snapshot_path != NULL) {
+        snapshot_state state;
+        memcpy(state.registers, registers, sizeof(state.registers));
+        state.pc = *pc;
+        state.steps = steps;
+        snapshot_status status =
+            save_snapshot(flags.snapshot_path, flags.restore_path,
+                          instructions, num_instructions, &state, mem);
+        if (status != SNAPSHOT_OK) {
+            fprintf(stderr, "Failed to save snapshot %s: %s\n",
+                    flags.snapshot_path, snapshot_status_message(status));
+            saved = false;
+        }
+    }
+    bool out_of_memory = mem->out_of_memory;
+    if (out_of_memory)
+        fprintf(stderr, "Out of memory for guest pages; some stores were "
+                        "dropped\n");
+    if (!saved || !traced || out_of_memory)
+        free_run_exit(prog, prof, pipe, mem, flags);
+    free_run(prog, prof, pipe, mem);
 }
 
 uint32_t hex_instruction_file_to_array(const char* filepath,
-                                       uint32_t* instructions) {
-    FILE* file;
-    file = fopen(filepath, "r");
-    if (file == NULL) {
+                                       program_image* image) {
+    return instruction_file_to_image(filepath, IMAGE_FORMAT_HEX, image);
+}
+
+uint32_t instruction_file_to_image(const char* filepath, image_format format,
+                                   program_image* image) {
+    image_status status = load_image(filepath, format, image);
+    if (status == IMAGE_OPEN_FAILED) {
         fprintf(stderr, "Failed to open file %s\n", filepath);
         exit(1);
+    } else if (status != IMAGE_OK) {
+        fprintf(stderr, "Failed to load file %s: %s\n", filepath,
+                image_status_message(status));
+        exit(1);
     }
-
-    uint32_t num_instructions = 0;
-    char* line = NULL;
-    size_t size = 0;
-    while (getline(&line, &size, file) != -1)
-        instructions[num_instructions++] = (uint32_t)strtoul(line, NULL, 16);
-
-    free(line);
-    fclose(file);
-
-    return num_instructions;
+    return image->num_instructions;
 }
@@ -4,14 +4,92 @@
 #include <unistd.h>
 
 #include "constants.h"
+#include "engine.h"
+#include "hostperf.h"
+#include "image.h"
 #include "instructions.h"
+#include "output.h"
 #include "types.h"
 
 typedef struct {
     char* filepath;
-    bool disp_array;
+    // How states are printed: -a is the same as --output=array
+    output_mode output;
     bool step_mode;
     bool disp_hex;
+    engine_kind engine;
+    image_format format;
+    // If true, filepath is a directory or list of programs to run (see
+    // batch_paths) instead of a single program
+    bool batch;
+    // Worker threads for batch mode, or 0 for default_num_threads()
+    size_t num_threads;
+    // If not NULL, the program is run once per initial register state in this
+    // file (see load_lockstep_states) instead of once from all zeros
+    char* states_path;
+    // If true, execution is profiled and a report is printed to stderr at exit
+    bool profile;
+    // If not NULL, the profile is also written here, as JSON if the path ends
+    // in .json, else in folded-stack format
+    char* profile_path;
+    // If true, execution is timed on a five-stage pipeline model and a report
+    // is printed to stderr at exit (see pipeline.h)
+    bool pipeline;
+    // If true, the simulator's own cost on the host (see hostperf.h) is
+    // measured while loading, decoding and running, and a report is printed
+    // to stderr at exit
+    bool host_counters;
+    // If not NULL, the host counters are also written here as JSON
+    char* host_counters_path;
+    // If true, the program is translated to C and run as native code,
+    // compiled once and cached in translate_directory (see load_translation)
+    bool translate;
+    // Cache directory for translations, or NULL for
+    // default_translation_directory()
+    char* translate_directory;
+    // If true, guest memory is one flat host mapping instead of pages (see
+    // create_memory)
+    bool flat_memory;
+    // If true, the interpreter fuses instructions (see program.peephole)
+    bool peephole;
+    // If true, the program is reduced (see reduce_program) and, with
+    // states_path, the reduced program is run instead
+    bool reduce;
+    // If not NULL, the run starts from this snapshot instead of the start of
+    // the program (see restore_snapshot)
+    char* restore_path;
+    // If not NULL, the state the run ends in is saved here (see save_snapshot),
+    // incrementally to restore_path if there is one
+    char* snapshot_path;
+    // Execution stops once this many instructions have been executed since
+    // the start of the program, including those before restore_path
+    uint64_t max_steps;
+    // If not NULL, the run keeps checkpoints in this directory and resumes
+    // from the latest one that edits to the program haven't invalidated (see
+    // checkpoint.h)
+    char* checkpoints_path;
+    // Steps between checkpoints
+    uint64_t checkpoint_interval;
+    // If true, step mode prints only the registers each step changed (see
+    // format_changes)
+    bool show_changes;
+    // If not NULL, every executed instruction is recorded in a trace file
+    // here (see trace.h)
+    char* trace_path;
+    // If not NULL, the run waits for gdb to connect here (see gdb_accept) and
+    // is debugged by it until it detaches (see serve_gdb)
+    char* gdb_address;
+    // If not 0, the program runs on this many harts that share one flat
+    // memory (see run_harts)
+    uint32_t num_harts;
+    // With num_harts, programs for the harts after the first, which runs
+    // filepath. Harts past the end of the list run its last program
+    char** hart_paths;
+    uint32_t num_hart_paths;
+    // Instructions each hart executes between barriers
+    uint64_t quantum;
+    // If true, harts take turns within each quantum (see hart_options)
+    bool serial_harts;
 } cli_args;
 
 /**
@@ -26,16 +104,16 @@ typedef struct {
 cli_args parse_cli(int argc, char* argv[]);
 
 /**
- * Pretty prints registers and PC in table format
+ * Prints registers and PC to stdout (see format_registers), with a single
+ * write
  *
  * @param registers
  * @param pc
- * @param disp_array true to print as array for autograding, else false to print
- * table
+ * @param mode
  * @param disp_hex true to print values in hex, else false to print in base-10
  * @return void
  */
-void print_state(int32_t* registers, uint32_t pc, bool disp_array,
+void print_state(const int32_t* registers, uint32_t pc, output_mode mode,
                  bool disp_hex);
 
 /**
@@ -47,41 +125,88 @@ void print_state(int32_t* registers, uint32_t pc, bool disp_array,
 bool validate_pc(uint32_t pc);
 
 /**
- * Executes instructions until the final instruction is executed (assuming no
- * jump/branch instructions), mutating registers and pc
+ * Executes instructions until execution runs past the final instruction or the
+ * program halts (a syscall with $v0 == 10), mutating registers and pc
  *
  * If pc is invalid (i.e., not a multiple of WORD_SIZE) during execution, prints
  * error message and exits
  *
- * @note Executing until the final instruction is simple and sufficient for this
- * lab because there are no jump/branch instructions. However, this is
- * unrealistic. A MIPS assembly program should actually exit when a syscall is
- * executed when $v0 contains the value 10. Or, for simplicity, the simulator
- * could exit when a special hardcoded instruction is executed, e.g., 0xdeadbeef
+ * If flags.profile is set, runs with run_profiled instead of flags.engine and
+ * reports the profile once execution ends. Likewise, if flags.pipeline is
+ * set, runs with run_pipelined and reports the pipeline's timing
+ *
+ * Loads and stores access a fresh guest memory (see create_memory), flat if
+ * flags.flat_memory is set. If a page can't be allocated, prints error message
+ * and exits once execution ends
+ *
+ * If flags.restore_path is set, registers, pc and memory are restored from
+ * that snapshot first, and if flags.snapshot_path is set, they are saved there
+ * once execution ends. If either fails, prints error message and exits
+ *
+ * If flags.translate is set, runs prog's native translation with
+ * run_translated instead of flags.engine, translating and compiling it
+ * first unless it is cached. If it can't be translated, prints error message
+ * and runs with flags.engine
+ *
+ * If flags.trace_path is set, runs with run_traced instead of flags.engine.
+ * If the trace can't be written, prints error message and exits once
+ * execution ends
+ *
+ * In step mode, the state is printed after every instruction, or with
+ * flags.show_changes only the registers it changed
+ *
+ * If flags.gdb_address is set, waits for gdb to connect there and runs
+ * under its control (see serve_gdb) until it detaches, then runs the rest
+ * with flags.engine. If gdb kills the program, it stops where it is. If gdb
+ * can't connect, prints error message and exits
+ *
+ * If flags.checkpoints_path is set, runs with run_checkpointed instead of
+ * flags.engine, from the latest valid checkpoint there if any. If the
+ * directory can't be used, prints error message and runs from the start
+ * without checkpoints
+ *
+ * @note On halt, pc is the address of the exit syscall, which is not executed
  * @param instructions pointer to instructions
  * @param num_instructions number of instructions
  * @param registers
  * @param pc
  * @param flags cli flags
+ * @param host if not NULL, decoding and running are measured in it (see
+ * host_region_begin)
  * @return void (but mutates registers and pc)
  */
 void execute_all(uint32_t* instructions, uint32_t num_instructions,
-                 int32_t* registers, uint32_t* pc, cli_args flags);
+                 int32_t* registers, uint32_t* pc, cli_args flags,
+                 host_profile* host);
 
 /**
- * Parses a file with MIPS instructions in hex format and populates a uint32_t
- * array with its instructions
+ * Parses a file with MIPS instructions in hex format into image, which is
+ * sized to fit however many instructions the file has (see load_hex_image)
  *
  * To generate a file with MIPS instructions in hex format, see the instructions
  * given by ./main -m (or check comments in main.c)
  *
- * If filepath is invalid, exits with error message
+ * If filepath is invalid or the file can't be loaded, exits with error message
  *
  * @param filepath
- * @param instructions instructions array to be filled
+ * @param image filled with the file's instructions (free with free_image)
  * @return number of instructions read on success
  */
 uint32_t hex_instruction_file_to_array(const char* filepath,
-                                       uint32_t* instructions);
+                                       program_image* image);
+
+/**
+ * Same as hex_instruction_file_to_array, but for a file in any format
+ * supported by load_image (e.g., a MARS binary dump or an ELF executable)
+ *
+ * If filepath is invalid or the file can't be loaded, exits with error message
+ *
+ * @param filepath
+ * @param format
+ * @param image filled with the file's instructions (free with free_image)
+ * @return number of instructions read on success
+ */
+uint32_t instruction_file_to_image(const char* filepath, image_format format,
+                                   program_image* image);
 
 #endif  // utils_H